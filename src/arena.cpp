@@ -0,0 +1,61 @@
+#include "arena.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+Arena::Arena(std::size_t initialBytes) : nextBlockSize(std::max<std::size_t>(initialBytes, 256)) {}
+
+Arena::~Arena() {
+    for (Finalizer* f = finalizers; f; f = f->next) {
+        f->destroy(f->object);
+    }
+    for (char* block : blocks) {
+        std::free(block);
+    }
+}
+
+void* Arena::allocate(std::size_t bytes, std::size_t alignment) {
+    auto align = [alignment](char* p) {
+        auto address = reinterpret_cast<std::uintptr_t>(p);
+        return reinterpret_cast<char*>((address + alignment - 1) & ~(std::uintptr_t)(alignment - 1));
+    };
+
+    char* start = cursor ? align(cursor) : nullptr;
+    if (!start || start + bytes > limit) {
+        grow(bytes + alignment);
+        start = align(cursor);
+    }
+    cursor = start + bytes;
+    allocated += bytes;
+    return start;
+}
+
+std::string_view Arena::copy(std::string_view text) {
+    if (text.empty()) {
+        return std::string_view();
+    }
+    char* memory = static_cast<char*>(allocate(text.size(), 1));
+    std::memcpy(memory, text.data(), text.size());
+    return std::string_view(memory, text.size());
+}
+
+void Arena::addFinalizer(void* object, void (*destroy)(void*)) {
+    auto* finalizer = static_cast<Finalizer*>(allocate(sizeof(Finalizer), alignof(Finalizer)));
+    finalizer->object = object;
+    finalizer->destroy = destroy;
+    finalizer->next = finalizers;
+    finalizers = finalizer;
+}
+
+void Arena::grow(std::size_t minimum) {
+    std::size_t size = std::max(nextBlockSize, minimum);
+    char* block = static_cast<char*>(std::malloc(size));
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    blocks.push_back(block);
+    cursor = block;
+    limit = block + size;
+    nextBlockSize = size * 2;
+}
@@ -0,0 +1,82 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <new>
+#include <vector>
+
+// Bump allocator for objects that share one owner's lifetime. Memory comes
+// from a chain of blocks, the first sized by the caller, and is released in
+// one shot when the arena goes away. Objects with non-trivial destructors are
+// finalized from a flat list, so tearing down a deep tree never recurses.
+class Arena {
+public:
+	explicit Arena(std::size_t initialBytes = 4096);
+	~Arena();
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	void* allocate(std::size_t bytes, std::size_t alignment = alignof(std::max_align_t));
+
+	template <typename T, typename... Args>
+	T* create(Args&&... args) {
+		void* memory = allocate(sizeof(T), alignof(T));
+		T* object = new (memory) T(std::forward<Args>(args)...);
+		if (!std::is_trivially_destructible<T>::value) {
+			addFinalizer(object, [](void* p) { static_cast<T*>(p)->~T(); });
+		}
+		return object;
+	}
+
+	std::string_view copy(std::string_view text);
+
+	std::size_t bytesAllocated() const { return allocated; }
+	std::size_t blockCount() const { return blocks.size(); }
+
+private:
+	struct Finalizer {
+		void* object;
+		void (*destroy)(void*);
+		Finalizer* next;
+	};
+
+	std::vector<char*> blocks;
+	char* cursor = nullptr;
+	char* limit = nullptr;
+	std::size_t nextBlockSize;
+	std::size_t allocated = 0;
+	Finalizer* finalizers = nullptr;
+
+	void addFinalizer(void* object, void (*destroy)(void*));
+	void grow(std::size_t minimum);
+};
+
+// Standard allocator over an Arena, for containers owned by arena objects.
+// Deallocation is a no-op; a growing container leaves its old storage behind
+// until the arena is released.
+template <typename T>
+class ArenaAllocator {
+public:
+	using value_type = T;
+
+	explicit ArenaAllocator(Arena& arena) : arena(&arena) {}
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+	T* allocate(std::size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T))); }
+	void deallocate(T*, std::size_t) {}
+
+	template <typename U>
+	bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+	template <typename U>
+	bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+
+private:
+	template <typename U> friend class ArenaAllocator;
+	Arena* arena;
+};
+
+#endif
@@ -1,56 +1,56 @@
 #include "ast.h"
 
-ASTNode::ASTNode(NodeType type, const std::string& content, size_t position, ParserState state)  
-    : type(type), content(content), position(position), state(state) {
-    try {
-        validateNode();
-    } catch (const std::exception& e) {
-        std::cerr << "Node validation error: " << e.what() << std::endl;
-    }
-}
+ASTNode::ASTNode(Arena& arena, NodeType type, std::string_view content, size_t position, ParserState state)
+    : type(type), content(content), position(position), state(state),
+      children(ArenaAllocator<ASTNode*>(arena)), references(ArenaAllocator<ASTNode*>(arena)) {}
 
-void ASTNode::validateNode() {
+bool ASTNode::validateNode(DiagnosticSink& diagnostics) const {
     if (content.empty() && type != NodeType::Document) {
-        throw std::runtime_error("Empty content for non-document node");
+        diagnostics.report(DiagnosticCode::EmptyContent, position, static_cast<int>(type));
+        return false;
     }
 
     switch (type) {
         case NodeType::Math:
-            validateMathContent();
+            if (!validateMathContent()) {
+                diagnostics.report(DiagnosticCode::InvalidMathContent, position, static_cast<int>(type));
+                return false;
+            }
             break;
         case NodeType::Section:
-            validateSectionContent();
+            if (!validateSectionContent()) {
+                diagnostics.report(DiagnosticCode::InvalidSectionContent, position, static_cast<int>(type));
+                return false;
+            }
             break;
         case NodeType::Command:
-            validateCommandContent();
+            if (!validateCommandContent()) {
+                diagnostics.report(DiagnosticCode::InvalidCommandContent, position, static_cast<int>(type));
+                return false;
+            }
             break;
         default:
             break;
     }
+    return true;
 }
 
-void ASTNode::validateMathContent() {
-    if (content.find("$") == std::string::npos && 
-        content.find("\\begin{equation}") == std::string::npos) {
-        throw std::runtime_error("Invalid math content format");
-    }
+bool ASTNode::validateMathContent() const {
+    return content.find("$") != std::string::npos ||
+           content.find("\\begin{equation}") != std::string::npos;
 }
 
-void ASTNode::validateSectionContent() {
-    if (content.find("\\section") == std::string::npos && 
-        content.find("\\subsection") == std::string::npos) {
-        throw std::runtime_error("Invalid section content format");
-    }
+bool ASTNode::validateSectionContent() const {
+    return content.find("\\section") != std::string::npos ||
+           content.find("\\subsection") != std::string::npos;
 }
 
-void ASTNode::validateCommandContent() {
-    if (content.empty() || content[0] != '\\') {
-        throw std::runtime_error("Invalid command format");
-    }
+bool ASTNode::validateCommandContent() const {
+    return !content.empty() && content[0] == '\\';
 }
 
 std::string ASTNode::getContent() const {
-    return content;
+    return std::string(content);
 }
 
 ASTNode::NodeType ASTNode::getType() const {
@@ -65,7 +65,11 @@ size_t ASTNode::getPosition() const {
     return position;
 }
 
-std::string ASTNode::getNodeTypeName(ASTNode::NodeType type) const {
+void ASTNode::setCommand(CommandRecord record) {
+    command = std::move(record);
+}
+
+std::string ASTNode::getNodeTypeName(ASTNode::NodeType type) {
     static const std::unordered_map<NodeType, std::string> nodeTypeNames = {
         {NodeType::Command, "Command"},
         {NodeType::Text, "Text"},
@@ -83,28 +87,19 @@ std::string ASTNode::getNodeTypeName(ASTNode::NodeType type) const {
     return it != nodeTypeNames.end() ? it->second : "Unknown";
 }
 
-const std::vector<std::shared_ptr<ASTNode>>& ASTNode::getChildren() const {
+const ASTNode::NodeList& ASTNode::getChildren() const {
     return children;
 }
 
-void ASTNode::addChild(const std::shared_ptr<ASTNode>& child) {
-    try {
-        if (!child) {
-            throw std::runtime_error("Attempted to add null child to node");
-        }
-
-        if (!isValidChild(child)) {
-            throw std::runtime_error("Invalid child type for current node");
-        }
-
-        children.push_back(child);
-    } catch (const std::exception& e) {
-        std::cerr << "Error adding child to node \"" << content << "\": " 
-                  << e.what() << std::endl;
+bool ASTNode::addChild(ASTNode* child) {
+    if (!child || !isValidChild(child)) {
+        return false;
     }
+    children.push_back(child);
+    return true;
 }
 
-bool ASTNode::isValidChild(const std::shared_ptr<ASTNode>& child) const {
+bool ASTNode::isValidChild(const ASTNode* child) const {
     static const std::unordered_map<NodeType, std::set<NodeType>> validChildren = {
         {NodeType::Document, {
             NodeType::Section, 
@@ -122,41 +117,29 @@ bool ASTNode::isValidChild(const std::shared_ptr<ASTNode>& child) const {
         }},
         {NodeType::Section, {NodeType::Text, NodeType::Command, NodeType::Math}},
         {NodeType::Math, {NodeType::Text}},
-        {NodeType::Environment, {NodeType::Text, NodeType::Command, NodeType::Math}},
+        {NodeType::Environment, {NodeType::Text, NodeType::Command, NodeType::Math, 
+                                 NodeType::Environment, NodeType::Section}},
         {NodeType::Author, {NodeType::Affiliation, NodeType::Text}}
     };
 
     auto it = validChildren.find(type);
     if (it != validChildren.end()) {
-        if (it->second.find(child->getType()) == it->second.end()) {
-            std::cerr << "Invalid child type: " << getNodeTypeName(child->getType()) 
-                      << " for parent type: " << getNodeTypeName(type) << std::endl;
-        }
         return it->second.find(child->getType()) != it->second.end();
     }
     return true; 
 }
 
-void ASTNode::addReference(const std::shared_ptr<ASTNode>& node) {
-    try {
-        if (!node) {
-            throw std::runtime_error("Attempted to add null reference");
-        }
-        references.push_back(node);
-    } catch (const std::exception& e) {
-        std::cerr << "Error adding reference to node \"" << content << "\": " 
-                  << e.what() << std::endl;
+bool ASTNode::addReference(ASTNode* node) {
+    if (!node) {
+        return false;
     }
+    references.push_back(node);
+    return true;
 }
 
 void ASTNode::setDAGNode(const std::shared_ptr<DAGNode>& dagNode_) {
-    try {
-        if (!dagNode_) {
-            throw std::runtime_error("Attempted to set null DAG node");
-        }
+    if (dagNode_) {
         dagNode = dagNode_;
-    } catch (const std::exception& e) {
-        std::cerr << "Error setting DAG node: " << e.what() << std::endl;
     }
 }
 
@@ -170,17 +153,42 @@ void ASTNode::print(int indent) const {
 }
 
 void ASTNode::printHelper(int indent, std::unordered_set<const ASTNode*>& visitedNodes) const {
+    struct Frame {
+        const ASTNode* node;
+        int indent;
+        size_t next;
+    };
+    SmallVector<Frame, 64> stack;
+    bool inAuthorGroup = false;
+    if (printLine(indent, visitedNodes, inAuthorGroup)) {
+        stack.push_back(Frame{this, indent, 0});
+    }
+
+    while (!stack.empty()) {
+        Frame& frame = stack.back();
+        if (frame.next == frame.node->children.size()) {
+            visitedNodes.erase(frame.node);
+            stack.pop_back();
+            continue;
+        }
+        const ASTNode* child = frame.node->children[frame.next++];
+        int childIndent = frame.indent + 2;
+        if (child->printLine(childIndent, visitedNodes, inAuthorGroup)) {
+            stack.push_back(Frame{child, childIndent, 0});
+        }
+    }
+}
+
+bool ASTNode::printLine(int indent, std::unordered_set<const ASTNode*>& visitedNodes, bool& inAuthorGroup) const {
     if (visitedNodes.find(this) != visitedNodes.end()) {
         std::string indentStr(indent, ' ');
         std::cout << indentStr << "[Already printed node: \"" << content << "\"]\n";
-        return;
+        return false;
     }
 
     visitedNodes.insert(this);
     std::string indentStr(indent, ' ');
 
-    static bool inAuthorGroup = false;
-
     if (content.find("\\author") != std::string::npos) {
         if (inAuthorGroup) {
             std::cout << indentStr << "[End of Author-Affiliation Group]\n";
@@ -211,23 +219,118 @@ void ASTNode::printHelper(int indent, std::unordered_set<const ASTNode*>& visite
                   << ", Content: \"" << content << "\"\n";
     }
 
-    for (const auto& child : children) {
-        child->printHelper(indent + 2, visitedNodes);
-    }
-
-    visitedNodes.erase(this);
+    return true;
 }
 
-AST::AST() {
+// Sized so a typical document's nodes and copied content fit in the first
+// block; the arena grows geometrically past that.
+AST::AST(size_t sourceBytes) : arena(2 * sourceBytes + 4096) {
     try {
-        root = std::make_shared<ASTNode>(ASTNode::NodeType::Document, "Document Root", 
-                                       0, ParserState::DefaultState);
+        root = createNode(ASTNode::NodeType::Document, "Document Root", 0, ParserState::DefaultState,
+                          ASTNode::Storage::Borrowed);
     } catch (const std::exception& e) {
         std::cerr << "Error creating AST root node: " << e.what() << std::endl;
         throw;
     }
 }
 
+ASTNode* AST::createNode(ASTNode::NodeType type, std::string_view content, size_t position,
+                         ParserState state, ASTNode::Storage storage) {
+    if (storage == ASTNode::Storage::Owned) {
+        content = arena.copy(content);
+    }
+    nodes++;
+    ASTNode* node = arena.create<ASTNode>(arena, type, content, position, state);
+    node->validateNode(diagnostics);
+    return node;
+}
+
+void AST::adopt(std::shared_ptr<AST> part, ASTNode* parent) {
+    if (!part || !part->root) {
+        return;
+    }
+    if (!parent) {
+        parent = root;
+    }
+    for (ASTNode* child : part->root->getChildren()) {
+        if (!parent->addChild(child)) {
+            diagnostics.report(DiagnosticCode::InvalidChild, child->getPosition(), static_cast<int>(child->getType()));
+        }
+    }
+    diagnostics.append(part->diagnostics);
+    crossReferences.append(part->crossReferences, static_cast<CrossReferences::Index>(nodes - 1));
+    nodes += part->nodes - 1;
+    auxiliarySources.insert(auxiliarySources.end(), part->auxiliarySources.begin(), part->auxiliarySources.end());
+    parts.push_back(std::move(part));
+}
+
+void AST::resolveReferences() {
+    crossReferences.resolve();
+    if (crossReferences.references.empty()) {
+        return;
+    }
+
+    std::vector<ASTNode*> preorder;
+    preorder.reserve(nodes);
+    SmallVector<ASTNode*, 64> pending;
+    pending.push_back(root);
+    while (!pending.empty()) {
+        ASTNode* node = pending.back();
+        pending.pop_back();
+        preorder.push_back(node);
+        const auto& children = node->getChildren();
+        for (auto it = children.rbegin(); it != children.rend(); ++it) {
+            pending.push_back(*it);
+        }
+    }
+    auto nodeAt = [&](CrossReferences::Index i) { return i < preorder.size() ? preorder[i] : nullptr; };
+
+    const auto& references = crossReferences.references;
+    for (const auto& site : references) {
+        if (ASTNode* node = nodeAt(site.node)) {
+            node->clearReferences();
+        }
+    }
+    for (size_t i = 0; i < references.size(); ++i) {
+        ASTNode* node = nodeAt(references[i].node);
+        ASTNode* target = crossReferences.targets[i] == CrossReferences::npos ? nullptr
+                                                                               : nodeAt(crossReferences.targets[i]);
+        if (node && target) {
+            node->addReference(target);
+        }
+    }
+
+    if (crossReferences.unresolved > 0) {
+        std::cerr << "Warning: " << crossReferences.unresolved << " of " << references.size()
+                  << " reference(s) point to undefined labels.\n";
+    }
+    if (crossReferences.duplicateLabels > 0) {
+        std::cerr << "Warning: " << crossReferences.duplicateLabels << " label(s) defined more than once.\n";
+    }
+}
+
+ASTTreeBuilder::ASTTreeBuilder(AST& ast) : ast(ast) {
+    openNodes.push_back(ast.root);
+}
+
+void ASTTreeBuilder::open(ASTNode::NodeType type, std::string_view content, size_t position, ParserState state,
+                          ASTNode::Storage storage, CommandRecord command) {
+    ASTNode* node = ast.createNode(type, content, position, state, storage);
+    if (type == ASTNode::NodeType::Command || type == ASTNode::NodeType::Environment) {
+        node->setCommand(std::move(command));
+    }
+    if (!openNodes.back()->addChild(node)) {
+        ast.diagnostics.report(DiagnosticCode::InvalidChild, position, static_cast<int>(type));
+    }
+    openNodes.push_back(node);
+}
+
+void ASTTreeBuilder::close() {
+    if (openNodes.size() > 1) {
+        openNodes.pop_back();
+    }
+}
+
 void AST::print() const {
     if (root) {
         root->print();
@@ -239,8 +342,8 @@ void AST::print() const {
 std::vector<std::string> AST::chunk() const {
     std::vector<std::string> chunks;
 
-    std::function<void(const std::shared_ptr<ASTNode>&, std::string&)> traverse;
-    traverse = [&](const std::shared_ptr<ASTNode>& node, std::string& currentChunk) {
+    std::function<void(const ASTNode*, std::string&)> traverse;
+    traverse = [&](const ASTNode* node, std::string& currentChunk) {
         if (node->getContent().find("\\author") != std::string::npos ||
             node->getContent().find("\\affiliation") != std::string::npos) {
             currentChunk += "[Author-Affiliation Group] " + node->getContent() + " ";
@@ -289,7 +392,7 @@ std::vector<std::string> AST::chunk() const {
 
         if (auto dagNode = node->getDAGNode()) {
             for (const auto& childDagNode : dagNode->getChildren()) {
-				if (auto linkedAstNode = childDagNode->getASTNode().lock()) {
+				if (auto linkedAstNode = childDagNode->getASTNode()) {
 					traverse(linkedAstNode, currentChunk);
 				}
 			}
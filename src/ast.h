@@ -2,6 +2,7 @@
 #define AST_H
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
 #include <unordered_set>
@@ -10,6 +11,12 @@
 #include <iostream>
 #include <stdexcept>
 #include "parser_state.h"
+#include "source_buffer.h"
+#include "command.h"
+#include "arena.h"
+#include "small_vector.h"
+#include "symbol_table.h"
+#include "diagnostics.h"
 #include "dag_node.h"
 
 class DAGNode;
@@ -33,19 +40,45 @@ public:
         Bibliography
     };
 
-    ASTNode(NodeType type, const std::string& content, size_t position, ParserState state);
+    // Borrowed content is a view into the document's SourceBuffer, which the
+    // owning AST keeps alive; Owned content is copied into the node.
+    enum class Storage {
+        Owned,
+        Borrowed
+    };
+
+    using NodeList = std::vector<ASTNode*, ArenaAllocator<ASTNode*>>;
+
+    // Nodes live in an AST's arena and are made through AST::createNode, which
+    // validates them; the content view must already be stable for the arena's
+    // lifetime.
+    ASTNode(Arena& arena, NodeType type, std::string_view content, size_t position, ParserState state);
+    ASTNode(const ASTNode&) = delete;
+    ASTNode& operator=(const ASTNode&) = delete;
     
     std::string getContent() const;
+    std::string_view getContentView() const { return content; }
     NodeType getType() const;
     ParserState getState() const;
     size_t getPosition() const;
+
+    // Command and Environment nodes keep the lexer's CommandRecord; its spans
+    // point into the AST's SourceBuffer.
+    void setCommand(CommandRecord record);
+    const CommandRecord& getCommand() const { return command; }
     
-    std::string getNodeTypeName(ASTNode::NodeType type) const;
+    static std::string getNodeTypeName(ASTNode::NodeType type);
 
-    const std::vector<std::shared_ptr<ASTNode>>& getChildren() const;
+    const NodeList& getChildren() const;
 
-    void addChild(const std::shared_ptr<ASTNode>& child);
-    void addReference(const std::shared_ptr<ASTNode>& node);
+    // Both return false, leaving the node unchanged, for a null node or a
+    // child type this node cannot hold.
+    bool addChild(ASTNode* child);
+    bool addReference(ASTNode* node);
+    void clearReferences() { references.clear(); }
+    // Nodes defining the labels this \ref-style command points to; filled by
+    // AST::resolveReferences.
+    const NodeList& getReferences() const { return references; }
     
     void setDAGNode(const std::shared_ptr<DAGNode>& dagNode);
     std::shared_ptr<DAGNode> getDAGNode() const;
@@ -62,33 +95,88 @@ public:
     }
 
 protected:
-    void validateNode();
-    void validateMathContent();
-    void validateSectionContent();
-    void validateCommandContent();
-    bool isValidChild(const std::shared_ptr<ASTNode>& child) const;
+    friend class AST;
+
+    bool validateNode(DiagnosticSink& diagnostics) const;
+    bool validateMathContent() const;
+    bool validateSectionContent() const;
+    bool validateCommandContent() const;
+    bool isValidChild(const ASTNode* child) const;
 
 private:
     NodeType type;
-    std::string content;
+    std::string_view content;
     size_t position;
     ParserState state;
-    std::vector<std::shared_ptr<ASTNode>> children;
-    std::vector<std::weak_ptr<ASTNode>> references;
+    CommandRecord command;
+    NodeList children;
+    NodeList references;
     std::weak_ptr<DAGNode> dagNode;
     
     void printHelper(int indent, std::unordered_set<const ASTNode*>& visitedNodes) const;
+    bool printLine(int indent, std::unordered_set<const ASTNode*>& visitedNodes, bool& inAuthorGroup) const;
     
     static const std::unordered_map<NodeType, std::set<NodeType>> validChildTypes;
 };
 
 
+// Owns every node of one document. Nodes are handed out as raw pointers that
+// stay valid for the AST's lifetime and are released together with it.
 class AST {
 public:
-    AST();
+    explicit AST(size_t sourceBytes = 0);
+    AST(const AST&) = delete;
+    AST& operator=(const AST&) = delete;
+
+    ASTNode* createNode(ASTNode::NodeType type, std::string_view content, size_t position,
+                        ParserState state, ASTNode::Storage storage = ASTNode::Storage::Owned);
+    // Moves part's top-level nodes under parent, by default this root, after
+    // the existing ones. parent must be last in preorder, as the node of an
+    // environment still open at the end of the tree is. The part's arena and
+    // sources are kept alive with this AST.
+    void adopt(std::shared_ptr<AST> part, ASTNode* parent = nullptr);
+    // Resolves crossReferences and links each reference node to the nodes
+    // defining its labels. Replaces the links of any earlier resolution.
+    void resolveReferences();
+    size_t nodeCount() const { return nodes; }
+    const Arena& getArena() const { return arena; }
+
     void print() const;
     std::vector<std::string> chunk() const;
-    std::shared_ptr<ASTNode> root;
+    ASTNode* root = nullptr;
+    std::shared_ptr<const SourceBuffer> source;
+    std::vector<std::shared_ptr<const SourceBuffer>> auxiliarySources;
+    CrossReferences crossReferences;
+    DiagnosticSink diagnostics;
+
+private:
+    Arena arena;
+    size_t nodes = 0;
+    std::vector<std::shared_ptr<AST>> parts;
+};
+
+// Receives a document's nodes in preorder. open() adds a node under the
+// innermost open one and makes it current; close() ends it. A leaf is an
+// open() immediately followed by close().
+class ASTBuilder {
+public:
+    virtual ~ASTBuilder() = default;
+    virtual void open(ASTNode::NodeType type, std::string_view content, size_t position, ParserState state,
+                      ASTNode::Storage storage, CommandRecord command) = 0;
+    virtual void close() = 0;
+};
+
+// Builds the pointer tree under an AST's root.
+class ASTTreeBuilder : public ASTBuilder {
+public:
+    explicit ASTTreeBuilder(AST& ast);
+    void open(ASTNode::NodeType type, std::string_view content, size_t position, ParserState state,
+              ASTNode::Storage storage, CommandRecord command) override;
+    void close() override;
+
+private:
+    AST& ast;
+    SmallVector<ASTNode*, 32> openNodes;
 };
 
 class ASTError : public std::runtime_error {
@@ -0,0 +1,384 @@
+#include "ast_image.h"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+
+constexpr char imageMagic[8] = {'T', 'Q', 'A', 'S', 'T', 'I', 'M', 'G'};
+constexpr uint32_t byteOrderMark = 0x01020304;
+
+enum Section {
+	Positions,
+	Contents,
+	Parents,
+	SubtreeEnds,
+	CommandSlots,
+	Commands,
+	Arguments,
+	Labels,
+	References,
+	Types,
+	States,
+	Text,
+	SectionCount
+};
+
+uint64_t alignUp(uint64_t offset) {
+	return (offset + 7) & ~uint64_t(7);
+}
+
+}
+
+struct ASTImage::Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t nodes;
+	uint32_t commands;
+	uint32_t arguments;
+	uint32_t labels;
+	uint32_t references;
+	uint32_t keyLength;
+	char key[maxKeyLength];
+	uint64_t sourceSize;
+	uint64_t textSize;
+	uint64_t offsets[SectionCount];
+};
+
+struct ASTImage::Span {
+	uint32_t offset;
+	uint32_t length;
+};
+
+struct ASTImage::CommandEntry {
+	uint32_t id;
+	uint32_t starred;
+	Span name;
+	// optionalCount spans from firstArgument on, then requiredCount more.
+	uint32_t firstArgument;
+	uint32_t optionalCount;
+	uint32_t requiredCount;
+	uint32_t reserved;
+};
+
+struct ASTImage::Site {
+	uint32_t node;
+	Span label;
+};
+
+void ASTImage::write(const FlatAST& flat, std::string_view key, std::ostream& out) {
+	if (key.size() > maxKeyLength) {
+		throw std::length_error("AST image key is longer than " + std::to_string(maxKeyLength) + " bytes");
+	}
+
+	// The source and the macro expansion buffers are copied whole, so views
+	// into them become offsets; anything else (arena copies) is appended.
+	struct Region {
+		const char* begin;
+		const char* end;
+		uint64_t offset;
+	};
+	std::string text;
+	std::vector<Region> regions;
+	auto addBuffer = [&](const std::shared_ptr<const SourceBuffer>& buffer) {
+		if (buffer && buffer->size() > 0) {
+			regions.push_back(Region{buffer->begin(), buffer->end(), text.size()});
+			text.append(buffer->view());
+		}
+	};
+	addBuffer(flat.source);
+	uint64_t sourceSize = text.size();
+	for (const auto& buffer : flat.auxiliarySources) {
+		addBuffer(buffer);
+	}
+	std::sort(regions.begin(), regions.end(), [](const Region& a, const Region& b) { return a.begin < b.begin; });
+	auto spanOf = [&](std::string_view view) {
+		if (view.empty()) {
+			return Span{0, 0};
+		}
+		auto after = std::upper_bound(regions.begin(), regions.end(), view.data(),
+		                              [](const char* p, const Region& r) { return p < r.begin; });
+		if (after != regions.begin()) {
+			const Region& region = *(after - 1);
+			if (view.data() + view.size() <= region.end) {
+				return Span{static_cast<uint32_t>(region.offset + (view.data() - region.begin)),
+				            static_cast<uint32_t>(view.size())};
+			}
+		}
+		Span span{static_cast<uint32_t>(text.size()), static_cast<uint32_t>(view.size())};
+		text.append(view);
+		return span;
+	};
+
+	Index nodes = flat.size();
+	std::vector<uint64_t> positions(nodes);
+	std::vector<Span> contents(nodes);
+	std::vector<uint32_t> parents(nodes);
+	std::vector<uint32_t> subtreeEnds(nodes);
+	std::vector<uint32_t> commandSlots(nodes, npos);
+	std::vector<CommandEntry> commands;
+	std::vector<Span> arguments;
+	std::vector<uint8_t> types(nodes);
+	std::vector<uint8_t> states(nodes);
+	for (Index i = 0; i < nodes; ++i) {
+		positions[i] = flat.position(i);
+		contents[i] = spanOf(flat.content(i));
+		parents[i] = flat.parent(i);
+		subtreeEnds[i] = flat.subtreeEnd(i);
+		types[i] = static_cast<uint8_t>(flat.type(i));
+		states[i] = static_cast<uint8_t>(flat.state(i));
+		if (flat.type(i) != ASTNode::NodeType::Command && flat.type(i) != ASTNode::NodeType::Environment) {
+			continue;
+		}
+		const CommandRecord& record = flat.command(i);
+		commandSlots[i] = static_cast<uint32_t>(commands.size());
+		commands.push_back(CommandEntry{record.id, record.starred ? 1u : 0u, spanOf(record.name),
+		                                static_cast<uint32_t>(arguments.size()),
+		                                static_cast<uint32_t>(record.optional.size()),
+		                                static_cast<uint32_t>(record.required.size()), 0});
+		for (std::string_view argument : record.optional) {
+			arguments.push_back(spanOf(argument));
+		}
+		for (std::string_view argument : record.required) {
+			arguments.push_back(spanOf(argument));
+		}
+	}
+	const CrossReferences& crossReferences = flat.crossReferences;
+	std::vector<Site> labels;
+	for (const auto& site : crossReferences.labels) {
+		labels.push_back(Site{site.node, spanOf(crossReferences.names.name(site.label))});
+	}
+	std::vector<Site> references;
+	for (const auto& site : crossReferences.references) {
+		references.push_back(Site{site.node, spanOf(crossReferences.names.name(site.label))});
+	}
+	if (text.size() > std::numeric_limits<uint32_t>::max()) {
+		throw std::length_error("AST image text exceeds 4 GiB");
+	}
+
+	Header header{};
+	std::memcpy(header.magic, imageMagic, sizeof(imageMagic));
+	header.version = formatVersion;
+	header.byteOrder = byteOrderMark;
+	header.nodes = nodes;
+	header.commands = static_cast<uint32_t>(commands.size());
+	header.arguments = static_cast<uint32_t>(arguments.size());
+	header.labels = static_cast<uint32_t>(labels.size());
+	header.references = static_cast<uint32_t>(references.size());
+	header.keyLength = static_cast<uint32_t>(key.size());
+	std::memcpy(header.key, key.data(), key.size());
+	header.sourceSize = sourceSize;
+	header.textSize = text.size();
+
+	const std::pair<const void*, uint64_t> sections[SectionCount] = {
+	    {positions.data(), positions.size() * sizeof(uint64_t)},
+	    {contents.data(), contents.size() * sizeof(Span)},
+	    {parents.data(), parents.size() * sizeof(uint32_t)},
+	    {subtreeEnds.data(), subtreeEnds.size() * sizeof(uint32_t)},
+	    {commandSlots.data(), commandSlots.size() * sizeof(uint32_t)},
+	    {commands.data(), commands.size() * sizeof(CommandEntry)},
+	    {arguments.data(), arguments.size() * sizeof(Span)},
+	    {labels.data(), labels.size() * sizeof(Site)},
+	    {references.data(), references.size() * sizeof(Site)},
+	    {types.data(), types.size()},
+	    {states.data(), states.size()},
+	    {text.data(), text.size()},
+	};
+	uint64_t offset = alignUp(sizeof(Header));
+	for (int s = 0; s < SectionCount; ++s) {
+		header.offsets[s] = offset;
+		offset = alignUp(offset + sections[s].second);
+	}
+
+	static const char padding[8] = {};
+	out.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+	uint64_t written = sizeof(Header);
+	for (int s = 0; s < SectionCount; ++s) {
+		out.write(padding, static_cast<std::streamsize>(header.offsets[s] - written));
+		out.write(static_cast<const char*>(sections[s].first), static_cast<std::streamsize>(sections[s].second));
+		written = header.offsets[s] + sections[s].second;
+	}
+}
+
+std::shared_ptr<const ASTImage> ASTImage::map(const std::string& path) {
+	return fromBuffer(SourceBuffer::mapFile(path));
+}
+
+ASTImage::ASTImage(std::shared_ptr<const SourceBuffer> buffer) : buffer(std::move(buffer)) {}
+
+std::shared_ptr<const ASTImage> ASTImage::fromBuffer(std::shared_ptr<const SourceBuffer> buffer) {
+	std::string_view bytes = buffer->view();
+	if (bytes.size() < sizeof(Header) || std::memcmp(bytes.data(), imageMagic, sizeof(imageMagic)) != 0) {
+		throw std::runtime_error("Not an AST image");
+	}
+	if (reinterpret_cast<std::uintptr_t>(bytes.data()) % alignof(Header) != 0) {
+		throw std::runtime_error("AST image is not aligned in memory");
+	}
+	const Header* header = reinterpret_cast<const Header*>(bytes.data());
+	if (header->version != formatVersion) {
+		throw std::runtime_error("AST image has format version " + std::to_string(header->version) + ", expected " +
+		                         std::to_string(formatVersion));
+	}
+	if (header->byteOrder != byteOrderMark) {
+		throw std::runtime_error("AST image was written with a different byte order");
+	}
+	if (header->nodes == 0 || header->keyLength > maxKeyLength || header->sourceSize > header->textSize) {
+		throw std::runtime_error("AST image header is corrupt");
+	}
+
+	const uint64_t sizes[SectionCount] = {
+	    uint64_t(header->nodes) * sizeof(uint64_t),
+	    uint64_t(header->nodes) * sizeof(Span),
+	    uint64_t(header->nodes) * sizeof(uint32_t),
+	    uint64_t(header->nodes) * sizeof(uint32_t),
+	    uint64_t(header->nodes) * sizeof(uint32_t),
+	    uint64_t(header->commands) * sizeof(CommandEntry),
+	    uint64_t(header->arguments) * sizeof(Span),
+	    uint64_t(header->labels) * sizeof(Site),
+	    uint64_t(header->references) * sizeof(Site),
+	    header->nodes,
+	    header->nodes,
+	    header->textSize,
+	};
+	for (int s = 0; s < SectionCount; ++s) {
+		uint64_t offset = header->offsets[s];
+		if (offset % 8 != 0 || offset > bytes.size() || sizes[s] > bytes.size() - offset) {
+			throw std::runtime_error("AST image is truncated or corrupt");
+		}
+	}
+
+	std::shared_ptr<ASTImage> image(new ASTImage(std::move(buffer)));
+	const char* base = bytes.data();
+	image->header = header;
+	image->positions = reinterpret_cast<const uint64_t*>(base + header->offsets[Positions]);
+	image->contents = reinterpret_cast<const Span*>(base + header->offsets[Contents]);
+	image->parents = reinterpret_cast<const uint32_t*>(base + header->offsets[Parents]);
+	image->subtreeEnds = reinterpret_cast<const uint32_t*>(base + header->offsets[SubtreeEnds]);
+	image->commandSlots = reinterpret_cast<const uint32_t*>(base + header->offsets[CommandSlots]);
+	image->commands = reinterpret_cast<const CommandEntry*>(base + header->offsets[Commands]);
+	image->arguments = reinterpret_cast<const Span*>(base + header->offsets[Arguments]);
+	image->labels = reinterpret_cast<const Site*>(base + header->offsets[Labels]);
+	image->references = reinterpret_cast<const Site*>(base + header->offsets[References]);
+	image->types = reinterpret_cast<const uint8_t*>(base + header->offsets[Types]);
+	image->states = reinterpret_cast<const uint8_t*>(base + header->offsets[States]);
+	image->text = std::string_view(base + header->offsets[Text], header->textSize);
+	return image;
+}
+
+std::string_view ASTImage::key() const {
+	return std::string_view(header->key, header->keyLength);
+}
+
+std::string_view ASTImage::source() const {
+	return text.substr(0, header->sourceSize);
+}
+
+ASTImage::Index ASTImage::size() const {
+	return header->nodes;
+}
+
+ASTNode::NodeType ASTImage::type(Index i) const {
+	return static_cast<ASTNode::NodeType>(types[i]);
+}
+
+std::string_view ASTImage::content(Index i) const {
+	return slice(contents[i]);
+}
+
+std::size_t ASTImage::position(Index i) const {
+	return static_cast<std::size_t>(positions[i]);
+}
+
+ParserState ASTImage::state(Index i) const {
+	return static_cast<ParserState>(states[i]);
+}
+
+ASTImage::Index ASTImage::parent(Index i) const {
+	return parents[i];
+}
+
+ASTImage::Index ASTImage::subtreeEnd(Index i) const {
+	return subtreeEnds[i];
+}
+
+CommandRecord ASTImage::command(Index i) const {
+	CommandRecord record;
+	uint32_t slot = commandSlots[i];
+	if (slot >= header->commands) {
+		return record;
+	}
+	const CommandEntry& entry = commands[slot];
+	record.id = entry.id;
+	record.name = slice(entry.name);
+	record.starred = entry.starred != 0;
+	uint64_t end = uint64_t(entry.firstArgument) + entry.optionalCount + entry.requiredCount;
+	if (end > header->arguments) {
+		return record;
+	}
+	const Span* argument = arguments + entry.firstArgument;
+	for (uint32_t k = 0; k < entry.optionalCount; ++k) {
+		record.optional.push_back(slice(*argument++));
+	}
+	for (uint32_t k = 0; k < entry.requiredCount; ++k) {
+		record.required.push_back(slice(*argument++));
+	}
+	return record;
+}
+
+ASTImage::Index ASTImage::nextSibling(Index i) const {
+	Index p = parents[i];
+	if (p == npos || p >= size()) {
+		return npos;
+	}
+	return subtreeEnds[i] < subtreeEnds[p] ? subtreeEnds[i] : npos;
+}
+
+std::vector<ASTImage::Index> ASTImage::children(Index i) const {
+	std::vector<Index> result;
+	for (Index child = firstChild(i); child != npos; child = nextSibling(child)) {
+		result.push_back(child);
+	}
+	return result;
+}
+
+std::shared_ptr<AST> ASTImage::toTree() const {
+	auto ast = std::make_shared<AST>(text.size());
+	ast->source = SourceBuffer::fromView(buffer, source());
+	ast->auxiliarySources.push_back(buffer);
+
+	Index nodes = size();
+	if (subtreeEnd(0) != nodes) {
+		throw std::runtime_error("AST image root does not span the document");
+	}
+	constexpr uint8_t lastType = static_cast<uint8_t>(ASTNode::NodeType::Bibliography);
+	ASTTreeBuilder builder(*ast);
+	SmallVector<Index, 32> openNodes;
+	openNodes.push_back(0);
+	for (Index i = 1; i < nodes; ++i) {
+		while (subtreeEnd(openNodes.back()) <= i) {
+			openNodes.pop_back();
+			builder.close();
+		}
+		Index end = subtreeEnd(i);
+		if (end <= i || end > subtreeEnd(openNodes.back()) || types[i] > lastType) {
+			throw std::runtime_error("AST image is corrupt at node " + std::to_string(i));
+		}
+		builder.open(type(i), content(i), position(i), state(i), ASTNode::Storage::Borrowed, command(i));
+		openNodes.push_back(i);
+	}
+
+	for (uint32_t k = 0; k < header->labels; ++k) {
+		ast->crossReferences.addLabel(slice(labels[k].label), labels[k].node);
+	}
+	for (uint32_t k = 0; k < header->references; ++k) {
+		ast->crossReferences.addReference(slice(references[k].label), references[k].node);
+	}
+	ast->resolveReferences();
+	return ast;
+}
+
+std::string_view ASTImage::slice(const Span& span) const {
+	return span.offset <= text.size() ? text.substr(span.offset, span.length) : std::string_view();
+}
@@ -0,0 +1,84 @@
+#ifndef AST_IMAGE_H
+#define AST_IMAGE_H
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "ast.h"
+#include "flat_ast.h"
+#include "source_buffer.h"
+
+// Versioned binary image of a parsed document in the FlatAST layout: node
+// arrays in preorder, command records, label and reference sites, and one
+// block of text that every span points into, the document source first. The
+// arrays sit at aligned offsets, so a mapped image is read in place and
+// opening one only checks its header. The byte order is the writer's; an
+// image from a machine of the other order is rejected, not converted.
+class ASTImage {
+public:
+	using Index = FlatAST::Index;
+	static constexpr Index npos = FlatAST::npos;
+	static constexpr uint32_t formatVersion = 1;
+	static constexpr std::size_t maxKeyLength = 64;
+
+	// key says what the document was parsed from, e.g. a hash of its input,
+	// so a reader can tell whether the image is still current. Throws
+	// std::length_error for a key over maxKeyLength or over 4 GiB of text.
+	static void write(const FlatAST& flat, std::string_view key, std::ostream& out);
+	// Both throw std::runtime_error for anything but an image of this version.
+	static std::shared_ptr<const ASTImage> map(const std::string& path);
+	static std::shared_ptr<const ASTImage> fromBuffer(std::shared_ptr<const SourceBuffer> buffer);
+
+	std::string_view key() const;
+	std::string_view source() const;
+
+	Index size() const;
+	ASTNode::NodeType type(Index i) const;
+	std::string_view content(Index i) const;
+	std::size_t position(Index i) const;
+	ParserState state(Index i) const;
+	Index parent(Index i) const;
+	Index subtreeEnd(Index i) const;
+	// Its spans point into the image.
+	CommandRecord command(Index i) const;
+
+	Index firstChild(Index i) const { return i + 1 < subtreeEnd(i) ? i + 1 : npos; }
+	Index nextSibling(Index i) const;
+	std::vector<Index> children(Index i) const;
+
+	// The pointer tree the FSM walks, rebuilt by replaying the nodes through
+	// an ASTTreeBuilder with no lexing or parsing. Contents and command
+	// arguments stay in the image, which the AST keeps alive. Throws
+	// std::runtime_error if the node ranges do not nest.
+	std::shared_ptr<AST> toTree() const;
+
+private:
+	struct Header;
+	struct Span;
+	struct CommandEntry;
+	struct Site;
+
+	explicit ASTImage(std::shared_ptr<const SourceBuffer> buffer);
+
+	std::shared_ptr<const SourceBuffer> buffer;
+	const Header* header = nullptr;
+	const uint64_t* positions = nullptr;
+	const Span* contents = nullptr;
+	const uint32_t* parents = nullptr;
+	const uint32_t* subtreeEnds = nullptr;
+	const uint32_t* commandSlots = nullptr;
+	const CommandEntry* commands = nullptr;
+	const Span* arguments = nullptr;
+	const Site* labels = nullptr;
+	const Site* references = nullptr;
+	const uint8_t* types = nullptr;
+	const uint8_t* states = nullptr;
+	std::string_view text;
+
+	std::string_view slice(const Span& span) const;
+};
+
+#endif
@@ -0,0 +1,116 @@
+// Compares a full traversal of the pointer-tree AST against a linear scan of
+// the preorder FlatAST over the same document.
+//
+//   ./bench_traversal [file.tex] [repetitions]
+//
+// Without a file a synthetic paper of nested sections, environments, math
+// and citations is generated.
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "../lexer.h"
+#include "../parser.h"
+#include "../flat_ast.h"
+
+namespace {
+
+std::string syntheticPaper(int sections) {
+    std::string text = "\\documentclass{article}\n\\begin{document}\n";
+    for (int s = 0; s < sections; ++s) {
+        text += "\\section{Section " + std::to_string(s) + "}\\label{sec:" + std::to_string(s) + "}\n";
+        text += "Body text with a citation \\cite{key" + std::to_string(s) + "} and $x_" + std::to_string(s) + "$.\n";
+        text += "\\begin{itemize}\n";
+        for (int i = 0; i < 8; ++i) {
+            text += "\\item entry " + std::to_string(i) + " with \\textbf{bold} and $a+b$\n";
+        }
+        text += "\\end{itemize}\n\\begin{equation}\nE = mc^2 \\label{eq:" + std::to_string(s) + "}\n\\end{equation}\n";
+        text += "\\begin{figure}\\begin{center}\\includegraphics{f.png}\\end{center}\\caption{Fig}\\end{figure}\n";
+    }
+    text += "\\end{document}\n";
+    return text;
+}
+
+struct Visit {
+    size_t nodes = 0;
+    size_t bytes = 0;
+    size_t environments = 0;
+};
+
+void visitTree(const ASTNode* node, Visit& visit) {
+    visit.nodes++;
+    visit.bytes += node->getContentView().size();
+    if (node->getType() == ASTNode::NodeType::Environment) {
+        visit.environments++;
+    }
+    for (const ASTNode* child : node->getChildren()) {
+        visitTree(child, visit);
+    }
+}
+
+void visitFlat(const FlatAST& flat, Visit& visit) {
+    for (FlatAST::Index i = 0; i < flat.size(); ++i) {
+        visit.nodes++;
+        visit.bytes += flat.content(i).size();
+        if (flat.type(i) == ASTNode::NodeType::Environment) {
+            visit.environments++;
+        }
+    }
+}
+
+template <typename F>
+double timeMs(int repetitions, F&& body) {
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repetitions; ++r) {
+        body();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    std::string text;
+    if (argc > 1) {
+        std::ifstream file(argv[1]);
+        if (!file) {
+            std::cerr << "Could not open " << argv[1] << "\n";
+            return 1;
+        }
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        text = buffer.str();
+    } else {
+        text = syntheticPaper(2000);
+    }
+    int repetitions = argc > 2 ? std::stoi(argv[2]) : 50;
+    auto source = SourceBuffer::fromString(std::move(text));
+
+    Lexer treeLexer(source, LexerMode::Span);
+    Parser treeParser(treeLexer);
+    auto ast = treeParser.parseDocument();
+
+    Lexer flatLexer(source, LexerMode::Span);
+    Parser flatParser(flatLexer);
+    auto flat = flatParser.parseFlatDocument();
+
+    Visit treeVisit;
+    Visit flatVisit;
+    double treeMs = timeMs(repetitions, [&] { visitTree(ast->root, treeVisit); });
+    double flatMs = timeMs(repetitions, [&] { visitFlat(*flat, flatVisit); });
+
+    if (treeVisit.nodes != flatVisit.nodes || treeVisit.bytes != flatVisit.bytes) {
+        std::cerr << "Traversals disagree: " << treeVisit.nodes << " vs " << flatVisit.nodes << " nodes\n";
+        return 1;
+    }
+
+    size_t nodes = flat->size();
+    std::printf("%zu bytes, %zu nodes, %d repetitions\n", source->size(), nodes, repetitions);
+    std::printf("pointer tree: %8.3f ms  (%.2f ns/node)\n", treeMs, treeMs * 1e6 / (nodes * repetitions));
+    std::printf("flat preorder: %7.3f ms  (%.2f ns/node)\n", flatMs, flatMs * 1e6 / (nodes * repetitions));
+    return 0;
+}
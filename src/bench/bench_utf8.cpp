@@ -0,0 +1,165 @@
+// Compares the byte-by-byte UTF-8 check the driver used to run on every
+// source file against checkUtf8 on each backend this CPU has.
+//
+//   ./bench_utf8 [file.tex or directory] [repetitions]
+//
+// A directory is searched recursively for .tex files, e.g. an unpacked
+// arXiv source dump; all of them are checked once per repetition. Without
+// a path a synthetic mix of ASCII and accented text is generated.
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../utf8.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// The driver's former check, kept as the baseline. It accepts overlong
+// forms, surrogates and code points past U+10FFFF.
+bool legacyIsValidUtf8(const std::string& string) {
+    int c, i, ix, n, j;
+    for (i = 0, ix = string.length(); i < ix; i++) {
+        c = (unsigned char)string[i];
+        if (0x00 <= c && c <= 0x7F) {
+            continue;
+        } else if ((c & 0xE0) == 0xC0) {
+            n = 1;
+        } else if ((c & 0xF0) == 0xE0) {
+            n = 2;
+        } else if ((c & 0xF8) == 0xF0) {
+            n = 3;
+        } else {
+            return false;
+        }
+        if (i + n >= ix) {
+            return false;
+        }
+        for (j = 0; j < n; j++) {
+            i++;
+            c = (unsigned char)string[i];
+            if ((c & 0xC0) != 0x80) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+std::string syntheticSource(int paragraphs) {
+    std::string text;
+    for (int p = 0; p < paragraphs; ++p) {
+        text += "\\paragraph{Result " + std::to_string(p) + "} The estimator converges for $n \\to \\infty$ ";
+        text += p % 4 == 0 ? "(see Erd\xC5\x91s and G\xC3\xB6" "del, \xC2\xA7" + std::to_string(p) + ").\n" : "as shown.\n";
+    }
+    return text;
+}
+
+std::vector<std::string> readSources(const fs::path& path) {
+    std::vector<fs::path> files;
+    if (fs::is_directory(path)) {
+        for (const auto& entry : fs::recursive_directory_iterator(path)) {
+            if (entry.is_regular_file() && entry.path().extension() == ".tex") {
+                files.push_back(entry.path());
+            }
+        }
+    } else {
+        files.push_back(path);
+    }
+    std::vector<std::string> sources;
+    for (const auto& file : files) {
+        std::ifstream in(file, std::ios::binary);
+        std::stringstream buffer;
+        buffer << in.rdbuf();
+        sources.push_back(buffer.str());
+    }
+    return sources;
+}
+
+template <typename F>
+double timeMs(int repetitions, F&& body) {
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repetitions; ++r) {
+        body();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> sources;
+    if (argc > 1) {
+        if (!fs::exists(argv[1])) {
+            std::cerr << "Could not open " << argv[1] << "\n";
+            return 1;
+        }
+        sources = readSources(argv[1]);
+    } else {
+        sources.push_back(syntheticSource(20000));
+    }
+    int repetitions = argc > 2 ? std::stoi(argv[2]) : 20;
+
+    size_t bytes = 0;
+    size_t legacyValid = 0;
+    size_t strictValid = 0;
+    size_t ascii = 0;
+    for (const auto& source : sources) {
+        bytes += source.size();
+        legacyValid += legacyIsValidUtf8(source);
+        Utf8Check check = checkUtf8(source, StructuralIndex::Backend::Scalar);
+        strictValid += check.valid;
+        ascii += check.ascii;
+    }
+    std::printf("%zu file(s), %zu bytes, %d repetitions\n", sources.size(), bytes, repetitions);
+    std::printf("valid: %zu legacy, %zu strict; %zu pure ASCII\n", legacyValid, strictValid, ascii);
+
+    auto report = [&](const char* name, double ms) {
+        std::printf("%-14s %9.3f ms  (%.2f GB/s)\n", name, ms, bytes * double(repetitions) / (ms * 1e6));
+    };
+
+    volatile size_t sink = 0;
+    report("legacy", timeMs(repetitions, [&] {
+        for (const auto& source : sources) {
+            sink = sink + legacyIsValidUtf8(source);
+        }
+    }));
+
+    std::vector<StructuralIndex::Backend> backends = {StructuralIndex::Backend::Scalar};
+#if defined(__x86_64__) || defined(__i386__)
+    if (StructuralIndex::detectBackend() != StructuralIndex::Backend::Scalar) {
+        backends.push_back(StructuralIndex::Backend::SSE42);
+    }
+#endif
+    if (StructuralIndex::detectBackend() != backends.back()) {
+        backends.push_back(StructuralIndex::detectBackend());
+    }
+    for (auto backend : backends) {
+        size_t agreeing = 0;
+        double ms = timeMs(repetitions, [&] {
+            for (const auto& source : sources) {
+                Utf8Check check = checkUtf8(source, backend);
+                sink = sink + check.valid + check.ascii;
+            }
+        });
+        for (const auto& source : sources) {
+            Utf8Check check = checkUtf8(source, backend);
+            Utf8Check reference = checkUtf8(source, StructuralIndex::Backend::Scalar);
+            agreeing += check.valid == reference.valid && (!check.valid || check.ascii == reference.ascii);
+        }
+        if (agreeing != sources.size()) {
+            std::cerr << StructuralIndex::backendName(backend) << " disagrees with scalar on "
+                      << sources.size() - agreeing << " file(s)\n";
+            return 1;
+        }
+        report(StructuralIndex::backendName(backend), ms);
+    }
+    return 0;
+}
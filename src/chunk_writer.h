@@ -0,0 +1,95 @@
+#ifndef CHUNK_WRITER_H
+#define CHUNK_WRITER_H
+
+#include <charconv>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+// Receives finished chunks. The text is only valid for the duration of the
+// call; a sink that keeps it makes its own copy.
+class ChunkSink {
+public:
+	virtual ~ChunkSink() = default;
+	virtual void write(std::string_view chunk) = 0;
+};
+
+// The chunk being assembled by the FSM handlers. Fragments are appended in
+// place to one buffer that keeps its capacity across chunks, so after the
+// first few sections no chunk reallocates. The buffer is contiguous because
+// citation and reference handlers record the chunk so far as their context.
+class ChunkBuilder {
+public:
+	ChunkBuilder& operator<<(std::string_view text) {
+		buffer.append(text.data(), text.size());
+		return *this;
+	}
+	ChunkBuilder& operator<<(const char* text) { return *this << std::string_view(text); }
+	ChunkBuilder& operator<<(const std::string& text) { return *this << std::string_view(text); }
+	ChunkBuilder& operator<<(char c) {
+		buffer.push_back(c);
+		return *this;
+	}
+
+	template <typename T, typename = std::enable_if_t<std::is_integral<T>::value && !std::is_same<T, char>::value &&
+	                                                  !std::is_same<T, bool>::value>>
+	ChunkBuilder& operator<<(T value) {
+		char digits[24];
+		auto result = std::to_chars(digits, digits + sizeof(digits), value);
+		buffer.append(digits, result.ptr);
+		return *this;
+	}
+
+	std::string_view view() const { return buffer; }
+	bool empty() const { return buffer.empty(); }
+	std::size_t size() const { return buffer.size(); }
+
+	// Hands the chunk to the sink, if there is one, and starts the next.
+	void flush(ChunkSink& sink) {
+		if (!buffer.empty()) {
+			sink.write(buffer);
+			buffer.clear();
+		}
+	}
+
+private:
+	std::string buffer;
+};
+
+class ChunkVector : public ChunkSink {
+public:
+	void write(std::string_view chunk) override { chunks.emplace_back(chunk); }
+	std::vector<std::string> chunks;
+};
+
+// Appends each chunk as a string element of an existing JSON array.
+class JsonChunkArray : public ChunkSink {
+public:
+	explicit JsonChunkArray(nlohmann::json& array) : array(array) {}
+	void write(std::string_view chunk) override { array.emplace_back(std::string(chunk)); }
+
+private:
+	nlohmann::json& array;
+};
+
+// Writes chunks to a stream as they finish, each followed by the separator.
+class StreamChunkSink : public ChunkSink {
+public:
+	explicit StreamChunkSink(std::ostream& out, std::string_view separator = "\n") : out(out), separator(separator) {}
+	void write(std::string_view chunk) override {
+		out.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+		out << separator;
+		count++;
+	}
+	std::size_t getChunkCount() const { return count; }
+
+private:
+	std::ostream& out;
+	std::string separator;
+	std::size_t count = 0;
+};
+
+#endif
@@ -0,0 +1,308 @@
+#include "chunker.h"
+#include <algorithm>
+#include <charconv>
+
+namespace {
+
+constexpr std::string_view textOpen = "<text_content>";
+constexpr std::string_view textClose = "</text_content>\n";
+
+bool isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+std::string_view between(std::string_view text, std::string_view open, std::string_view close) {
+	std::size_t start = text.find(open);
+	if (start == std::string_view::npos) {
+		return {};
+	}
+	start += open.size();
+	std::size_t end = text.find(close, start);
+	return end == std::string_view::npos ? std::string_view() : text.substr(start, end - start);
+}
+
+}
+
+TokenChunker::TokenChunker(EmbeddingSink& sink) : TokenChunker(sink, Options{}) {}
+
+TokenChunker::TokenChunker(EmbeddingSink& sink, const Options& options)
+    : sink(sink), options(options), wrapperTokens(options.countTokens("<text_content></text_content>\n")) {}
+
+void TokenChunker::write(std::string_view chunk) {
+	units.clear();
+	split(chunk);
+
+	for (std::size_t i = 0; i < units.size(); ++i) {
+		const Unit& unit = units[i];
+		if (unit.kind == Kind::SectionHeader) {
+			emit(false);
+			enterSection(unit.text);
+		} else if (unit.kind == Kind::EnvironmentStart) {
+			std::size_t span = environmentTokens(i);
+			if (span <= options.maxTokens && pendingTokens + span > options.maxTokens) {
+				emit(true);
+			}
+		}
+		add(unit);
+	}
+
+	// The FSM ends a chunk mid-section only after a section header, which
+	// belongs to the chunk that the next write continues.
+	if (freshUnits == 0 && pending.size() == 1 && pending[0].kind == Kind::SectionHeader) {
+		if (pending[0].text.data() != carry.data()) {
+			carry.assign(pending[0].text);
+			pending[0].text = carry;
+		}
+	} else {
+		emit(false);
+	}
+}
+
+void TokenChunker::finish() {
+	emit(false);
+}
+
+void TokenChunker::split(std::string_view text) {
+	std::size_t pos = 0;
+	while (pos < text.size()) {
+		std::size_t lineEnd = text.find('\n', pos);
+		lineEnd = lineEnd == std::string_view::npos ? text.size() : lineEnd + 1;
+		Kind kind = Kind::Block;
+		std::size_t end = lineEnd;
+
+		if (text[pos] == '<') {
+			std::size_t nameEnd = std::min(text.find_first_of(" >\n", pos + 1), text.size());
+			std::string_view name = text.substr(pos + 1, nameEnd - pos - 1);
+			if (name == "environment_start") {
+				kind = Kind::EnvironmentStart;
+			} else if (name == "/environment_end") {
+				kind = Kind::EnvironmentEnd;
+			} else if (!name.empty() && name[0] != '/') {
+				// A fragment runs to the line with its closing tag. Nested
+				// elements are indented, so an unindented tag without it (some
+				// floats are never closed) starts the next fragment instead.
+				std::string closing = "</" + std::string(name) + ">";
+				std::size_t line = pos;
+				end = text.size();
+				while (line < text.size()) {
+					std::size_t next = text.find('\n', line);
+					next = next == std::string_view::npos ? text.size() : next + 1;
+					bool closes = text.substr(line, next - line).find(closing) != std::string_view::npos;
+					if (!closes && line != pos && text[line] == '<') {
+						end = line;
+						break;
+					}
+					if (closes) {
+						end = next;
+						break;
+					}
+					line = next;
+				}
+
+				std::size_t close = text.substr(pos, end - pos).rfind(closing);
+				if (name == "text_content" && close != std::string_view::npos) {
+					splitText(text.substr(pos + textOpen.size(), close - textOpen.size()));
+					pos = end;
+					continue;
+				}
+				if (name == "section_header") {
+					kind = Kind::SectionHeader;
+				}
+			}
+		}
+
+		std::string_view fragment = text.substr(pos, end - pos);
+		units.push_back(Unit{fragment, options.countTokens(fragment), fragments++, kind});
+		pos = end;
+	}
+}
+
+// Breaks after paragraph ends and after sentence punctuation followed by
+// space, but not inside braces or $...$ left in the text.
+void TokenChunker::splitText(std::string_view body) {
+	uint32_t fragment = fragments++;
+	std::size_t start = 0;
+	int depth = 0;
+	bool math = false;
+	for (std::size_t i = 0; i < body.size(); ++i) {
+		char c = body[i];
+		if (c == '{') {
+			depth++;
+		} else if (c == '}') {
+			depth = depth > 0 ? depth - 1 : 0;
+		} else if (c == '$') {
+			math = !math;
+		}
+		if (depth > 0 || math || i + 1 >= body.size() || !isSpace(body[i + 1])) {
+			continue;
+		}
+		bool sentence = c == '.' || c == '!' || c == '?';
+		bool paragraph = c == '\n' && body[i + 1] == '\n';
+		if (sentence || paragraph) {
+			std::size_t end = i + 1;
+			while (end < body.size() && isSpace(body[end])) {
+				end++;
+			}
+			addTextPiece(body.substr(start, end - start), fragment);
+			start = end;
+			i = end - 1;
+		}
+	}
+	if (start < body.size() || body.empty()) {
+		addTextPiece(body.substr(start), fragment);
+	}
+}
+
+void TokenChunker::addTextPiece(std::string_view piece, uint32_t fragment) {
+	std::size_t tokens = options.countTokens(piece);
+	if (tokens <= options.maxTokens) {
+		units.push_back(Unit{piece, tokens, fragment, Kind::Text});
+		return;
+	}
+
+	// A sentence over budget is cut between words.
+	std::size_t start = 0;
+	std::size_t sum = 0;
+	std::size_t pos = 0;
+	while (pos < piece.size()) {
+		std::size_t wordEnd = pos;
+		while (wordEnd < piece.size() && !isSpace(piece[wordEnd])) {
+			wordEnd++;
+		}
+		while (wordEnd < piece.size() && isSpace(piece[wordEnd])) {
+			wordEnd++;
+		}
+		std::size_t word = options.countTokens(piece.substr(pos, wordEnd - pos));
+		if (sum > 0 && sum + word > options.maxTokens) {
+			units.push_back(Unit{piece.substr(start, pos - start), sum, fragment, Kind::Text});
+			start = pos;
+			sum = 0;
+		}
+		sum += word;
+		pos = wordEnd;
+	}
+	units.push_back(Unit{piece.substr(start), sum, fragment, Kind::Text});
+}
+
+void TokenChunker::enterSection(std::string_view header) {
+	std::string_view title = between(header, "<section_title>", "</section_title>");
+	std::string_view level = between(header, "<section_level>", "</section_level>");
+	if (title.empty()) {
+		title = between(header, "<title>", "</title>");
+	}
+	if (level.empty()) {
+		level = between(header, "<level>", "</level>");
+	}
+	int depth = 0;
+	std::from_chars(level.data(), level.data() + level.size(), depth);
+
+	while (!sections.empty() && sections.back().first >= depth) {
+		sections.pop_back();
+	}
+	sections.emplace_back(depth, std::string(title));
+
+	sectionPath.clear();
+	for (const auto& section : sections) {
+		if (!sectionPath.empty()) {
+			sectionPath += " > ";
+		}
+		sectionPath += section.second;
+	}
+}
+
+// Tokens from the environment start at units[start] through its end, or
+// through the last unit seen; stops counting once over budget.
+std::size_t TokenChunker::environmentTokens(std::size_t start) const {
+	std::size_t sum = 0;
+	int depth = 0;
+	for (std::size_t i = start; i < units.size() && sum <= options.maxTokens; ++i) {
+		sum += units[i].tokens;
+		if (units[i].kind == Kind::EnvironmentStart) {
+			depth++;
+		} else if (units[i].kind == Kind::EnvironmentEnd && --depth == 0) {
+			break;
+		}
+	}
+	return sum;
+}
+
+std::size_t TokenChunker::unitTokens(const Unit& unit, const Unit* previous) const {
+	bool continues = previous && previous->kind == Kind::Text && previous->fragment == unit.fragment;
+	return unit.tokens + (unit.kind == Kind::Text && !continues ? wrapperTokens : 0);
+}
+
+void TokenChunker::add(const Unit& unit) {
+	if (freshUnits > 0 && pendingTokens + unitTokens(unit, &pending.back()) > options.maxTokens) {
+		emit(true);
+	}
+	// Overlap gives way to new content, oldest first; a section header stays.
+	while (freshUnits == 0 && !pending.empty() && pendingTokens + unitTokens(unit, &pending.back()) > options.maxTokens) {
+		auto overlap = std::find_if(pending.begin(), pending.end(),
+		                            [](const Unit& u) { return u.kind != Kind::SectionHeader; });
+		if (overlap == pending.end()) {
+			break;
+		}
+		pending.erase(overlap);
+		recount();
+	}
+	pendingTokens += unitTokens(unit, pending.empty() ? nullptr : &pending.back());
+	pending.push_back(unit);
+	if (unit.kind != Kind::SectionHeader) {
+		freshUnits++;
+	}
+}
+
+void TokenChunker::emit(bool keepOverlap) {
+	if (freshUnits == 0) {
+		// Nothing new since the last chunk: only a header or overlap is left.
+		if (!keepOverlap) {
+			pending.clear();
+			pendingTokens = 0;
+		}
+		return;
+	}
+
+	rendered.clear();
+	for (std::size_t i = 0; i < pending.size(); ++i) {
+		const Unit& unit = pending[i];
+		if (unit.kind != Kind::Text) {
+			rendered += unit.text;
+			continue;
+		}
+		bool continues = i > 0 && pending[i - 1].kind == Kind::Text && pending[i - 1].fragment == unit.fragment;
+		bool continued = i + 1 < pending.size() && pending[i + 1].kind == Kind::Text &&
+		                 pending[i + 1].fragment == unit.fragment;
+		if (!continues) {
+			rendered += textOpen;
+		}
+		rendered += unit.text;
+		if (!continued) {
+			rendered += textClose;
+		}
+	}
+	sink.write(EmbeddingChunk{rendered, sectionPath, pendingTokens});
+	emitted++;
+
+	std::size_t keep = pending.size();
+	if (keepOverlap) {
+		std::size_t sum = 0;
+		while (keep > 1) {
+			const Unit& unit = pending[keep - 1];
+			if ((unit.kind != Kind::Text && unit.kind != Kind::Block) || sum + unit.tokens > options.overlapTokens) {
+				break;
+			}
+			sum += unit.tokens;
+			keep--;
+		}
+	}
+	pending.erase(pending.begin(), pending.begin() + static_cast<std::ptrdiff_t>(keep));
+	recount();
+	freshUnits = 0;
+}
+
+void TokenChunker::recount() {
+	pendingTokens = 0;
+	for (std::size_t i = 0; i < pending.size(); ++i) {
+		pendingTokens += unitTokens(pending[i], i > 0 ? &pending[i - 1] : nullptr);
+	}
+}
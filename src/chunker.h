@@ -0,0 +1,90 @@
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "chunk_writer.h"
+#include "token_counter.h"
+
+// A chunk sized for embedding, with the titles of its enclosing sections
+// joined by " > ". Views are valid for the duration of the sink call.
+struct EmbeddingChunk {
+	std::string_view text;
+	std::string_view sectionPath;
+	std::size_t tokens;
+};
+
+class EmbeddingSink {
+public:
+	virtual ~EmbeddingSink() = default;
+	virtual void write(const EmbeddingChunk& chunk) = 0;
+};
+
+// Re-packs the FSM's section chunks into chunks of at most maxTokens.
+// Fragments are kept whole except text, which breaks at paragraph and
+// sentence ends (words only for a sentence over budget); math, citations and
+// other command blocks are never split, so one larger than the budget is
+// emitted on its own. Environments that fit a chunk are moved whole into the
+// next one rather than cut, and each section starts a new chunk. Consecutive
+// chunks of a section share up to overlapTokens of trailing fragments.
+class TokenChunker : public ChunkSink {
+public:
+	using TokenCounter = std::size_t (*)(std::string_view);
+
+	struct Options {
+		std::size_t maxTokens = 512;
+		std::size_t overlapTokens = 64;
+		TokenCounter countTokens = estimateTokens;
+	};
+
+	explicit TokenChunker(EmbeddingSink& sink);
+	TokenChunker(EmbeddingSink& sink, const Options& options);
+
+	void write(std::string_view chunk) override;
+	// Emits whatever is still pending; call once after the last chunk.
+	void finish();
+
+	std::size_t getChunkCount() const { return emitted; }
+
+private:
+	enum class Kind : uint8_t { Text, Block, EnvironmentStart, EnvironmentEnd, SectionHeader };
+
+	struct Unit {
+		std::string_view text;
+		std::size_t tokens;
+		// Text units cut from one <text_content> element share an id and are
+		// rendered back into a single element when they stay together.
+		uint32_t fragment;
+		Kind kind;
+	};
+
+	EmbeddingSink& sink;
+	Options options;
+	std::size_t wrapperTokens;
+	std::vector<Unit> units;
+	std::vector<Unit> pending;
+	std::size_t pendingTokens = 0;
+	std::size_t freshUnits = 0;
+	uint32_t fragments = 0;
+	std::vector<std::pair<int, std::string>> sections;
+	std::string sectionPath;
+	std::string carry;
+	std::string rendered;
+	std::size_t emitted = 0;
+
+	void split(std::string_view text);
+	void splitText(std::string_view body);
+	void addTextPiece(std::string_view piece, uint32_t fragment);
+	void enterSection(std::string_view header);
+	std::size_t environmentTokens(std::size_t start) const;
+	void add(const Unit& unit);
+	void emit(bool keepOverlap);
+	void recount();
+	std::size_t unitTokens(const Unit& unit, const Unit* previous) const;
+};
+
+#endif
@@ -0,0 +1,394 @@
+#include "command.h"
+#include <array>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+struct CommandEntry {
+    std::string_view name;
+    CommandId id;
+    CommandKind kind;
+};
+
+// Listed in CommandId order, so entry i describes id i + 1.
+constexpr CommandEntry commandTable[] = {
+    {"documentclass", CommandId::Documentclass, CommandKind::Document},
+    {"usepackage", CommandId::Usepackage, CommandKind::Document},
+    {"title", CommandId::Title, CommandKind::Document},
+    {"author", CommandId::Author, CommandKind::Document},
+    {"date", CommandId::Date, CommandKind::Document},
+    {"maketitle", CommandId::Maketitle, CommandKind::Document},
+    {"begin", CommandId::Begin, CommandKind::Document},
+    {"end", CommandId::End, CommandKind::Document},
+    {"institute", CommandId::Institute, CommandKind::Document},
+    {"abstract", CommandId::Abstract, CommandKind::Document},
+    {"keywords", CommandId::Keywords, CommandKind::Document},
+    {"thanks", CommandId::Thanks, CommandKind::Document},
+    {"acknowledgements", CommandId::Acknowledgements, CommandKind::Document},
+    {"part", CommandId::Part, CommandKind::Sectioning},
+    {"chapter", CommandId::Chapter, CommandKind::Sectioning},
+    {"section", CommandId::Section, CommandKind::Sectioning},
+    {"subsection", CommandId::Subsection, CommandKind::Sectioning},
+    {"subsubsection", CommandId::Subsubsection, CommandKind::Sectioning},
+    {"paragraph", CommandId::Paragraph, CommandKind::Sectioning},
+    {"subparagraph", CommandId::Subparagraph, CommandKind::Sectioning},
+    {"alpha", CommandId::Alpha, CommandKind::Math},
+    {"beta", CommandId::Beta, CommandKind::Math},
+    {"gamma", CommandId::Gamma, CommandKind::Math},
+    {"delta", CommandId::Delta, CommandKind::Math},
+    {"epsilon", CommandId::Epsilon, CommandKind::Math},
+    {"zeta", CommandId::Zeta, CommandKind::Math},
+    {"eta", CommandId::Eta, CommandKind::Math},
+    {"theta", CommandId::Theta, CommandKind::Math},
+    {"iota", CommandId::Iota, CommandKind::Math},
+    {"kappa", CommandId::Kappa, CommandKind::Math},
+    {"lambda", CommandId::Lambda, CommandKind::Math},
+    {"mu", CommandId::Mu, CommandKind::Math},
+    {"nu", CommandId::Nu, CommandKind::Math},
+    {"xi", CommandId::Xi, CommandKind::Math},
+    {"pi", CommandId::Pi, CommandKind::Math},
+    {"rho", CommandId::Rho, CommandKind::Math},
+    {"sigma", CommandId::Sigma, CommandKind::Math},
+    {"tau", CommandId::Tau, CommandKind::Math},
+    {"upsilon", CommandId::Upsilon, CommandKind::Math},
+    {"phi", CommandId::Phi, CommandKind::Math},
+    {"chi", CommandId::Chi, CommandKind::Math},
+    {"psi", CommandId::Psi, CommandKind::Math},
+    {"omega", CommandId::Omega, CommandKind::Math},
+    {"sum", CommandId::Sum, CommandKind::Math},
+    {"int", CommandId::Int, CommandKind::Math},
+    {"prod", CommandId::Prod, CommandKind::Math},
+    {"coprod", CommandId::Coprod, CommandKind::Math},
+    {"bigcup", CommandId::Bigcup, CommandKind::Math},
+    {"bigcap", CommandId::Bigcap, CommandKind::Math},
+    {"frac", CommandId::Frac, CommandKind::Math},
+    {"sqrt", CommandId::Sqrt, CommandKind::Math},
+    {"partial", CommandId::Partial, CommandKind::Math},
+    {"nabla", CommandId::Nabla, CommandKind::Math},
+    {"infty", CommandId::Infty, CommandKind::Math},
+    {"lim", CommandId::Lim, CommandKind::Math},
+    {"sup", CommandId::Sup, CommandKind::Math},
+    {"inf", CommandId::Inf, CommandKind::Math},
+    {"leq", CommandId::Leq, CommandKind::Math},
+    {"geq", CommandId::Geq, CommandKind::Math},
+    {"equiv", CommandId::Equiv, CommandKind::Math},
+    {"sim", CommandId::Sim, CommandKind::Math},
+    {"simeq", CommandId::Simeq, CommandKind::Math},
+    {"approx", CommandId::Approx, CommandKind::Math},
+    {"propto", CommandId::Propto, CommandKind::Math},
+    {"equation", CommandId::Equation, CommandKind::Math},
+    {"align", CommandId::Align, CommandKind::Math},
+    {"gather", CommandId::Gather, CommandKind::Math},
+    {"multline", CommandId::Multline, CommandKind::Math},
+    {"matrix", CommandId::Matrix, CommandKind::Math},
+    {"cases", CommandId::Cases, CommandKind::Math},
+    {"mathbf", CommandId::Mathbf, CommandKind::Math},
+    {"mathcal", CommandId::Mathcal, CommandKind::Math},
+    {"mathit", CommandId::Mathit, CommandKind::Math},
+    {"mathrm", CommandId::Mathrm, CommandKind::Math},
+    {"mathsf", CommandId::Mathsf, CommandKind::Math},
+    {"mathtt", CommandId::Mathtt, CommandKind::Math},
+    {"theorem", CommandId::Theorem, CommandKind::Theorem},
+    {"lemma", CommandId::Lemma, CommandKind::Theorem},
+    {"proposition", CommandId::Proposition, CommandKind::Theorem},
+    {"corollary", CommandId::Corollary, CommandKind::Theorem},
+    {"definition", CommandId::Definition, CommandKind::Theorem},
+    {"remark", CommandId::Remark, CommandKind::Theorem},
+    {"proof", CommandId::Proof, CommandKind::Theorem},
+    {"example", CommandId::Example, CommandKind::Theorem},
+    {"notation", CommandId::Notation, CommandKind::Theorem},
+    {"claim", CommandId::Claim, CommandKind::Theorem},
+    {"figure", CommandId::Figure, CommandKind::Float},
+    {"table", CommandId::Table, CommandKind::Float},
+    {"algorithm", CommandId::Algorithm, CommandKind::Float},
+    {"listing", CommandId::Listing, CommandKind::Float},
+    {"includegraphics", CommandId::Includegraphics, CommandKind::Float},
+    {"caption", CommandId::Caption, CommandKind::Float},
+    {"subfigure", CommandId::Subfigure, CommandKind::Float},
+    {"subfloat", CommandId::Subfloat, CommandKind::Float},
+    {"cite", CommandId::Cite, CommandKind::Citation},
+    {"citep", CommandId::Citep, CommandKind::Citation},
+    {"citet", CommandId::Citet, CommandKind::Citation},
+    {"citeyear", CommandId::Citeyear, CommandKind::Citation},
+    {"citeauthor", CommandId::Citeauthor, CommandKind::Citation},
+    {"bibliographystyle", CommandId::Bibliographystyle, CommandKind::Citation},
+    {"bibliography", CommandId::Bibliography, CommandKind::Citation},
+    {"bibitem", CommandId::Bibitem, CommandKind::Citation},
+    {"label", CommandId::Label, CommandKind::Reference},
+    {"ref", CommandId::Ref, CommandKind::Reference},
+    {"eqref", CommandId::Eqref, CommandKind::Reference},
+    {"pageref", CommandId::Pageref, CommandKind::Reference},
+    {"autoref", CommandId::Autoref, CommandKind::Reference},
+    {"cref", CommandId::Cref, CommandKind::Reference},
+    {"affiliation", CommandId::Affiliation, CommandKind::Generic},
+    {"email", CommandId::Email, CommandKind::Generic},
+    {"newcommand", CommandId::Newcommand, CommandKind::Generic},
+    {"renewcommand", CommandId::Renewcommand, CommandKind::Generic},
+    {"providecommand", CommandId::Providecommand, CommandKind::Generic},
+    {"def", CommandId::Def, CommandKind::Generic},
+    {"DeclareMathOperator", CommandId::DeclareMathOperator, CommandKind::Generic}
+};
+
+constexpr size_t commandCount = sizeof(commandTable) / sizeof(commandTable[0]);
+
+constexpr bool tableInIdOrder() {
+    for (size_t i = 0; i < commandCount; ++i) {
+        if (static_cast<size_t>(commandTable[i].id) != i + 1) {
+            return false;
+        }
+    }
+    return static_cast<size_t>(CommandId::DeclareMathOperator) == commandCount;
+}
+
+static_assert(tableInIdOrder(), "commandTable must list every CommandId in order");
+
+// CHD-style perfect hash: a name's hash picks a bucket, and the bucket's
+// displacement turns the same hash into a slot no other name occupies. A
+// lookup is one hash, one displacement read and one name compare.
+constexpr uint64_t hashName(std::string_view name, uint64_t seed) {
+    uint64_t hash = 14695981039346656037ull ^ (seed * 0x9E3779B97F4A7C15ull);
+    for (char c : name) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 31;
+    hash *= 0xBF58476D1CE4E5B9ull;
+    return hash ^ (hash >> 29);
+}
+
+constexpr std::size_t bucketOf(uint64_t hash, std::size_t buckets) {
+    return static_cast<std::size_t>(hash >> 40) % buckets;
+}
+
+// The step is odd and the slot count a power of two, so successive
+// displacements walk every slot.
+constexpr std::size_t slotOf(uint64_t hash, uint64_t displacement, std::size_t slotMask) {
+    return static_cast<std::size_t>((hash + displacement * ((hash >> 20) | 1)) & slotMask);
+}
+
+constexpr std::size_t maxBucketSize = 16;
+
+// Slots hold entry index + 1, 0 when free. Fails when a bucket is too full or
+// cannot be placed; the caller retries with another seed.
+template <typename Displacements, typename Slots>
+constexpr bool buildPerfectHash(const CommandEntry* entries, std::size_t count, uint64_t seed,
+                                Displacements& displacements, Slots& slots) {
+    std::size_t buckets = displacements.size();
+    std::size_t slotMask = slots.size() - 1;
+    for (auto& slot : slots) {
+        slot = 0;
+    }
+    for (auto& displacement : displacements) {
+        displacement = 0;
+    }
+
+    // Fullest buckets first, while most slots are still free.
+    for (std::size_t size = maxBucketSize; size > 0; --size) {
+        for (std::size_t bucket = 0; bucket < buckets; ++bucket) {
+            std::size_t members[maxBucketSize + 1] = {};
+            std::size_t found = 0;
+            for (std::size_t i = 0; i < count && found <= maxBucketSize; ++i) {
+                if (bucketOf(hashName(entries[i].name, seed), buckets) == bucket) {
+                    members[found++] = i;
+                }
+            }
+            if (found > maxBucketSize) {
+                return false;
+            }
+            if (found != size) {
+                continue;
+            }
+
+            bool placed = false;
+            for (uint64_t displacement = 0; displacement <= slotMask && !placed; ++displacement) {
+                placed = true;
+                for (std::size_t m = 0; m < found && placed; ++m) {
+                    std::size_t slot = slotOf(hashName(entries[members[m]].name, seed), displacement, slotMask);
+                    if (slots[slot] != 0) {
+                        placed = false;
+                    }
+                    for (std::size_t other = 0; other < m && placed; ++other) {
+                        placed = slot != slotOf(hashName(entries[members[other]].name, seed), displacement, slotMask);
+                    }
+                }
+                if (placed) {
+                    displacements[bucket] = static_cast<typename Displacements::value_type>(displacement);
+                    for (std::size_t m = 0; m < found; ++m) {
+                        std::size_t slot = slotOf(hashName(entries[members[m]].name, seed), displacement, slotMask);
+                        slots[slot] = static_cast<typename Slots::value_type>(members[m] + 1);
+                    }
+                }
+            }
+            if (!placed) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+template <typename Displacements, typename Slots>
+constexpr std::size_t probe(std::string_view name, const CommandEntry* entries, uint64_t seed,
+                            const Displacements& displacements, const Slots& slots) {
+    uint64_t hash = hashName(name, seed);
+    uint64_t displacement = displacements[bucketOf(hash, displacements.size())];
+    std::size_t entry = slots[slotOf(hash, displacement, slots.size() - 1)];
+    return entry != 0 && entries[entry - 1].name == name ? entry : 0;
+}
+
+struct BuiltinHash {
+    uint64_t seed = 0;
+    bool built = false;
+    std::array<uint16_t, 32> displacements{};
+    std::array<uint8_t, 256> slots{};
+};
+
+constexpr BuiltinHash buildBuiltinHash() {
+    BuiltinHash hash;
+    for (uint64_t seed = 0; seed < 64 && !hash.built; ++seed) {
+        hash.seed = seed;
+        hash.built = buildPerfectHash(commandTable, commandCount, seed, hash.displacements, hash.slots);
+    }
+    return hash;
+}
+
+constexpr BuiltinHash builtinHash = buildBuiltinHash();
+
+static_assert(builtinHash.built, "no perfect hash found for commandTable");
+static_assert(commandCount < 256, "builtin slots store entry indices in a byte");
+static_assert(probe("section", commandTable, builtinHash.seed, builtinHash.displacements, builtinHash.slots) ==
+              static_cast<std::size_t>(CommandId::Section), "builtin perfect hash finds its own names");
+
+// Built-in commands plus user aliases, hashed at runtime with the same scheme.
+struct ExtendedTable {
+    std::deque<std::string> names;
+    std::vector<CommandEntry> entries;
+    uint64_t seed = 0;
+    std::vector<uint32_t> displacements;
+    std::vector<uint32_t> slots;
+};
+
+std::unique_ptr<ExtendedTable> extendedTable;
+
+std::string_view stripCommandName(std::string_view name) {
+    return !name.empty() && name[0] == '\\' ? name.substr(1) : name;
+}
+
+}
+
+CommandInfo classifyCommand(std::string_view name) {
+    std::size_t entry = 0;
+    const CommandEntry* entries = commandTable;
+    if (extendedTable) {
+        entries = extendedTable->entries.data();
+        entry = probe(name, entries, extendedTable->seed, extendedTable->displacements, extendedTable->slots);
+    } else {
+        entry = probe(name, entries, builtinHash.seed, builtinHash.displacements, builtinHash.slots);
+    }
+    if (entry == 0) {
+        return CommandInfo{CommandId::Other, CommandKind::Generic};
+    }
+    return CommandInfo{entries[entry - 1].id, entries[entry - 1].kind};
+}
+
+CommandId lookupCommand(std::string_view name) {
+    return classifyCommand(name).id;
+}
+
+CommandKind commandKind(CommandId id) {
+    size_t index = static_cast<size_t>(id);
+    if (index == 0 || index > commandCount) {
+        return CommandKind::Generic;
+    }
+    return commandTable[index - 1].kind;
+}
+
+std::size_t loadCommandAliases(std::istream& in) {
+    auto table = std::make_unique<ExtendedTable>();
+    if (extendedTable) {
+        table->names = extendedTable->names;
+    }
+    table->entries.assign(commandTable, commandTable + commandCount);
+    // Re-point carried-over aliases at the copied names.
+    if (extendedTable) {
+        for (size_t i = commandCount; i < extendedTable->entries.size(); ++i) {
+            CommandEntry entry = extendedTable->entries[i];
+            entry.name = table->names[i - commandCount];
+            table->entries.push_back(entry);
+        }
+    }
+
+    std::size_t added = 0;
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(in, line)) {
+        lineNumber++;
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        std::string alias;
+        std::string target;
+        std::string extra;
+        if (!(fields >> alias)) {
+            continue;
+        }
+        if (!(fields >> target) || (fields >> extra)) {
+            std::cerr << "Warning: command alias line " << lineNumber << " should read \"alias target\".\n";
+            continue;
+        }
+        std::string_view aliasName = stripCommandName(alias);
+        CommandInfo info = classifyCommand(stripCommandName(target));
+        if (info.id == CommandId::Other) {
+            std::cerr << "Warning: command alias \\" << aliasName << " targets unknown command " << target << ".\n";
+            continue;
+        }
+        bool known = false;
+        for (const CommandEntry& entry : table->entries) {
+            known = known || entry.name == aliasName;
+        }
+        if (aliasName.empty() || known) {
+            std::cerr << "Warning: command alias \\" << aliasName << " is already defined.\n";
+            continue;
+        }
+        table->names.emplace_back(aliasName);
+        table->entries.push_back(CommandEntry{table->names.back(), info.id, info.kind});
+        added++;
+    }
+    if (added == 0) {
+        return 0;
+    }
+
+    std::size_t count = table->entries.size();
+    std::size_t slotCount = 64;
+    while (slotCount < count * 2) {
+        slotCount *= 2;
+    }
+    table->displacements.assign(count / 4 + 1, 0);
+    table->slots.assign(slotCount, 0);
+    bool built = false;
+    for (uint64_t seed = 0; seed < 256 && !built; ++seed) {
+        table->seed = seed;
+        built = buildPerfectHash(table->entries.data(), count, seed, table->displacements, table->slots);
+    }
+    if (!built) {
+        throw std::runtime_error("Could not build a perfect hash for " + std::to_string(count) + " commands");
+    }
+    extendedTable = std::move(table);
+    return added;
+}
+
+std::size_t loadCommandAliases(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("Could not open command alias file: " + path);
+    }
+    return loadCommandAliases(in);
+}
+
+void resetCommandAliases() {
+    extendedTable.reset();
+}
@@ -0,0 +1,91 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <string_view>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <iosfwd>
+
+// Interned ids for the commands the FSM dispatches on. Each id belongs to one
+// CommandKind, which selects the FSM handler; anything not in the table is
+// Other and handled generically.
+enum class CommandId : uint32_t {
+	Other = 0,
+	// Document
+	Documentclass, Usepackage, Title, Author, Date, Maketitle, Begin, End,
+	Institute, Abstract, Keywords, Thanks, Acknowledgements,
+	// Sectioning
+	Part, Chapter, Section, Subsection, Subsubsection, Paragraph, Subparagraph,
+	// Math
+	Alpha, Beta, Gamma, Delta, Epsilon, Zeta, Eta, Theta, Iota, Kappa, Lambda,
+	Mu, Nu, Xi, Pi, Rho, Sigma, Tau, Upsilon, Phi, Chi, Psi, Omega,
+	Sum, Int, Prod, Coprod, Bigcup, Bigcap, Frac, Sqrt, Partial, Nabla, Infty,
+	Lim, Sup, Inf, Leq, Geq, Equiv, Sim, Simeq, Approx, Propto,
+	Equation, Align, Gather, Multline, Matrix, Cases,
+	Mathbf, Mathcal, Mathit, Mathrm, Mathsf, Mathtt,
+	// Theorem
+	Theorem, Lemma, Proposition, Corollary, Definition, Remark, Proof, Example,
+	Notation, Claim,
+	// Float
+	Figure, Table, Algorithm, Listing, Includegraphics, Caption, Subfigure, Subfloat,
+	// Citation
+	Cite, Citep, Citet, Citeyear, Citeauthor, Bibliographystyle, Bibliography, Bibitem,
+	// Reference
+	Label, Ref, Eqref, Pageref, Autoref, Cref,
+	// Front matter handled outside the kind dispatch
+	Affiliation, Email,
+	// Macro definitions, consumed by MacroExpander
+	Newcommand, Renewcommand, Providecommand, Def, DeclareMathOperator
+};
+
+enum class CommandKind : uint8_t {
+	Generic,
+	Document,
+	Sectioning,
+	Math,
+	Theorem,
+	Float,
+	Citation,
+	Reference
+};
+
+// A command and its arguments as spans into the source. optional holds the
+// [...] groups and required the {...} groups written directly after the name,
+// each in source order with nested braces kept inside the span. Environment
+// tokens reuse the record: id is then an EnvironmentId, name the environment
+// name and optional its [...] option.
+struct CommandRecord {
+	uint32_t id = 0;
+	std::string_view name;
+	bool starred = false;
+	std::vector<std::string_view> optional;
+	std::vector<std::string_view> required;
+
+	CommandId commandId() const { return static_cast<CommandId>(id); }
+};
+
+struct CommandInfo {
+	CommandId id;
+	CommandKind kind;
+};
+
+// Names are classified with one probe of a perfect hash table, built at
+// compile time for the built-in commands and rebuilt once when aliases are
+// added. Unknown names are Other/Generic.
+CommandInfo classifyCommand(std::string_view name);
+CommandId lookupCommand(std::string_view name);
+CommandKind commandKind(CommandId id);
+
+// Makes custom macros behave as built-in commands, e.g. a journal's \citeal
+// as \cite. Each line reads "alias target" (backslashes optional, # starts a
+// comment); malformed lines and unknown targets are reported and skipped.
+// Returns the number of aliases added. Not thread-safe: call at startup,
+// before any document is lexed.
+std::size_t loadCommandAliases(std::istream& in);
+std::size_t loadCommandAliases(const std::string& path);
+// Drops all aliases, back to the built-in table.
+void resetCommandAliases();
+
+#endif
@@ -5,24 +5,37 @@
 #include <iostream>
 #include <fstream>
 #include <algorithm>
-
-std::atomic<size_t> DAGNode::nodeCounter(0);
-
+#include <charconv>
 
 std::shared_ptr<DAGNode> DAGNode::create(const std::string& id, NodeType type) {
     try {
-        return std::shared_ptr<DAGNode>(new DAGNode(id, type));
+        return std::shared_ptr<DAGNode>(new DAGNode(id, type, false));
     } catch (const std::exception& e) {
         std::cerr << "Error creating DAGNode: " << e.what() << std::endl;
         return nullptr;
     }
 }
 
+std::shared_ptr<DAGNode> DAGNode::createNumbered(NodeType type, const std::string& label) {
+    try {
+        return std::shared_ptr<DAGNode>(new DAGNode(label, type, true));
+    } catch (const std::exception& e) {
+        std::cerr << "Error creating DAGNode: " << e.what() << std::endl;
+        return nullptr;
+    }
+}
 
+std::string DAGNode::getId() const {
+    if (!numbered) {
+        return name;
+    }
+    return std::to_string(index) + "_" + std::to_string(static_cast<int>(nodeType)) + "_" + name;
+}
 
-DAGNode::DAGNode(const std::string& id, NodeType type) 
-    : id(id)
+DAGNode::DAGNode(const std::string& name, NodeType type, bool numbered) 
+    : name(name)
     , nodeType(type)
+    , numbered(numbered)
     , content()
     , children()
     , parents()
@@ -42,19 +55,19 @@ DAGNode::DAGNode(const std::string& id, NodeType type)
 void DAGNode::addEdge(const std::shared_ptr<DAGNode>& target, EdgeType type,
                      const std::string& label) {
     if (!target) {
-        std::cerr << "Cannot add edge to null target from node " << id << std::endl;
+        std::cerr << "Cannot add edge to null target from node " << getId() << std::endl;
         return;
     }
     
     try {
         if (!validateEdge(target, type)) {
             std::cerr << "Invalid edge type " << static_cast<int>(type) 
-                     << " between " << id << " and " << target->getId() << std::endl;
+                     << " between " << getId() << " and " << target->getId() << std::endl;
             return;
         }
         
         if (type == EdgeType::Hierarchical && wouldCreateCycle(target)) {
-            std::cerr << "Cannot add hierarchical edge from " << id 
+            std::cerr << "Cannot add hierarchical edge from " << getId() 
                      << " to " << target->getId() << " - would create cycle" << std::endl;
             return;
         }
@@ -63,7 +76,7 @@ void DAGNode::addEdge(const std::shared_ptr<DAGNode>& target, EdgeType type,
         for (const auto& edge : outgoingEdges) {
             if (auto existing = edge.target.lock()) {
                 if (existing == target && edge.type == type) {
-                    std::cerr << "Edge already exists from " << id 
+                    std::cerr << "Edge already exists from " << getId() 
                              << " to " << target->getId() << std::endl;
                     return;
                 }
@@ -76,7 +89,7 @@ void DAGNode::addEdge(const std::shared_ptr<DAGNode>& target, EdgeType type,
         outgoingEdges.push_back(std::move(newOutEdge));
         target->incomingEdges.push_back(std::move(newInEdge));
         
-        std::cerr << "Added edge from " << id << " to " << target->getId() 
+        std::cerr << "Added edge from " << getId() << " to " << target->getId() 
                   << " of type " << static_cast<int>(type) << std::endl;
         
     } catch (const std::exception& e) {
@@ -96,6 +109,10 @@ bool DAGNode::validateEdge(const std::shared_ptr<DAGNode>& target, EdgeType type
             {NodeType::Figure, {EdgeType::FigureReference}},
             {NodeType::Table, {EdgeType::TableReference}},
             {NodeType::Equation, {EdgeType::EquationReference}}
+        }},
+        // \ref-style commands point at the \label command that defines them.
+        {NodeType::Reference, {
+            {NodeType::Command, {EdgeType::CrossReference, EdgeType::EquationReference}}
         }}
     };
     
@@ -137,24 +154,26 @@ bool DAGNode::wouldCreateCycle(const std::shared_ptr<DAGNode>& target) const {
 }
 
 std::shared_ptr<DAGNode> DAG::createNode(NodeType type, const std::string& content) {
-    static size_t nodeCounter = 0;
-    std::string id = std::to_string(nodeCounter++) + "_" + 
-                    std::to_string(static_cast<int>(type)) + "_" +
-                    content.substr(0, 30);
-    
-    auto node = DAGNode::create(id, type);
-    node->setContent(content);
-    nodes[id] = node;
+    auto node = createNumberedNode(type, content.substr(0, 30));
+    if (node) {
+        node->setContent(content);
+    }
     return node;
 }
 
-void DAG::buildFromAST(const std::shared_ptr<ASTNode>& root) {
+std::shared_ptr<DAGNode> DAG::createNumberedNode(NodeType type, const std::string& label) {
+    auto node = DAGNode::createNumbered(type, label);
+    addNode(node);
+    return node;
+}
+
+void DAG::buildFromAST(ASTNode* root) {
     if (!root) return;
     auto documentNode = createNode(NodeType::Document);
     processASTNode(root, documentNode);
 }
 
-void DAG::processASTNode(const std::shared_ptr<ASTNode>& astNode,
+void DAG::processASTNode(ASTNode* astNode,
                         const std::shared_ptr<DAGNode>& parentDagNode) {
     if (!astNode || !parentDagNode) return;
     
@@ -244,7 +263,7 @@ void DAG::processASTNode(const std::shared_ptr<ASTNode>& astNode,
 
 
 
-void DAG::processSpecialRelationships(const std::shared_ptr<ASTNode>& astNode,
+void DAG::processSpecialRelationships(ASTNode* astNode,
                                     const std::shared_ptr<DAGNode>& dagNode) {
     if (astNode->getType() == ASTNode::NodeType::Reference) {
         std::string content = astNode->getContent();
@@ -273,19 +292,44 @@ std::string DAG::generateSubgraph(const std::vector<std::shared_ptr<DAGNode>>& n
     return ss.str();
 }
 
+// A named node replaces any earlier node of the same name, in its slot.
 void DAG::addNode(const std::shared_ptr<DAGNode>& node) {
-    if (!node) return;
-    nodes[node->getId()] = node;
+    if (!node || contains(node)) return;
+    if (!node->numbered) {
+        auto [it, added] = namedNodes.emplace(node->name, static_cast<uint32_t>(nodes.size()));
+        if (!added) {
+            node->index = it->second;
+            nodes[it->second] = node;
+            return;
+        }
+    }
+    node->index = static_cast<uint32_t>(nodes.size());
+    nodes.push_back(node);
+}
+
+bool DAG::contains(const std::shared_ptr<DAGNode>& node) const {
+    return node->index < nodes.size() && nodes[node->index] == node;
 }
 
 std::shared_ptr<DAGNode> DAG::getNode(const std::string& id) const {
-    auto it = nodes.find(id);
-    return (it != nodes.end()) ? it->second : nullptr;
+    auto named = namedNodes.find(id);
+    if (named != namedNodes.end()) {
+        return nodes[named->second];
+    }
+    // Numbered ids start with the node's index.
+    uint32_t index = 0;
+    auto result = std::from_chars(id.data(), id.data() + id.size(), index);
+    if (result.ec != std::errc() || result.ptr == id.data() + id.size() || *result.ptr != '_' ||
+        index >= nodes.size()) {
+        return nullptr;
+    }
+    const auto& node = nodes[index];
+    return node->numbered && node->getId() == id ? node : nullptr;
 }
 
 std::vector<std::shared_ptr<DAGNode>> DAG::findNodesByType(NodeType type) const {
     std::vector<std::shared_ptr<DAGNode>> result;
-    for (const auto& [_, node] : nodes) {
+    for (const auto& node : nodes) {
         if (node->getType() == type) {
             result.push_back(node);
         }
@@ -310,7 +354,7 @@ std::vector<std::shared_ptr<DAGNode>> DAG::findConnectedNodes(
 }
 
 
-std::weak_ptr<ASTNode> DAGNode::getASTNode() const {
+ASTNode* DAGNode::getASTNode() const {
     return astNode;
 }
 
@@ -345,27 +389,30 @@ void DAGNode::addParent(const std::shared_ptr<DAGNode>& parent) {
 }
 
 std::shared_ptr<DAGNode> DAG::getOrCreateNode(const std::string& id, NodeType type) {
-    auto it = nodes.find(id);
-    if (it != nodes.end()) {
-        return it->second;
+    auto it = namedNodes.find(id);
+    if (it != namedNodes.end()) {
+        return nodes[it->second];
     }
     
     auto node = DAGNode::create(id, type);
-    nodes[id] = node;
+    addNode(node);
     return node;
 }
 
 
 void DAG::generateDOT(const std::string& filename) const {
-    if (!validate()) {
-        std::cerr << "Warning: DAG validation failed. DOT output may be incomplete.\n";
-    }
-
     std::ofstream file(filename);
     if (!file) {
         std::cerr << "Failed to open file: " << filename << std::endl;
         return;
     }
+    generateDOT(file);
+}
+
+void DAG::generateDOT(std::ostream& file) const {
+    if (!validate()) {
+        std::cerr << "Warning: DAG validation failed. DOT output may be incomplete.\n";
+    }
 
     try {
         file << "digraph ResearchPaper {\n";
@@ -376,8 +423,9 @@ void DAG::generateDOT(const std::string& filename) const {
 
 
         std::unordered_map<std::string, std::string> cleanLabels;
-        for (const auto& [id, node] : nodes) {
+        for (const auto& node : nodes) {
             if (!node) continue;
+            std::string id = node->getId();
 
             std::string content = node->getContent();
             
@@ -433,7 +481,7 @@ void DAG::generateDOT(const std::string& filename) const {
 
 
         std::unordered_map<NodeType, std::vector<std::shared_ptr<DAGNode>>> nodesByType;
-        for (const auto& [id, node] : nodes) {
+        for (const auto& node : nodes) {
             if (!node) continue;
             nodesByType[node->getType()].push_back(node);
         }
@@ -456,7 +504,7 @@ void DAG::generateDOT(const std::string& filename) const {
         }
 
 
-        for (const auto& [id, node] : nodes) {
+        for (const auto& node : nodes) {
             if (!node) continue;
 
             for (const auto& edge : node->getOutgoingEdges()) {
@@ -530,9 +578,9 @@ bool DAG::validate() const {
     std::cerr << "Total nodes: " << nodes.size() << "\n";
 
 
-    for (const auto& [id, node] : nodes) {
+    for (const auto& node : nodes) {
         if (!node) {
-            std::cerr << "Error: Null node found with id: " << id << "\n";
+            std::cerr << "Error: Null node found\n";
             isValid = false;
             continue;
         }
@@ -548,7 +596,7 @@ bool DAG::validate() const {
     std::queue<std::shared_ptr<DAGNode>> queue;
 
 
-    for (const auto& [id, node] : nodes) {
+    for (const auto& node : nodes) {
         if (node && node->getIncomingEdges().empty()) {
             queue.push(node);
         }
@@ -595,7 +643,7 @@ bool DAG::validateNode(const std::shared_ptr<DAGNode>& node) const {
         }
 
 
-        if (nodes.find(target->getId()) == nodes.end()) {
+        if (!contains(target)) {
             std::cerr << "Error: Edge points to non-existent node " << target->getId() << "\n";
             isValid = false;
         }
@@ -611,7 +659,7 @@ void DAG::dumpStructure() const {
 
 
     std::vector<std::shared_ptr<DAGNode>> roots;
-    for (const auto& [id, node] : nodes) {
+    for (const auto& node : nodes) {
         if (node && node->getIncomingEdges().empty()) {
             roots.push_back(node);
         }
@@ -654,7 +702,7 @@ DAG::PaperStructureAnalysis DAG::analyzePaperStructure() const {
     std::unordered_map<std::string, double> conceptFrequency;
 
 
-    for (const auto& [_, node] : nodes) {
+    for (const auto& node : nodes) {
 
         for (const auto& edge : node->getOutgoingEdges()) {
             if (edge.type == EdgeType::MainContribution) {
@@ -725,7 +773,7 @@ DAG::CitationAnalysis DAG::analyzeCitations() const {
     std::unordered_map<std::string, std::vector<std::string>> contextMap;
     std::unordered_map<int, std::set<std::string>> yearMap;
 
-    for (const auto& [_, node] : nodes) {
+    for (const auto& node : nodes) {
         if (node->getType() == NodeType::Citation) {
 
             std::string citation = node->getContent();
@@ -783,7 +831,7 @@ std::vector<std::string> DAG::identifyResearchGaps() const {
     std::set<std::string> mentionedGaps;
 
 
-    for (const auto& [_, node] : nodes) {
+    for (const auto& node : nodes) {
         if (node->getType() == NodeType::Section ||
             node->getType() == NodeType::Text) {
             std::string content = node->getContent();
@@ -801,7 +849,7 @@ std::vector<std::string> DAG::identifyResearchGaps() const {
     }
 
 
-    for (const auto& [_, node] : nodes) {
+    for (const auto& node : nodes) {
 
         for (const auto& edge : node->getOutgoingEdges()) {
             if (edge.type == EdgeType::Limitation || edge.type == EdgeType::FutureWork) {
@@ -876,7 +924,7 @@ DAG::findStronglyConnectedComponents() const {
         }
     };
 
-    for (const auto& [_, node] : nodes) {
+    for (const auto& node : nodes) {
         if (indices.find(node->getId()) == indices.end()) {
             strongConnect(node);
         }
@@ -891,7 +939,7 @@ std::map<std::shared_ptr<DAGNode>, double> DAG::calculateNodeCentrality() const
     size_t n = nodes.size();
 
 
-    for (const auto& [_, node] : nodes) {
+    for (const auto& node : nodes) {
         centrality[node] = 1.0 / n;
     }
 
@@ -904,7 +952,7 @@ std::map<std::shared_ptr<DAGNode>, double> DAG::calculateNodeCentrality() const
         std::map<std::shared_ptr<DAGNode>, double> newScores;
         double diff = 0.0;
 
-        for (const auto& [_, node] : nodes) {
+        for (const auto& node : nodes) {
             double sum = 0.0;
             for (const auto& edge : node->getIncomingEdges()) {
                 if (auto source = edge.target.lock()) {
@@ -928,7 +976,7 @@ std::vector<std::pair<std::string, double>> DAG::extractKeyThemes() const {
     std::unordered_map<std::string, std::set<std::string>> themeContexts;
 
 
-    for (const auto& [_, node] : nodes) {
+    for (const auto& node : nodes) {
         std::string content = node->getContent();
         std::transform(content.begin(), content.end(), content.begin(), ::tolower);
 
@@ -1014,7 +1062,7 @@ std::map<std::string, std::vector<std::string>> DAG::buildConceptHierarchy() con
     std::unordered_map<std::string, std::set<std::string>> dependencies;
 
 
-    for (const auto& [_, node] : nodes) {
+    for (const auto& node : nodes) {
         for (const auto& edge : node->getOutgoingEdges()) {
             if (edge.type == EdgeType::ConceptDependency ||
                 edge.type == EdgeType::Definition) {
@@ -1066,7 +1114,7 @@ bool DAG::validateMethodologyCompleteness() const {
     std::vector<std::shared_ptr<DAGNode>> methodNodes;
 
 
-    for (const auto& [_, node] : nodes) {
+    for (const auto& node : nodes) {
         if (node->getType() == NodeType::Section) {
             std::string content = node->getContent();
             std::transform(content.begin(), content.end(), content.begin(), ::tolower);
@@ -1129,7 +1177,7 @@ bool DAG::validateEvidenceChain() const {
 
 
     std::vector<std::shared_ptr<DAGNode>> claims;
-    for (const auto& [_, node] : nodes) {
+    for (const auto& node : nodes) {
         for (const auto& edge : node->getOutgoingEdges()) {
             if (edge.type == EdgeType::MainContribution ||
                 edge.type == EdgeType::SubContribution) {
@@ -1206,7 +1254,7 @@ std::vector<std::shared_ptr<DAGNode>> DAG::findBridgingConcepts() const {
     std::map<std::shared_ptr<DAGNode>, double> betweenness = calculateNodeCentrality();
 
 
-    for (const auto& [_, node] : nodes) {
+    for (const auto& node : nodes) {
         std::set<NodeType> connectedTypes;
         int totalConnections = 0;
 
@@ -1245,6 +1293,16 @@ std::vector<std::shared_ptr<DAGNode>> DAG::findBridgingConcepts() const {
 
 
 void DAG::exportToKnowledgeGraph(const std::string& filename) const {
+    std::ofstream file(filename);
+    if (!file) {
+        std::cerr << "Failed to open file for knowledge graph export: "
+                  << filename << std::endl;
+        return;
+    }
+    exportToKnowledgeGraph(file);
+}
+
+void DAG::exportToKnowledgeGraph(std::ostream& file) const {
     json graph;
     graph["metadata"]["type"] = "ResearchPaperKnowledgeGraph";
     graph["metadata"]["nodes"] = nodes.size();
@@ -1254,7 +1312,8 @@ void DAG::exportToKnowledgeGraph(const std::string& filename) const {
     std::unordered_map<std::string, size_t> nodeIndices;
     size_t index = 0;
 
-    for (const auto& [id, node] : nodes) {
+    for (const auto& node : nodes) {
+        std::string id = node->getId();
         json nodeJson;
         nodeJson["id"] = id;
         nodeJson["type"] = getNodeTypeName(node->getType());
@@ -1276,7 +1335,7 @@ void DAG::exportToKnowledgeGraph(const std::string& filename) const {
 
 
     graph["edges"] = json::array();
-    for (const auto& [_, node] : nodes) {
+    for (const auto& node : nodes) {
         for (const auto& edge : node->getOutgoingEdges()) {
             if (auto target = edge.target.lock()) {
                 json edgeJson;
@@ -1301,13 +1360,7 @@ void DAG::exportToKnowledgeGraph(const std::string& filename) const {
     }
 
 
-    std::ofstream file(filename);
-    if (file) {
-        file << graph.dump(2); 
-    } else {
-        std::cerr << "Failed to open file for knowledge graph export: "
-                  << filename << std::endl;
-    }
+    file << graph.dump(2); 
 }
 
 void DAG::generateSemanticMap(const std::string& filename) const {
@@ -1316,8 +1369,10 @@ void DAG::generateSemanticMap(const std::string& filename) const {
         std::cerr << "Failed to open file for semantic map: " << filename << std::endl;
         return;
     }
+    generateSemanticMap(file);
+}
 
-
+void DAG::generateSemanticMap(std::ostream& file) const {
     file << "digraph SemanticMap {\n";
     file << "  rankdir=TB;\n";
     file << "  node [shape=box, style=filled, fontname=\"Arial\"];\n";
@@ -1327,7 +1382,7 @@ void DAG::generateSemanticMap(const std::string& filename) const {
     std::unordered_map<std::string, std::vector<std::shared_ptr<DAGNode>>> conceptGroups;
     std::unordered_map<std::string, double> conceptImportance;
 
-    for (const auto& [_, node] : nodes) {
+    for (const auto& node : nodes) {
         if (auto semanticInfo = node->getSemanticInfo()) {
             conceptGroups[semanticInfo->conceptType].push_back(node);
             conceptImportance[node->getId()] = semanticInfo->importance;
@@ -1354,7 +1409,7 @@ void DAG::generateSemanticMap(const std::string& filename) const {
     }
 
 
-    for (const auto& [_, node] : nodes) {
+    for (const auto& node : nodes) {
         for (const auto& edge : node->getOutgoingEdges()) {
             if (auto target = edge.target.lock()) {
 
@@ -1376,7 +1431,10 @@ void DAG::generateMethodologyFlow(const std::string& filename) const {
         std::cerr << "Failed to open file for methodology flow: " << filename << std::endl;
         return;
     }
+    generateMethodologyFlow(file);
+}
 
+void DAG::generateMethodologyFlow(std::ostream& file) const {
     file << "digraph MethodologyFlow {\n";
     file << "  rankdir=LR;\n";
     file << "  node [shape=box, style=filled, fontname=\"Arial\"];\n";
@@ -1385,7 +1443,7 @@ void DAG::generateMethodologyFlow(const std::string& filename) const {
     std::vector<std::shared_ptr<DAGNode>> methodNodes;
     std::vector<std::vector<std::shared_ptr<DAGNode>>> phases;
 
-    for (const auto& [_, node] : nodes) {
+    for (const auto& node : nodes) {
         if (isMethodologyComponent(node)) {
             methodNodes.push_back(node);
         }
@@ -1443,7 +1501,7 @@ void DAG::generateMethodologyFlow(const std::string& filename) const {
     }
 
 
-    for (const auto& [_, node] : nodes) {
+    for (const auto& node : nodes) {
         for (const auto& edge : node->getOutgoingEdges()) {
             if (edge.type == EdgeType::MethodologyFlow) {
                 if (auto target = edge.target.lock()) {
@@ -1484,7 +1542,7 @@ std::vector<std::string> DAG::identifyLogicalGaps() const {
     };
 
 
-    for (const auto& [_, node] : nodes) {
+    for (const auto& node : nodes) {
         std::set<EdgeType> outgoingTypes;
         for (const auto& edge : node->getOutgoingEdges()) {
             outgoingTypes.insert(edge.type);
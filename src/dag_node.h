@@ -6,7 +6,9 @@
 #include <memory>
 #include <unordered_map>
 #include <set>
-#include <atomic>
+#include <ostream>
+#include <cstdint>
+#include <limits>
 #include <chrono>
 #include <nlohmann/json.hpp>
 #include "ast.h"
@@ -250,15 +252,24 @@ private:
 
 class DAGNode : public std::enable_shared_from_this<DAGNode> {
 protected:
-    DAGNode(const std::string& id, NodeType type);
+    DAGNode(const std::string& name, NodeType type, bool numbered);
     
 public:
-    static std::shared_ptr<DAGNode> create(const std::string& id, NodeType type);
+    static constexpr uint32_t npos = std::numeric_limits<uint32_t>::max();
 
-    std::string getId() const { return id; }
+    // A node identified by name, such as an author.
+    static std::shared_ptr<DAGNode> create(const std::string& id, NodeType type);
+    // A node identified by its index in the DAG it is added to; label is a
+    // short, readable suffix for the exported id.
+    static std::shared_ptr<DAGNode> createNumbered(NodeType type, const std::string& label);
+
+    // The name, or "<index>_<type>_<label>" for a numbered node.
+    std::string getId() const;
+    // Dense index in the owning DAG, npos until added.
+    uint32_t getIndex() const { return index; }
     NodeType getType() const { return nodeType; }
     std::string getContent() const { return content; }
-    std::weak_ptr<ASTNode> getASTNode() const;
+    ASTNode* getASTNode() const;
     
     void addEdge(const std::shared_ptr<DAGNode>& target, EdgeType type, 
                  const std::string& label = "");
@@ -266,7 +277,7 @@ public:
     const std::vector<Edge>& getIncomingEdges() const { return incomingEdges; }
     
     void setContent(const std::string& content) { this->content = content; }
-    void setASTNode(const std::shared_ptr<ASTNode>& node) { astNode = node; }
+    void setASTNode(ASTNode* node) { astNode = node; }
 
     void addChild(const std::shared_ptr<DAGNode>& child);
     void addParent(const std::shared_ptr<DAGNode>& parent);
@@ -289,15 +300,20 @@ public:
         const std::shared_ptr<DAGNode>& target, EdgeType type) const;
 
 private:
-    std::string id;
+    friend class DAG;
+
+    std::string name;
     NodeType nodeType;
+    bool numbered;
+    uint32_t index = npos;
     std::string content;
     std::vector<std::shared_ptr<DAGNode>> children;
     std::vector<std::shared_ptr<DAGNode>> parents;
     
     std::vector<Edge> outgoingEdges;
     std::vector<Edge> incomingEdges;
-    std::weak_ptr<ASTNode> astNode;
+    // Non-owning; valid while the AST that produced this node is alive.
+    ASTNode* astNode = nullptr;
     
     RelationshipManager relationshipManager;
     std::shared_ptr<SemanticInfo> semanticInfo;
@@ -306,24 +322,26 @@ private:
     bool validateEdge(const std::shared_ptr<DAGNode>& target, EdgeType type) const;
     bool wouldCreateCycle(const std::shared_ptr<DAGNode>& target) const;
     double calculateSemanticSimilarity(const std::shared_ptr<DAGNode>& other) const;
-    
-    static std::atomic<size_t> nodeCounter;
-
 };
 
 class DAG {
 public:
     std::shared_ptr<DAGNode> getOrCreateNode(const std::string& id, NodeType type);
     std::shared_ptr<DAGNode> createNode(NodeType type, const std::string& content = "");
+    std::shared_ptr<DAGNode> createNumberedNode(NodeType type, const std::string& label);
     std::shared_ptr<DAGNode> getNode(const std::string& id) const;
     void addNode(const std::shared_ptr<DAGNode>& node);
     
-    void buildFromAST(const std::shared_ptr<ASTNode>& root);
+    void buildFromAST(ASTNode* root);
     
     void generateDOT(const std::string& filename) const;
     void exportToKnowledgeGraph(const std::string& filename) const;
     void generateSemanticMap(const std::string& filename) const;
     void generateMethodologyFlow(const std::string& filename) const;
+    void generateDOT(std::ostream& file) const;
+    void exportToKnowledgeGraph(std::ostream& file) const;
+    void generateSemanticMap(std::ostream& file) const;
+    void generateMethodologyFlow(std::ostream& file) const;
 
     struct PaperStructureAnalysis {
         std::vector<std::shared_ptr<DAGNode>> mainContributions;
@@ -369,10 +387,16 @@ public:
 
 
 private:
-    std::unordered_map<std::string, std::shared_ptr<DAGNode>> nodes;
+    // Indexed by DAGNode::getIndex(), in creation order. Ids are handed out
+    // per DAG, so a document's output does not depend on what else the
+    // process has built.
+    std::vector<std::shared_ptr<DAGNode>> nodes;
+    std::unordered_map<std::string, uint32_t> namedNodes;
+
+    bool contains(const std::shared_ptr<DAGNode>& node) const;
     
-    void processASTNode(const std::shared_ptr<ASTNode>& astNode, const std::shared_ptr<DAGNode>& parentDagNode);
-    void processSpecialRelationships(const std::shared_ptr<ASTNode>& astNode, const std::shared_ptr<DAGNode>& dagNode);
+    void processASTNode(ASTNode* astNode, const std::shared_ptr<DAGNode>& parentDagNode);
+    void processSpecialRelationships(ASTNode* astNode, const std::shared_ptr<DAGNode>& dagNode);
     std::string generateSubgraph(const std::vector<std::shared_ptr<DAGNode>>& nodes,const std::string& name) const;
     std::string getEdgeStyle(EdgeType type) const;
     bool validateNode(const std::shared_ptr<DAGNode>& node) const;
@@ -0,0 +1,61 @@
+#include "diagnostics.h"
+#include "ast.h"
+
+void DiagnosticSink::append(const DiagnosticSink& other) {
+	records.insert(records.end(), other.records.begin(), other.records.end());
+}
+
+std::size_t DiagnosticSink::count(DiagnosticCode code) const {
+	std::size_t total = 0;
+	for (const Diagnostic& record : records) {
+		if (record.code == code) {
+			total++;
+		}
+	}
+	return total;
+}
+
+const char* DiagnosticSink::codeName(DiagnosticCode code) {
+	switch (code) {
+		case DiagnosticCode::EmptyContent: return "empty-content";
+		case DiagnosticCode::InvalidMathContent: return "invalid-math-content";
+		case DiagnosticCode::InvalidSectionContent: return "invalid-section-content";
+		case DiagnosticCode::InvalidCommandContent: return "invalid-command-content";
+		case DiagnosticCode::NullChild: return "null-child";
+		case DiagnosticCode::InvalidChild: return "invalid-child";
+		case DiagnosticCode::NullReference: return "null-reference";
+		case DiagnosticCode::InvalidTransition: return "invalid-transition";
+		case DiagnosticCode::InvalidStructure: return "invalid-structure";
+		case DiagnosticCode::UnknownNodeType: return "unknown-node-type";
+		case DiagnosticCode::HandlerFailed: return "handler-failed";
+	}
+	return "unknown";
+}
+
+void DiagnosticSink::printReport(std::ostream& out, std::string_view document) const {
+	if (records.empty()) {
+		return;
+	}
+	constexpr std::size_t codeCount = static_cast<std::size_t>(DiagnosticCode::HandlerFailed) + 1;
+	std::size_t counts[codeCount] = {};
+	const Diagnostic* first[codeCount] = {};
+	for (const Diagnostic& record : records) {
+		std::size_t code = static_cast<std::size_t>(record.code);
+		if (counts[code]++ == 0) {
+			first[code] = &record;
+		}
+	}
+
+	out << "Diagnostics for " << document << ": " << records.size() << " issue(s)\n";
+	for (std::size_t code = 0; code < codeCount; ++code) {
+		if (counts[code] == 0) {
+			continue;
+		}
+		out << "  " << codeName(static_cast<DiagnosticCode>(code)) << ": " << counts[code]
+		    << " (first at " << first[code]->position;
+		if (first[code]->nodeType >= 0) {
+			out << " in " << ASTNode::getNodeTypeName(static_cast<ASTNode::NodeType>(first[code]->nodeType));
+		}
+		out << ")\n";
+	}
+}
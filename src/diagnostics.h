@@ -0,0 +1,57 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+// Problems found while building or walking a document's tree. Messy sources
+// produce them by the thousand, so they are recorded as plain values instead
+// of being thrown or printed one by one.
+enum class DiagnosticCode : uint8_t {
+	EmptyContent,
+	InvalidMathContent,
+	InvalidSectionContent,
+	InvalidCommandContent,
+	NullChild,
+	InvalidChild,
+	NullReference,
+	InvalidTransition,
+	InvalidStructure,
+	UnknownNodeType,
+	HandlerFailed
+};
+
+struct Diagnostic {
+	DiagnosticCode code;
+	// Stored as int to keep this header free of ast.h; -1 when no node applies.
+	int nodeType;
+	std::size_t position;
+};
+
+class DiagnosticSink {
+public:
+	void report(DiagnosticCode code, std::size_t position, int nodeType = -1) {
+		records.push_back(Diagnostic{code, nodeType, position});
+	}
+	void append(const DiagnosticSink& other);
+	void clear() { records.clear(); }
+
+	const std::vector<Diagnostic>& getRecords() const { return records; }
+	std::size_t count(DiagnosticCode code) const;
+	std::size_t size() const { return records.size(); }
+	bool empty() const { return records.empty(); }
+
+	// Prints nothing when empty; otherwise a header and one line per code that
+	// occurred, with its count and first occurrence.
+	void printReport(std::ostream& out, std::string_view document) const;
+
+	static const char* codeName(DiagnosticCode code);
+
+private:
+	std::vector<Diagnostic> records;
+};
+
+#endif
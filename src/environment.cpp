@@ -0,0 +1,69 @@
+#include "environment.h"
+#include <unordered_map>
+
+namespace {
+
+struct EnvironmentEntry {
+    std::string_view name;
+    EnvironmentId id;
+};
+
+const EnvironmentEntry environmentTable[] = {
+    {"document", EnvironmentId::Document},
+    {"abstract", EnvironmentId::Abstract},
+    {"figure", EnvironmentId::Figure},
+    {"figure*", EnvironmentId::Figure},
+    {"table", EnvironmentId::Table},
+    {"table*", EnvironmentId::Table},
+    {"equation", EnvironmentId::Equation},
+    {"equation*", EnvironmentId::Equation},
+    {"align", EnvironmentId::Align},
+    {"align*", EnvironmentId::Align},
+    {"gather", EnvironmentId::Gather},
+    {"gather*", EnvironmentId::Gather},
+    {"multline", EnvironmentId::Multline},
+    {"multline*", EnvironmentId::Multline},
+    {"eqnarray", EnvironmentId::Eqnarray},
+    {"eqnarray*", EnvironmentId::Eqnarray},
+    {"itemize", EnvironmentId::Itemize},
+    {"enumerate", EnvironmentId::Enumerate},
+    {"description", EnvironmentId::Description},
+    {"theorem", EnvironmentId::Theorem},
+    {"lemma", EnvironmentId::Lemma},
+    {"proposition", EnvironmentId::Proposition},
+    {"corollary", EnvironmentId::Corollary},
+    {"definition", EnvironmentId::Definition},
+    {"proof", EnvironmentId::Proof},
+    {"remark", EnvironmentId::Remark},
+    {"example", EnvironmentId::Example},
+    {"algorithm", EnvironmentId::Algorithm},
+    {"algorithm*", EnvironmentId::Algorithm},
+    {"tabular", EnvironmentId::Tabular},
+    {"tabular*", EnvironmentId::Tabular},
+    {"verbatim", EnvironmentId::Verbatim},
+    {"thebibliography", EnvironmentId::Bibliography}
+};
+
+}
+
+EnvironmentId lookupEnvironment(std::string_view name) {
+    static const std::unordered_map<std::string_view, EnvironmentId> ids = [] {
+        std::unordered_map<std::string_view, EnvironmentId> table;
+        for (const auto& entry : environmentTable) {
+            table.emplace(entry.name, entry.id);
+        }
+        return table;
+    }();
+
+    auto it = ids.find(name);
+    return it != ids.end() ? it->second : EnvironmentId::Other;
+}
+
+const char* environmentName(EnvironmentId id) {
+    for (const auto& entry : environmentTable) {
+        if (entry.id == id) {
+            return entry.name.data();
+        }
+    }
+    return "other";
+}
@@ -0,0 +1,41 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include <string_view>
+#include <cstdint>
+
+// Interned ids for the environments the FSM treats specially. Starred variants
+// share the id of their base name; anything not in the table is Other and is
+// told apart by name.
+enum class EnvironmentId : uint32_t {
+	Other = 0,
+	Document,
+	Abstract,
+	Figure,
+	Table,
+	Equation,
+	Align,
+	Gather,
+	Multline,
+	Eqnarray,
+	Itemize,
+	Enumerate,
+	Description,
+	Theorem,
+	Lemma,
+	Proposition,
+	Corollary,
+	Definition,
+	Proof,
+	Remark,
+	Example,
+	Algorithm,
+	Tabular,
+	Verbatim,
+	Bibliography
+};
+
+EnvironmentId lookupEnvironment(std::string_view name);
+const char* environmentName(EnvironmentId id);
+
+#endif
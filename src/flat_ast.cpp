@@ -0,0 +1,142 @@
+#include "flat_ast.h"
+#include <utility>
+
+namespace {
+
+bool liesWithin(std::string_view text, const std::shared_ptr<const SourceBuffer>& buffer) {
+    return buffer && text.data() >= buffer->begin() && text.data() + text.size() <= buffer->end();
+}
+
+}
+
+FlatAST::FlatAST(size_t sourceBytes) : arena(sourceBytes / 2 + 4096) {
+    // Roughly one node per 32 bytes of source.
+    size_t expected = sourceBytes / 32 + 16;
+    types.reserve(expected);
+    contents.reserve(expected);
+    positions.reserve(expected);
+    states.reserve(expected);
+    parents.reserve(expected);
+    subtreeEnds.reserve(expected);
+    commandSlots.reserve(expected);
+}
+
+const CommandRecord& FlatAST::command(Index i) const {
+    static const CommandRecord none;
+    Index slot = commandSlots[i];
+    return slot == npos ? none : commands[slot];
+}
+
+FlatAST::Index FlatAST::depth(Index i) const {
+    Index levels = 0;
+    while (parents[i] != npos) {
+        i = parents[i];
+        levels++;
+    }
+    return levels;
+}
+
+FlatAST::Index FlatAST::nextSibling(Index i) const {
+    Index p = parents[i];
+    if (p == npos) {
+        return npos;
+    }
+    return subtreeEnds[i] < subtreeEnds[p] ? subtreeEnds[i] : npos;
+}
+
+std::vector<FlatAST::Index> FlatAST::children(Index i) const {
+    std::vector<Index> result;
+    for (Index child = firstChild(i); child != npos; child = nextSibling(child)) {
+        result.push_back(child);
+    }
+    return result;
+}
+
+std::shared_ptr<FlatAST> FlatAST::fromTree(const AST& ast) {
+    size_t sourceBytes = ast.source ? ast.source->size() : 0;
+    FlatASTBuilder builder(sourceBytes);
+
+    auto storageFor = [&ast](std::string_view text) {
+        if (liesWithin(text, ast.source)) {
+            return ASTNode::Storage::Borrowed;
+        }
+        for (const auto& buffer : ast.auxiliarySources) {
+            if (liesWithin(text, buffer)) {
+                return ASTNode::Storage::Borrowed;
+            }
+        }
+        return ASTNode::Storage::Owned;
+    };
+
+    // Explicit stack of (node, next child) so deep trees do not recurse.
+    std::vector<std::pair<const ASTNode*, size_t>> stack;
+    if (ast.root) {
+        stack.emplace_back(ast.root, 0);
+    }
+    while (!stack.empty()) {
+        auto& [node, next] = stack.back();
+        const auto& children = node->getChildren();
+        if (next == children.size()) {
+            stack.pop_back();
+            if (!stack.empty()) {
+                builder.close();
+            }
+            continue;
+        }
+        const ASTNode* child = children[next++];
+        builder.open(child->getType(), child->getContentView(), child->getPosition(), child->getState(),
+                     storageFor(child->getContentView()), child->getCommand());
+        stack.emplace_back(child, 0);
+    }
+
+    std::shared_ptr<FlatAST> flat = builder.finish();
+    flat->source = ast.source;
+    flat->auxiliarySources = ast.auxiliarySources;
+    flat->crossReferences = ast.crossReferences;
+    flat->crossReferences.resolve();
+    return flat;
+}
+
+FlatASTBuilder::FlatASTBuilder(size_t sourceBytes) : flat(new FlatAST(sourceBytes)) {
+    open(ASTNode::NodeType::Document, "Document Root", 0, ParserState::DefaultState,
+         ASTNode::Storage::Borrowed, CommandRecord());
+}
+
+void FlatASTBuilder::open(ASTNode::NodeType type, std::string_view content, size_t position, ParserState state,
+                          ASTNode::Storage storage, CommandRecord command) {
+    FlatAST& f = *flat;
+    FlatAST::Index index = f.size();
+    f.types.push_back(type);
+    f.contents.push_back(storage == ASTNode::Storage::Owned ? f.arena.copy(content) : content);
+    f.positions.push_back(position);
+    f.states.push_back(state);
+    f.parents.push_back(openNodes.empty() ? FlatAST::npos : openNodes.back());
+    f.subtreeEnds.push_back(index + 1);
+    if (type == ASTNode::NodeType::Command || type == ASTNode::NodeType::Environment) {
+        f.commandSlots.push_back(static_cast<FlatAST::Index>(f.commands.size()));
+        f.commands.push_back(std::move(command));
+    } else {
+        f.commandSlots.push_back(FlatAST::npos);
+    }
+    openNodes.push_back(index);
+}
+
+void FlatASTBuilder::close() {
+    // The root stays open until finish().
+    if (openNodes.size() > 1) {
+        FlatAST::Index index = openNodes.back();
+        openNodes.pop_back();
+        flat->subtreeEnds[index] = flat->size();
+    }
+}
+
+std::shared_ptr<FlatAST> FlatASTBuilder::finish() {
+    while (openNodes.size() > 1) {
+        close();
+    }
+    if (!openNodes.empty()) {
+        flat->subtreeEnds[openNodes.back()] = flat->size();
+        openNodes.clear();
+    }
+    return std::move(flat);
+}
@@ -0,0 +1,75 @@
+#ifndef FLAT_AST_H
+#define FLAT_AST_H
+
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <limits>
+#include "ast.h"
+#include "small_vector.h"
+
+// Frozen AST stored in DFS preorder as parallel arrays. Node 0 is the
+// document root; the descendants of node i are exactly the range
+// [i + 1, subtreeEnd(i)), so a full traversal is a linear scan and a subtree
+// is a contiguous slice. Content spans point into the source buffers or the
+// FlatAST's own arena.
+class FlatAST {
+public:
+	using Index = uint32_t;
+	static constexpr Index npos = std::numeric_limits<Index>::max();
+
+	static std::shared_ptr<FlatAST> fromTree(const AST& ast);
+
+	Index size() const { return static_cast<Index>(types.size()); }
+	ASTNode::NodeType type(Index i) const { return types[i]; }
+	std::string_view content(Index i) const { return contents[i]; }
+	size_t position(Index i) const { return positions[i]; }
+	ParserState state(Index i) const { return states[i]; }
+	Index parent(Index i) const { return parents[i]; }
+	Index subtreeEnd(Index i) const { return subtreeEnds[i]; }
+	const CommandRecord& command(Index i) const;
+
+	Index depth(Index i) const;
+	Index firstChild(Index i) const { return i + 1 < subtreeEnds[i] ? i + 1 : npos; }
+	Index nextSibling(Index i) const;
+	std::vector<Index> children(Index i) const;
+
+	std::shared_ptr<const SourceBuffer> source;
+	std::vector<std::shared_ptr<const SourceBuffer>> auxiliarySources;
+	// Resolved; site ordinals and targets are indices into this layout.
+	CrossReferences crossReferences;
+
+private:
+	friend class FlatASTBuilder;
+
+	explicit FlatAST(size_t sourceBytes);
+
+	std::vector<ASTNode::NodeType> types;
+	std::vector<std::string_view> contents;
+	std::vector<size_t> positions;
+	std::vector<ParserState> states;
+	std::vector<Index> parents;
+	std::vector<Index> subtreeEnds;
+	// Command records are sparse, so nodes index into a side table.
+	std::vector<Index> commandSlots;
+	std::vector<CommandRecord> commands;
+	Arena arena;
+};
+
+class FlatASTBuilder : public ASTBuilder {
+public:
+	explicit FlatASTBuilder(size_t sourceBytes = 0);
+
+	void open(ASTNode::NodeType type, std::string_view content, size_t position, ParserState state,
+	          ASTNode::Storage storage, CommandRecord command) override;
+	void close() override;
+
+	std::shared_ptr<FlatAST> finish();
+
+private:
+	std::shared_ptr<FlatAST> flat;
+	SmallVector<FlatAST::Index, 32> openNodes;
+};
+
+#endif
@@ -4,88 +4,41 @@
 #include <vector>
 using json = nlohmann::json;
 
-const std::unordered_map<FSM::FSMState, std::set<FSM::FSMState>> FSM::validTransitions = {
-    {FSMState::Start, {FSMState::InDocument, FSMState::InCommand}},
-    {FSMState::InDocument, {FSMState::InDocument, FSMState::InSection, FSMState::InCommand, 
-                           FSMState::InText, FSMState::InMath, FSMState::InAuthor, 
-                           FSMState::InAbstract, FSMState::InEnvironment}},
-    {FSMState::InSection, {FSMState::InSection, FSMState::InText, FSMState::InCommand, 
-                          FSMState::InMath, FSMState::InEnvironment}},
-    {FSMState::InCommand, {FSMState::InCommand, FSMState::InDocument, FSMState::InSection, 
-                          FSMState::InText, FSMState::InAuthor, FSMState::InAffiliation,
-                          FSMState::InMath, FSMState::InEnvironment, FSMState::InEquation,
-                           FSMState::InAbstract}},
-    {FSMState::InText, {FSMState::InText, FSMState::InCommand, FSMState::InMath, 
-                       FSMState::InSection, FSMState::InEnvironment}},
-    {FSMState::InEnvironment, {FSMState::InEnvironment, FSMState::InText, FSMState::InCommand, 
-                              FSMState::InMath, FSMState::InFigure, FSMState::InTable}},
-    {FSMState::InEquation, {FSMState::InEquation, FSMState::InText, FSMState::InMath}},
-    {FSMState::InMath, {FSMState::InMath, FSMState::InText, FSMState::InDocument, 
-                        FSMState::InEquation, FSMState::InCommand}},
-    {FSMState::InFigure, {FSMState::InFigure, FSMState::InText, FSMState::InCommand, 
-                          FSMState::InEnvironment}},
-    {FSMState::InTable, {FSMState::InTable, FSMState::InText, FSMState::InCommand, 
-                         FSMState::InEnvironment}},
-    {FSMState::InBibliography, {FSMState::InBibliography, FSMState::InText, 
-                               FSMState::InCommand}},
-    {FSMState::InAuthor, {FSMState::InAuthor, FSMState::InAffiliation, FSMState::InText, 
-                         FSMState::InCommand}},
-    {FSMState::InAffiliation, {FSMState::InAffiliation, FSMState::InAuthor, FSMState::InText, 
-                              FSMState::InCommand}},
-    {FSMState::InAbstract, {FSMState::InAbstract, FSMState::InText, FSMState::InCommand, 
-                           FSMState::InMath}}
-};
-
-std::string FSM::getStateName(FSMState state) const {
-    static const std::unordered_map<FSMState, std::string> stateNames = {
-        {FSMState::Start, "Start"},
-        {FSMState::InDocument, "InDocument"},
-        {FSMState::InSection, "InSection"},
-        {FSMState::InCommand, "InCommand"},
-        {FSMState::InText, "InText"},
-        {FSMState::InEnvironment, "InEnvironment"},
-        {FSMState::InEquation, "InEquation"},
-        {FSMState::InMath, "InMath"},
-        {FSMState::InFigure, "InFigure"},
-        {FSMState::InTable, "InTable"},
-        {FSMState::InBibliography, "InBibliography"},
-        {FSMState::InAuthor, "InAuthor"},
-        {FSMState::InAffiliation, "InAffiliation"},
-        {FSMState::InAbstract, "InAbstract"}
+const char* FSM::getStateName(FSMState state) {
+    static constexpr const char* names[] = {
+        "Start", "InDocument", "InTitle", "InAuthor", "InAffiliation", "InDate", "InAbstract",
+        "InKeywords", "InSection", "InSubsection", "InParagraph", "InMath", "InInlineMath",
+        "InEquation", "InAlignedEquation", "InFigure", "InTable", "InAlgorithm", "InListing",
+        "InCitation", "InBibliography", "InTheorem", "InProof", "InDefinition", "InLemma",
+        "InCorollary", "InCommand", "InText", "InEnvironment", "InLabel", "InRef", "InCrossRef"
     };
-    
-    auto it = stateNames.find(state);
-    if (it != stateNames.end()) {
-        return it->second;
-    }
-    return "Unknown";
+    static_assert(sizeof(names) / sizeof(names[0]) == stateCount, "one name per FSMState");
+    return names[static_cast<std::size_t>(state)];
 }
 
 FSM::FSM() : currentState(FSMState::Start), ner() {}
 
-void FSM::validateStateTransition(FSMState newState) {
-    try {
-        if (!isTransitionValid(currentState, newState)) {
-            std::stringstream ss;
-            ss << "Invalid state transition from " << static_cast<int>(currentState) 
-            << " to " << static_cast<int>(newState);
-            throw ParserError(ss.str(), 0);
-        }
-    } catch (const std::exception& e) {
-            std::throw_with_nested(ParserError("State transition validation failed", 0));
-    }
-}
-
-
-
-void FSM::setState(FSMState newState) {
+template <typename Policy>
+bool FSM::setState(FSMState newState) {
     FSMState prevState = currentState;
     
-    validateStateTransition(newState);
+    if (!Policy::allows(prevState, newState)) {
+        report(DiagnosticCode::InvalidTransition);
+        return false;
+    }
     
     currentState = newState;
     
     handleStateChange(prevState, newState);
+    return true;
+}
+
+void FSM::report(DiagnosticCode code) {
+    if (currentNode) {
+        diagnostics.report(code, currentNode->getPosition(), static_cast<int>(currentNode->getType()));
+    } else {
+        diagnostics.report(code, 0);
+    }
 }
 
 void FSM::handleStateChange(FSMState oldState, FSMState newState) {
@@ -116,7 +69,7 @@ void FSM::handleStateChange(FSMState oldState, FSMState newState) {
     }
 }
 
-bool FSM::isValidStructure(const std::shared_ptr<ASTNode>& node) const {
+bool FSM::isValidStructure(ASTNode* node) const {
     if (!node) return false;
     
     switch (currentState) {
@@ -129,100 +82,148 @@ bool FSM::isValidStructure(const std::shared_ptr<ASTNode>& node) const {
             return node->getType() != ASTNode::NodeType::Math;
         case FSMState::InAuthor:
             return node->getType() == ASTNode::NodeType::Command ||
-                   node->getType() == ASTNode::NodeType::Text;
+                   node->getType() == ASTNode::NodeType::Text ||
+                   node->getType() == ASTNode::NodeType::Environment;
         default:
             return true;
     }
 }
 
-void FSM::traverseAST(const std::shared_ptr<ASTNode>& node, std::string& currentChunk, 
-                      std::vector<std::string>& chunks) {
+// Walks the tree with an explicit stack. Each frame visits the node's AST
+// children, then the AST nodes linked from its DAG node, then leaves it; a
+// node whose handler fails is skipped along with its subtree.
+void FSM::traverseAST(ASTNode* node, ChunkBuilder& chunk, ChunkSink& sink) {
     if (!node) return;
 
-    try {
-        if (!isValidStructure(node)) {
-            std::stringstream ss;
-            ss << "Invalid node structure in state " << static_cast<int>(currentState);
-            throw ParserError(ss.str(), 0);
+    struct Frame {
+        ASTNode* node;
+        size_t next;
+        bool linked;
+    };
+    SmallVector<Frame, 64> stack;
+    if (enterNode(node, chunk, sink)) {
+        stack.push_back(Frame{node, 0, false});
+    }
+
+    while (!stack.empty()) {
+        Frame& frame = stack.back();
+        ASTNode* next = nullptr;
+        if (!frame.linked) {
+            const auto& children = frame.node->getChildren();
+            if (frame.next < children.size()) {
+                next = children[frame.next++];
+            } else {
+                frame.linked = true;
+                frame.next = 0;
+            }
+        }
+        if (frame.linked && !next) {
+            auto dagNode = frame.node->getDAGNode();
+            if (dagNode && frame.next < dagNode->getChildren().size()) {
+                next = dagNode->getChildren()[frame.next++]->getASTNode();
+                if (!next) {
+                    continue;
+                }
+            } else {
+                ASTNode* done = frame.node;
+                stack.pop_back();
+                leaveNode(done, chunk);
+                continue;
+            }
+        }
+        if (next && enterNode(next, chunk, sink)) {
+            stack.push_back(Frame{next, 0, false});
         }
+    }
+}
 
+bool FSM::enterNode(ASTNode* node, ChunkBuilder& chunk, ChunkSink& sink) {
+    currentNode = node;
+    if (!isValidStructure(node)) {
+        report(DiagnosticCode::InvalidStructure);
+        return false;
+    }
+
+    // Handlers still throw for genuinely unexpected failures; those skip the
+    // node like a failed transition does.
+    try {
         switch (node->getType()) {
             case ASTNode::NodeType::Document:
-                setState(FSMState::InDocument);
-                handleDocument(node, currentChunk);
+                if (!setState(FSMState::InDocument)) {
+                    return false;
+                }
+                handleDocument(node, chunk);
                 break;
             case ASTNode::NodeType::Section:
-                setState(FSMState::InSection);
-                handleSection(node, currentChunk, chunks);
+                if (!setState(FSMState::InSection)) {
+                    return false;
+                }
+                handleSection(node, chunk, sink);
                 break;
             case ASTNode::NodeType::Command: {
-                setState(FSMState::InCommand);
-                std::string cmd = node->getContent();
-                if (cmd.find("\\author") != std::string::npos) {
-                    setState(FSMState::InAuthor);
+                if (!setState(FSMState::InCommand)) {
+                    return false;
+                }
+                CommandId cmdId = node->getCommand().commandId();
+                if (cmdId == CommandId::Author) {
+                    if (!setState(FSMState::InAuthor)) {
+                        return false;
+                    }
                     insideAuthorBlock = true;
-                } else if (cmd.find("\\institute") != std::string::npos || 
-                         cmd.find("\\affiliation") != std::string::npos) {
-                    setState(FSMState::InAffiliation);
+                } else if (cmdId == CommandId::Institute || cmdId == CommandId::Affiliation) {
+                    if (!setState(FSMState::InAffiliation)) {
+                        return false;
+                    }
                     insideInstituteBlock = true;
                 }
-                handleCommand(node, currentChunk);
+                handleCommand(node, chunk);
                 break;
             }
             case ASTNode::NodeType::Text:
-                setState(FSMState::InText);
-                handleText(node, currentChunk);
+                if (!setState(FSMState::InText)) {
+                    return false;
+                }
+                handleText(node, chunk);
                 break;
             case ASTNode::NodeType::Math:
-                try {
-                    setState(FSMState::InMath);
-                    handleMath(node, currentChunk);
-                } catch (const std::exception& e) {
-                    std::cerr << "Error handling math node: " << e.what() << std::endl;
+                if (setState(FSMState::InMath)) {
+                    handleMath(node, chunk);
+                } else {
                     setState(FSMState::InText);
                 }
-                break; 
+                break;
             case ASTNode::NodeType::Environment:
-                setState(FSMState::InEnvironment);
-                handleEnvironment(node, currentChunk);
+                if (!setState(FSMState::InEnvironment)) {
+                    return false;
+                }
+                handleEnvironment(node, chunk);
                 break;
             default:
-                std::cerr << "Error: Unknown node type encountered: " 
-                      << static_cast<int>(node->getType()) 
-                      << " (" << node->getNodeTypeName(node->getType()) << ")" << std::endl;
-            throw ParserError("Unknown node type", 0);
-        }
-
-        for (const auto& child : node->getChildren()) {
-            if (child) {
-                traverseAST(child, currentChunk, chunks);
-            }
-        }
-
-        if (auto dagNode = node->getDAGNode()) {
-            for (const auto& childDagNode : dagNode->getChildren()) {
-                if (auto linkedAstNode = childDagNode->getASTNode().lock()) {
-                    traverseAST(linkedAstNode, currentChunk, chunks);
-                }
-            }
+                report(DiagnosticCode::UnknownNodeType);
+                return false;
         }
+    } catch (const std::exception&) {
+        report(DiagnosticCode::HandlerFailed);
+        return false;
+    }
+    return true;
+}
 
-        if (node->getType() == ASTNode::NodeType::Command) {
-            std::string cmd = node->getContent();
-            if (cmd.find("\\author") != std::string::npos) {
+void FSM::leaveNode(ASTNode* node, ChunkBuilder& chunk) {
+    currentNode = node;
+    try {
+        if (node->getType() == ASTNode::NodeType::Environment) {
+            finishEnvironment(node, chunk);
+        } else if (node->getType() == ASTNode::NodeType::Command) {
+            CommandId cmdId = node->getCommand().commandId();
+            if (cmdId == CommandId::Author) {
                 insideAuthorBlock = false;
-            } else if (cmd.find("\\institute") != std::string::npos ||
-                      cmd.find("\\affiliation") != std::string::npos) {
+            } else if (cmdId == CommandId::Institute || cmdId == CommandId::Affiliation) {
                 insideInstituteBlock = false;
             }
         }
-
-    } catch (const ParserError& e) {
-        std::cerr << "Parser error at position " << e.getPosition() << ": " 
-                  << e.what() << "\n" << getCurrentContext() << std::endl;
-    } catch (const std::exception& e) {
-        std::cerr << "Unexpected error: " << e.what() << "\n" 
-                  << getCurrentContext() << std::endl;
+    } catch (const std::exception&) {
+        report(DiagnosticCode::HandlerFailed);
     }
 }
 
@@ -272,8 +273,8 @@ std::string FSM::cleanAuthor(const std::string& authorStr) {
 }
 
 
-void FSM::ParserContext::pushEnvironment(const std::string& env) {
-    environmentStack.push(env);
+void FSM::ParserContext::pushEnvironment(EnvironmentId id, std::string_view name) {
+    environmentStack.emplace(id, name);
 }
 
 void FSM::ParserContext::popEnvironment() {
@@ -282,16 +283,12 @@ void FSM::ParserContext::popEnvironment() {
     }
 }
 
-bool FSM::ParserContext::isInEnvironment(const std::string& env) const {
-    return !environmentStack.empty() && environmentStack.top() == env;
+bool FSM::ParserContext::isInEnvironment(EnvironmentId id) const {
+    return !environmentStack.empty() && environmentStack.top().first == id;
 }
 
 bool FSM::isTransitionValid(FSMState from, FSMState to) const {
-    if (validTransitions.find(from) == validTransitions.end()) {
-        return false;
-    }
-    const auto& validStates = validTransitions.at(from);
-    return validStates.find(to) != validStates.end();
+    return CheckedTransitions::allows(from, to);
 }
 
 std::string FSM::getCurrentContext() const {
@@ -301,7 +298,7 @@ std::string FSM::getCurrentContext() const {
     ss << "Inside Author Block: " << (insideAuthorBlock ? "Yes" : "No") << "\n";
     ss << "Inside Institute Block: " << (insideInstituteBlock ? "Yes" : "No") << "\n";
     if (!context.environmentStack.empty()) {
-        ss << "Current Environment: " << context.environmentStack.top() << "\n";
+        ss << "Current Environment: " << context.environmentStack.top().second << "\n";
     }
     return ss.str();
 }
@@ -332,13 +329,18 @@ void FSM::processAuthorCommand(const std::string& content, Author& author) {
 }
 
 
-void FSM::handleCitationCommand(const std::string& cmd, const std::vector<std::string>& args,
-                              std::string& currentChunk) {
+void FSM::handleCitationCommand(const CommandRecord& command, ChunkBuilder& chunk) {
     try {
-        auto citationNode = createOrGetDAGNode(args[0], ASTNode::NodeType::Citation);
+        if (command.required.empty()) {
+            return;
+        }
+
+        std::string cmd(command.name);
+        std::string_view keyList = command.required[0];
+        auto citationNode = createOrGetDAGNode(std::string(keyList), ASTNode::NodeType::Citation);
         auto sourceNode = context.getCurrentNode();
         
-        if (sourceNode) {
+        if (citationNode && sourceNode) {
             citationNode->addEdge(sourceNode, EdgeType::Citation);
         }
         
@@ -347,44 +349,37 @@ void FSM::handleCitationCommand(const std::string& cmd, const std::vector<std::s
         citationJson["command"] = cmd;
         citationJson["sourceNode"] = sourceNode ? sourceNode->getId() : "";
         citationJson["keys"] = json::array();
-        citationJson["context"] = currentChunk; 
+        citationJson["context"] = std::string(chunk.view());
         
-        for (const auto& arg : args) {
-            size_t pos = 0;
-            
-            if (pos < arg.length() && arg[pos] == '[') {
-                size_t optEnd = arg.find("]", pos);
-                if (optEnd != std::string::npos) {
-                    std::string options = arg.substr(pos + 1, optEnd - pos - 1);
-                    citationJson["options"] = options;
-                    pos = optEnd + 1;
-                }
-            }
-            
-            while (pos < arg.length()) {
-                pos = arg.find("{", pos);
-                if (pos == std::string::npos) break;
-                
-                std::string key = extractContentBetweenBraces(arg, pos);
-                if (!key.empty()) {
-                    context.citations.push_back(key);
-                    citationJson["keys"].push_back({
-                        {"key", key},
-                        {"node_id", citationNode->getId()},
-                        {"source_location", currentChunk} 
-                    });
-                }
-                pos += key.length() + 2;
+        if (!command.optional.empty()) {
+            citationJson["options"] = std::string(command.optional[0]);
+        }
+
+        size_t pos = 0;
+        while (pos <= keyList.length()) {
+            size_t comma = keyList.find(',', pos);
+            std::string_view key = keyList.substr(pos, comma == std::string_view::npos ? std::string_view::npos : comma - pos);
+            size_t first = key.find_first_not_of(" \t\n\r");
+            if (first != std::string_view::npos) {
+                key = key.substr(first, key.find_last_not_of(" \t\n\r") - first + 1);
+                context.citations.push_back(std::string(key));
+                citationJson["keys"].push_back({
+                    {"key", std::string(key)},
+                    {"node_id", citationNode ? citationNode->getId() : ""},
+                    {"source_location", std::string(chunk.view())}
+                });
             }
+            if (comma == std::string_view::npos) break;
+            pos = comma + 1;
         }
         
         context.semanticChunks.push_back(citationJson);
         
-        currentChunk += "<citation type=\"" + cmd + "\">\n";
+        chunk << "<citation type=\"" << cmd << "\">\n";
         for (const auto& key : citationJson["keys"]) {
-            currentChunk += "  <key>" + key["key"].get<std::string>() + "</key>\n";
+            chunk << "  <key>" << key["key"].get_ref<const std::string&>() << "</key>\n";
         }
-        currentChunk += "</citation>\n";
+        chunk << "</citation>\n";
         
     } catch (const std::exception& e) {
         std::cerr << "Error in handleCitationCommand: " << e.what() << std::endl;
@@ -392,9 +387,9 @@ void FSM::handleCitationCommand(const std::string& cmd, const std::vector<std::s
     }
 }
 
-std::string FSM::extractContentBetweenBraces(const std::string& str, size_t start_pos) {
+std::string FSM::extractContentBetweenBraces(std::string_view str, size_t start_pos) {
     size_t open = str.find('{', start_pos);
-    if (open == std::string::npos) return "";
+    if (open == std::string_view::npos) return "";
     
     int depth = 1;
     size_t pos = open + 1;
@@ -406,13 +401,13 @@ std::string FSM::extractContentBetweenBraces(const std::string& str, size_t star
     }
     
     if (depth == 0) {
-        return str.substr(open + 1, pos - open - 2);
+        return std::string(str.substr(open + 1, pos - open - 2));
     }
     
     return "";
 }
 
-void FSM::handleText(const std::shared_ptr<ASTNode>& node, std::string& currentChunk) {
+void FSM::handleText(ASTNode* node, ChunkBuilder& chunk) {
     if (!node) return;
     
     try {
@@ -459,26 +454,26 @@ void FSM::handleText(const std::shared_ptr<ASTNode>& node, std::string& currentC
             return;
         }
 
-        std::stringstream contentStream;
-        std::string remaining = textContent;
         std::regex inlineMathRegex(R"(\$(.*?)\$)");
         std::smatch matches;
+        auto remaining = textContent.cbegin();
+        auto view = [&textContent](auto first, auto last) {
+            return std::string_view(textContent).substr(first - textContent.cbegin(), last - first);
+        };
         
-        while (std::regex_search(remaining, matches, inlineMathRegex)) {
+        while (std::regex_search(remaining, textContent.cend(), matches, inlineMathRegex)) {
             if (matches.prefix().length() > 0) {
-                contentStream << "<text_content>" << matches.prefix().str() << "</text_content>\n";
+                chunk << "<text_content>" << view(matches.prefix().first, matches.prefix().second) << "</text_content>\n";
             }
             
-            contentStream << "<inline_math>" << matches[1].str() << "</inline_math>\n";
+            chunk << "<inline_math>" << view(matches[1].first, matches[1].second) << "</inline_math>\n";
             
-            remaining = matches.suffix();
+            remaining = matches.suffix().first;
         }
         
-        if (!remaining.empty()) {
-            contentStream << "<text_content>" << remaining << "</text_content>\n";
+        if (remaining != textContent.cend()) {
+            chunk << "<text_content>" << view(remaining, textContent.cend()) << "</text_content>\n";
         }
-        
-        currentChunk += contentStream.str();
 
     } catch (const std::exception& e) {
         std::cerr << "Error in handleText: " << e.what() << std::endl;
@@ -486,27 +481,21 @@ void FSM::handleText(const std::shared_ptr<ASTNode>& node, std::string& currentC
     }
 }
 
-void FSM::handleSection(const std::shared_ptr<ASTNode>& node, std::string& currentChunk, 
-                       std::vector<std::string>& chunks) {
+void FSM::handleSection(ASTNode* node, ChunkBuilder& chunk, ChunkSink& sink) {
     if (!node) return;
 
     try {
         std::string sectionContent = node->getContent();
         
-        currentChunk += "<section_header>\n";
-        currentChunk += "  <section_title>" + sectionContent + "</section_title>\n";
-        currentChunk += "  <section_level>" + 
-                       std::to_string(node->getSectionLevel()) + 
-                       "</section_level>\n";
-        currentChunk += "</section_header>\n";
+        chunk << "<section_header>\n";
+        chunk << "  <section_title>" << sectionContent << "</section_title>\n";
+        chunk << "  <section_level>" << node->getSectionLevel() << "</section_level>\n";
+        chunk << "</section_header>\n";
 
         auto sectionNode = createOrGetDAGNode(sectionContent, ASTNode::NodeType::Section);
         node->setDAGNode(sectionNode);
 
-        if (!currentChunk.empty()) {
-            chunks.push_back(currentChunk);
-            currentChunk.clear();
-        }
+        chunk.flush(sink);
 
     } catch (const std::exception& e) {
         std::cerr << "Error in handleSection: " << e.what() << std::endl;
@@ -514,46 +503,40 @@ void FSM::handleSection(const std::shared_ptr<ASTNode>& node, std::string& curre
     }
 }
 
-void FSM::handleDocument(const std::shared_ptr<ASTNode>&, std::string& currentChunk) {
-    currentChunk += "Document Root\n";
+void FSM::handleDocument(ASTNode*, ChunkBuilder& chunk) {
+    chunk << "Document Root\n";
 }
 
 
-void FSM::handleEnvironment(const std::shared_ptr<ASTNode>& node, std::string& currentChunk) {
+void FSM::handleEnvironment(ASTNode* node, ChunkBuilder& chunk) {
     if (!node) return;
 
     try {
-        std::string envContent = node->getContent();
-        
+        const CommandRecord& env = node->getCommand();
+        EnvironmentId envId = static_cast<EnvironmentId>(env.id);
+        std::string envType(env.name);
+
         if (currentState != FSMState::InEnvironment) {
             setState(FSMState::InEnvironment);
         }
 
-        std::regex envRegex(R"(\\(begin|end)\{(\w+)\})");
-        std::smatch matches;
-
-        if (std::regex_search(envContent, matches, envRegex)) {
-            std::string envAction = matches[1].str();
-            std::string envType = matches[2].str();
+        context.pushEnvironment(envId, env.name);
+        chunk << "<environment_start type=\"" << envType << "\">\n";
 
-            if (envAction == "begin") {
-                context.pushEnvironment(envType);
-                currentChunk += "<environment_start type=\"" + envType + "\">\n";
-                
-                if (envType == "figure" || envType == "table") {
-                    handleFloatEnvironment(envType, node, currentChunk);
-                } else if (envType == "abstract") {
-                    setState(FSMState::InAbstract);
-                    handleAbstractEnvironment(node, currentChunk);
-                }
-            } else if (envAction == "end") {
-                context.popEnvironment();
-                currentChunk += "</environment_end>\n";
-                setState(FSMState::InDocument);  
-            }
+        switch (envId) {
+            case EnvironmentId::Figure:
+            case EnvironmentId::Table:
+                handleFloatEnvironment(envType, node, chunk);
+                break;
+            case EnvironmentId::Abstract:
+                setState(FSMState::InAbstract);
+                handleAbstractEnvironment(node, chunk);
+                break;
+            default:
+                break;
         }
 
-        auto envNode = createOrGetDAGNode(envContent, ASTNode::NodeType::Environment);
+        auto envNode = createOrGetDAGNode(node->getContent(), ASTNode::NodeType::Environment);
         if (envNode) {
             node->setDAGNode(envNode);
         }
@@ -565,40 +548,68 @@ void FSM::handleEnvironment(const std::shared_ptr<ASTNode>& node, std::string& c
     }
 }
 
-std::vector<std::string> FSM::chunkDocument(const std::shared_ptr<ASTNode>& root) {
-    std::vector<std::string> chunks;
-    std::string currentChunk;
+void FSM::finishEnvironment(ASTNode*, ChunkBuilder& chunk) {
+    context.popEnvironment();
+    chunk << "</environment_end>\n";
+}
+
+void FSM::chunkDocument(ASTNode* root, ChunkSink& sink) {
+    ChunkBuilder chunk;
+    traverseAST(root, chunk, sink);
+    chunk.flush(sink);
+}
+
+std::vector<std::string> FSM::chunkDocument(ASTNode* root) {
+    ChunkVector chunks;
+    chunkDocument(root, chunks);
+    return std::move(chunks.chunks);
+}
 
-    traverseAST(root, currentChunk, chunks);
+namespace {
 
-    if (!currentChunk.empty()) {
-        chunks.push_back(currentChunk);
+// Content entries of the document JSON, keyed as search.py reads them.
+class JsonChunkObjects : public EmbeddingSink {
+public:
+    explicit JsonChunkObjects(json& array) : array(array) {}
+    void write(const EmbeddingChunk& chunk) override {
+        array.push_back({{"content", std::string(chunk.text)},
+                         {"section", std::string(chunk.sectionPath)},
+                         {"tokens", chunk.tokens}});
     }
 
-    return chunks;
-}
+private:
+    json& array;
+};
 
-json FSM::chunkDocumentToJson(const std::shared_ptr<ASTNode>& root) {
-    json documentJson;
-    documentJson["document"]["metadata"]["authors"] = json::array();
-    documentJson["document"]["metadata"]["affiliations"] = json::array();
-    documentJson["document"]["content"] = json::array();
+class JsonWriterChunks : public EmbeddingSink {
+public:
+    explicit JsonWriterChunks(JsonWriter& writer) : writer(writer) {}
+    void write(const EmbeddingChunk& chunk) override {
+        writer.beginObject();
+        writer.key("content");
+        writer.value(chunk.text);
+        writer.key("section");
+        writer.value(chunk.sectionPath);
+        writer.key("tokens");
+        writer.value(static_cast<int64_t>(chunk.tokens));
+        writer.endObject();
+    }
 
-    std::string currentChunk;
-    std::vector<std::string> chunks;
+private:
+    JsonWriter& writer;
+};
 
-    traverseAST(root, currentChunk, chunks);
+}
 
+FSM::DocumentMetadata FSM::collectMetadata() {
+    DocumentMetadata metadata;
     const auto& entities = ner.getEntities();
 
     std::unordered_map<std::string, int> affiliationIds;
-    int affiliationCounter = 1;
 
     if (entities.find("authors") != entities.end()) {
         for (const auto& authorName : entities.at("authors")) {
-            json authorJson;
-            authorJson["name"] = authorName;
-            authorJson["affiliations"] = json::array();
+            DocumentMetadata::AuthorEntry author{authorName, {}};
 
             auto authorNode = dag.getNode(authorName);
             if (authorNode) {
@@ -606,52 +617,123 @@ json FSM::chunkDocumentToJson(const std::shared_ptr<ASTNode>& root) {
                     if (child->getNodeType() == NodeType::Affiliation) {
                         std::string affiliation = child->getId();
 
-                        if (affiliationIds.find(affiliation) == affiliationIds.end()) {
-                            affiliationIds[affiliation] = affiliationCounter++;
-
-                            json affiliationJson;
-                            affiliationJson["id"] = affiliationIds[affiliation];
-                            affiliationJson["details"] = affiliation;
-                            documentJson["document"]["metadata"]["affiliations"].push_back(affiliationJson);
+                        auto found = affiliationIds.find(affiliation);
+                        if (found == affiliationIds.end()) {
+                            metadata.affiliations.push_back(affiliation);
+                            found = affiliationIds.emplace(affiliation, static_cast<int>(metadata.affiliations.size())).first;
                         }
 
-                        authorJson["affiliations"].push_back(affiliationIds[affiliation]);
+                        author.affiliations.push_back(found->second);
                     }
                 }
             }
 
-            documentJson["document"]["metadata"]["authors"].push_back(authorJson);
+            metadata.authors.push_back(std::move(author));
         }
     } else {
         std::cerr << "Warning: No authors found in the NER entities." << std::endl;
     }
+    return metadata;
+}
 
-    for (const auto& chunk : chunks) {
-        documentJson["document"]["content"].push_back(chunk);
+json FSM::chunkDocumentToJson(ASTNode* root, const TokenChunker::Options& options) {
+    json documentJson;
+    documentJson["document"]["metadata"]["authors"] = json::array();
+    documentJson["document"]["metadata"]["affiliations"] = json::array();
+    documentJson["document"]["content"] = json::array();
+
+    ChunkBuilder chunk;
+    JsonChunkObjects content(documentJson["document"]["content"]);
+    TokenChunker chunker(content, options);
+    traverseAST(root, chunk, chunker);
+    chunk.flush(chunker);
+    chunker.finish();
+
+    DocumentMetadata metadata = collectMetadata();
+    for (size_t i = 0; i < metadata.affiliations.size(); ++i) {
+        documentJson["document"]["metadata"]["affiliations"].push_back({
+            {"id", static_cast<int>(i + 1)},
+            {"details", metadata.affiliations[i]}
+        });
+    }
+    for (const auto& author : metadata.authors) {
+        documentJson["document"]["metadata"]["authors"].push_back({
+            {"name", author.name},
+            {"affiliations", author.affiliations}
+        });
     }
 
     return documentJson;
 }
 
+// Same document as chunkDocumentToJson, with keys in the order dump() sorts
+// them. Content comes first, so chunks are written while the tree is walked.
+void FSM::writeDocumentJson(ASTNode* root, JsonWriter& writer, const TokenChunker::Options& options) {
+    writer.beginObject();
+    writer.key("document");
+    writer.beginObject();
+
+    writer.key("content");
+    writer.beginArray();
+    ChunkBuilder chunk;
+    JsonWriterChunks content(writer);
+    TokenChunker chunker(content, options);
+    traverseAST(root, chunk, chunker);
+    chunk.flush(chunker);
+    chunker.finish();
+    writer.endArray();
+
+    DocumentMetadata metadata = collectMetadata();
+    writer.key("metadata");
+    writer.beginObject();
+    writer.key("affiliations");
+    writer.beginArray();
+    for (size_t i = 0; i < metadata.affiliations.size(); ++i) {
+        writer.beginObject();
+        writer.key("details");
+        writer.value(metadata.affiliations[i]);
+        writer.key("id");
+        writer.value(static_cast<int>(i + 1));
+        writer.endObject();
+    }
+    writer.endArray();
+    writer.key("authors");
+    writer.beginArray();
+    for (const auto& author : metadata.authors) {
+        writer.beginObject();
+        writer.key("affiliations");
+        writer.beginArray();
+        for (int id : author.affiliations) {
+            writer.value(id);
+        }
+        writer.endArray();
+        writer.key("name");
+        writer.value(author.name);
+        writer.endObject();
+    }
+    writer.endArray();
+    writer.endObject();
+
+    writer.endObject();
+    writer.endObject();
+}
+
 DAG& FSM::getDAG() {
     return dag;
 }
 
 
-void FSM::handleMath(const std::shared_ptr<ASTNode>& node, std::string& currentChunk) {
+void FSM::handleMath(ASTNode* node, ChunkBuilder& chunk) {
     if (!node) return;
     
     try {
         std::string mathContent = node->getContent();
-        std::stringstream ss;
-        ss << "<math_content>\n"
-           << "  <math_type>" 
-           << (context.isInEnvironment("equation") ? "display" : "inline") 
-           << "</math_type>\n"
-           << "  <math_expression>" << mathContent << "</math_expression>\n"
-           << "</math_content>\n";
-        
-        currentChunk += ss.str();
+        chunk << "<math_content>\n"
+              << "  <math_type>" 
+              << (context.isInEnvironment(EnvironmentId::Equation) ? "display" : "inline") 
+              << "</math_type>\n"
+              << "  <math_expression>" << mathContent << "</math_expression>\n"
+              << "</math_content>\n";
         
         auto mathNode = createOrGetDAGNode(mathContent, ASTNode::NodeType::Math);
         if (mathNode) {
@@ -669,47 +751,47 @@ void FSM::handleMath(const std::shared_ptr<ASTNode>& node, std::string& currentC
     }
 }
 
-void FSM::handleCommand(const std::shared_ptr<ASTNode>& node, std::string& currentChunk) {
+void FSM::handleCommand(ASTNode* node, ChunkBuilder& chunk) {
     if (!node) return;
 
     try {
-        std::string commandContent = node->getContent();
-        std::regex cmdRegex(R"(\\(\w+)(?:\[([^\]]*)\])?(?:\{([^}]*)\})*)");
-        std::smatch matches;
-
-        if (std::regex_search(commandContent, matches, cmdRegex)) {
-            std::string cmdName = matches[1].str();
-            std::string cmdOpts = matches[2].str();
-            std::vector<std::string> args;
-            
-            std::string remaining = matches.suffix().str();
-            std::regex argRegex(R"(\{([^}]*)\})");
-            std::smatch argMatch;
-            while (std::regex_search(remaining, argMatch, argRegex)) {
-                args.push_back(argMatch[1].str());
-                remaining = argMatch.suffix().str();
-            }
+        const CommandRecord& command = node->getCommand();
+        if (command.name.empty()) {
+            return;
+        }
 
-            auto cmdNode = createOrGetDAGNode(commandContent, ASTNode::NodeType::Command);
+        // A \label is given its DAG node early when a reference to it comes first.
+        auto cmdNode = node->getDAGNode();
+        if (!cmdNode) {
+            cmdNode = createOrGetDAGNode(node->getContent(), ASTNode::NodeType::Command);
             node->setDAGNode(cmdNode);
+        }
 
-            if (isDocumentCommand(cmdName)) {
-                handleDocumentCommand(cmdName, args, currentChunk);
-            } else if (isSectionCommand(cmdName)) {
-                handleSectioningCommand(cmdName, args, currentChunk);
-            } else if (isMathCommand(cmdName)) {
-                handleMathematicalContent(cmdName, args, currentChunk);
-            } else if (isTheoremCommand(cmdName)) {
-                handleTheoremEnvironment(cmdName, args, currentChunk);
-            } else if (isFloatCommand(cmdName)) {
-                handleFloatEnvironment(cmdName, args, currentChunk);
-            } else if (isCitationCommand(cmdName)) {
-                handleCitationCommand(cmdName, args, currentChunk);
-            } else if (isReferenceCommand(cmdName)) {
-                handleReferenceCommand(cmdName, args, currentChunk);
-            } else {
-                handleGenericCommand(cmdName, cmdOpts, args, currentChunk);
-            }
+        switch (commandKind(command.commandId())) {
+            case CommandKind::Document:
+                handleDocumentCommand(command, chunk);
+                break;
+            case CommandKind::Sectioning:
+                handleSectioningCommand(command, chunk);
+                break;
+            case CommandKind::Math:
+                handleMathematicalContent(command, chunk);
+                break;
+            case CommandKind::Theorem:
+                handleTheoremEnvironment(command, chunk);
+                break;
+            case CommandKind::Float:
+                handleFloatEnvironment(command, chunk);
+                break;
+            case CommandKind::Citation:
+                handleCitationCommand(command, chunk);
+                break;
+            case CommandKind::Reference:
+                handleReferenceCommand(command, node->getReferences(), chunk);
+                break;
+            default:
+                handleGenericCommand(command, chunk);
+                break;
         }
     } catch (const std::exception& e) {
         std::cerr << "Error in handleCommand: " << e.what() << std::endl;
@@ -718,53 +800,48 @@ void FSM::handleCommand(const std::shared_ptr<ASTNode>& node, std::string& curre
 }
 
 
-void FSM::handleDocumentCommand(const std::string& cmd, const std::vector<std::string>& args,
-                              std::string& currentChunk) {
+void FSM::handleDocumentCommand(const CommandRecord& command, ChunkBuilder& chunk) {
     try {
         FSMState prevState = currentState;
+        std::string cmd(command.name);
+        std::string arg = command.required.empty() ? std::string() : std::string(command.required[0]);
         
-        currentChunk += "<document_command type=\"" + cmd + "\">\n";
+        chunk << "<document_command type=\"" << cmd << "\">\n";
         
-        if (cmd == "documentclass") {
-            setState(FSMState::InDocument);  
-            currentChunk += "  <class>";
-            if (!args.empty()) currentChunk += args[0];
-            currentChunk += "</class>\n";
-        }
-        else if (cmd == "title") {
-            setState(FSMState::InDocument);  
-            currentChunk += "  <title>";
-            if (!args.empty()) currentChunk += args[0];
-            currentChunk += "</title>\n";
-        }
-        else if (cmd == "author") {
-            if (!args.empty()) {
-                setState(FSMState::InAuthor);  
-                handleAuthorCommand(args[0]);
-            }
-        }
-        else if (cmd == "abstract") {
-            setState(FSMState::InAbstract); 
-            currentChunk += "  <abstract>";
-            if (!args.empty()) currentChunk += args[0];
-            currentChunk += "</abstract>\n";
-        }
-        else if (cmd == "date") {
-            setState(FSMState::InDocument);  
-            currentChunk += "  <date>";
-            if (!args.empty()) currentChunk += args[0];
-            currentChunk += "</date>\n";
-        }
-        else if (cmd == "thanks") {
-            setState(FSMState::InDocument);  
-            currentChunk += "  <acknowledgment>";
-            if (!args.empty()) currentChunk += args[0];
-            currentChunk += "</acknowledgment>\n";
+        switch (command.commandId()) {
+            case CommandId::Documentclass:
+                setState(FSMState::InDocument);  
+                chunk << "  <class>" << arg << "</class>\n";
+                break;
+            case CommandId::Title:
+                setState(FSMState::InDocument);  
+                chunk << "  <title>" << arg << "</title>\n";
+                break;
+            case CommandId::Author:
+                if (!arg.empty()) {
+                    setState(FSMState::InAuthor);  
+                    handleAuthorCommand(arg);
+                }
+                break;
+            case CommandId::Abstract:
+                setState(FSMState::InAbstract); 
+                chunk << "  <abstract>" << arg << "</abstract>\n";
+                break;
+            case CommandId::Date:
+                setState(FSMState::InDocument);  
+                chunk << "  <date>" << arg << "</date>\n";
+                break;
+            case CommandId::Thanks:
+                setState(FSMState::InDocument);  
+                chunk << "  <acknowledgment>" << arg << "</acknowledgment>\n";
+                break;
+            default:
+                break;
         }
         
-        currentChunk += "</document_command>\n";
+        chunk << "</document_command>\n";
         
-        if (cmd != "author" && cmd != "abstract") {  
+        if (command.commandId() != CommandId::Author && command.commandId() != CommandId::Abstract) {  
             setState(prevState);
         }
         
@@ -776,35 +853,38 @@ void FSM::handleDocumentCommand(const std::string& cmd, const std::vector<std::s
 }
 
 
-void FSM::handleSectioningCommand(const std::string& cmd, const std::vector<std::string>& args,
-                                std::string& currentChunk) {
+void FSM::handleSectioningCommand(const CommandRecord& command, ChunkBuilder& chunk) {
     try {
         setState(FSMState::InSection);
         
         int level = 0;
-        if (cmd == "chapter") level = 1;
-        else if (cmd == "section") level = 2;
-        else if (cmd == "subsection") level = 3;
-        else if (cmd == "subsubsection") level = 4;
-        else if (cmd == "paragraph") level = 5;
-        else if (cmd == "subparagraph") level = 6;
+        switch (command.commandId()) {
+            case CommandId::Chapter: level = 1; break;
+            case CommandId::Section: level = 2; break;
+            case CommandId::Subsection: level = 3; break;
+            case CommandId::Subsubsection: level = 4; break;
+            case CommandId::Paragraph: level = 5; break;
+            case CommandId::Subparagraph: level = 6; break;
+            default: break;
+        }
         
-        currentChunk += "<section_header>\n";
-        currentChunk += "  <level>" + std::to_string(level) + "</level>\n";
+        chunk << "<section_header>\n";
+        chunk << "  <level>" << level << "</level>\n";
         
-        if (!args.empty()) {
-            currentChunk += "  <title>" + args[0] + "</title>\n";
+        if (!command.required.empty()) {
+            std::string_view title = command.required[0];
+            chunk << "  <title>" << title << "</title>\n";
             
-            size_t labelPos = args[0].find("\\label");
-            if (labelPos != std::string::npos) {
-                std::string label = extractContentBetweenBraces(args[0], labelPos + 6);
+            size_t labelPos = title.find("\\label");
+            if (labelPos != std::string_view::npos) {
+                std::string label = extractContentBetweenBraces(title, labelPos + 6);
                 if (!label.empty()) {
-                    currentChunk += "  <label>" + label + "</label>\n";
+                    chunk << "  <label>" << label << "</label>\n";
                 }
             }
         }
         
-        currentChunk += "</section_header>\n";
+        chunk << "</section_header>\n";
         
     } catch (const std::exception& e) {
         std::cerr << "Error in handleSectioningCommand: " << e.what() << std::endl;
@@ -813,24 +893,24 @@ void FSM::handleSectioningCommand(const std::string& cmd, const std::vector<std:
 }
 
 
-void FSM::handleMathematicalContent(const std::string& cmd, const std::vector<std::string>& args,
-                                  std::string& currentChunk) {
+void FSM::handleMathematicalContent(const CommandRecord& command, ChunkBuilder& chunk) {
     try {
-        if (cmd == "equation" || cmd == "align" || cmd == "gather" || cmd == "eq") {
+        std::string cmd(command.name);
+        CommandId cmdId = command.commandId();
+        if (cmdId == CommandId::Equation || cmdId == CommandId::Align || cmdId == CommandId::Gather) {
             setState(FSMState::InEquation);
-            currentChunk += "<display_math type=\"" + cmd + "\">\n";
-            for (const auto& arg : args) {
-                currentChunk += "  <math_content>" + arg + "</math_content>\n";
+            chunk << "<display_math type=\"" << cmd << "\">\n";
+            for (const auto& arg : command.required) {
+                chunk << "  <math_content>" << arg << "</math_content>\n";
             }
-            currentChunk += "</display_math>\n";
-        } else if (isMathCommand(cmd)) {
+            chunk << "</display_math>\n";
+        } else {
             setState(FSMState::InMath);
-            currentChunk += "<math_command type=\"" + cmd + "\">\n";
-            for (size_t i = 0; i < args.size(); i++) {
-                currentChunk += "  <arg" + std::to_string(i+1) + ">" + 
-                              args[i] + "</arg" + std::to_string(i+1) + ">\n";
+            chunk << "<math_command type=\"" << cmd << "\">\n";
+            for (size_t i = 0; i < command.required.size(); i++) {
+                chunk << "  <arg" << i + 1 << ">" << command.required[i] << "</arg" << i + 1 << ">\n";
             }
-            currentChunk += "</math_command>\n";
+            chunk << "</math_command>\n";
         }
         
         if (currentState == FSMState::InMath || currentState == FSMState::InEquation) {
@@ -845,39 +925,39 @@ void FSM::handleMathematicalContent(const std::string& cmd, const std::vector<st
 
 
 
-void FSM::handleTheoremEnvironment(const std::string& cmd, const std::vector<std::string>& args,
-                                 std::string& currentChunk) {
+void FSM::handleTheoremEnvironment(const CommandRecord& command, ChunkBuilder& chunk) {
     try {
         setState(FSMState::InEnvironment);
 
-        currentChunk += "<theorem type=\"" + cmd + "\">\n";
+        chunk << "<theorem type=\"" << command.name << "\">\n";
 
         size_t startPos = 0;
 
-        if (!args.empty()) {
-            size_t labelPos = args[0].find("\\label");
-            if (labelPos != std::string::npos) {
-                std::string label = extractContentBetweenBraces(args[0], labelPos + 6);
+        if (!command.required.empty()) {
+            std::string_view body = command.required[0];
+            size_t labelPos = body.find("\\label");
+            if (labelPos != std::string_view::npos) {
+                std::string label = extractContentBetweenBraces(body, labelPos + 6);
                 if (!label.empty()) {
-                    currentChunk += "  <label>" + label + "</label>\n";
+                    chunk << "  <label>" << label << "</label>\n";
                 }
                 startPos = labelPos + 6;
             }
 
-            if (startPos < args[0].length()) {
-                size_t titlePos = args[0].find("\\name", startPos);
-                if (titlePos != std::string::npos) {
-                    std::string title = extractContentBetweenBraces(args[0], titlePos + 5);
+            if (startPos < body.length()) {
+                size_t titlePos = body.find("\\name", startPos);
+                if (titlePos != std::string_view::npos) {
+                    std::string title = extractContentBetweenBraces(body, titlePos + 5);
                     if (!title.empty()) {
-                        currentChunk += "  <title>" + title + "</title>\n";
+                        chunk << "  <title>" << title << "</title>\n";
                     }
                 }
             }
 
-            currentChunk += "  <content>" + args[0] + "</content>\n";
+            chunk << "  <content>" << body << "</content>\n";
         }
 
-        currentChunk += "</theorem>\n";
+        chunk << "</theorem>\n";
 
     } catch (const std::exception& e) {
         std::cerr << "Error in handleTheoremEnvironment: " << e.what() << std::endl;
@@ -887,56 +967,46 @@ void FSM::handleTheoremEnvironment(const std::string& cmd, const std::vector<std
 
 
 
-void FSM::handleFloatEnvironment(const std::string& cmd, const std::vector<std::string>& args,
-                               std::string& currentChunk) {
+void FSM::handleFloatEnvironment(const CommandRecord& command, ChunkBuilder& chunk) {
     try {
         setState(FSMState::InEnvironment);
 
-        currentChunk += "<float type=\"" + cmd + "\">\n";
+        chunk << "<float type=\"" << command.name << "\">\n";
 
-        for (const auto& arg : args) {
-            size_t pos = 0;
-
-            pos = arg.find("\\caption");
-            if (pos != std::string::npos) {
-                std::string caption = extractContentBetweenBraces(arg, pos + 8);
-                if (!caption.empty()) {
-                    currentChunk += "  <caption>" + caption + "</caption>\n";
-                }
-            }
-
-            pos = arg.find("\\label");
-            if (pos != std::string::npos) {
-                std::string label = extractContentBetweenBraces(arg, pos + 6);
-                if (!label.empty()) {
-                    currentChunk += "  <label>" + label + "</label>\n";
+        std::string_view firstArg = command.required.empty() ? std::string_view() : command.required[0];
+        switch (command.commandId()) {
+            case CommandId::Caption:
+                chunk << "  <caption>" << firstArg << "</caption>\n";
+                break;
+            case CommandId::Includegraphics:
+                chunk << "  <graphics";
+                if (!command.optional.empty()) {
+                    chunk << " options=\"" << command.optional[0] << "\"";
                 }
-            }
-
-            pos = arg.find("\\includegraphics");
-            if (pos != std::string::npos) {
-                size_t optPos = arg.find("[", pos);
-                std::string options;
-                if (optPos != std::string::npos && optPos < arg.find("{", pos)) {
-                    size_t optEnd = arg.find("]", optPos);
-                    if (optEnd != std::string::npos) {
-                        options = arg.substr(optPos + 1, optEnd - optPos - 1);
-                        pos = optEnd + 1;
+                chunk << " path=\"" << firstArg << "\"/>\n";
+                break;
+            default:
+                for (const auto& arg : command.required) {
+                    size_t pos = arg.find("\\caption");
+                    if (pos != std::string_view::npos) {
+                        std::string caption = extractContentBetweenBraces(arg, pos + 8);
+                        if (!caption.empty()) {
+                            chunk << "  <caption>" << caption << "</caption>\n";
+                        }
                     }
-                }
 
-                std::string path = extractContentBetweenBraces(arg, pos);
-                if (!path.empty()) {
-                    currentChunk += "  <graphics";
-                    if (!options.empty()) {
-                        currentChunk += " options=\"" + options + "\"";
+                    pos = arg.find("\\label");
+                    if (pos != std::string_view::npos) {
+                        std::string label = extractContentBetweenBraces(arg, pos + 6);
+                        if (!label.empty()) {
+                            chunk << "  <label>" << label << "</label>\n";
+                        }
                     }
-                    currentChunk += " path=\"" + path + "\"/>\n";
                 }
-            }
+                break;
         }
 
-        currentChunk += "</float>\n";
+        chunk << "</float>\n";
 
     } catch (const std::exception& e) {
         std::cerr << "Error in handleFloatEnvironment: " << e.what() << std::endl;
@@ -944,64 +1014,75 @@ void FSM::handleFloatEnvironment(const std::string& cmd, const std::vector<std::
     }
 }
 
-void FSM::handleReferenceCommand(const std::string& cmd, const std::vector<std::string>& args,
-                               std::string& currentChunk) {
+void FSM::handleReferenceCommand(const CommandRecord& command, const ASTNode::NodeList& targets,
+                                 ChunkBuilder& chunk) {
     try {
-        EdgeType edgeType;
+        if (command.required.empty()) {
+            return;
+        }
+
+        EdgeType edgeType = EdgeType::CrossReference;
         std::string refType;
-        if (cmd == "eqref") {
-            edgeType = EdgeType::EquationReference;
-            refType = "equation";
-        } else if (cmd == "ref") {
-            edgeType = EdgeType::CrossReference;
-            refType = "standard";
-        } else if (cmd == "autoref") {
-            edgeType = EdgeType::CrossReference;
-            refType = "auto";
+        switch (command.commandId()) {
+            case CommandId::Eqref:
+                edgeType = EdgeType::EquationReference;
+                refType = "equation";
+                break;
+            case CommandId::Ref:
+                refType = "standard";
+                break;
+            case CommandId::Autoref:
+                refType = "auto";
+                break;
+            default:
+                break;
         }
         
-        auto referenceNode = createOrGetDAGNode(args[0], ASTNode::NodeType::Reference);
+        std::string label(command.required[0]);
+        auto referenceNode = createOrGetDAGNode(label, ASTNode::NodeType::Reference);
         
         json referenceJson;
         referenceJson["type"] = "reference";
         referenceJson["reference_type"] = refType;
-        referenceJson["node_id"] = referenceNode->getId();
-        referenceJson["context"] = currentChunk;
+        referenceJson["node_id"] = referenceNode ? referenceNode->getId() : "";
+        referenceJson["context"] = std::string(chunk.view());
         
-        if (!args.empty()) {
-            size_t pos = 0;
-            if (args[0][0] == '[') {
-                size_t optEnd = args[0].find("]");
-                if (optEnd != std::string::npos) {
-                    std::string text = args[0].substr(1, optEnd - 1);
-                    referenceJson["description"] = text;
-                    pos = optEnd + 1;
-                }
-            }
+        if (!command.optional.empty()) {
+            referenceJson["description"] = std::string(command.optional[0]);
+        }
             
-            std::string label = extractContentBetweenBraces(args[0], pos);
-            if (!label.empty()) {
-                if (auto targetNode = context.getLabeledNode(label)) {
-                    referenceNode->addEdge(targetNode, edgeType);
-                    referenceJson["target"] = {
-                        {"label", label},
-                        {"node_id", targetNode->getId()},
-                        {"node_type", static_cast<int>(targetNode->getType())}
-                    };
+        for (ASTNode* target : targets) {
+            if (!referenceNode) {
+                break;
+            }
+            auto targetNode = target->getDAGNode();
+            if (!targetNode) {
+                targetNode = createOrGetDAGNode(target->getContent(), ASTNode::NodeType::Command);
+                if (!targetNode) {
+                    continue;
                 }
+                target->setDAGNode(targetNode);
+            }
+            referenceNode->addEdge(targetNode, edgeType);
+            if (!referenceJson.contains("target")) {
+                referenceJson["target"] = {
+                    {"label", label},
+                    {"node_id", targetNode->getId()},
+                    {"node_type", static_cast<int>(targetNode->getType())}
+                };
             }
         }
         
         context.semanticChunks.push_back(referenceJson);
         
-        currentChunk += "<reference type=\"" + refType + "\">\n";
+        chunk << "<reference type=\"" << refType << "\">\n";
         if (referenceJson.contains("description")) {
-            currentChunk += "  <text>" + referenceJson["description"].get<std::string>() + "</text>\n";
+            chunk << "  <text>" << referenceJson["description"].get_ref<const std::string&>() << "</text>\n";
         }
         if (referenceJson.contains("target")) {
-            currentChunk += "  <label>" + referenceJson["target"]["label"].get<std::string>() + "</label>\n";
+            chunk << "  <label>" << referenceJson["target"]["label"].get_ref<const std::string&>() << "</label>\n";
         }
-        currentChunk += "</reference>\n";
+        chunk << "</reference>\n";
         
     } catch (const std::exception& e) {
         std::cerr << "Error in handleReferenceCommand: " << e.what() << std::endl;
@@ -1009,34 +1090,34 @@ void FSM::handleReferenceCommand(const std::string& cmd, const std::vector<std::
     }
 }
 
-void FSM::handleGenericCommand(const std::string& cmd, const std::string& cmdOpts,
-                             const std::vector<std::string>& args, std::string& currentChunk) {
+void FSM::handleGenericCommand(const CommandRecord& command, ChunkBuilder& chunk) {
     try {
-        currentChunk += "<command name=\"" + cmd + "\">\n";
+        chunk << "<command name=\"" << command.name << "\">\n";
         
-        if (!cmdOpts.empty()) {
-            currentChunk += "  <options>" + cmdOpts + "</options>\n";
+        for (const auto& option : command.optional) {
+            chunk << "  <options>" << option << "</options>\n";
         }
         
-        for (size_t i = 0; i < args.size(); i++) {
-            currentChunk += "  <arg" + std::to_string(i+1) + ">";
+        for (size_t i = 0; i < command.required.size(); i++) {
+            std::string_view arg = command.required[i];
+            chunk << "  <arg" << i + 1 << ">";
             size_t pos = 0;
-            while (pos < args[i].length()) {
-                size_t bracePos = args[i].find("{", pos);
-                if (bracePos == std::string::npos) {
-                    currentChunk += args[i].substr(pos);
+            while (pos < arg.length()) {
+                size_t bracePos = arg.find("{", pos);
+                if (bracePos == std::string_view::npos) {
+                    chunk << arg.substr(pos);
                     break;
                 }
                 
-                currentChunk += args[i].substr(pos, bracePos - pos);
-                std::string nested = extractContentBetweenBraces(args[i], bracePos);
-                currentChunk += nested;
+                chunk << arg.substr(pos, bracePos - pos);
+                std::string nested = extractContentBetweenBraces(arg, bracePos);
+                chunk << nested;
                 pos = bracePos + nested.length() + 2; 
             }
-            currentChunk += "</arg" + std::to_string(i+1) + ">\n";
+            chunk << "</arg" << i + 1 << ">\n";
         }
         
-        currentChunk += "</command>\n";
+        chunk << "</command>\n";
         
     } catch (const std::exception& e) {
         std::cerr << "Error in handleGenericCommand: " << e.what() << std::endl;
@@ -1233,33 +1314,36 @@ void FSM::handleAffiliationCommand(const std::string& args) {
 }
 
 void FSM::handleFloatEnvironment(const std::string& type, 
-                                const std::shared_ptr<ASTNode>& node,
-                                std::string& currentChunk) {
-    currentChunk += "<float type=\"" + type + "\">\n";
+                                ASTNode* node,
+                                ChunkBuilder& chunk) {
+    chunk << "<float type=\"" << type << "\">\n";
     
     for (const auto& child : node->getChildren()) {
         if (child->getType() == ASTNode::NodeType::Command) {
-            std::string cmd = child->getContent();
-            if (cmd.find("\\caption") != std::string::npos) {
-                currentChunk += "  <caption>" + extractContentBetweenBraces(cmd, 8) + "</caption>\n";
-            } else if (cmd.find("\\label") != std::string::npos) {
-                currentChunk += "  <label>" + extractContentBetweenBraces(cmd, 6) + "</label>\n";
+            const CommandRecord& command = child->getCommand();
+            if (command.required.empty()) {
+                continue;
+            }
+            if (command.commandId() == CommandId::Caption) {
+                chunk << "  <caption>" << command.required[0] << "</caption>\n";
+            } else if (command.commandId() == CommandId::Label) {
+                chunk << "  <label>" << command.required[0] << "</label>\n";
             }
         }
     }
 }
 
-void FSM::handleAbstractEnvironment(const std::shared_ptr<ASTNode>& node,
-                                  std::string& currentChunk) {
-    currentChunk += "<abstract>\n";
+void FSM::handleAbstractEnvironment(ASTNode* node,
+                                  ChunkBuilder& chunk) {
+    chunk << "<abstract>\n";
     
     for (const auto& child : node->getChildren()) {
         if (child->getType() == ASTNode::NodeType::Text) {
-            currentChunk += "  <abstract_text>" + child->getContent() + "</abstract_text>\n";
+            chunk << "  <abstract_text>" << child->getContentView() << "</abstract_text>\n";
         }
     }
     
-    currentChunk += "</abstract>\n";
+    chunk << "</abstract>\n";
 }
 
 std::shared_ptr<DAGNode> FSM::createOrGetDAGNode(const std::string& content, ASTNode::NodeType astType) {
@@ -1276,22 +1360,12 @@ std::shared_ptr<DAGNode> FSM::createOrGetDAGNode(const std::string& content, AST
                      [](char c) { return !std::isalnum(c) && c != '_'; }), 
                      safeContent.end());
     
-    static int nodeCounter = 0;
-    std::string nodeId = std::to_string(++nodeCounter) + "_" + 
-                        std::to_string(static_cast<int>(dagType)) + "_" +
-                        (safeContent.length() > 30 ? safeContent.substr(0, 30) : safeContent);
-
-    auto existingNode = dag.getNode(nodeId);
-    if (existingNode) {
-        return existingNode;
-    }
-
+    std::string label = safeContent.length() > 30 ? safeContent.substr(0, 30) : safeContent;
     try {
-        auto newNode = DAGNode::create(nodeId, dagType);
+        auto newNode = dag.createNumberedNode(dagType, label);
         if (!newNode) {
             throw std::runtime_error("Failed to create DAG node");
         }
-        dag.addNode(newNode);
         return newNode;
     } catch (const std::exception& e) {
         std::cerr << "Failed to create DAG node: " << e.what() << std::endl;
@@ -1300,77 +1374,10 @@ std::shared_ptr<DAGNode> FSM::createOrGetDAGNode(const std::string& content, AST
 }
 
 
-bool FSM::isDocumentCommand(const std::string& cmd) const {
-    static const std::unordered_set<std::string> docCommands = {
-        "documentclass", "usepackage", "title", "author", "date",
-        "maketitle", "begin", "end", "institute", "abstract",
-        "keywords", "thanks", "acknowledgements"
-    };
-    return docCommands.find(cmd) != docCommands.end();
-}
-
-bool FSM::isSectionCommand(const std::string& cmd) const {
-    static const std::unordered_set<std::string> secCommands = {
-        "section", "subsection", "subsubsection", "paragraph",
-        "subparagraph", "part", "chapter"
-    };
-    return secCommands.find(cmd) != secCommands.end();
-}
-
-bool FSM::isMathCommand(const std::string& cmd) const {
-    static const std::unordered_set<std::string> mathCommands = {
-        // Greek letters
-        "alpha", "beta", "gamma", "delta", "epsilon", "zeta", "eta", "theta",
-        "iota", "kappa", "lambda", "mu", "nu", "xi", "pi", "rho", "sigma",
-        "tau", "upsilon", "phi", "chi", "psi", "omega",
-        // Math operators
-        "sum", "int", "prod", "coprod", "bigcup", "bigcap", "frac", "sqrt",
-        "partial", "nabla", "infty", "lim", "sup", "inf",
-        // Math Relations
-        "leq", "geq", "equiv", "sim", "simeq", "approx", "propto",
-        // Math Environments
-        "equation", "align", "gather", "multline", "matrix", "cases",
-        // Math fonts
-        "mathbf", "mathcal", "mathit", "mathrm", "mathsf", "mathtt"
-    };
-    return mathCommands.find(cmd) != mathCommands.end();
-}
-
-bool FSM::isTheoremCommand(const std::string& cmd) const {
-    static const std::unordered_set<std::string> theoremCommands = {
-        "theorem", "lemma", "proposition", "corollary", "definition",
-        "remark", "proof", "example", "notation", "claim"
-    };
-    return theoremCommands.find(cmd) != theoremCommands.end();
-}
-
-bool FSM::isFloatCommand(const std::string& cmd) const {
-    static const std::unordered_set<std::string> floatCommands = {
-        "figure", "table", "algorithm", "listing",
-        "includegraphics", "caption", "subfigure", "subfloat"
-    };
-    return floatCommands.find(cmd) != floatCommands.end();
-}
-
-bool FSM::isCitationCommand(const std::string& cmd) const {
-    static const std::unordered_set<std::string> citeCommands = {
-        "cite", "citep", "citet", "citeyear", "citeauthor",
-        "bibliographystyle", "bibliography", "bibitem"
-    };
-    return citeCommands.find(cmd) != citeCommands.end();
-}
-
-bool FSM::isReferenceCommand(const std::string& cmd) const {
-    static const std::unordered_set<std::string> refCommands = {
-        "label", "ref", "eqref", "pageref", "autoref", "cref"
-    };
-    return refCommands.find(cmd) != refCommands.end();
-}
-
 FSM::FSMState FSM::getCurrentState() const {
     return currentState;
 }
 
-bool FSM::isInEnvironment(const std::string& env) const {
-    return context.isInEnvironment(env);
+bool FSM::isInEnvironment(EnvironmentId id) const {
+    return context.isInEnvironment(id);
 }
@@ -14,10 +14,17 @@
 #include <unordered_map>
 #include <set>
 #include <stack>
+#include <cstdint>
+#include <initializer_list>
 #include <nlohmann/json.hpp>
 #include "ast.h" 
+#include "small_vector.h"
+#include "environment.h"
 #include "dag_node.h" 
 #include "ner.h"
+#include "chunk_writer.h"
+#include "json_writer.h"
+#include "chunker.h"
 
 class ASTNode;
 
@@ -91,18 +98,38 @@ public:
 
     FSM();
     
-    void traverseAST(const std::shared_ptr<ASTNode>& node, std::string& currentChunk, 
-                    std::vector<std::string>& chunks);
-    nlohmann::json chunkDocumentToJson(const std::shared_ptr<ASTNode>& root);
-    std::vector<std::string> chunkDocument(const std::shared_ptr<ASTNode>& root);
+    // Finished chunks go to the sink as each section header closes one; the
+    // text after the last header stays in the builder.
+    void traverseAST(ASTNode* node, ChunkBuilder& chunk, ChunkSink& sink);
+    // The document JSON; its content is the FSM output re-chunked to the
+    // token budget in options, each entry with its section path.
+    nlohmann::json chunkDocumentToJson(ASTNode* root, const TokenChunker::Options& options = TokenChunker::Options());
+    void writeDocumentJson(ASTNode* root, JsonWriter& writer,
+                           const TokenChunker::Options& options = TokenChunker::Options());
+    void chunkDocument(ASTNode* root, ChunkSink& sink);
+    std::vector<std::string> chunkDocument(ASTNode* root);
     DAG& getDAG();
+    // Problems met while walking the tree; the walk itself never throws them.
+    const DiagnosticSink& getDiagnostics() const { return diagnostics; }
     
     std::string getCurrentContext() const;
     FSMState getCurrentState() const;
 
+    // Transition checking policies, defined below the class from the
+    // compile-time rule table. Release builds (NDEBUG) may select the no-check
+    // policy with FSM_UNCHECKED_TRANSITIONS; debug builds always validate.
+    struct CheckedTransitions;
+    struct UncheckedTransitions;
+#if defined(NDEBUG) && defined(FSM_UNCHECKED_TRANSITIONS)
+    using TransitionPolicy = UncheckedTransitions;
+#else
+    using TransitionPolicy = CheckedTransitions;
+#endif
+
+    static constexpr std::size_t stateCount = static_cast<std::size_t>(FSMState::InCrossRef) + 1;
+
 private:
     FSMState currentState;
-    static const std::unordered_map<FSMState, std::set<FSMState>> validTransitions;
     
     struct ParserContext {
         std::vector<json> semanticChunks;
@@ -117,27 +144,17 @@ private:
         }
 
         std::shared_ptr<DAGNode> currentNode;
-        std::unordered_map<std::string, std::shared_ptr<DAGNode>> labeledNodes;
         std::shared_ptr<DAGNode> getCurrentNode() const { return currentNode; }
         void setCurrentNode(std::shared_ptr<DAGNode> node) { currentNode = node; }
     
-        void addLabeledNode(const std::string& label, std::shared_ptr<DAGNode> node) {
-            labeledNodes[label] = node;
-        }
-    
-        std::shared_ptr<DAGNode> getLabeledNode(const std::string& label) const {
-            auto it = labeledNodes.find(label);
-            return it != labeledNodes.end() ? it->second : nullptr;
-        }
-    
 
-        std::stack<std::string> environmentStack;
-        std::unordered_map<std::string, std::shared_ptr<ASTNode>> labels;
+        std::stack<std::pair<EnvironmentId, std::string_view>> environmentStack;
+        std::unordered_map<std::string, ASTNode*> labels;
         std::vector<std::string> citations;
         
-        void pushEnvironment(const std::string& env);
+        void pushEnvironment(EnvironmentId id, std::string_view name);
         void popEnvironment();
-        bool isInEnvironment(const std::string& env) const;
+        bool isInEnvironment(EnvironmentId id) const;
     };
 
     void handleError(const std::string& context, const std::exception& e);
@@ -147,26 +164,44 @@ private:
     std::shared_ptr<DAGNode> currentEnvironmentNode;
 
     bool isTransitionValid(FSMState from, FSMState to) const;
-    void validateStateTransition(FSMState newState);
-    void setState(FSMState newState);
-    bool isValidStructure(const std::shared_ptr<ASTNode>& node) const;
+    // Returns false and leaves the state unchanged on a transition Policy
+    // rejects.
+    template <typename Policy = TransitionPolicy>
+    bool setState(FSMState newState);
+    void report(DiagnosticCode code);
+    bool isValidStructure(ASTNode* node) const;
+    bool enterNode(ASTNode* node, ChunkBuilder& chunk, ChunkSink& sink);
+    void leaveNode(ASTNode* node, ChunkBuilder& chunk);
 
     void handleEmailCommand(const std::string& cmdArgs);
-    void handleDocument(const std::shared_ptr<ASTNode>& node, std::string& currentChunk);
-    void handleSection(const std::shared_ptr<ASTNode>& node, std::string& currentChunk, std::vector<std::string>& chunks);
-    void handleCommand(const std::shared_ptr<ASTNode>& node, std::string& currentChunk);
-    void handleText(const std::shared_ptr<ASTNode>& node, std::string& currentChunk);
-    void handleEnvironment(const std::shared_ptr<ASTNode>& node, std::string& currentChunk);
-    void handleMath(const std::shared_ptr<ASTNode>& node, std::string& currentChunk);
+    void handleDocument(ASTNode* node, ChunkBuilder& chunk);
+    void handleSection(ASTNode* node, ChunkBuilder& chunk, ChunkSink& sink);
+    void handleCommand(ASTNode* node, ChunkBuilder& chunk);
+    void handleText(ASTNode* node, ChunkBuilder& chunk);
+    void handleEnvironment(ASTNode* node, ChunkBuilder& chunk);
+    void finishEnvironment(ASTNode* node, ChunkBuilder& chunk);
+    void handleMath(ASTNode* node, ChunkBuilder& chunk);
 
     void handleAuthorCommand(const std::string& args);
     void handleAffiliationCommand(const std::string& args);
     void handleCitationCommand(const std::string& args);
-    void handleFloatEnvironment(const std::string& type, const std::shared_ptr<ASTNode>& node, std::string& currentChunk);
-    void handleAbstractEnvironment(const std::shared_ptr<ASTNode>& node, std::string& currentChunk);
+    void handleFloatEnvironment(const std::string& type, ASTNode* node, ChunkBuilder& chunk);
+    void handleAbstractEnvironment(ASTNode* node, ChunkBuilder& chunk);
 
     std::shared_ptr<DAGNode> createOrGetDAGNode(const std::string& content, ASTNode::NodeType astType);
 
+    // Authors and their affiliations for the document's metadata block;
+    // affiliation ids are 1-based positions in affiliations.
+    struct DocumentMetadata {
+        struct AuthorEntry {
+            std::string name;
+            std::vector<int> affiliations;
+        };
+        std::vector<std::string> affiliations;
+        std::vector<AuthorEntry> authors;
+    };
+    DocumentMetadata collectMetadata();
+
     std::string extractAuthorName(const std::string& authorCommand);
     std::vector<std::string> extractMultipleAuthors(const std::string& authorTexCommand);
     std::string extractAffiliation(const std::string& affiliationCommand);
@@ -174,7 +209,7 @@ private:
     std::string extractGraphicsFile(const std::string& graphicsCommand);
     std::string extractFigureCaption(const std::string& captionCommand);
     std::string extractCitationLabel(const std::string& citationCommand);
-    std::string extractContentBetweenBraces(const std::string& str, size_t start_pos);
+    std::string extractContentBetweenBraces(std::string_view str, size_t start_pos);
 
     void parseInstitutions(const std::string& instituteBlock, 
                           std::unordered_map<std::string, std::string>& affiliationMap);
@@ -186,22 +221,15 @@ private:
     void linkUnlabeledAffiliations(std::vector<Author>& authors, std::vector<std::string>& unlabeledAffiliations);
 
 
-    bool isDocumentCommand(const std::string& cmd) const;
-    bool isSectionCommand(const std::string& cmd) const;
-    bool isMathCommand(const std::string& cmd) const;
-    bool isTheoremCommand(const std::string& cmd) const;
-    bool isFloatCommand(const std::string& cmd) const;
-    bool isCitationCommand(const std::string& cmd) const;
-    bool isReferenceCommand(const std::string& cmd) const;
-
-    void handleDocumentCommand(const std::string& cmd, const std::vector<std::string>& args, std::string& currentChunk) ;   
-    void handleSectioningCommand(const std::string& cmd, const std::vector<std::string>& args, std::string& currentChunk);
-    void handleMathematicalContent(const std::string& cmd, const std::vector<std::string>& args, std::string& currentChunk);
-    void handleTheoremEnvironment(const std::string& cmd, const std::vector<std::string>& args, std::string& currentChunk);
-    void handleFloatEnvironment(const std::string& cmd, const std::vector<std::string>& args, std::string& currentChunk);
-    void handleCitationCommand(const std::string& cmd, const std::vector<std::string>& args, std::string& currentChunk);
-    void handleReferenceCommand(const std::string& cmd, const std::vector<std::string>& args, std::string& currentChunk);
-    void handleGenericCommand(const std::string& cmd, const std::string& cmdOpts, const std::vector<std::string>& args, std::string& currentChunk);
+    void handleDocumentCommand(const CommandRecord& command, ChunkBuilder& chunk);
+    void handleSectioningCommand(const CommandRecord& command, ChunkBuilder& chunk);
+    void handleMathematicalContent(const CommandRecord& command, ChunkBuilder& chunk);
+    void handleTheoremEnvironment(const CommandRecord& command, ChunkBuilder& chunk);
+    void handleFloatEnvironment(const CommandRecord& command, ChunkBuilder& chunk);
+    void handleCitationCommand(const CommandRecord& command, ChunkBuilder& chunk);
+    void handleReferenceCommand(const CommandRecord& command, const ASTNode::NodeList& targets,
+                                ChunkBuilder& chunk);
+    void handleGenericCommand(const CommandRecord& command, ChunkBuilder& chunk);
     
     std::string removeInvalidUTF8(const std::string& input);
     std::string cleanAuthor(const std::string& author);
@@ -215,20 +243,22 @@ private:
     void addAffiliationNode(std::shared_ptr<DAGNode> authorNode, const std::string& label);
     void addAffiliationNode(std::shared_ptr<DAGNode> authorNode, int index);
     void handleStateChange(FSMState oldState, FSMState newState);
-    std::string getStateName(FSMState state) const;
+    static const char* getStateName(FSMState state);
 
     ParserContext context;
+    DiagnosticSink diagnostics;
+    const ASTNode* currentNode = nullptr;
     std::unordered_map<std::string, std::string> affiliationMap;
     std::vector<Author> authors;
     std::vector<std::string> unlabeledAffiliations;
     DAG dag;
     NER ner;
-    bool insideAuthorBlock;
+    bool insideAuthorBlock = false;
     std::string authorBlockContent;
-    bool insideInstituteBlock;
+    bool insideInstituteBlock = false;
     std::string instituteBlockContent;
 
-    bool isInEnvironment(const std::string& env) const;
+    bool isInEnvironment(EnvironmentId id) const;
 
 struct DAGContext {
     std::shared_ptr<DAGNode> currentSection;
@@ -252,4 +282,111 @@ struct DAGContext {
 
 };
 
+// Transition rules, one row per source state. The bit matrix the FSM checks
+// against is built from this table at compile time.
+namespace fsm_rules {
+
+using State = FSM::FSMState;
+
+constexpr std::size_t index(State state) { return static_cast<std::size_t>(state); }
+constexpr uint64_t bit(State state) { return uint64_t(1) << index(state); }
+
+constexpr uint64_t states(std::initializer_list<State> list) {
+    uint64_t mask = 0;
+    for (State state : list) {
+        mask |= bit(state);
+    }
+    return mask;
+}
+
+struct Rule {
+    State from;
+    uint64_t to;
+};
+
+constexpr Rule rules[] = {
+    {State::Start, states({State::InDocument, State::InCommand})},
+    {State::InDocument, states({State::InDocument, State::InSection, State::InCommand, State::InText,
+                                State::InMath, State::InAuthor, State::InAbstract, State::InEnvironment})},
+    {State::InSection, states({State::InSection, State::InText, State::InCommand, State::InMath,
+                               State::InEnvironment})},
+    {State::InCommand, states({State::InCommand, State::InDocument, State::InSection, State::InText,
+                               State::InAuthor, State::InAffiliation, State::InMath, State::InEnvironment,
+                               State::InEquation, State::InAbstract})},
+    {State::InText, states({State::InText, State::InCommand, State::InMath, State::InSection,
+                            State::InEnvironment})},
+    {State::InEnvironment, states({State::InEnvironment, State::InText, State::InCommand, State::InMath,
+                                   State::InFigure, State::InTable, State::InAbstract})},
+    {State::InEquation, states({State::InEquation, State::InText, State::InMath})},
+    {State::InMath, states({State::InMath, State::InText, State::InDocument, State::InEquation,
+                            State::InCommand, State::InEnvironment})},
+    {State::InFigure, states({State::InFigure, State::InText, State::InCommand, State::InEnvironment})},
+    {State::InTable, states({State::InTable, State::InText, State::InCommand, State::InEnvironment})},
+    {State::InAuthor, states({State::InAuthor, State::InAffiliation, State::InText, State::InCommand,
+                              State::InEnvironment})},
+    {State::InAffiliation, states({State::InAffiliation, State::InAuthor, State::InText, State::InCommand,
+                                   State::InEnvironment})},
+    {State::InAbstract, states({State::InAbstract, State::InText, State::InCommand, State::InMath,
+                                State::InEnvironment})},
+};
+
+struct Matrix {
+    uint64_t rows[FSM::stateCount];
+};
+
+constexpr Matrix buildMatrix() {
+    Matrix matrix{};
+    for (const Rule& rule : rules) {
+        matrix.rows[index(rule.from)] |= rule.to;
+    }
+    return matrix;
+}
+
+constexpr Matrix matrix = buildMatrix();
+
+constexpr uint64_t sources() {
+    uint64_t mask = 0;
+    for (const Rule& rule : rules) {
+        mask |= bit(rule.from);
+    }
+    return mask;
+}
+
+constexpr uint64_t targets() {
+    uint64_t mask = 0;
+    for (const Rule& rule : rules) {
+        mask |= rule.to;
+    }
+    return mask;
+}
+
+constexpr uint64_t reachableFromStart() {
+    uint64_t reached = bit(State::Start);
+    for (uint64_t previous = 0; previous != reached;) {
+        previous = reached;
+        for (std::size_t i = 0; i < FSM::stateCount; ++i) {
+            if (reached >> i & 1) {
+                reached |= matrix.rows[i];
+            }
+        }
+    }
+    return reached;
+}
+
+static_assert(FSM::stateCount <= 64, "transition rows are 64-bit masks");
+static_assert((sources() & ~reachableFromStart()) == 0, "a state with rules cannot be reached from Start");
+static_assert((targets() & ~sources()) == 0, "a reachable state has no rules to leave it");
+
+}
+
+struct FSM::CheckedTransitions {
+    static constexpr bool allows(FSMState from, FSMState to) {
+        return fsm_rules::matrix.rows[fsm_rules::index(from)] >> fsm_rules::index(to) & 1;
+    }
+};
+
+struct FSM::UncheckedTransitions {
+    static constexpr bool allows(FSMState, FSMState) { return true; }
+};
+
 #endif
@@ -0,0 +1,464 @@
+#include "include_resolver.h"
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <system_error>
+#include <thread>
+#include "log_capture.h"
+#include "manifest.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+bool isLetter(char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+bool isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+std::string_view trimmed(std::string_view value) {
+	while (!value.empty() && isSpace(value.front())) {
+		value.remove_prefix(1);
+	}
+	while (!value.empty() && isSpace(value.back())) {
+		value.remove_suffix(1);
+	}
+	return value;
+}
+
+// Spaces after a control word, and at most one line end among them.
+std::size_t skipSpaces(std::string_view text, std::size_t i) {
+	bool lineEnd = false;
+	while (i < text.size() && isSpace(text[i])) {
+		if (text[i] == '\n') {
+			if (lineEnd) {
+				break;
+			}
+			lineEnd = true;
+		}
+		i++;
+	}
+	return i;
+}
+
+// A non-empty {group} at i: its trimmed content, and i moved past it.
+bool braceArgument(std::string_view text, std::size_t& i, std::string& argument) {
+	if (i >= text.size() || text[i] != '{') {
+		return false;
+	}
+	std::size_t close = text.find('}', i + 1);
+	if (close == std::string_view::npos) {
+		return false;
+	}
+	std::string_view content = trimmed(text.substr(i + 1, close - i - 1));
+	if (content.empty()) {
+		return false;
+	}
+	argument = std::string(content);
+	i = close + 1;
+	return true;
+}
+
+// \input's plain TeX form: a file name ended by a space or a special
+// character.
+bool bareArgument(std::string_view text, std::size_t& i, std::string& argument) {
+	std::size_t end = i;
+	while (end < text.size() && !isSpace(text[end]) && text[end] != '{' && text[end] != '}' && text[end] != '%' &&
+	       text[end] != '\\') {
+		end++;
+	}
+	if (end == i) {
+		return false;
+	}
+	argument = std::string(text.substr(i, end - i));
+	i = end;
+	return true;
+}
+
+// The directive for control word name, whose arguments start at i.
+bool matchDirective(std::string_view text, std::string_view name, std::size_t i, IncludeDirective& directive) {
+	using Kind = IncludeDirective::Kind;
+	if (name == "begin" || name == "end") {
+		constexpr std::string_view document = "{document}";
+		if (text.substr(i, document.size()) != document) {
+			return false;
+		}
+		directive.kind = name == "begin" ? Kind::BeginDocument : Kind::EndDocument;
+		directive.end = i + document.size();
+		return true;
+	}
+
+	if (name == "input" || name == "include" || name == "subfile") {
+		directive.kind = name == "input" ? Kind::Input : name == "include" ? Kind::Include : Kind::Subfile;
+		i = skipSpaces(text, i);
+		if (!braceArgument(text, i, directive.name) &&
+		    !(directive.kind == Kind::Input && bareArgument(text, i, directive.name))) {
+			return false;
+		}
+		directive.end = i;
+		return true;
+	}
+
+	bool import = name == "import" || name == "inputfrom" || name == "includefrom";
+	bool subimport = name == "subimport" || name == "subinputfrom" || name == "subincludefrom";
+	if (!import && !subimport) {
+		return false;
+	}
+	directive.kind = import ? Kind::Import : Kind::Subimport;
+	if (i < text.size() && text[i] == '*') {
+		i++;
+	}
+	i = skipSpaces(text, i);
+	if (!braceArgument(text, i, directive.directory)) {
+		return false;
+	}
+	i = skipSpaces(text, i);
+	if (!braceArgument(text, i, directive.name)) {
+		return false;
+	}
+	directive.end = i;
+	return true;
+}
+
+fs::path withExtension(fs::path path) {
+	if (!path.has_extension()) {
+		path += ".tex";
+	}
+	return path.lexically_normal();
+}
+
+struct PendingFile {
+	std::shared_ptr<const ScannedSource> scanned;
+	// What loading wrote, replayed when the walk reaches the file.
+	CapturedLog log;
+	std::string error;
+	bool fromCache = false;
+};
+
+std::shared_ptr<const ScannedSource> scanLoaded(LoadedSource source) {
+	auto scanned = std::make_shared<ScannedSource>();
+	scanned->directives = scanIncludes(source.text());
+	scanned->source = std::move(source);
+	return scanned;
+}
+
+PendingFile loadFile(const fs::path& path, SourceCache* cache) {
+	PendingFile file;
+	LogCapture capture(file.log);
+	try {
+		std::shared_ptr<const SourceBuffer> mapped = SourceBuffer::mapFile(path.string());
+		if (cache) {
+			file.scanned = cache->load(std::move(mapped), file.fromCache);
+		} else {
+			file.scanned = scanLoaded(loadSource(std::move(mapped)));
+		}
+	} catch (const std::exception& e) {
+		file.error = e.what();
+	}
+	return file;
+}
+
+// Depth-first walk in document order; the graph's parts are built here and
+// handed over at the end.
+class Walk {
+public:
+	Walk(const fs::path& mainFile, const IncludeResolver::Options& options)
+	    : root(mainFile.parent_path()), options(options) {}
+
+	enum class Mode { Main, Included, Body };
+
+	std::vector<IncludeGraph::File> files;
+	std::vector<std::string_view> slices;
+	std::size_t bytes = 0;
+	std::vector<fs::path> missing;
+
+	void visit(const fs::path& path, Mode mode) {
+		std::size_t index = files.size();
+		visited.emplace(path, index);
+		files.push_back(IncludeGraph::File{path, nullptr, {}, false});
+
+		// A main file is the paper's own; only included ones are worth caching.
+		PendingFile file = take(path, mode == Mode::Main ? nullptr : options.cache);
+		std::cout << file.log.out;
+		std::cerr << file.log.err;
+		if (!file.error.empty()) {
+			std::cerr << file.error << "\n";
+			return;
+		}
+		const LoadedSource& source = file.scanned->source;
+		std::cout << "Detected LaTeX encoding in file " << path << ": "
+		          << (source.declaredEncoding.empty() ? "UTF-8" : source.declaredEncoding) << "\n";
+		if (!source.convertedFrom.empty()) {
+			std::cout << "Converting file " << path << " from " << source.convertedFrom << " to UTF-8\n";
+		}
+		std::string_view text = source.text();
+		if (text.empty()) {
+			if (!source.convertedFrom.empty()) {
+				std::cerr << "Failed to convert file to UTF-8: " << path << "\n";
+			}
+			return;
+		}
+		files[index].scanned = file.scanned;
+		files[index].fromCache = file.fromCache;
+
+		const std::vector<IncludeDirective>& directives = file.scanned->directives;
+		std::vector<fs::path> targets(directives.size());
+		std::vector<fs::path> wanted;
+		for (std::size_t k = 0; k < directives.size(); ++k) {
+			if (directives[k].isInclude()) {
+				targets[k] = locate(directives[k], path.parent_path());
+				if (!targets[k].empty()) {
+					wanted.push_back(targets[k]);
+				}
+			}
+		}
+		prefetch(wanted);
+
+		std::size_t cursor = 0;
+		std::size_t stop = text.size();
+		if (mode == Mode::Body) {
+			bodyBounds(directives, cursor, stop);
+		}
+		for (std::size_t k = 0; k < directives.size(); ++k) {
+			const IncludeDirective& directive = directives[k];
+			if (directive.begin < cursor || directive.end > stop) {
+				continue;
+			}
+			if (!directive.isInclude()) {
+				if (mode != Mode::Main) {
+					emit(text.substr(cursor, directive.begin - cursor));
+					cursor = directive.end;
+				}
+				continue;
+			}
+			if (targets[k].empty()) {
+				std::cerr << "Included file not found: " << withExtension(searchBase(directive, path.parent_path()) /
+				                                                           directive.name)
+				          << "\n";
+				continue;
+			}
+			emit(text.substr(cursor, directive.begin - cursor));
+			cursor = directive.end;
+			auto seen = visited.find(targets[k]);
+			if (seen != visited.end()) {
+				files[index].includes.push_back(seen->second);
+				continue;
+			}
+			files[index].includes.push_back(files.size());
+			visit(targets[k], directive.kind == IncludeDirective::Kind::Subfile ? Mode::Body : Mode::Included);
+		}
+		emit(text.substr(cursor, stop - cursor));
+	}
+
+private:
+	fs::path root;
+	const IncludeResolver::Options& options;
+	std::map<fs::path, std::size_t> visited;
+	std::map<fs::path, PendingFile> pending;
+
+	void emit(std::string_view slice) {
+		if (!slice.empty()) {
+			slices.push_back(slice);
+			bytes += slice.size();
+		}
+	}
+
+	// Where the directive's name is looked up first.
+	fs::path searchBase(const IncludeDirective& directive, const fs::path& base) const {
+		switch (directive.kind) {
+			case IncludeDirective::Kind::Import: return root / directive.directory;
+			case IncludeDirective::Kind::Subimport: return base / directive.directory;
+			default: return base;
+		}
+	}
+
+	fs::path locate(const IncludeDirective& directive, const fs::path& base) {
+		fs::path candidate = withExtension(searchBase(directive, base) / directive.name);
+		if (exists(candidate)) {
+			return candidate;
+		}
+		if (directive.kind != IncludeDirective::Kind::Import && directive.kind != IncludeDirective::Kind::Subimport &&
+		    base != root) {
+			candidate = withExtension(root / directive.name);
+			if (exists(candidate)) {
+				return candidate;
+			}
+		}
+		return fs::path();
+	}
+
+	// Notes a path looked up in vain: a file created there later would
+	// change the combined input.
+	bool exists(const fs::path& candidate) {
+		std::error_code ec;
+		if (fs::exists(candidate, ec)) {
+			return true;
+		}
+		fs::path normal = candidate.lexically_normal();
+		if (std::find(missing.begin(), missing.end(), normal) == missing.end()) {
+			missing.push_back(normal);
+		}
+		return false;
+	}
+
+	// A subfile's text between its \begin{document} and \end{document}, or
+	// all of it without them.
+	static void bodyBounds(const std::vector<IncludeDirective>& directives, std::size_t& cursor, std::size_t& stop) {
+		for (const auto& directive : directives) {
+			if (directive.kind == IncludeDirective::Kind::BeginDocument && cursor == 0) {
+				cursor = directive.end;
+			} else if (directive.kind == IncludeDirective::Kind::EndDocument && cursor > 0) {
+				stop = directive.begin;
+				return;
+			}
+		}
+	}
+
+	PendingFile take(const fs::path& path, SourceCache* cache) {
+		auto it = pending.find(path);
+		if (it == pending.end()) {
+			return loadFile(path, cache);
+		}
+		PendingFile file = std::move(it->second);
+		pending.erase(it);
+		return file;
+	}
+
+	// Loads the files a file names on several threads at once; with just
+	// one, it is loaded when the walk gets to it.
+	void prefetch(const std::vector<fs::path>& paths) {
+		std::vector<fs::path> wanted;
+		for (const auto& path : paths) {
+			if (!visited.count(path) && !pending.count(path) &&
+			    std::find(wanted.begin(), wanted.end(), path) == wanted.end()) {
+				wanted.push_back(path);
+			}
+		}
+		std::size_t threadCount = std::min(options.prefetchThreads, wanted.size());
+		if (threadCount < 2) {
+			return;
+		}
+
+		std::vector<PendingFile> loaded(wanted.size());
+		std::atomic<std::size_t> next{0};
+		auto work = [&]() {
+			for (std::size_t k = next++; k < wanted.size(); k = next++) {
+				loaded[k] = loadFile(wanted[k], options.cache);
+			}
+		};
+		std::vector<std::thread> workers;
+		for (std::size_t t = 1; t < threadCount; ++t) {
+			try {
+				workers.emplace_back(work);
+			} catch (const std::system_error& e) {
+				std::cerr << "Warning: could not start prefetch thread: " << e.what() << "\n";
+				break;
+			}
+		}
+		work();
+		for (auto& worker : workers) {
+			worker.join();
+		}
+		for (std::size_t k = 0; k < wanted.size(); ++k) {
+			pending.emplace(wanted[k], std::move(loaded[k]));
+		}
+	}
+};
+
+}
+
+std::vector<IncludeDirective> scanIncludes(std::string_view text) {
+	std::vector<IncludeDirective> directives;
+	std::size_t i = text.find_first_of("\\%");
+	while (i != std::string_view::npos) {
+		if (text[i] == '%') {
+			i = text.find('\n', i);
+			if (i == std::string_view::npos) {
+				break;
+			}
+		} else {
+			std::size_t nameEnd = i + 1;
+			while (nameEnd < text.size() && isLetter(text[nameEnd])) {
+				nameEnd++;
+			}
+			if (nameEnd == i + 1) {
+				// \\, \% and other control symbols.
+				nameEnd = std::min(i + 2, text.size());
+			} else {
+				IncludeDirective directive{IncludeDirective::Kind::Input, i, nameEnd, std::string(), std::string()};
+				if (matchDirective(text, text.substr(i + 1, nameEnd - i - 1), nameEnd, directive)) {
+					directives.push_back(std::move(directive));
+					nameEnd = directives.back().end;
+				}
+			}
+			i = nameEnd;
+		}
+		i = text.find_first_of("\\%", i);
+	}
+	return directives;
+}
+
+SourceCache::SourceCache(std::size_t capacityBytes, std::size_t maxFileBytes)
+    : capacityBytes(capacityBytes), maxFileBytes(maxFileBytes) {}
+
+std::shared_ptr<const ScannedSource> SourceCache::load(std::shared_ptr<const SourceBuffer> mapped, bool& hit) {
+	hit = false;
+	if (mapped->size() > maxFileBytes || mapped->size() > capacityBytes) {
+		return scanLoaded(loadSource(std::move(mapped)));
+	}
+	std::string key = Manifest::hashContent(mapped->view());
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = entries.find(key);
+		if (it != entries.end()) {
+			stats.hits++;
+			hit = true;
+			return it->second;
+		}
+		if (stats.bytes + mapped->size() > capacityBytes) {
+			return scanLoaded(loadSource(std::move(mapped)));
+		}
+	}
+
+	LoadedSource source = loadSource(std::move(mapped));
+	if (source.buffer->isMapped()) {
+		source.buffer = SourceBuffer::fromString(std::string(source.text()));
+	}
+	std::shared_ptr<const ScannedSource> scanned = scanLoaded(std::move(source));
+	std::lock_guard<std::mutex> lock(mutex);
+	std::size_t size = scanned->source.text().size();
+	if (stats.bytes + size <= capacityBytes && entries.emplace(key, scanned).second) {
+		stats.files++;
+		stats.bytes += size;
+	}
+	return scanned;
+}
+
+SourceCache::Stats SourceCache::getStats() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return stats;
+}
+
+std::string IncludeGraph::assemble() const {
+	std::string text;
+	text.reserve(bytes);
+	for (std::string_view slice : slices) {
+		text.append(slice);
+	}
+	return text;
+}
+
+IncludeGraph IncludeResolver::resolve(const fs::path& mainFile, const Options& options) {
+	Walk walk(mainFile, options);
+	walk.visit(mainFile.lexically_normal(), Walk::Mode::Main);
+	IncludeGraph graph;
+	graph.files = std::move(walk.files);
+	graph.slices = std::move(walk.slices);
+	graph.bytes = walk.bytes;
+	graph.missing = std::move(walk.missing);
+	return graph;
+}
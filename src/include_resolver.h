@@ -0,0 +1,128 @@
+#ifndef INCLUDE_RESOLVER_H
+#define INCLUDE_RESOLVER_H
+
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "source_loader.h"
+
+// A command in a source file that pulls in another file or marks the
+// document body: \input{name} or \input name, \include{name},
+// \subfile{name}, the import package's \import{dir}{name} and
+// \subimport{dir}{name} (and their inputfrom/includefrom spellings), and
+// \begin{document} and \end{document}.
+struct IncludeDirective {
+	enum class Kind { Input, Include, Subfile, Import, Subimport, BeginDocument, EndDocument };
+
+	Kind kind;
+	// The command's bytes in the file, from its backslash.
+	std::size_t begin;
+	std::size_t end;
+	// For the import kinds, the directory argument.
+	std::string directory;
+	std::string name;
+
+	bool isInclude() const { return kind != Kind::BeginDocument && kind != Kind::EndDocument; }
+};
+
+// One pass over text that matches the commands above by hand; commands in
+// comments and escaped backslashes are skipped.
+std::vector<IncludeDirective> scanIncludes(std::string_view text);
+
+// A file as loaded and scanned, which does not depend on where it lives.
+struct ScannedSource {
+	LoadedSource source;
+	std::vector<IncludeDirective> directives;
+};
+
+// Scanned files shared across papers, keyed by a hash of their raw bytes,
+// so that a style or boilerplate file many papers include (a macros file,
+// a conference template) is converted and scanned once. Entries own a copy
+// of their text rather than holding the first paper's mapping. Files over
+// maxFileBytes are not cached, and once capacityBytes are held nothing more
+// is added. Thread-safe.
+class SourceCache {
+public:
+	struct Stats {
+		std::size_t hits = 0;
+		std::size_t files = 0;
+		std::size_t bytes = 0;
+	};
+
+	explicit SourceCache(std::size_t capacityBytes, std::size_t maxFileBytes = 256 * 1024);
+
+	// Loads and scans the mapped file, or returns the entry for a file with
+	// the same bytes.
+	std::shared_ptr<const ScannedSource> load(std::shared_ptr<const SourceBuffer> mapped, bool& hit);
+
+	Stats getStats() const;
+
+private:
+	std::size_t capacityBytes;
+	std::size_t maxFileBytes;
+	mutable std::mutex mutex;
+	std::unordered_map<std::string, std::shared_ptr<const ScannedSource>> entries;
+	Stats stats;
+};
+
+// The files of one paper and how they include each other, read from its
+// main file, and the combined input as slices of those files in document
+// order: the text between include commands, each included file's slices in
+// place of the command that names it. A file already included is not
+// included again; a command naming a file that does not exist is kept as
+// text. Included files lose their \begin{document} and \end{document}
+// lines; a \subfile contributes only its document body.
+class IncludeGraph {
+public:
+	struct File {
+		std::filesystem::path path;
+		std::shared_ptr<const ScannedSource> scanned;
+		// Indices of the files it includes, in order.
+		std::vector<std::size_t> includes;
+		bool fromCache = false;
+	};
+
+	const std::vector<File>& getFiles() const { return files; }
+	const std::vector<std::string_view>& getSlices() const { return slices; }
+	// Paths an include was looked up at and not found, in the order tried,
+	// including the first place a name was looked for when it was found in
+	// the main file's directory instead.
+	const std::vector<std::filesystem::path>& getMissing() const { return missing; }
+	std::size_t size() const { return bytes; }
+	bool empty() const { return bytes == 0; }
+	// The slices copied into one string.
+	std::string assemble() const;
+
+private:
+	friend class IncludeResolver;
+
+	std::vector<File> files;
+	std::vector<std::string_view> slices;
+	std::vector<std::filesystem::path> missing;
+	std::size_t bytes = 0;
+};
+
+// Builds a paper's IncludeGraph. Names resolve against the including file's
+// directory, then the main file's; \import directories against the main
+// file's and \subimport ones against the including file's. A name without
+// an extension gets .tex. When a file names several others, they are loaded
+// on up to prefetchThreads threads at once before the first is walked.
+// Logs each file's encoding as it is reached, and missing or unreadable
+// files, in document order.
+class IncludeResolver {
+public:
+	struct Options {
+		std::size_t prefetchThreads = 4;
+		// Shared across papers; null loads every file afresh.
+		SourceCache* cache = nullptr;
+	};
+
+	static IncludeGraph resolve(const std::filesystem::path& mainFile, const Options& options);
+};
+
+#endif
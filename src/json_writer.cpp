@@ -0,0 +1,210 @@
+#include "json_writer.h"
+#include <charconv>
+#include <cstring>
+
+namespace {
+
+constexpr uint64_t ones = 0x0101010101010101ULL;
+constexpr uint64_t highs = ones * 0x80;
+
+// True when any of the eight bytes is a control character, a quote, a
+// backslash or part of a multi-byte sequence; plain ASCII words are copied
+// without looking at single bytes.
+bool needsAttention(uint64_t word) {
+	uint64_t quote = word ^ (ones * '"');
+	uint64_t backslash = word ^ (ones * '\\');
+	return (((word - ones * 0x20) & ~word) | ((quote - ones) & ~quote) | ((backslash - ones) & ~backslash) | word) &
+	       highs;
+}
+
+// Length of the well-formed UTF-8 sequence at p, or 0 for an overlong,
+// surrogate, out-of-range or truncated one.
+std::size_t sequenceLength(const char* p, const char* end) {
+	unsigned char lead = static_cast<unsigned char>(*p);
+	std::size_t length;
+	uint32_t codepoint;
+	uint32_t minimum;
+	if ((lead & 0xE0) == 0xC0) {
+		length = 2;
+		codepoint = lead & 0x1F;
+		minimum = 0x80;
+	} else if ((lead & 0xF0) == 0xE0) {
+		length = 3;
+		codepoint = lead & 0x0F;
+		minimum = 0x800;
+	} else if ((lead & 0xF8) == 0xF0) {
+		length = 4;
+		codepoint = lead & 0x07;
+		minimum = 0x10000;
+	} else {
+		return 0;
+	}
+	if (static_cast<std::size_t>(end - p) < length) {
+		return 0;
+	}
+	for (std::size_t i = 1; i < length; ++i) {
+		unsigned char next = static_cast<unsigned char>(p[i]);
+		if ((next & 0xC0) != 0x80) {
+			return 0;
+		}
+		codepoint = (codepoint << 6) | (next & 0x3F);
+	}
+	if (codepoint < minimum || codepoint > 0x10FFFF || (codepoint >= 0xD800 && codepoint <= 0xDFFF)) {
+		return 0;
+	}
+	return length;
+}
+
+}
+
+JsonWriter::JsonWriter(std::ostream& out, Style style, int indent) : out(out), style(style), indent(indent) {
+	buffer.reserve(flushBytes + flushBytes / 4);
+}
+
+JsonWriter::~JsonWriter() {
+	flush();
+}
+
+void JsonWriter::flush() {
+	if (!buffer.empty()) {
+		out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+		buffer.clear();
+	}
+}
+
+void JsonWriter::newline(std::size_t depth) {
+	buffer.push_back('\n');
+	buffer.append(depth * static_cast<std::size_t>(indent), ' ');
+}
+
+void JsonWriter::beginValue() {
+	if (afterKey) {
+		afterKey = false;
+		return;
+	}
+	if (levels.empty()) {
+		return;
+	}
+	Level& level = levels.back();
+	if (level.count++ > 0) {
+		buffer.push_back(',');
+	}
+	if (style == Style::Pretty) {
+		newline(levels.size());
+	}
+}
+
+void JsonWriter::key(std::string_view name) {
+	beginValue();
+	buffer.push_back('"');
+	appendEscaped(buffer, name);
+	buffer.append(style == Style::Pretty ? "\": " : "\":");
+	afterKey = true;
+}
+
+void JsonWriter::open(char bracket, bool object) {
+	beginValue();
+	buffer.push_back(bracket);
+	levels.push_back(Level{0, object});
+}
+
+void JsonWriter::close(char bracket) {
+	std::size_t count = levels.back().count;
+	levels.pop_back();
+	if (count > 0 && style == Style::Pretty) {
+		newline(levels.size());
+	}
+	buffer.push_back(bracket);
+	maybeFlush();
+}
+
+void JsonWriter::beginObject() {
+	open('{', true);
+}
+
+void JsonWriter::endObject() {
+	close('}');
+}
+
+void JsonWriter::beginArray() {
+	open('[', false);
+}
+
+void JsonWriter::endArray() {
+	close(']');
+}
+
+void JsonWriter::value(std::string_view text) {
+	beginValue();
+	buffer.push_back('"');
+	appendEscaped(buffer, text);
+	buffer.push_back('"');
+	maybeFlush();
+}
+
+void JsonWriter::value(int64_t number) {
+	beginValue();
+	char digits[24];
+	auto result = std::to_chars(digits, digits + sizeof(digits), number);
+	buffer.append(digits, result.ptr);
+}
+
+void JsonWriter::value(bool flag) {
+	beginValue();
+	buffer.append(flag ? "true" : "false");
+}
+
+void JsonWriter::null() {
+	beginValue();
+	buffer.append("null");
+}
+
+void JsonWriter::appendEscaped(std::string& out, std::string_view text) {
+	static const char hex[] = "0123456789abcdef";
+	const char* p = text.data();
+	const char* end = p + text.size();
+	const char* run = p;
+	while (p < end) {
+		if (end - p >= 8) {
+			uint64_t word;
+			std::memcpy(&word, p, sizeof(word));
+			if (!needsAttention(word)) {
+				p += 8;
+				continue;
+			}
+		}
+		unsigned char c = static_cast<unsigned char>(*p);
+		if (c >= 0x20 && c != '"' && c != '\\' && c < 0x80) {
+			++p;
+			continue;
+		}
+		if (c >= 0x80) {
+			std::size_t length = sequenceLength(p, end);
+			if (length > 0) {
+				p += length;
+				continue;
+			}
+		}
+
+		out.append(run, p);
+		switch (c) {
+			case '"': out.append("\\\""); break;
+			case '\\': out.append("\\\\"); break;
+			case '\b': out.append("\\b"); break;
+			case '\f': out.append("\\f"); break;
+			case '\n': out.append("\\n"); break;
+			case '\r': out.append("\\r"); break;
+			case '\t': out.append("\\t"); break;
+			default:
+				if (c < 0x20) {
+					char escape[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]};
+					out.append(escape, sizeof(escape));
+				} else {
+					out.append("\xEF\xBF\xBD");
+				}
+				break;
+		}
+		run = ++p;
+	}
+	out.append(run, p);
+}
@@ -0,0 +1,82 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include "chunk_writer.h"
+#include "small_vector.h"
+
+// Event-style JSON output: values are written to a buffered stream as they
+// are produced, so nothing of the document is held but the current nesting.
+// Pretty output matches nlohmann::json::dump(4) and compact output dump(),
+// which keeps files written either way interchangeable for readers.
+class JsonWriter {
+public:
+	enum class Style { Compact, Pretty };
+
+	explicit JsonWriter(std::ostream& out, Style style = Style::Pretty, int indent = 4);
+	~JsonWriter();
+	JsonWriter(const JsonWriter&) = delete;
+	JsonWriter& operator=(const JsonWriter&) = delete;
+
+	void beginObject();
+	void endObject();
+	void beginArray();
+	void endArray();
+	// Inside an object, each value is preceded by its key.
+	void key(std::string_view name);
+
+	void value(std::string_view text);
+	void value(const char* text) { value(std::string_view(text)); }
+	void value(int64_t number);
+	void value(int number) { value(static_cast<int64_t>(number)); }
+	void value(bool flag);
+	void null();
+
+	// Hands buffered output to the stream; also done when the buffer fills
+	// and on destruction.
+	void flush();
+
+	// Bytes that are not valid UTF-8 are written as U+FFFD.
+	static void appendEscaped(std::string& out, std::string_view text);
+
+private:
+	struct Level {
+		std::size_t count;
+		bool object;
+	};
+
+	std::ostream& out;
+	std::string buffer;
+	SmallVector<Level, 16> levels;
+	Style style;
+	int indent;
+	bool afterKey = false;
+
+	void beginValue();
+	void open(char bracket, bool object);
+	void close(char bracket);
+	void newline(std::size_t depth);
+	void maybeFlush() {
+		if (buffer.size() >= flushBytes) {
+			flush();
+		}
+	}
+
+	static constexpr std::size_t flushBytes = 64 * 1024;
+};
+
+// Writes each finished chunk as the next string of the writer's open array.
+class JsonArraySink : public ChunkSink {
+public:
+	explicit JsonArraySink(JsonWriter& writer) : writer(writer) {}
+	void write(std::string_view chunk) override { writer.value(chunk); }
+
+private:
+	JsonWriter& writer;
+};
+
+#endif
@@ -1,6 +1,36 @@
 #include "lexer.h"
 
-Lexer::Lexer(const std::string& input) : input(input), pos(0), length(input.length()) {}
+Lexer::Lexer(const std::string& input)
+    : Lexer(SourceBuffer::fromString(input), LexerMode::Owning) {}
+
+Lexer::Lexer(std::shared_ptr<const SourceBuffer> source, LexerMode mode, StructuralIndex::Backend backend)
+    : source(std::move(source)), mode(mode), pos(0) {
+    input = this->source->view();
+    length = input.length();
+    if (backend != StructuralIndex::Backend::Scalar) {
+        index = StructuralIndex(input, backend);
+    }
+}
+
+Lexer::Lexer(std::shared_ptr<const SourceBuffer> source, size_t begin, size_t end, LexerMode mode,
+             StructuralIndex::Backend backend)
+    : source(std::move(source)), mode(mode), pos(0) {
+    std::string_view whole = this->source->view();
+    end = std::min(end, whole.size());
+    base = std::min(begin, end);
+    input = whole.substr(base, end - base);
+    length = input.length();
+    bounded = end < whole.size();
+    if (backend != StructuralIndex::Backend::Scalar) {
+        index = StructuralIndex(input, backend);
+    }
+}
+
+void Lexer::noteStop(size_t stop) {
+    if (bounded && stop >= length) {
+        truncated = true;
+    }
+}
 
 char Lexer::peek() const {
     return pos < length ? input[pos] : '\0';
@@ -11,15 +41,30 @@ char Lexer::get() {
 }
 
 void Lexer::skipWhitespace() {
-    while (std::isspace(peek())) {
+    while (pos < length && (std::isspace(peek()) || input[pos] == '\0')) {
         get();
     }
 }
 
 void Lexer::skipComment() {
+    if (index.isBuilt()) {
+        size_t stop = input.find_first_of(std::string_view("\n\0", 2), pos);
+        pos = stop == std::string_view::npos ? length : stop;
+        noteStop(pos);
+        return;
+    }
     while (peek() != '\n' && peek() != '\0') {
         get();
     }
+    noteStop(pos);
+}
+
+Token Lexer::makeToken(TokenType type, size_t start, size_t end) const {
+    Token token{type, std::string(), base + start, input.substr(start, end - start), CommandRecord()};
+    if (mode == LexerMode::Owning) {
+        token.value = std::string(token.text);
+    }
+    return token;
 }
 
 Token Lexer::lexCommand() {
@@ -28,45 +73,93 @@ Token Lexer::lexCommand() {
     while (std::isalpha(peek())) {
         get();
     }
-    std::string commandName = input.substr(start, pos - start);
+    std::string_view commandName = input.substr(start, pos - start);
 
-    std::string optionalArg;
-    std::string requiredArg;
+    if (peek() == '{') {
+        if (commandName == "\\begin") {
+            return lexEnvironment(TokenType::BeginEnvironment, start);
+        } else if (commandName == "\\end") {
+            return lexEnvironment(TokenType::EndEnvironment, start);
+        }
+    }
 
-    if (peek() == '[') {
-        optionalArg = parseBracketContent();
+    CommandRecord command;
+    command.name = commandName.substr(1);
+    command.id = static_cast<uint32_t>(lookupCommand(command.name));
+    if (peek() == '*') {
+        get();
+        command.starred = true;
+        commandName = input.substr(start, pos - start);
     }
-    if (peek() == '{') {
-        requiredArg = parseBraceContent();
+    lexArguments(command);
+
+    Token token = makeToken(TokenType::Command, start, pos);
+    if (mode == LexerMode::Owning) {
+        std::string display(commandName);
+        display.append(" [").append(command.optional.empty() ? std::string_view() : command.optional[0])
+               .append("] {").append(command.required.empty() ? std::string_view() : command.required[0])
+               .append("}");
+        for (size_t i = 1; i < command.optional.size(); ++i) {
+            display.append(" [").append(command.optional[i]).append("]");
+        }
+        for (size_t i = 1; i < command.required.size(); ++i) {
+            display.append(" {").append(command.required[i]).append("}");
+        }
+        token.value = std::move(display);
+    }
+    token.command = std::move(command);
+    return token;
+}
+
+void Lexer::lexArguments(CommandRecord& command) {
+    while (true) {
+        if (peek() == '[') {
+            command.optional.push_back(scanBracketSpan());
+        } else if (peek() == '{') {
+            command.required.push_back(scanBraceSpan());
+        } else {
+            break;
+        }
     }
-    return {TokenType::Command, commandName + " [" + optionalArg + "] {" + requiredArg + "}", start};
+}
+
+Token Lexer::lexEnvironment(TokenType type, size_t start) {
+    CommandRecord command;
+    command.name = scanBraceSpan();
+    command.id = static_cast<uint32_t>(lookupEnvironment(command.name));
+    if (type == TokenType::BeginEnvironment && peek() == '[') {
+        command.optional.push_back(scanBracketSpan());
+    }
+    Token token = makeToken(type, start, pos);
+    token.command = std::move(command);
+    return token;
 }
 
 Token Lexer::getNextToken() {
     skipWhitespace();
 
     if (pos >= length) {
-        return {TokenType::EOFToken, "", pos};
+        return {TokenType::EOFToken, "", base + pos, std::string_view(), CommandRecord()};
     }
     char currentChar = get();
 
     if (currentChar == '$') {
         if (peek() == '$') {
             get();
-            return {TokenType::MathShift, "$$", pos - 2};
+            return makeToken(TokenType::MathShift, pos - 2, pos);
         } else {
-            return {TokenType::MathShift, "$", pos - 1};
+            return makeToken(TokenType::MathShift, pos - 1, pos);
         }
     } else if (currentChar == '\\') {
         if (std::isalpha(peek())) {
             return lexCommand();
         } else {
-            return {TokenType::Command, std::string(1, currentChar), pos - 1};
+            return makeToken(TokenType::Command, pos - 1, pos);
         }
     } else if (currentChar == '{') {
-        return {TokenType::OpenBrace, "{", pos - 1};
+        return makeToken(TokenType::OpenBrace, pos - 1, pos);
     } else if (currentChar == '}') {
-        return {TokenType::CloseBrace, "}", pos - 1};
+        return makeToken(TokenType::CloseBrace, pos - 1, pos);
     } else if (currentChar == '%') {
         skipComment();
         return getNextToken();
@@ -78,15 +171,18 @@ Token Lexer::getNextToken() {
 
 Token Lexer::lexText() {
     size_t start = pos;
-    std::string text;
+    if (index.isBuilt()) {
+        pos = index.nextTextStop(pos);
+        return makeToken(TokenType::Text, start, pos);
+    }
     while (true) {
         char c = peek();
         if (c == '\\' || c == '{' || c == '}' || c == '%' || c == '\0') {
             break;
         }
-        text += get();
+        get();
     }
-    return {TokenType::Text, text, start};
+    return makeToken(TokenType::Text, start, pos);
 }
 
 void Lexer::expect(char expectedChar) {
@@ -97,8 +193,24 @@ void Lexer::expect(char expectedChar) {
 }
 
 std::string Lexer::parseBracketContent() {
+    return std::string(scanBracketSpan());
+}
+
+std::string Lexer::parseBraceContent() {
+    return std::string(scanBraceSpan());
+}
+
+std::string_view Lexer::scanBracketSpan() {
     expect('[');
-    std::string content;
+    size_t start = pos;
+    if (index.isBuilt()) {
+        size_t close = index.bracketClose(start - 1);
+        if (close != StructuralIndex::npos) {
+            noteStop(close);
+            pos = close < length && input[close] == ']' ? close + 1 : close;
+            return input.substr(start, close - start);
+        }
+    }
     int bracketCount = 1;
     while (bracketCount > 0 && peek() != '\0') {
         char c = get();
@@ -107,17 +219,25 @@ std::string Lexer::parseBracketContent() {
         } else if (c == ']') {
             bracketCount--;
             if (bracketCount == 0) {
-                break;
+                return input.substr(start, pos - 1 - start);
             }
         }
-        content += c;
     }
-    return content;
+    noteStop(pos);
+    return input.substr(start, pos - start);
 }
 
-std::string Lexer::parseBraceContent() {
+std::string_view Lexer::scanBraceSpan() {
     expect('{');
-    std::string content;
+    size_t start = pos;
+    if (index.isBuilt()) {
+        size_t close = index.braceClose(start - 1);
+        if (close != StructuralIndex::npos) {
+            noteStop(close);
+            pos = close < length && input[close] == '}' ? close + 1 : close;
+            return input.substr(start, close - start);
+        }
+    }
     int braceCount = 1;
     while (braceCount > 0 && peek() != '\0') {
         char c = get();
@@ -126,11 +246,10 @@ std::string Lexer::parseBraceContent() {
         } else if (c == '}') {
             braceCount--;
             if (braceCount == 0) {
-                break;
+                return input.substr(start, pos - 1 - start);
             }
         }
-        content += c;
     }
-    return content;
+    noteStop(pos);
+    return input.substr(start, pos - start);
 }
-
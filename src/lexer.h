@@ -2,10 +2,18 @@
 #define LEXER_H
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <memory>
 #include <cstddef>
+#include <cstdint>
 #include <cctype>
 #include <stdexcept>
+#include <algorithm>
+#include "source_buffer.h"
+#include "structural_index.h"
+#include "environment.h"
+#include "command.h"
 
 
 enum class TokenType {
@@ -26,30 +34,95 @@ struct Token {
 	TokenType type;
 	std::string value;
 	std::size_t position;
+	std::string_view text;
+	// Set on Command and Begin/EndEnvironment tokens.
+	CommandRecord command;
+
+	// Owning mode fills value; span mode leaves it empty and only sets text,
+	// which always points at the token's raw bytes in the source buffer.
+	std::string_view view() const { return value.empty() ? text : std::string_view(value); }
+};
+
+
+enum class LexerMode {
+	Owning,
+	Span
 };
 
 
-class Lexer {
+// What the parser reads tokens from: a Lexer, or a MacroExpander wrapping one.
+class TokenSource {
+public:
+	virtual ~TokenSource() = default;
+
+	virtual Token getNextToken() = 0;
+	virtual LexerMode getMode() const = 0;
+	virtual const std::shared_ptr<const SourceBuffer>& getSource() const = 0;
+	// Buffers besides getSource() that emitted tokens point into; the AST
+	// keeps them alive.
+	virtual std::vector<std::shared_ptr<const SourceBuffer>> getAuxiliarySources() const { return {}; }
+};
+
+
+class Lexer : public TokenSource {
 public:
 	Lexer(const std::string& input);
-	Token getNextToken();
+	Lexer(std::shared_ptr<const SourceBuffer> source, LexerMode mode = LexerMode::Span,
+	      StructuralIndex::Backend backend = StructuralIndex::detectBackend());
+	// Lexes only source[begin, end); token positions stay relative to the
+	// whole buffer.
+	Lexer(std::shared_ptr<const SourceBuffer> source, std::size_t begin, std::size_t end,
+	      LexerMode mode = LexerMode::Span,
+	      StructuralIndex::Backend backend = StructuralIndex::detectBackend());
+
+	Token getNextToken() override;
 	std::string parseBraceContent();
 	std::string parseBracketContent();
 
+	const std::shared_ptr<const SourceBuffer>& getSource() const override { return source; }
+	LexerMode getMode() const override { return mode; }
+	StructuralIndex::Backend getBackend() const { return index.getBackend(); }
+
+	// Raw read position, for callers that consume source text the lexer has
+	// no token for (e.g. \def parameter text). sourceView() is the text such
+	// positions index into.
+	std::size_t tell() const { return base + pos; }
+	void seek(std::size_t position) { pos = position < base ? 0 : std::min(position - base, length); }
+	std::string_view sourceView() const { return source->view().substr(0, base + length); }
+
+	// True once a bounded lexer cut a comment or argument group short at its
+	// end, i.e. lexing the whole buffer would have tokenized differently.
+	bool hitBound() const { return truncated; }
+	// Lets callers scanning sourceView() themselves report an unterminated
+	// scan, so hitBound() covers them too.
+	void noteRawStop(std::size_t position) { noteStop(position - base); }
+
 private:
-	std::string input;
+	std::shared_ptr<const SourceBuffer> source;
+	std::string_view input;
+	LexerMode mode;
 	std::size_t pos;
 	std::size_t length;
-	
+	std::size_t base = 0;
+	bool bounded = false;
+	bool truncated = false;
+	StructuralIndex index;
+
 	char peek() const;
 	char get();
 	void skipWhitespace();
 	void skipComment();
 
 	Token lexCommand();
-	
+	Token lexEnvironment(TokenType type, std::size_t start);
+	void lexArguments(CommandRecord& command);
+
     Token lexText();
+	Token makeToken(TokenType type, std::size_t start, std::size_t end) const;
+	std::string_view scanBraceSpan();
+	std::string_view scanBracketSpan();
 	void expect(char expectedChar);
+	void noteStop(std::size_t stop);
 };
 
 #endif
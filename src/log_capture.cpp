@@ -0,0 +1,91 @@
+#include "log_capture.h"
+#include <iostream>
+#include <mutex>
+
+namespace {
+
+enum Stream { Out, Err };
+
+thread_local std::string* captured[2] = {nullptr, nullptr};
+
+std::mutex releaseMutex;
+
+}
+
+class LogRouting::RoutingBuffer : public std::streambuf {
+public:
+	RoutingBuffer(std::streambuf* original, Stream stream) : original(original), stream(stream) {}
+
+protected:
+	int_type overflow(int_type c) override {
+		if (traits_type::eq_int_type(c, traits_type::eof())) {
+			return traits_type::not_eof(c);
+		}
+		if (std::string* target = captured[stream]) {
+			target->push_back(traits_type::to_char_type(c));
+			return c;
+		}
+		return original->sputc(traits_type::to_char_type(c));
+	}
+
+	std::streamsize xsputn(const char* s, std::streamsize n) override {
+		if (std::string* target = captured[stream]) {
+			target->append(s, static_cast<std::size_t>(n));
+			return n;
+		}
+		return original->sputn(s, n);
+	}
+
+	int sync() override {
+		return captured[stream] ? 0 : original->pubsync();
+	}
+
+private:
+	std::streambuf* original;
+	Stream stream;
+};
+
+LogRouting::LogRouting()
+    : originalOut(std::cout.rdbuf()), originalErr(std::cerr.rdbuf()),
+      out(new RoutingBuffer(originalOut, Out)), err(new RoutingBuffer(originalErr, Err)) {
+	std::cout.rdbuf(out.get());
+	std::cerr.rdbuf(err.get());
+}
+
+LogRouting::~LogRouting() {
+	std::cout.rdbuf(originalOut);
+	std::cerr.rdbuf(originalErr);
+}
+
+void CapturedLog::release() {
+	std::lock_guard<std::mutex> lock(releaseMutex);
+	std::cout.write(out.data(), static_cast<std::streamsize>(out.size()));
+	std::cout.flush();
+	std::cerr.write(err.data(), static_cast<std::streamsize>(err.size()));
+	std::cerr.flush();
+	out.clear();
+	err.clear();
+}
+
+LogCapture::LogCapture() : LogCapture(own) {}
+
+LogCapture::LogCapture(CapturedLog& log) : log(&log), previousOut(captured[Out]), previousErr(captured[Err]) {
+	captured[Out] = &log.out;
+	captured[Err] = &log.err;
+}
+
+LogCapture::~LogCapture() {
+	release();
+}
+
+void LogCapture::release() {
+	if (!active) {
+		return;
+	}
+	active = false;
+	captured[Out] = previousOut;
+	captured[Err] = previousErr;
+	if (log == &own) {
+		own.release();
+	}
+}
@@ -0,0 +1,64 @@
+#ifndef LOG_CAPTURE_H
+#define LOG_CAPTURE_H
+
+#include <memory>
+#include <streambuf>
+#include <string>
+
+// While installed, std::cout and std::cerr go through buffers that divert a
+// thread's output into its LogCapture, if it has one, and pass everything
+// else through unchanged. Install from the main thread before starting any
+// workers and keep it alive until they have been joined.
+class LogRouting {
+public:
+	LogRouting();
+	~LogRouting();
+	LogRouting(const LogRouting&) = delete;
+	LogRouting& operator=(const LogRouting&) = delete;
+
+private:
+	class RoutingBuffer;
+	std::streambuf* originalOut;
+	std::streambuf* originalErr;
+	std::unique_ptr<RoutingBuffer> out;
+	std::unique_ptr<RoutingBuffer> err;
+};
+
+// Output held back from std::cout and std::cerr.
+struct CapturedLog {
+	std::string out;
+	std::string err;
+
+	// Writes the output to the real streams, standard output first, holding
+	// a lock shared by all captures, and clears it.
+	void release();
+};
+
+// Collects what the current thread writes to std::cout and std::cerr, so a
+// task's log can be written out in one piece rather than interleaved with
+// other threads'. Captures nest: releasing an inner one writes into the
+// capture around it.
+class LogCapture {
+public:
+	LogCapture();
+	// Appends to log, which outlives the capture and is released by its
+	// owner, e.g. once a task that moves between threads is done.
+	explicit LogCapture(CapturedLog& log);
+	// Releases anything not yet released.
+	~LogCapture();
+	LogCapture(const LogCapture&) = delete;
+	LogCapture& operator=(const LogCapture&) = delete;
+
+	// Stops capturing and, unless the log was given to the constructor,
+	// releases it.
+	void release();
+
+private:
+	CapturedLog own;
+	CapturedLog* log;
+	std::string* previousOut;
+	std::string* previousErr;
+	bool active = true;
+};
+
+#endif
@@ -0,0 +1,326 @@
+#include "macro_expander.h"
+#include <algorithm>
+#include <cctype>
+#include <iterator>
+
+namespace {
+
+void skipSpaces(std::string_view text, size_t& pos) {
+    while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) {
+        ++pos;
+    }
+}
+
+// Balanced group opening at text[pos]; on success inner is its content and pos
+// is just past the closing character.
+bool scanGroup(std::string_view text, size_t& pos, char open, char close, std::string_view& inner) {
+    if (pos >= text.size() || text[pos] != open) {
+        return false;
+    }
+    int depth = 1;
+    for (size_t i = pos + 1; i < text.size(); ++i) {
+        if (text[i] == open) {
+            depth++;
+        } else if (text[i] == close && --depth == 0) {
+            inner = text.substr(pos + 1, i - pos - 1);
+            pos = i + 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string_view trim(std::string_view text) {
+    size_t first = text.find_first_not_of(" \t\n\r");
+    if (first == std::string_view::npos) {
+        return std::string_view();
+    }
+    return text.substr(first, text.find_last_not_of(" \t\n\r") - first + 1);
+}
+
+}
+
+MacroExpander::MacroExpander(Lexer& lexer) : MacroExpander(lexer, Limits()) {}
+
+MacroExpander::MacroExpander(Lexer& lexer, Limits limits) : lexer(lexer), limits(limits) {}
+
+bool MacroExpander::isDefinition(const Token& token) {
+    switch (token.command.commandId()) {
+        case CommandId::Newcommand:
+        case CommandId::Renewcommand:
+        case CommandId::Providecommand:
+        case CommandId::Def:
+        case CommandId::DeclareMathOperator:
+            return true;
+        default:
+            return false;
+    }
+}
+
+Token MacroExpander::getNextToken() {
+    while (true) {
+        if (!pending.empty()) {
+            Token token = std::move(pending.front());
+            pending.pop_front();
+            return token;
+        }
+
+        Token token = lexer.getNextToken();
+        if (token.type != TokenType::Command) {
+            return token;
+        }
+        if (isDefinition(token)) {
+            std::vector<Token> leftover;
+            define(token, lexer, leftover);
+            pending.insert(pending.end(), std::make_move_iterator(leftover.begin()),
+                           std::make_move_iterator(leftover.end()));
+            return token;
+        }
+
+        auto it = macros.empty() ? macros.end() : macros.find(token.command.name);
+        if (it == macros.end()) {
+            return token;
+        }
+        std::vector<Token> expansion;
+        expand(it->second, token, 0, expansion);
+        pending.insert(pending.end(), std::make_move_iterator(expansion.begin()),
+                       std::make_move_iterator(expansion.end()));
+    }
+}
+
+void MacroExpander::define(const Token& token, Lexer& source, std::vector<Token>& out) {
+    const CommandRecord& command = token.command;
+    std::string_view raw = source.sourceView();
+    CommandId id = command.commandId();
+
+    std::string_view name;
+    std::string_view body;
+    bool haveBody = false;
+    std::vector<std::string_view> options = command.optional;
+    Macro macro;
+
+    if (id == CommandId::DeclareMathOperator) {
+        if (command.required.size() < 2) {
+            return;
+        }
+        std::string_view target = trim(command.required[0]);
+        if (target.size() < 2 || target[0] != '\\') {
+            return;
+        }
+        name = target.substr(1);
+        macro.body = command.starred ? "\\operatorname*{" : "\\operatorname{";
+        macro.body.append(command.required[1]).append("}");
+        options.clear();
+    } else if (id == CommandId::Def) {
+        Token nameToken = source.getNextToken();
+        if (nameToken.type != TokenType::Command || nameToken.command.name.empty()) {
+            out.push_back(std::move(nameToken));
+            return;
+        }
+        if (!nameToken.command.required.empty()) {
+            body = nameToken.command.required[0];
+            haveBody = true;
+        } else {
+            size_t pos = source.tell();
+            while (pos + 1 < raw.size() && raw[pos] == '#' && std::isdigit(static_cast<unsigned char>(raw[pos + 1]))) {
+                macro.numArgs = std::max(macro.numArgs, raw[pos + 1] - '0');
+                pos += 2;
+            }
+            if (scanGroup(raw, pos, '{', '}', body)) {
+                haveBody = true;
+                source.seek(pos);
+            } else {
+                source.noteRawStop(raw.size());
+            }
+        }
+        if (!haveBody) {
+            out.push_back(std::move(nameToken));
+            return;
+        }
+        name = nameToken.command.name;
+        options.clear();
+    } else {
+        if (command.required.empty()) {
+            Token nameToken = source.getNextToken();
+            if (nameToken.type != TokenType::Command || nameToken.command.name.empty()) {
+                out.push_back(std::move(nameToken));
+                return;
+            }
+            name = nameToken.command.name;
+            options = nameToken.command.optional;
+            if (!nameToken.command.required.empty()) {
+                body = nameToken.command.required[0];
+                haveBody = true;
+            }
+        } else {
+            std::string_view target = trim(command.required[0]);
+            if (target.size() < 2 || target[0] != '\\') {
+                return;
+            }
+            name = target.substr(1);
+            if (command.required.size() >= 2) {
+                body = command.required[1];
+                haveBody = true;
+            }
+        }
+        if (!haveBody) {
+            size_t pos = source.tell();
+            skipSpaces(raw, pos);
+            std::string_view option;
+            while (scanGroup(raw, pos, '[', ']', option)) {
+                options.push_back(option);
+                skipSpaces(raw, pos);
+            }
+            if (scanGroup(raw, pos, '{', '}', body)) {
+                haveBody = true;
+                source.seek(pos);
+            } else {
+                source.noteRawStop(raw.size());
+            }
+        }
+        if (!haveBody || (id == CommandId::Providecommand && isDefined(name))) {
+            return;
+        }
+        if (!options.empty()) {
+            std::string_view count = trim(options[0]);
+            if (count.size() == 1 && std::isdigit(static_cast<unsigned char>(count[0]))) {
+                macro.numArgs = count[0] - '0';
+            }
+            if (options.size() > 1 && macro.numArgs > 0) {
+                macro.hasDefault = true;
+                macro.defaultArg = std::string(options[1]);
+            }
+        }
+    }
+
+    if (haveBody) {
+        macro.body = std::string(body);
+    }
+    macros.insert_or_assign(name, std::move(macro));
+    stats.definitions++;
+    cache.clear();
+}
+
+std::string MacroExpander::substitute(const Macro& macro, const Token& call) const {
+    const CommandRecord& command = call.command;
+    const char* textEnd = call.text.data() + call.text.size();
+    const char* consumedEnd = std::min(call.text.data() + 1 + command.name.size(), textEnd);
+    auto consume = [&](std::string_view span) {
+        const char* end = span.data() + span.size();
+        if (end < textEnd && (*end == '}' || *end == ']')) {
+            ++end;
+        }
+        consumedEnd = std::max(consumedEnd, end);
+        return span;
+    };
+
+    std::vector<std::string_view> args;
+    size_t required = 0;
+    if (macro.hasDefault) {
+        args.push_back(command.optional.empty() ? std::string_view(macro.defaultArg) : consume(command.optional[0]));
+    }
+    while (static_cast<int>(args.size()) < macro.numArgs) {
+        args.push_back(required < command.required.size() ? consume(command.required[required++]) : std::string_view());
+    }
+
+    std::string text;
+    text.reserve(macro.body.size() + call.text.size());
+    for (size_t i = 0; i < macro.body.size(); ++i) {
+        char c = macro.body[i];
+        if (c == '#' && i + 1 < macro.body.size()) {
+            char next = macro.body[i + 1];
+            if (next == '#') {
+                text += '#';
+                ++i;
+                continue;
+            }
+            if (next >= '1' && next <= '9') {
+                size_t index = static_cast<size_t>(next - '1');
+                if (index < args.size()) {
+                    text.append(args[index]);
+                }
+                ++i;
+                continue;
+            }
+        }
+        text += c;
+    }
+    // Groups after the consumed arguments were never the macro's; they follow
+    // the expansion as written.
+    text.append(consumedEnd, textEnd);
+    return text;
+}
+
+void MacroExpander::expand(const Macro& macro, const Token& call, int depth, std::vector<Token>& out) {
+    if (depth >= limits.maxDepth) {
+        stats.depthLimitHits++;
+        out.push_back(call);
+        return;
+    }
+
+    auto cached = cache.find(call.text);
+    if (cached != cache.end()) {
+        if (expandedBytes + cached->second.bytes > limits.maxExpandedBytes) {
+            stats.sizeLimitHits++;
+            out.push_back(call);
+            return;
+        }
+        stats.cacheHits++;
+        stats.expansions++;
+        expandedBytes += cached->second.bytes;
+        for (const auto& token : cached->second.tokens) {
+            out.push_back(token);
+            out.back().position = call.position;
+        }
+        return;
+    }
+
+    std::string text = substitute(macro, call);
+    if (expandedBytes + text.size() > limits.maxExpandedBytes) {
+        stats.sizeLimitHits++;
+        out.push_back(call);
+        return;
+    }
+    stats.cacheMisses++;
+    stats.expansions++;
+    expandedBytes += text.size();
+
+    size_t bytes = text.size();
+    size_t definitionsBefore = stats.definitions;
+    size_t limitHitsBefore = stats.depthLimitHits + stats.sizeLimitHits;
+
+    auto buffer = SourceBuffer::fromString(std::move(text));
+    expansionBuffers.push_back(buffer);
+    Lexer inner(buffer, lexer.getMode(), StructuralIndex::Backend::Scalar);
+
+    std::vector<Token> result;
+    for (Token token = inner.getNextToken(); token.type != TokenType::EOFToken; token = inner.getNextToken()) {
+        if (token.type == TokenType::Command) {
+            if (isDefinition(token)) {
+                std::vector<Token> leftover;
+                define(token, inner, leftover);
+                result.push_back(std::move(token));
+                result.insert(result.end(), std::make_move_iterator(leftover.begin()),
+                              std::make_move_iterator(leftover.end()));
+                continue;
+            }
+            auto it = macros.find(token.command.name);
+            if (it != macros.end()) {
+                expand(it->second, token, depth + 1, result);
+                continue;
+            }
+        }
+        result.push_back(std::move(token));
+    }
+    for (auto& token : result) {
+        token.position = call.position;
+    }
+
+    // An expansion that defined macros or hit a limit is not reproducible
+    // from its invocation alone.
+    if (stats.definitions == definitionsBefore &&
+        stats.depthLimitHits + stats.sizeLimitHits == limitHitsBefore) {
+        cache[call.text] = CachedExpansion{result, bytes};
+    }
+    out.insert(out.end(), std::make_move_iterator(result.begin()), std::make_move_iterator(result.end()));
+}
@@ -0,0 +1,83 @@
+#ifndef MACRO_EXPANDER_H
+#define MACRO_EXPANDER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <cstddef>
+#include "lexer.h"
+
+// Token-level macro expander between the Lexer and the Parser. Definitions made
+// with \newcommand, \renewcommand, \providecommand, \def and
+// \DeclareMathOperator are recorded as they stream past (they are still passed
+// on, so they appear in the AST); later invocations are replaced by the
+// re-lexed expansion. Expanded text lives in buffers the AST retains through
+// getAuxiliarySources().
+class MacroExpander : public TokenSource {
+public:
+	struct Limits {
+		int maxDepth = 32;
+		std::size_t maxExpandedBytes = 16 * 1024 * 1024;
+	};
+
+	struct Stats {
+		std::size_t definitions = 0;
+		std::size_t expansions = 0;
+		std::size_t cacheHits = 0;
+		std::size_t cacheMisses = 0;
+		std::size_t depthLimitHits = 0;
+		std::size_t sizeLimitHits = 0;
+	};
+
+	explicit MacroExpander(Lexer& lexer);
+	MacroExpander(Lexer& lexer, Limits limits);
+
+	Token getNextToken() override;
+	LexerMode getMode() const override { return lexer.getMode(); }
+	const std::shared_ptr<const SourceBuffer>& getSource() const override { return lexer.getSource(); }
+	std::vector<std::shared_ptr<const SourceBuffer>> getAuxiliarySources() const override { return expansionBuffers; }
+
+	bool isDefined(std::string_view name) const { return macros.find(name) != macros.end(); }
+	// Starts from another expander's definitions, whose name and body views
+	// must outlive this one.
+	void inheritDefinitions(const MacroExpander& other) { macros = other.macros; }
+	const Stats& getStats() const { return stats; }
+	std::size_t getExpandedBytes() const { return expandedBytes; }
+
+private:
+	struct Macro {
+		std::string body;
+		int numArgs = 0;
+		bool hasDefault = false;
+		std::string defaultArg;
+	};
+
+	// Expansions are keyed by the invocation's raw text (name plus argument
+	// groups), so argument-free macros and repeated macro/argument pairs hit.
+	// Any new definition clears the cache.
+	struct CachedExpansion {
+		std::vector<Token> tokens;
+		std::size_t bytes = 0;
+	};
+
+	Lexer& lexer;
+	Limits limits;
+	Stats stats;
+	// Keys are views into the source or an expansion buffer, both of which
+	// outlive the expander's use of them.
+	std::unordered_map<std::string_view, Macro> macros;
+	std::unordered_map<std::string_view, CachedExpansion> cache;
+	std::vector<std::shared_ptr<const SourceBuffer>> expansionBuffers;
+	std::deque<Token> pending;
+	std::size_t expandedBytes = 0;
+
+	static bool isDefinition(const Token& token);
+	void define(const Token& token, Lexer& source, std::vector<Token>& out);
+	void expand(const Macro& macro, const Token& call, int depth, std::vector<Token>& out);
+	std::string substitute(const Macro& macro, const Token& call) const;
+};
+
+#endif
@@ -6,15 +6,22 @@
 #include <vector>
 #include <string>
 #include <map>
-#include <set>
-#include <regex>
 #include <algorithm>
-#include <iconv.h>
-#include <uchardet/uchardet.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
 #include "lexer.h"
+#include "macro_expander.h"
+#include "parallel_parser.h"
 #include "parser.h"
 #include "ast.h"
+#include "ast_image.h"
 #include "fsm.h"
+#include "include_resolver.h"
+#include "log_capture.h"
+#include "manifest.h"
+#include "pipeline.h"
+#include "source_loader.h"
 #include "nlohmann/json.hpp"
 
 namespace fs = std::filesystem;
@@ -56,207 +63,382 @@ fs::path find_main_tex_file(const std::vector<fs::path>& tex_files) {
     return fs::path();
 }
 
-std::string detect_encoding_from_latex(const fs::path& file_path) {
-    std::ifstream file(file_path);
-    if (!file.is_open()) {
-        return "UTF-8";
-    }
-    std::string line;
-    size_t max_lines = 50;
-    size_t line_count = 0;
-    while (std::getline(file, line) && line_count++ < max_lines) {
-        std::regex inputenc_regex(R"(\\usepackage\[(.*?)\]\{inputenc\})");
-        std::smatch match;
-        if (std::regex_search(line, match, inputenc_regex)) {
-            std::string encoding = match[1].str();
-            encoding.erase(std::remove_if(encoding.begin(), encoding.end(), ::isspace), encoding.end());
-            return encoding;
-        }
-        std::regex inputencoding_regex(R"(\\inputencoding\{(.*?)\})");
-        if (std::regex_search(line, match, inputencoding_regex)) {
-            std::string encoding = match[1].str();
-            encoding.erase(std::remove_if(encoding.begin(), encoding.end(), ::isspace), encoding.end());
-            return encoding;
+struct PaperTask {
+    fs::path directory;
+    std::vector<fs::path> texFiles;
+    uintmax_t bytes = 0;
+};
+
+struct DriverOptions {
+    size_t sectionThreads = 1;
+    JsonWriter::Style jsonStyle = JsonWriter::Style::Pretty;
+    TokenChunker::Options chunkOptions;
+    // Options besides the input that change the parsed tree, for the key of
+    // its AST image.
+    std::string parseFingerprint;
+    bool reuseAstImages = true;
+    size_t prefetchThreads = 4;
+    // Included files shared across papers; null when disabled.
+    SourceCache* sourceCache = nullptr;
+};
+
+// A paper on its way through the pipeline. Each stage fills in what the next
+// one needs and drops what is no longer used; a paper that is done early
+// (nothing to parse, or an error) passes through the remaining stages
+// untouched so that its log still reaches the writer.
+struct PaperJob {
+    PaperTask paper;
+    // Path relative to the input directory; the paper's key in the manifest.
+    std::string key;
+    CapturedLog log;
+    bool done = false;
+    // Set when the manifest shows the paper's outputs are current, found
+    // either from file stamps alone or from the hash of its combined input.
+    enum class Skip { None, Stamps, Content } skip = Skip::None;
+    bool written = false;
+    Manifest::Entry entry;
+    // The AST image of an earlier run over the same input, if any; the parse
+    // stage rebuilds the tree from it instead of parsing.
+    std::string imageKey;
+    std::shared_ptr<const ASTImage> image;
+    bool astFromImage = false;
+    std::string input;
+    std::shared_ptr<AST> ast;
+    std::shared_ptr<FSM> fsm;
+    // Outputs are streamed into their files by the stage that renders them,
+    // so none is held whole in memory; the write stage reports them.
+    bool jsonWritten = false;
+    bool graphsWritten[4] = {};
+    bool imageWritten = false;
+};
+
+const char* const graphSuffixes[] = {".dot", "method.dot", "semantic.dot", "know.dot"};
+
+fs::path output_path(const PaperJob& job, const fs::path& outputDir, const char* suffix) {
+    return outputDir / (make_safe_filename(job.key) + suffix);
+}
+
+// Renders one output into a temporary file next to path and moves it into
+// place once complete, so a failed paper never leaves a truncated output
+// over an earlier good one.
+template <typename Render>
+bool write_output(const fs::path& path, Render render) {
+    fs::path partial = path;
+    partial += ".part";
+    std::error_code ec;
+    try {
+        std::ofstream file(partial, std::ios::binary);
+        if (file) {
+            render(file);
         }
-        std::regex cjk_regex(R"(\\begin\{CJK\*\}\{(.*?)\}\{.*\})");
-        if (std::regex_search(line, match, cjk_regex)) {
-            std::string encoding = match[1].str();
-            encoding.erase(std::remove_if(encoding.begin(), encoding.end(), ::isspace), encoding.end());
-            return encoding;
+        file.close();
+        if (file) {
+            fs::rename(partial, path, ec);
+            if (!ec) {
+                return true;
+            }
         }
+    } catch (...) {
+        fs::remove(partial, ec);
+        throw;
     }
-    return "UTF-8";
+    fs::remove(partial, ec);
+    return false;
 }
 
-std::string detect_encoding(const std::string& content) {
-    uchardet_t ud = uchardet_new();
-    if (uchardet_handle_data(ud, content.c_str(), content.length()) != 0) {
-        uchardet_delete(ud);
-        return "UNKNOWN";
+using PaperQueue = BoundedQueue<std::unique_ptr<PaperJob>>;
+
+void load_paper(PaperJob& job, const DriverOptions& options, const Manifest* manifest, const fs::path& outputDir) {
+    const fs::path& arxiv_dir = job.paper.directory;
+    std::cout << "Processing arXiv directory: " << arxiv_dir << "\n";
+
+    if (job.paper.texFiles.empty()) {
+        std::cerr << "No .tex files found in directory: " << arxiv_dir << "\n";
+        job.done = true;
+        return;
     }
-    uchardet_data_end(ud);
-    const char* charset_cstr = uchardet_get_charset(ud);
-    std::string charset = charset_cstr ? charset_cstr : "UNKNOWN";
-    uchardet_delete(ud);
-    return charset;
-}
 
-std::string convert_encoding(const std::string& input, const std::string& from_encoding, const std::string& to_encoding) {
-    iconv_t cd = iconv_open(to_encoding.c_str(), from_encoding.c_str());
-    if (cd == (iconv_t)-1) {
-        std::cerr << "Error: iconv_open failed for encoding conversion from " << from_encoding << " to " << to_encoding << "." << std::endl;
-        return "";
+    fs::path main_tex_file = find_main_tex_file(job.paper.texFiles);
+
+    if (main_tex_file.empty()) {
+        std::cerr << "No main .tex file found in directory: " << arxiv_dir << "\n";
+        job.done = true;
+        return;
     }
 
-    size_t in_bytes_left = input.size();
-    size_t out_bytes_left = in_bytes_left * 4;
-    const char* in_buf = input.c_str();
-    std::string output;
-    output.resize(out_bytes_left);
-    char* out_buf = &output[0];
-
-    while (in_bytes_left > 0) {
-        size_t result = iconv(cd, const_cast<char**>(&in_buf), &in_bytes_left, &out_buf, &out_bytes_left);
-        if (result == (size_t)-1) {
-            if (errno == EILSEQ || errno == EINVAL) {
-                std::cerr << "Warning: Invalid multibyte sequence encountered during conversion." << std::endl;
-                ++in_buf;
-                --in_bytes_left;
-                continue;
-            } else if (errno == E2BIG) {
-                size_t out_buf_used = output.size() - out_bytes_left;
-                output.resize(output.size() * 2);
-                out_buf = &output[0] + out_buf_used;
-                out_bytes_left = output.size() - out_buf_used;
-                continue;
-            } else {
-                std::cerr << "Error: iconv conversion failed from " << from_encoding << " to " << to_encoding << "." << std::endl;
-                iconv_close(cd);
-                return "";
-            }
-        }
+    std::cout << "Main .tex file: " << main_tex_file << "\n";
+
+    IncludeResolver::Options includeOptions;
+    includeOptions.prefetchThreads = options.prefetchThreads;
+    includeOptions.cache = options.sourceCache;
+    IncludeGraph includes = IncludeResolver::resolve(main_tex_file, includeOptions);
+    job.input = includes.assemble();
+
+    if (job.input.empty()) {
+        std::cerr << "No valid content to parse for directory: " << arxiv_dir << "\n";
+        job.done = true;
+        return;
     }
-    iconv_close(cd);
 
-    size_t out_buf_used = output.size() - out_bytes_left;
-    output.resize(out_buf_used);
-    return output;
-}
+    job.entry.hash = Manifest::hashContent(job.input);
+    job.entry.listing = Manifest::listingOf(job.paper.texFiles);
+    for (const auto& file : includes.getFiles()) {
+        job.entry.inputs.push_back(Manifest::stamp(file.path));
+    }
+    // A file created where an include was not found changes the input.
+    for (const auto& path : includes.getMissing()) {
+        job.entry.inputs.push_back(Manifest::FileStamp{path.string(), Manifest::missingSize, 0});
+    }
+    std::sort(job.entry.inputs.begin(), job.entry.inputs.end(),
+              [](const Manifest::FileStamp& a, const Manifest::FileStamp& b) { return a.path < b.path; });
+    if (manifest && manifest->hasSameContent(job.key, job.entry.hash, outputDir)) {
+        std::cout << "Skipping arXiv directory with unchanged content: " << arxiv_dir << "\n";
+        job.entry.outputs = manifest->find(job.key)->outputs;
+        job.skip = PaperJob::Skip::Content;
+        job.input = std::string();
+        job.done = true;
+        return;
+    }
 
-bool is_valid_utf8(const std::string& string) {
-    int c, i, ix, n, j;
-    for (i = 0, ix = string.length(); i < ix; i++) {
-        c = (unsigned char)string[i];
-        if (0x00 <= c && c <= 0x7F) {
-            continue;
-        } else if ((c & 0xE0) == 0xC0) {
-            n = 1;
-        } else if ((c & 0xF0) == 0xE0) {
-            n = 2;
-        } else if ((c & 0xF8) == 0xF0) {
-            n = 3;
-        } else {
-            return false;
-        }
-        if (i + n >= ix) {
-            return false;
-        }
-        for (j = 0; j < n; j++) {
-            i++;
-            c = (unsigned char)string[i];
-            if ((c & 0xC0) != 0x80) {
-                return false;
+    job.imageKey = Manifest::hashContent(job.entry.hash + options.parseFingerprint);
+    fs::path imagePath = output_path(job, outputDir, ".ast");
+    std::error_code ec;
+    if (options.reuseAstImages && fs::exists(imagePath, ec)) {
+        try {
+            auto image = ASTImage::map(imagePath.string());
+            if (image->key() == job.imageKey) {
+                job.image = std::move(image);
             }
+        } catch (const std::exception& e) {
+            std::cerr << "Ignoring AST image " << imagePath << ": " << e.what() << "\n";
         }
     }
-    return true;
 }
 
-std::string read_file_as_utf8(const fs::path& file_path) {
-    std::ifstream file(file_path, std::ios::binary);
-    if (!file.is_open()) {
-        std::cerr << "Could not open the file: " << file_path << "\n";
-        return "";
+void parse_paper(PaperJob& job, const DriverOptions& options) {
+    if (job.image) {
+        job.ast = job.image->toTree();
+        job.image.reset();
+        job.input = std::string();
+        job.astFromImage = true;
+        std::cout << "Loaded AST image for arXiv directory: " << job.paper.directory << "\n";
+        job.ast->print();
+        return;
     }
-    std::string content((std::istreambuf_iterator<char>(file)),
-                        std::istreambuf_iterator<char>());
-    file.close();
-
-    std::string encoding = detect_encoding_from_latex(file_path);
-    std::cout << "Detected LaTeX encoding in file " << file_path << ": " << encoding << "\n";
-
-    if (encoding == "UTF-8") {
-        std::string detected_encoding = detect_encoding(content);
-        std::cout << "Detected encoding from content: " << detected_encoding << "\n";
-        if (detected_encoding != "UNKNOWN") {
-            encoding = detected_encoding;
+
+    ParallelParser::Options parseOptions;
+    parseOptions.threads = options.sectionThreads;
+    ParallelParser parser(SourceBuffer::fromString(std::move(job.input)), LexerMode::Owning, parseOptions);
+    job.input = std::string();
+
+    job.ast = parser.parseDocument();
+    if (options.sectionThreads > 1) {
+        std::cout << "Parsed " << parser.getSliceCount() << " section slice(s)";
+        if (parser.getReparsedSliceCount() > 0) {
+            std::cout << ", " << parser.getReparsedSliceCount() << " reparsed";
         }
+        std::cout << (parser.usedFallback() ? ", fell back to serial" : "") << "\n";
     }
+    const MacroExpander::Stats& macroStats = parser.getMacroStats();
+    std::cout << "Macros: " << macroStats.definitions << " defined, " << macroStats.expansions
+              << " expanded (" << macroStats.cacheHits << " cached)\n";
+    std::cout << "Printing AST structure for arXiv directory: " << job.paper.directory << "\n";
+    job.ast->print();
+}
+
+void analyze_paper(PaperJob& job, const DriverOptions& options, const fs::path& outputDir) {
+    // The FSM walk builds the DAG and streams the document JSON as it goes.
+    job.fsm = std::make_shared<FSM>();
+    job.jsonWritten = write_output(output_path(job, outputDir, ".json"), [&](std::ostream& out) {
+        JsonWriter writer(out, options.jsonStyle);
+        job.fsm->writeDocumentJson(job.ast->root, writer, options.chunkOptions);
+    });
+
+    DiagnosticSink diagnostics;
+    diagnostics.append(job.ast->diagnostics);
+    diagnostics.append(job.fsm->getDiagnostics());
+    diagnostics.printReport(std::cerr, job.paper.directory.string());
+}
 
-    if (is_valid_utf8(content)) {
-        return content;
+void serialize_paper(PaperJob& job, const fs::path& outputDir) {
+    const DAG& dag = job.fsm->getDAG();
+    void (DAG::*const graphs[])(std::ostream&) const = {
+        &DAG::generateDOT,
+        &DAG::generateMethodologyFlow,
+        &DAG::generateSemanticMap,
+        &DAG::exportToKnowledgeGraph,
+    };
+    for (size_t i = 0; i < 4; ++i) {
+        job.graphsWritten[i] = write_output(output_path(job, outputDir, graphSuffixes[i]),
+                                            [&](std::ostream& out) { (dag.*graphs[i])(out); });
     }
 
-    std::string utf8_content = convert_encoding(content, encoding, "UTF-8");
-    if (utf8_content.empty()) {
-        std::cerr << "Failed to convert file to UTF-8: " << file_path << "\n";
-        return "";
+    if (!job.astFromImage) {
+        job.imageWritten = write_output(output_path(job, outputDir, ".ast"), [&](std::ostream& out) {
+            ASTImage::write(*FlatAST::fromTree(*job.ast), job.imageKey, out);
+        });
     }
-    return utf8_content;
+
+    job.fsm.reset();
+    job.ast.reset();
 }
 
-std::string read_tex_file_with_includes(const fs::path& file_path, std::set<fs::path>& included_files, bool is_main_file = false) {
-    if (included_files.count(file_path)) {
-        return "";
+void write_paper(PaperJob& job, const fs::path& outputDir) {
+    fs::path jsonFilePath = output_path(job, outputDir, ".json");
+    bool written = job.jsonWritten;
+    if (written) {
+        std::cout << "Document successfully written to " << jsonFilePath << "\n";
+        job.entry.outputs.push_back(jsonFilePath.filename().string());
+    } else {
+        std::cerr << "Error writing JSON output: " << jsonFilePath << "\n";
     }
-    included_files.insert(file_path);
 
-    std::string content = read_file_as_utf8(file_path);
-    if (content.empty()) {
-        return "";
+    const char* graphNames[] = {
+        "DAG structure",
+        "DAG methodology flow structure",
+        "DAG Semantic map structure",
+        "DAG Knowledge graph structure",
+    };
+    for (size_t i = 0; i < 4; ++i) {
+        fs::path dotFilePath = output_path(job, outputDir, graphSuffixes[i]);
+        if (job.graphsWritten[i]) {
+            std::cout << graphNames[i] << " successfully written to " << dotFilePath << "\n";
+            job.entry.outputs.push_back(dotFilePath.filename().string());
+        } else {
+            std::cerr << "Failed to open file: " << dotFilePath << "\n";
+            written = false;
+        }
     }
 
-    if (!is_main_file) {
-        content = std::regex_replace(content, std::regex(R"(\\begin\{document\})"), "");
-        content = std::regex_replace(content, std::regex(R"(\\end\{document\})"), "");
+    fs::path imagePath = output_path(job, outputDir, ".ast");
+    if (job.astFromImage) {
+        job.entry.outputs.push_back(imagePath.filename().string());
+    } else if (job.imageWritten) {
+        std::cout << "AST image successfully written to " << imagePath << "\n";
+        job.entry.outputs.push_back(imagePath.filename().string());
+    } else {
+        std::cerr << "Failed to open file: " << imagePath << "\n";
+        written = false;
     }
+    // A paper with a missing output is not recorded, so the next run retries it.
+    job.written = written;
+}
 
-    std::regex include_regex(R"(\\(input|include)\{([^}]+)\})");
-    std::smatch match;
-    std::string processed_content;
-    std::string::const_iterator search_start(content.cbegin());
-    while (std::regex_search(search_start, content.cend(), match, include_regex)) {
-        processed_content += match.prefix().str();
-
-        std::string command = match[1].str();
-        std::string filename = match[2].str();
-
-        fs::path included_file_path = file_path.parent_path() / filename;
-        if (!included_file_path.has_extension()) {
-            included_file_path += ".tex";
+// Wraps a stage's work on one paper: output goes to the paper's log, and an
+// error ends the paper's processing.
+template <typename Step>
+auto paper_step(Step step) {
+    return [step](std::unique_ptr<PaperJob>& job) {
+        if (job->done) {
+            return;
         }
-        if (!fs::exists(included_file_path)) {
-            std::cerr << "Included file not found: " << included_file_path << "\n";
-            processed_content += match.str(); 
-        } else {
-            std::string included_content = read_tex_file_with_includes(included_file_path, included_files);
-            processed_content += included_content;
+        LogCapture capture(job->log);
+        try {
+            step(*job);
+        } catch (const std::exception& e) {
+            std::cerr << "Error processing arXiv directory " << job->paper.directory << ": " << e.what() << "\n";
+            job->done = true;
         }
+    };
+}
 
-        search_start = match.suffix().first;
+void print_stage(const StageCounters& counters, const PaperQueue* input) {
+    double seconds = static_cast<double>(counters.busyNanos.load()) / 1e9;
+    std::cerr << "  " << counters.name << ": " << counters.threads << " thread(s), " << counters.items.load()
+              << " paper(s), " << seconds << " s busy";
+    if (seconds > 0) {
+        // Busy time is summed over the stage's threads.
+        std::cerr << ", up to " << static_cast<double>(counters.items.load()) * counters.threads / seconds
+                  << " paper(s)/s";
     }
-    processed_content += std::string(search_start, content.cend());
-
-    return processed_content;
+    if (input) {
+        std::cerr << "; input queue max " << input->getMaxDepth() << "/" << input->capacity() << ", "
+                  << input->getFullWaits() << " full wait(s)";
+    }
+    std::cerr << "\n";
 }
 
 
 int main(int argc, char* argv[]) {
     if (argc < 2) {
-        std::cerr << "Usage: ./parser <input_directory>\n";
+        std::cerr << "Usage: ./parser <input_directory> [-j N] [--load-threads N] [--parse-threads N] [--analyze-threads N] [--serialize-threads N] [--write-threads N] [--queue-depth N] [--pipeline-stats] [--section-threads N] [--prefetch-threads N] [--file-cache-mb N] [--commands FILE] [--compact-json] [--chunk-tokens N] [--chunk-overlap N] [--vocab FILE] [--force]\n";
         return 1;
     }
 
+    DriverOptions options;
+    size_t loadThreads = 1;
+    size_t parseThreads = 1;
+    size_t analyzeThreads = 1;
+    size_t serializeThreads = 1;
+    size_t writeThreads = 1;
+    size_t queueDepth = 8;
+    bool pipelineStats = false;
+    bool force = false;
+    size_t fileCacheMb = 64;
+    // Files that change what is written for a paper, for the manifest
+    // fingerprint below.
+    std::ostringstream optionFiles;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-j" && i + 1 < argc) {
+            loadThreads = parseThreads = analyzeThreads = serializeThreads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--load-threads" && i + 1 < argc) {
+            loadThreads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--parse-threads" && i + 1 < argc) {
+            parseThreads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--analyze-threads" && i + 1 < argc) {
+            analyzeThreads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--serialize-threads" && i + 1 < argc) {
+            serializeThreads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--write-threads" && i + 1 < argc) {
+            writeThreads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--queue-depth" && i + 1 < argc) {
+            queueDepth = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--pipeline-stats") {
+            pipelineStats = true;
+        } else if (arg == "--force") {
+            force = true;
+        } else if (arg == "--prefetch-threads" && i + 1 < argc) {
+            options.prefetchThreads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--file-cache-mb" && i + 1 < argc) {
+            fileCacheMb = static_cast<size_t>(std::max(0, std::atoi(argv[++i])));
+        } else if (arg == "--section-threads" && i + 1 < argc) {
+            options.sectionThreads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--chunk-tokens" && i + 1 < argc) {
+            options.chunkOptions.maxTokens = static_cast<size_t>(std::max(1, std::atoi(argv[++i])));
+        } else if (arg == "--chunk-overlap" && i + 1 < argc) {
+            options.chunkOptions.overlapTokens = static_cast<size_t>(std::max(0, std::atoi(argv[++i])));
+        } else if (arg == "--compact-json") {
+            options.jsonStyle = JsonWriter::Style::Compact;
+        } else if (arg == "--commands" && i + 1 < argc) {
+            try {
+                Manifest::FileStamp stamp = Manifest::stamp(argv[i + 1]);
+                std::string commands = " commands=" + stamp.path + ":" + std::to_string(stamp.size) + ":" +
+                                       std::to_string(stamp.modified);
+                options.parseFingerprint += commands;
+                optionFiles << commands;
+                size_t added = loadCommandAliases(std::string(argv[++i]));
+                std::cout << "Loaded " << added << " command alias(es)\n";
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << "\n";
+                return 1;
+            }
+        } else if (arg == "--vocab" && i + 1 < argc) {
+            try {
+                Manifest::FileStamp stamp = Manifest::stamp(argv[i + 1]);
+                optionFiles << " vocab=" << stamp.path << ":" << stamp.size << ":" << stamp.modified;
+                size_t tokens = loadTokenVocabulary(std::string(argv[++i]));
+                std::cout << "Loaded " << tokens << " vocabulary token(s)\n";
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << "\n";
+                return 1;
+            }
+        } else {
+            std::cerr << "Unknown option: " << arg << "\n";
+            return 1;
+        }
+    }
+
     fs::path inputPath(argv[1]);
 
     if (!fs::exists(inputPath) || !fs::is_directory(inputPath)) {
@@ -267,87 +449,162 @@ int main(int argc, char* argv[]) {
     fs::path outputDir = "json_output";
     fs::create_directories(outputDir);
 
-    NER ner;
-    ner.initializeCRFModel();  
+    // A manifest recorded under options that change the output does not apply.
+    std::ostringstream fingerprint;
+    fingerprint << "json=" << (options.jsonStyle == JsonWriter::Style::Compact ? "compact" : "pretty")
+                << " chunk=" << options.chunkOptions.maxTokens << "/" << options.chunkOptions.overlapTokens
+                << optionFiles.str();
+    Manifest manifest(outputDir / "manifest.jsonl", fingerprint.str());
+    size_t recorded = 0;
+    if (force) {
+        options.reuseAstImages = false;
+        manifest.compact();
+    } else {
+        recorded = manifest.load();
+    }
+    if (recorded > 0) {
+        std::cout << "Manifest lists " << recorded << " processed paper(s)\n";
+    }
+    const Manifest* previous = force ? nullptr : &manifest;
 
+    SourceCache sourceCache(fileCacheMb * 1024 * 1024);
+    if (fileCacheMb > 0) {
+        options.sourceCache = &sourceCache;
+    }
 
-    for (const auto& arxiv_dir_entry : fs::directory_iterator(inputPath)) {
-        if (arxiv_dir_entry.is_directory()) {
-            fs::path arxiv_dir = arxiv_dir_entry.path();
-            std::cout << "Processing arXiv directory: " << arxiv_dir << "\n";
+    NER ner;
+    ner.initializeCRFModel();  
 
-            std::vector<fs::path> tex_files;
-            collect_tex_files(arxiv_dir, tex_files);
 
-            if (tex_files.empty()) {
-                std::cerr << "No .tex files found in directory: " << arxiv_dir << "\n";
+    // Directory scan, load and transcode, parse, FSM and DAG, serialization
+    // and write run as stages connected by bounded queues, each stage on its
+    // own threads. A full queue stalls the stage feeding it, so at most a
+    // few papers per queue are held in memory when a later stage falls
+    // behind. Each paper's log is collected across stages and printed in one
+    // piece once it has been written.
+    bool parallel = std::max({loadThreads, parseThreads, analyzeThreads, serializeThreads, writeThreads}) > 1;
+    PaperQueue loadQueue(queueDepth);
+    PaperQueue parseQueue(queueDepth);
+    PaperQueue analyzeQueue(queueDepth);
+    PaperQueue serializeQueue(queueDepth);
+    PaperQueue writeQueue(queueDepth);
+    StageCounters scanCounters("scan");
+    StageCounters loadCounters("load");
+    StageCounters parseCounters("parse");
+    StageCounters analyzeCounters("analyze");
+    StageCounters serializeCounters("serialize");
+    StageCounters writeCounters("write");
+
+    LogRouting routing;
+    auto started = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    startStage(threads, loadThreads, loadQueue, &parseQueue, loadCounters,
+               paper_step([&options, previous, &outputDir](PaperJob& job) {
+                   load_paper(job, options, previous, outputDir);
+               }));
+    startStage(threads, parseThreads, parseQueue, &analyzeQueue, parseCounters,
+               paper_step([&options](PaperJob& job) { parse_paper(job, options); }));
+    startStage(threads, analyzeThreads, analyzeQueue, &serializeQueue, analyzeCounters,
+               paper_step([&options, &outputDir](PaperJob& job) { analyze_paper(job, options, outputDir); }));
+    startStage(threads, serializeThreads, serializeQueue, &writeQueue, serializeCounters,
+               paper_step([&outputDir](PaperJob& job) { serialize_paper(job, outputDir); }));
+    std::atomic<size_t> processed{0};
+    std::atomic<size_t> skippedByStamps{0};
+    std::atomic<size_t> skippedByContent{0};
+    std::atomic<size_t> failed{0};
+    startStage(threads, writeThreads, writeQueue, static_cast<PaperQueue*>(nullptr), writeCounters,
+               [&, step = paper_step([&outputDir](PaperJob& job) { write_paper(job, outputDir); })](
+                   std::unique_ptr<PaperJob>& job) {
+                   step(job);
+                   if (job->written || job->skip == PaperJob::Skip::Content) {
+                       // A paper skipped for its content gets its new stamps,
+                       // so the next run can skip it from stat() alone.
+                       manifest.record(job->key, job->entry);
+                   }
+                   if (job->written) {
+                       processed++;
+                   } else if (job->skip == PaperJob::Skip::Stamps) {
+                       skippedByStamps++;
+                   } else if (job->skip == PaperJob::Skip::Content) {
+                       skippedByContent++;
+                   } else {
+                       failed++;
+                   }
+                   job->log.release();
+                   job.reset();
+               });
+
+    // With several threads, the largest papers go first, so that none is
+    // left to start last and keep one thread busy long after the others
+    // have run out of work. That needs the whole listing; a serial run
+    // streams it.
+    scanCounters.threads = 1;
+    try {
+        std::vector<std::unique_ptr<PaperJob>> papers;
+        for (const auto& arxiv_dir_entry : fs::directory_iterator(inputPath)) {
+            if (!arxiv_dir_entry.is_directory()) {
                 continue;
             }
-
-            fs::path main_tex_file = find_main_tex_file(tex_files);
-
-            if (main_tex_file.empty()) {
-                std::cerr << "No main .tex file found in directory: " << arxiv_dir << "\n";
-                continue;
+            auto start = std::chrono::steady_clock::now();
+            auto job = std::make_unique<PaperJob>();
+            job->paper.directory = arxiv_dir_entry.path();
+            job->key = fs::relative(job->paper.directory, inputPath).generic_string();
+            collect_tex_files(job->paper.directory, job->paper.texFiles);
+            if (previous && previous->isUpToDate(job->key, job->paper.texFiles, outputDir)) {
+                LogCapture capture(job->log);
+                std::cout << "Skipping unchanged arXiv directory: " << job->paper.directory << "\n";
+                job->skip = PaperJob::Skip::Stamps;
+                job->done = true;
             }
-
-            std::cout << "Main .tex file: " << main_tex_file << "\n";
-
-            std::set<fs::path> included_files;
-            std::string combined_input = read_tex_file_with_includes(main_tex_file, included_files, true);
-
-            if (combined_input.empty()) {
-                std::cerr << "No valid content to parse for directory: " << arxiv_dir << "\n";
-                continue;
+            for (const auto& tex_file : job->paper.texFiles) {
+                std::error_code ec;
+                uintmax_t size = fs::file_size(tex_file, ec);
+                job->paper.bytes += ec ? 0 : size;
             }
-
-            Lexer lexer(combined_input);
-            //DAG dag;
-            Parser parser(lexer);
-
-            try {
-                std::shared_ptr<AST> ast = parser.parseDocument();
-                std::cout << "Printing AST structure for arXiv directory: " << arxiv_dir << "\n";
-                ast->print();
-                
-                std::shared_ptr<FSM> fsm = std::make_shared<FSM>();  
-                nlohmann::json jsonDocument = fsm->chunkDocumentToJson(ast->root);
-
-                fs::path relativeDir = fs::relative(arxiv_dir, inputPath);
-                std::string jsonFileName = make_safe_filename(relativeDir) + ".json";
-                fs::path jsonFilePath = outputDir / jsonFileName;
-
-                std::ofstream jsonFile(jsonFilePath);
-                if (jsonFile.is_open()) {
-                    jsonFile << jsonDocument.dump(4);
-                    jsonFile.close();
-                    std::cout << "Document successfully written to " << jsonFilePath << "\n";
-                } else {
-                    std::cerr << "Error opening file for writing JSON output: " << jsonFilePath << "\n";
-                }
-
-				std::string dotFileName = make_safe_filename(relativeDir) + ".dot";
-                std::string methodFileName = make_safe_filename(relativeDir) + "method.dot";
-                std::string semanticMapFileName = make_safe_filename(relativeDir) + "semantic.dot";
-                std::string knowledgeGraphFileName = make_safe_filename(relativeDir) + "know.dot";
-                fs::path dotFilePath = outputDir / dotFileName;
-                fs::path dotMethodFilePath = outputDir / methodFileName;
-                fs::path dotSemanticMapFilePath = outputDir / semanticMapFileName;
-                fs::path dotKnowledgeGraphFilePath = outputDir / knowledgeGraphFileName;
-                fsm->getDAG().generateDOT(dotFilePath.string());
-				std::cout << "DAG structure successfully written to " << dotFilePath << "\n";
-                fsm->getDAG().generateMethodologyFlow(dotMethodFilePath.string());
-                std::cout << "DAG methodology flow structure successfully written to " << dotMethodFilePath << "\n";
-                fsm->getDAG().generateSemanticMap(dotSemanticMapFilePath.string());
-                std::cout << "DAG Semantic map structure successfully written to " << dotSemanticMapFilePath << "\n";
-                fsm->getDAG().exportToKnowledgeGraph(dotKnowledgeGraphFilePath.string());
-                std::cout << "DAG Knowledge graph structure successfully written to " << dotKnowledgeGraphFilePath << "\n";
-            } catch (const std::exception& e) {
-                std::cerr << "Error processing arXiv directory " << arxiv_dir << ": " << e.what() << "\n";
-                continue;
+            scanCounters.busyNanos += static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+            scanCounters.items++;
+            if (parallel) {
+                papers.push_back(std::move(job));
+            } else {
+                loadQueue.push(std::move(job));
             }
         }
+        std::stable_sort(papers.begin(), papers.end(),
+                         [](const std::unique_ptr<PaperJob>& a, const std::unique_ptr<PaperJob>& b) {
+                             return a->paper.bytes > b->paper.bytes;
+                         });
+        for (auto& job : papers) {
+            loadQueue.push(std::move(job));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error scanning input directory " << inputPath << ": " << e.what() << "\n";
+    }
+    loadQueue.close();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    manifest.compact();
+
+    std::cout << "Run summary: " << processed + skippedByStamps + skippedByContent + failed << " paper(s), "
+              << processed << " processed, " << skippedByStamps + skippedByContent << " skipped as unchanged ("
+              << skippedByStamps << " by file stamps, " << skippedByContent << " by content hash), " << failed
+              << " not processed\n";
+    SourceCache::Stats cacheStats = sourceCache.getStats();
+    if (cacheStats.hits > 0) {
+        std::cout << "File cache: " << cacheStats.hits << " included file(s) reused, " << cacheStats.files
+                  << " file(s) and " << cacheStats.bytes << " bytes held\n";
+    }
+
+    if (pipelineStats) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        std::cerr << "Pipeline: " << writeCounters.items.load() << " paper(s) in " << seconds << " s\n";
+        print_stage(scanCounters, nullptr);
+        print_stage(loadCounters, &loadQueue);
+        print_stage(parseCounters, &parseQueue);
+        print_stage(analyzeCounters, &analyzeQueue);
+        print_stage(serializeCounters, &serializeQueue);
+        print_stage(writeCounters, &writeQueue);
     }
     return 0;
 }
-
@@ -0,0 +1,229 @@
+#include "manifest.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include "nlohmann/json.hpp"
+
+namespace fs = std::filesystem;
+using json = nlohmann::json;
+
+namespace {
+
+constexpr int manifestVersion = 1;
+
+uint64_t rotl(uint64_t value, int bits) {
+	return (value << bits) | (value >> (64 - bits));
+}
+
+uint64_t finalMix(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDull;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ull;
+	return h ^ (h >> 33);
+}
+
+}
+
+Manifest::Manifest(fs::path path, std::string fingerprint) : path(std::move(path)), fingerprint(std::move(fingerprint)) {}
+
+// Two 64-bit lanes over 16-byte blocks; not cryptographic, only meant to
+// tell changed inputs apart.
+std::string Manifest::hashContent(std::string_view content) {
+	constexpr uint64_t k1 = 0x9E3779B97F4A7C15ull;
+	constexpr uint64_t k2 = 0xC2B2AE3D27D4EB4Full;
+	uint64_t a = 0x243F6A8885A308D3ull ^ content.size();
+	uint64_t b = 0x13198A2E03707344ull;
+	const char* p = content.data();
+	std::size_t n = content.size();
+	std::size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		uint64_t first;
+		uint64_t second;
+		std::memcpy(&first, p + i, 8);
+		std::memcpy(&second, p + i + 8, 8);
+		a = rotl(a ^ (first * k2), 31) * k1;
+		b = rotl(b ^ (second * k2), 27) * k1;
+	}
+	uint64_t tail[2] = {0, 0};
+	std::memcpy(tail, p + i, n - i);
+	a = rotl(a ^ (tail[0] * k2), 31) * k1;
+	b = rotl(b ^ (tail[1] * k2), 27) * k1;
+
+	uint64_t words[2] = {finalMix(a ^ rotl(b, 17)), finalMix(b + a)};
+	static const char hex[] = "0123456789abcdef";
+	std::string digest;
+	for (uint64_t word : words) {
+		for (int shift = 60; shift >= 0; shift -= 4) {
+			digest.push_back(hex[(word >> shift) & 0xF]);
+		}
+	}
+	return digest;
+}
+
+Manifest::FileStamp Manifest::stamp(const fs::path& file) {
+	FileStamp result;
+	result.path = file.string();
+	std::error_code ec;
+	result.size = fs::file_size(file, ec);
+	if (ec) {
+		result.size = missingSize;
+	}
+	auto modified = fs::last_write_time(file, ec);
+	if (!ec) {
+		result.modified = static_cast<int64_t>(
+		    std::chrono::duration_cast<std::chrono::nanoseconds>(modified.time_since_epoch()).count());
+	}
+	return result;
+}
+
+std::vector<std::string> Manifest::listingOf(const std::vector<fs::path>& texFiles) {
+	std::vector<std::string> listing;
+	listing.reserve(texFiles.size());
+	for (const auto& file : texFiles) {
+		listing.push_back(file.filename().string());
+	}
+	std::sort(listing.begin(), listing.end());
+	return listing;
+}
+
+std::size_t Manifest::load() {
+	std::ifstream in(path);
+	std::string line;
+	if (in && std::getline(in, line)) {
+		bool current = false;
+		try {
+			json header = json::parse(line);
+			current = header.value("manifest", 0) == manifestVersion && header.value("fingerprint", "") == fingerprint;
+		} catch (const json::exception&) {
+		}
+		stale = !current;
+		while (current && std::getline(in, line)) {
+			try {
+				json record = json::parse(line);
+				Entry entry;
+				entry.hash = record.at("hash").get<std::string>();
+				entry.listing = record.at("listing").get<std::vector<std::string>>();
+				for (const auto& input : record.at("inputs")) {
+					entry.inputs.push_back(FileStamp{input.at(0).get<std::string>(), input.at(1).get<uintmax_t>(),
+					                                 input.at(2).get<int64_t>()});
+				}
+				entry.outputs = record.at("outputs").get<std::vector<std::string>>();
+				std::string paper = record.at("paper").get<std::string>();
+				if (!entries.emplace(paper, entry).second) {
+					entries[paper] = std::move(entry);
+					stale = true;
+				}
+			} catch (const json::exception&) {
+				// A line cut short by an interrupted run.
+				stale = true;
+			}
+		}
+	}
+	in.close();
+
+	if (stale || !fs::exists(path)) {
+		compact();
+	} else {
+		journal.open(path, std::ios::app);
+	}
+	if (!journal) {
+		std::cerr << "Warning: could not open manifest for writing: " << path << "\n";
+	}
+	return entries.size();
+}
+
+const Manifest::Entry* Manifest::find(const std::string& paper) const {
+	auto it = entries.find(paper);
+	return it == entries.end() ? nullptr : &it->second;
+}
+
+bool Manifest::outputsExist(const Entry& entry, const fs::path& outputDir) const {
+	for (const auto& output : entry.outputs) {
+		std::error_code ec;
+		if (!fs::exists(outputDir / output, ec)) {
+			return false;
+		}
+	}
+	return !entry.outputs.empty();
+}
+
+bool Manifest::isUpToDate(const std::string& paper, const std::vector<fs::path>& texFiles,
+                          const fs::path& outputDir) const {
+	const Entry* entry = find(paper);
+	if (!entry || entry->inputs.empty() || entry->listing != listingOf(texFiles)) {
+		return false;
+	}
+	// A path stamped missing no longer matches once a file exists there.
+	for (const auto& input : entry->inputs) {
+		FileStamp now = stamp(input.path);
+		if (now.size != input.size || now.modified != input.modified) {
+			return false;
+		}
+	}
+	return outputsExist(*entry, outputDir);
+}
+
+bool Manifest::hasSameContent(const std::string& paper, const std::string& hash, const fs::path& outputDir) const {
+	const Entry* entry = find(paper);
+	return entry && entry->hash == hash && outputsExist(*entry, outputDir);
+}
+
+void Manifest::record(const std::string& paper, const Entry& entry) {
+	std::lock_guard<std::mutex> lock(mutex);
+	recorded[paper] = entry;
+	if (journal) {
+		journal << entryLine(paper, entry) << '\n';
+		journal.flush();
+	}
+}
+
+void Manifest::compact() {
+	std::lock_guard<std::mutex> lock(mutex);
+	journal.close();
+	for (const auto& [paper, entry] : recorded) {
+		entries[paper] = entry;
+	}
+	recorded.clear();
+
+	fs::path temporary = path;
+	temporary += ".tmp";
+	{
+		std::ofstream out(temporary, std::ios::trunc);
+		out << headerLine() << '\n';
+		for (const auto& [paper, entry] : entries) {
+			out << entryLine(paper, entry) << '\n';
+		}
+		if (!out.flush()) {
+			std::cerr << "Warning: could not write manifest: " << temporary << "\n";
+			return;
+		}
+	}
+	std::error_code ec;
+	fs::rename(temporary, path, ec);
+	if (ec) {
+		std::cerr << "Warning: could not replace manifest " << path << ": " << ec.message() << "\n";
+		return;
+	}
+	stale = false;
+	journal.open(path, std::ios::app);
+}
+
+std::string Manifest::headerLine() const {
+	return json{{"manifest", manifestVersion}, {"fingerprint", fingerprint}}.dump(-1, ' ', false,
+	                                                                             json::error_handler_t::replace);
+}
+
+std::string Manifest::entryLine(const std::string& paper, const Entry& entry) {
+	json inputs = json::array();
+	for (const auto& input : entry.inputs) {
+		inputs.push_back(json::array({input.path, input.size, input.modified}));
+	}
+	return json{{"paper", paper},
+	            {"hash", entry.hash},
+	            {"listing", entry.listing},
+	            {"inputs", inputs},
+	            {"outputs", entry.outputs}}
+	    .dump(-1, ' ', false, json::error_handler_t::replace);
+}
@@ -0,0 +1,83 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Record of the papers a previous run finished, kept in the output directory
+// so that later runs can skip papers whose inputs have not changed. Each
+// finished paper is appended as one JSON line and flushed right away, so a
+// run that is interrupted resumes after the last paper it wrote; the file is
+// rewritten without superseded lines at the end of a run.
+//
+// A paper is up to date when the .tex files in its directory are the same
+// ones, every file its combined input was read from has the recorded size
+// and modification time, no file has appeared where an include was looked
+// up and not found, and its outputs still exist: checked with stat() alone. Failing that, a paper whose combined input hashes to the recorded
+// value is also up to date, and only needs its stamps refreshed.
+class Manifest {
+public:
+	struct FileStamp {
+		std::string path;
+		// missingSize for a file that did not exist when stamped.
+		uintmax_t size = 0;
+		int64_t modified = 0;
+	};
+
+	static constexpr uintmax_t missingSize = static_cast<uintmax_t>(-1);
+
+	struct Entry {
+		std::string hash;
+		// File names of the .tex files in the paper directory, sorted.
+		std::vector<std::string> listing;
+		// The files the combined input was read from, and the paths of
+		// includes that were not found.
+		std::vector<FileStamp> inputs;
+		std::vector<std::string> outputs;
+	};
+
+	// Entries recorded under another fingerprint (a summary of the options
+	// that shape the output) are dropped.
+	Manifest(std::filesystem::path path, std::string fingerprint);
+
+	// Reads the existing manifest, if any, and opens it for appending.
+	// Returns the number of papers it lists.
+	std::size_t load();
+
+	bool isUpToDate(const std::string& paper, const std::vector<std::filesystem::path>& texFiles,
+	                const std::filesystem::path& outputDir) const;
+	bool hasSameContent(const std::string& paper, const std::string& hash,
+	                    const std::filesystem::path& outputDir) const;
+	const Entry* find(const std::string& paper) const;
+
+	// Thread-safe.
+	void record(const std::string& paper, const Entry& entry);
+	// Rewrites the file with one line per paper.
+	void compact();
+
+	static std::string hashContent(std::string_view content);
+	static FileStamp stamp(const std::filesystem::path& path);
+	static std::vector<std::string> listingOf(const std::vector<std::filesystem::path>& texFiles);
+
+private:
+	std::filesystem::path path;
+	std::string fingerprint;
+	// Loaded at startup and only read afterwards; record() goes to recorded.
+	std::map<std::string, Entry> entries;
+	std::map<std::string, Entry> recorded;
+	std::ofstream journal;
+	std::mutex mutex;
+	bool stale = false;
+
+	bool outputsExist(const Entry& entry, const std::filesystem::path& outputDir) const;
+	std::string headerLine() const;
+	static std::string entryLine(const std::string& paper, const Entry& entry);
+};
+
+#endif
@@ -21,7 +21,7 @@ void NER::initializeCRFModel() {
     crfModel->train(trainFeatures, trainLabels, 5, 0.1);
 }
 
-void NER::annotateWithCRF(const std::vector<Token>& tokens, DAG& dag, const std::shared_ptr<ASTNode>& astNode) {
+void NER::annotateWithCRF(const std::vector<Token>& tokens, DAG& dag, ASTNode* astNode) {
     if (!crfModel) {
         std::cerr << "CRF model not initialized!" << std::endl;
         return;
@@ -16,7 +16,7 @@ public:
     NER();
     void initializeCRFModel();
 
-    void annotateWithCRF(const std::vector<Token>& tokens, DAG& dag, const std::shared_ptr<ASTNode>& astNode);
+    void annotateWithCRF(const std::vector<Token>& tokens, DAG& dag, ASTNode* astNode);
 
     const std::unordered_map<std::string, std::vector<std::string>>& getEntities() const { return entities; }
     std::vector<std::string> matchRegex(const std::string& content, const std::regex& pattern) const;
@@ -0,0 +1,236 @@
+#include "parallel_parser.h"
+#include "macro_expander.h"
+#include "parser.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <stack>
+#include <system_error>
+#include <thread>
+
+ParallelParser::ParallelParser(std::shared_ptr<const SourceBuffer> source, LexerMode mode, Options options)
+    : source(std::move(source)), mode(mode), options(options) {}
+
+ParallelParser::Layout ParallelParser::scanLayout(std::string_view text) {
+    Layout layout;
+    int depth = 0;
+    size_t i = 0;
+    while ((i = text.find_first_of("\\%", i)) != std::string_view::npos) {
+        if (text[i] == '%') {
+            i = text.find('\n', i);
+            if (i == std::string_view::npos) {
+                break;
+            }
+            continue;
+        }
+
+        size_t nameEnd = i + 1;
+        while (nameEnd < text.size() && std::isalpha(static_cast<unsigned char>(text[nameEnd]))) {
+            nameEnd++;
+        }
+        std::string_view name = text.substr(i + 1, nameEnd - i - 1);
+        bool group = nameEnd < text.size() && text[nameEnd] == '{';
+        // The document environment wraps the sections rather than nesting them.
+        if (group && (name == "begin" || name == "end") && text.compare(nameEnd, 10, "{document}") == 0) {
+            if (depth == 0 && name == "begin" && layout.documentBegin == std::string_view::npos) {
+                layout.documentBegin = i;
+            } else if (depth == 0 && name == "end" && layout.documentBegin != std::string_view::npos) {
+                layout.documentEnd = i;
+                break;
+            }
+        } else if (name == "begin" && group) {
+            depth++;
+        } else if (name == "end" && group) {
+            depth = std::max(0, depth - 1);
+        } else if (depth == 0 && (name == "section" || name == "chapter")) {
+            layout.splitPoints.push_back(i);
+        }
+        i = std::max(nameEnd, i + 1);
+    }
+    return layout;
+}
+
+ParallelParser::Plan ParallelParser::planSlices() const {
+    size_t length = source->size();
+    Layout layout = scanLayout(source->view());
+    Plan plan;
+    plan.bounds = {0};
+    plan.inBody = layout.documentBegin != std::string_view::npos;
+    size_t bodyEnd = std::min(layout.documentEnd, length);
+    std::vector<size_t> points;
+    for (size_t point : layout.splitPoints) {
+        if (point > 0 && (!plan.inBody || point > layout.documentBegin)) {
+            points.push_back(point);
+        }
+    }
+    if (points.empty()) {
+        plan.inBody = false;
+        plan.bounds.push_back(length);
+        return plan;
+    }
+
+    // The preamble is its own slice so its definitions can seed the workers.
+    plan.bounds.push_back(points.front());
+    size_t remaining = bodyEnd - points.front();
+    size_t target = std::max(options.minSliceBytes, remaining / (options.threads * 4));
+    for (size_t point : points) {
+        if (point - plan.bounds.back() >= target && bodyEnd - point >= options.minSliceBytes) {
+            plan.bounds.push_back(point);
+        }
+    }
+    plan.bounds.push_back(bodyEnd);
+    if (bodyEnd < length) {
+        plan.bounds.push_back(length);
+        plan.tail = true;
+    }
+    return plan;
+}
+
+std::shared_ptr<AST> ParallelParser::parseSerial() {
+    Lexer lexer(source, mode);
+    MacroExpander expander(lexer);
+    Parser parser(expander);
+    auto ast = parser.parseDocument();
+    macroStats = expander.getStats();
+    return ast;
+}
+
+std::shared_ptr<AST> ParallelParser::parseDocument() {
+    Plan plan = planSlices();
+    const std::vector<size_t>& bounds = plan.bounds;
+    sliceCount = bounds.size() - 1;
+    fallback = false;
+    reparsedSlices = 0;
+    if (sliceCount < 2 || options.threads < 2) {
+        return parseSerial();
+    }
+
+    Lexer preambleLexer(source, bounds[0], bounds[1], mode);
+    MacroExpander preamble(preambleLexer);
+    Parser preambleParser(preamble);
+    std::shared_ptr<AST> ast = preambleParser.parseFragment();
+    bool preambleEnded = plan.inBody ? preambleParser.endedInDocumentBody() : preambleParser.endedAtTopLevel();
+    if (preambleLexer.hitBound() || !preambleEnded) {
+        fallback = true;
+        return parseSerial();
+    }
+
+    // Slice k covers bounds[k] to bounds[end]; a repaired one spans several.
+    struct SliceResult {
+        std::shared_ptr<AST> ast;
+        MacroExpander::Stats stats;
+        size_t expandedBytes = 0;
+        size_t end = 0;
+        bool clean = false;
+        std::stack<ParserState> startStates;
+        std::stack<ParserState> endStates;
+    };
+    std::vector<SliceResult> results(sliceCount);
+
+    auto parseSlice = [&](size_t k, size_t end, const std::stack<ParserState>& states) {
+        SliceResult& result = results[k];
+        result = SliceResult();
+        result.end = end;
+        result.startStates = states;
+        try {
+            Lexer lexer(source, bounds[k], bounds[end], mode);
+            MacroExpander expander(lexer);
+            expander.inheritDefinitions(preamble);
+            Parser parser(expander);
+            // The tail closes the body it starts in.
+            result.ast = plan.inBody ? parser.parseBodyFragment(states) : parser.parseFragment();
+            result.stats = expander.getStats();
+            result.expandedBytes = expander.getExpandedBytes();
+            result.endStates = parser.getStatesAtEnd();
+            bool last = end == sliceCount;
+            bool ended = plan.inBody && !(last && plan.tail) ? parser.endedInDocumentBody()
+                                                             : last || parser.endedAtTopLevel();
+            // Definitions made here would have been visible to later slices.
+            result.clean = !lexer.hitBound() && ended && (last || result.stats.definitions == 0);
+        } catch (const std::exception& e) {
+            std::cerr << "Error parsing section slice " << k << ": " << e.what() << "\n";
+        }
+    };
+
+    // Later slices guess that the one before ended just inside the body.
+    std::stack<ParserState> bodyStates;
+    bodyStates.push(ParserState::DefaultState);
+    bodyStates.push(ParserState::EnvironmentState);
+    std::atomic<size_t> next{1};
+    auto work = [&]() {
+        for (size_t k = next++; k < sliceCount; k = next++) {
+            parseSlice(k, k + 1, k == 1 ? preambleParser.getStatesAtEnd() : bodyStates);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    size_t threadCount = std::min(options.threads, sliceCount - 1);
+    for (size_t t = 1; t < threadCount; ++t) {
+        try {
+            workers.emplace_back(work);
+        } catch (const std::system_error& e) {
+            std::cerr << "Warning: could not start parser thread: " << e.what() << "\n";
+            break;
+        }
+    }
+    work();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    // A stray math shift can leave the parser in other states at the end of
+    // a section, or inside a math span that runs on into the next ones. A
+    // body slice that guessed its states wrong is parsed again, in order,
+    // from where the one before it ended, and one that does not end cleanly
+    // is widened over the slices after it, doubling each time, until it
+    // does. The tail cannot be merged into the body.
+    std::vector<size_t> chain;
+    size_t bodySlices = plan.tail ? sliceCount - 1 : sliceCount;
+    for (size_t k = 1; k < sliceCount; k = results[k].end) {
+        const std::stack<ParserState>& states =
+            chain.empty() ? preambleParser.getStatesAtEnd() : results[chain.back()].endStates;
+        if (plan.inBody && (!results[k].clean || results[k].startStates != states)) {
+            size_t limit = k < bodySlices ? bodySlices : sliceCount;
+            size_t width = results[k].startStates != states ? 1 : 2;
+            for (;; width *= 2) {
+                parseSlice(k, std::min(k + width, limit), states);
+                if (results[k].clean || results[k].end == limit) {
+                    break;
+                }
+            }
+            reparsedSlices += results[k].end - k;
+        }
+        chain.push_back(k);
+    }
+
+    // The serial parse shares one expansion budget across the document.
+    size_t expandedBytes = preamble.getExpandedBytes();
+    macroStats = preamble.getStats();
+    for (size_t k : chain) {
+        const SliceResult& result = results[k];
+        expandedBytes += result.expandedBytes;
+        if (!result.clean || result.stats.sizeLimitHits > 0) {
+            fallback = true;
+        }
+        macroStats.definitions += result.stats.definitions;
+        macroStats.expansions += result.stats.expansions;
+        macroStats.cacheHits += result.stats.cacheHits;
+        macroStats.cacheMisses += result.stats.cacheMisses;
+        macroStats.depthLimitHits += result.stats.depthLimitHits;
+    }
+    if (fallback || expandedBytes > MacroExpander::Limits().maxExpandedBytes) {
+        fallback = true;
+        return parseSerial();
+    }
+
+    // The document environment is open at the end of the preamble, so its
+    // node is the root's last child.
+    ASTNode* parent = plan.inBody ? ast->root->getChildren().back() : ast->root;
+    for (size_t k : chain) {
+        bool tail = plan.tail && k == bodySlices;
+        ast->adopt(std::move(results[k].ast), tail ? ast->root : parent);
+    }
+    // References may cross slices, so they are resolved on the stitched tree.
+    ast->resolveReferences();
+    return ast;
+}
@@ -0,0 +1,80 @@
+#ifndef PARALLEL_PARSER_H
+#define PARALLEL_PARSER_H
+
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include "lexer.h"
+#include "ast.h"
+#include "macro_expander.h"
+
+// Parses one large document on several threads by splitting it at top-level
+// \section / \chapter commands. The preamble slice is parsed first so its
+// macro definitions reach every worker; the remaining slices are lexed,
+// expanded and parsed concurrently and stitched under the document root, or
+// under the document environment when the sections are in one, in order.
+// Anything after \end{document} is a slice of its own. A body slice that
+// started in other parser states than the previous one ended in is parsed
+// again from those, and one that did not end cleanly (a comment, argument
+// group or math span running into the next slice, an environment left open,
+// a macro defined) is parsed again together with the slices after it. What
+// is still unclean makes the whole document fall back to the serial parse,
+// so the result always matches Parser::parseDocument.
+class ParallelParser {
+public:
+	struct Options {
+		std::size_t threads = 1;
+		// Slices smaller than this are merged with their neighbours.
+		std::size_t minSliceBytes = 64 * 1024;
+	};
+
+	ParallelParser(std::shared_ptr<const SourceBuffer> source, LexerMode mode, Options options);
+
+	std::shared_ptr<AST> parseDocument();
+
+	std::size_t getSliceCount() const { return sliceCount; }
+	bool usedFallback() const { return fallback; }
+	// Slices parsed a second time, from the states the slice before them
+	// ended in or merged with their neighbours.
+	std::size_t getReparsedSliceCount() const { return reparsedSlices; }
+	// Summed over slices; cache counts depend on the split.
+	const MacroExpander::Stats& getMacroStats() const { return macroStats; }
+
+	struct Layout {
+		// Offsets of \section and \chapter commands that look top-level:
+		// outside comments and \begin/\end pairs other than the document
+		// environment's. Only candidates; each split is checked after parsing.
+		std::vector<std::size_t> splitPoints;
+		// Offsets of the first top-level \begin{document} and the
+		// \end{document} after it, or npos.
+		std::size_t documentBegin = std::string_view::npos;
+		std::size_t documentEnd = std::string_view::npos;
+	};
+
+	static Layout scanLayout(std::string_view text);
+	static std::vector<std::size_t> findSplitPoints(std::string_view text) { return scanLayout(text).splitPoints; }
+
+private:
+	std::shared_ptr<const SourceBuffer> source;
+	LexerMode mode;
+	Options options;
+	std::size_t sliceCount = 0;
+	bool fallback = false;
+	std::size_t reparsedSlices = 0;
+	MacroExpander::Stats macroStats;
+
+	struct Plan {
+		std::vector<std::size_t> bounds;
+		// The sections are in the document environment, which the preamble
+		// slice opens.
+		bool inBody = false;
+		// The last slice starts at \end{document}.
+		bool tail = false;
+	};
+
+	Plan planSlices() const;
+	std::shared_ptr<AST> parseSerial();
+};
+
+#endif
@@ -1,14 +1,37 @@
 #include "parser.h"
+#include <algorithm>
 
-Parser::Parser(Lexer& lexer) : lexer(lexer) {
+namespace {
+
+std::string_view trimLabel(std::string_view label) {
+    size_t first = label.find_first_not_of(" \t\n\r");
+    if (first == std::string_view::npos) {
+        return std::string_view();
+    }
+    return label.substr(first, label.find_last_not_of(" \t\n\r") - first + 1);
+}
+
+}
+
+Parser::Parser(TokenSource& tokens) : Parser(tokens, Limits()) {}
+
+Parser::Parser(TokenSource& tokens, Limits limits) : tokens(tokens), limits(limits) {
     stateStack.push(ParserState::DefaultState);
     advance();
 }
 
 
 void Parser::advance() {
-    currentToken = lexer.getNextToken();
+    currentToken = tokens.getNextToken();
+    trackMathShift();
+/*
+    std::cout << "Advanced to token: Type=" << static_cast<int>(currentToken.type)
+              << ", Value=\"" << currentToken.value << "\""
+              << ", State=" << static_cast<int>(currentState()) << "\n";    
+*/
+}
 
+void Parser::trackMathShift() {
     switch (currentToken.type) {
         case TokenType::MathShift:
             if (currentState() != ParserState::MathModeState) {
@@ -17,20 +40,9 @@ void Parser::advance() {
                 popState();
             }
             break;
-        case TokenType::BeginEnvironment:
-            pushState(ParserState::EnvironmentState);
-            break;
-        case TokenType::EndEnvironment:
-            popState();
-            break;
         default:
             break;
     }
-/*
-    std::cout << "Advanced to token: Type=" << static_cast<int>(currentToken.type)
-              << ", Value=\"" << currentToken.value << "\""
-              << ", State=" << static_cast<int>(currentState()) << "\n";    
-*/
 }
 
 ParserState Parser::currentState() const {
@@ -56,155 +68,297 @@ void Parser::expect(TokenType type) {
             "Unexpected token at position " + std::to_string(currentToken.position) +
             ". Expected: " + std::to_string(static_cast<int>(type)) +
             ", Got: " + std::to_string(static_cast<int>(currentToken.type)) +
-            ", Value: \"" + currentToken.value + "\""
+            ", Value: \"" + std::string(currentToken.view()) + "\""
         );
     }
     advance();
 }
 
 std::shared_ptr<AST> Parser::parseDocument() {
-    auto ast = std::make_shared<AST>();
+    auto ast = parseFragment();
+    ast->resolveReferences();
+    return ast;
+}
+
+std::shared_ptr<AST> Parser::parseFragment() {
+    auto ast = std::make_shared<AST>(tokens.getSource()->size());
+    ast->source = tokens.getSource();
+    ASTTreeBuilder tree(*ast);
+    parseInto(tree);
+    ast->auxiliarySources = tokens.getAuxiliarySources();
+    ast->crossReferences = std::move(crossReferences);
+    return ast;
+}
+
+std::shared_ptr<AST> Parser::parseBodyFragment() {
+    std::stack<ParserState> states;
+    states.push(ParserState::DefaultState);
+    states.push(ParserState::EnvironmentState);
+    return parseBodyFragment(states);
+}
+
+std::shared_ptr<AST> Parser::parseBodyFragment(const std::stack<ParserState>& states) {
+    auto ast = std::make_shared<AST>(tokens.getSource()->size());
+    ast->source = tokens.getSource();
+    ASTTreeBuilder tree(*ast);
+    parseInto(tree, &states);
+    ast->auxiliarySources = tokens.getAuxiliarySources();
+    ast->crossReferences = std::move(crossReferences);
+    return ast;
+}
+
+std::shared_ptr<FlatAST> Parser::parseFlatDocument() {
+    FlatASTBuilder flat(tokens.getSource()->size());
+    parseInto(flat);
+    auto result = flat.finish();
+    result->source = tokens.getSource();
+    result->auxiliarySources = tokens.getAuxiliarySources();
+    result->crossReferences = std::move(crossReferences);
+    result->crossReferences.resolve();
+    return result;
+}
+
+void Parser::parseInto(ASTBuilder& target, const std::stack<ParserState>* bodyStates) {
+    builder = &target;
+    openEnvironments.clear();
+    suppressedDepth = 0;
+    nestingLimitHits = 0;
+    mathRanOut = false;
+    crossReferences = CrossReferences();
+    emitted = 0;
+    bool inDocumentBody = bodyStates != nullptr;
+    if (inDocumentBody) {
+        openEnvironments.push_back(EnvironmentFrame{"document", 1, true});
+        // The first token was read on construction, against the default states.
+        stateStack = *bodyStates;
+        trackMathShift();
+    }
+
     while (currentToken.type != TokenType::EOFToken) {
-        auto element = parseElement();
-        if (element) {
-            ast->root->addChild(element);
+        // Outside any environment an \end inside math is part of the math.
+        bool inEnvironment = !openEnvironments.empty() || suppressedDepth > 0;
+        if (currentToken.type == TokenType::EndEnvironment &&
+            (inEnvironment || currentState() != ParserState::MathModeState)) {
+            handleEndEnvironment();
+        } else {
+            parseElement();
         }
     }
-    return ast;
+    topLevelAtEnd = openEnvironments.empty() && suppressedDepth == 0 && stateStack.size() == 1 &&
+                    currentState() == ParserState::DefaultState && !mathRanOut;
+    // A body part must still be in the body it started in, not one it opened.
+    documentBodyAtEnd = openEnvironments.size() == 1 && openEnvironments.back().name == "document" &&
+                        openEnvironments.back().implicit == inDocumentBody &&
+                        openEnvironments.back().stateDepth == 1 && suppressedDepth == 0 && !mathRanOut;
+    statesAtEnd = stateStack;
+    while (!openEnvironments.empty()) {
+        closeEnvironment();
+    }
+
+    if (nestingLimitHits > 0) {
+        std::cerr << "Warning: " << nestingLimitHits << " environment(s) nested deeper than "
+                  << limits.maxNesting << " levels were flattened.\n";
+    }
+    builder = nullptr;
 }
 
-std::shared_ptr<ASTNode> Parser::parseElement() {
+void Parser::parseElement() {
     switch (currentState()) {
         case ParserState::DefaultState:
+        case ParserState::EnvironmentState:
             if (currentToken.type == TokenType::Command) {
-                return parseCommand();
+                parseCommand();
             } else if (currentToken.type == TokenType::BeginEnvironment) {
-                pushState(ParserState::EnvironmentState);
-                return parseEnvironment();
+                openEnvironment();
             } else if (currentToken.type == TokenType::Text) {
-                return parseText();
+                parseText();
             } else if (currentToken.type == TokenType::MathShift) {
                 pushState(ParserState::MathModeState);
-                return parseMathMode();
-            } else if (currentToken.type == TokenType::EOFToken) {
-                return nullptr;
-            } else {
+                parseMathMode();
+            } else if (currentToken.type != TokenType::EOFToken) {
                 advance(); 
-                return nullptr;
             }
+            break;
 
         case ParserState::MathModeState:
-            return parseMathMode();
-
-        case ParserState::EnvironmentState:
-            return parseEnvironmentContent();
+            parseMathMode();
+            break;
 
         default:
             advance();
-            return nullptr;
+            break;
     }
 }
 
-std::shared_ptr<ASTNode> Parser::parseCommand() {
-    std::string commandName = currentToken.value;
-    size_t position = currentToken.position;
-    advance();
+bool Parser::isSpanMode() const {
+    return tokens.getMode() == LexerMode::Span;
+}
 
-    if (commandName == "\\section") {
-        expect(TokenType::OpenBrace);
-        std::string content = parseBraceContent();
-        auto node = std::make_shared<ASTNode>(ASTNode::NodeType::Section, content, position, currentState());
-        return node;
+std::string_view Parser::sourceRange(size_t begin, size_t end) const {
+    // Tokens from macro expansions report the position of the invocation, so
+    // a range built from them can come out reversed.
+    if (end < begin) {
+        return std::string_view();
     }
-    auto node = std::make_shared<ASTNode>(ASTNode::NodeType::Command, commandName, position, currentState());
-    return node;
+    return tokens.getSource()->slice(begin, end - begin);
 }
 
-std::shared_ptr<ASTNode> Parser::parseEnvironment() {
-    std::string envName = currentToken.value;
-    size_t position = currentToken.position;
+void Parser::openNode(ASTNode::NodeType type, std::string_view content, size_t position, CommandRecord command) {
+    emitted++;
+    if (type == ASTNode::NodeType::Command) {
+        noteCrossReference(command, emitted);
+    }
+    builder->open(type, content, position, currentState(),
+                  isSpanMode() ? ASTNode::Storage::Borrowed : ASTNode::Storage::Owned, std::move(command));
+}
+
+void Parser::emitLeaf(ASTNode::NodeType type, std::string_view content, size_t position, CommandRecord command) {
+    openNode(type, content, position, std::move(command));
+    builder->close();
+}
+
+void Parser::parseCommand() {
+    emitLeaf(ASTNode::NodeType::Command, currentToken.view(), currentToken.position, std::move(currentToken.command));
     advance();
+}
 
-    auto node = std::make_shared<ASTNode>(ASTNode::NodeType::Environment, envName, position, currentState());
-    while (currentToken.type != TokenType::EOFToken) {
-        if (currentToken.type == TokenType::EndEnvironment && currentToken.value == envName) {
-            advance();
-            break;
-        }
-        auto child = parseElement();
-        if (child) {
-            node->addChild(child);
-        }
+void Parser::openEnvironment() {
+    if (suppressedDepth > 0 || openEnvironments.size() >= limits.maxNesting) {
+        emitLeaf(ASTNode::NodeType::Environment, currentToken.view(), currentToken.position,
+                 std::move(currentToken.command));
+        suppressedDepth++;
+        nestingLimitHits++;
+        advance();
+        return;
     }
-    popState();
-    return node;
+
+    std::string_view envName = currentToken.command.name;
+    openNode(ASTNode::NodeType::Environment, currentToken.view(), currentToken.position,
+             std::move(currentToken.command));
+    openEnvironments.push_back(EnvironmentFrame{envName, stateStack.size()});
+    pushState(ParserState::EnvironmentState);
+    advance();
 }
 
-std::shared_ptr<ASTNode> Parser::parseEnvironmentContent() {
-    auto node = std::make_shared<ASTNode>(ASTNode::NodeType::EnvironmentContent, "", currentToken.position, currentState());
-    while (currentToken.type != TokenType::EndEnvironment && currentToken.type != TokenType::EOFToken) {
-        auto child = parseElement();
-        if (child) {
-            node->addChild(child);
-        }
+void Parser::closeEnvironment() {
+    size_t depth = openEnvironments.back().stateDepth;
+    bool implicit = openEnvironments.back().implicit;
+    openEnvironments.pop_back();
+    while (stateStack.size() > depth) {
+        stateStack.pop();
+    }
+    if (!implicit) {
+        builder->close();
     }
-    return node;
 }
 
-std::shared_ptr<ASTNode> Parser::parseMathMode() {
-    std::string mathDelimiter = currentToken.value;
+void Parser::handleEndEnvironment() {
+    // Each \end past the nesting cap closes one flattened environment.
+    if (suppressedDepth > 0) {
+        suppressedDepth--;
+        advance();
+        return;
+    }
+    if (openEnvironments.empty()) {
+        advance();
+        return;
+    }
+    std::string_view name = currentToken.command.name;
+    if (openEnvironments.back().name == name) {
+        closeEnvironment();
+        advance();
+        return;
+    }
+    // An \end for an enclosing environment closes everything inside it; an
+    // \end matching nothing open is dropped.
+    auto match = std::find_if(openEnvironments.begin(), openEnvironments.end(),
+                              [name](const EnvironmentFrame& frame) { return frame.name == name; });
+    if (match == openEnvironments.end()) {
+        advance();
+        return;
+    }
+    closeEnvironment();
+}
+
+void Parser::parseMathMode() {
+    std::string mathDelimiter(currentToken.view());
     size_t position = currentToken.position;
     std::string mathContent;
+    size_t contentBegin = currentToken.position + currentToken.text.size();
+    size_t contentEnd = contentBegin;
+    bool closed = false;
 
     advance();
     while (currentToken.type != TokenType::EOFToken) {
-        if (currentToken.type == TokenType::MathShift && currentToken.value == mathDelimiter) {
+        if (currentToken.type == TokenType::MathShift && currentToken.view() == mathDelimiter) {
+            contentEnd = currentToken.position;
+            closed = true;
             advance();
             popState();
             break;
         }
-        mathContent += currentToken.value;
+        if (isSpanMode()) {
+            contentEnd = currentToken.position + currentToken.text.size();
+        } else {
+            mathContent += currentToken.value;
+        }
         advance();
     }
-    auto mathNode = std::make_shared<ASTNode>(ASTNode::NodeType::Math, mathContent, position, currentState());
-    return mathNode;
+    // The span would have continued into whatever input follows.
+    if (currentToken.type == TokenType::EOFToken && !closed) {
+        mathRanOut = true;
+    }
+    if (isSpanMode()) {
+        emitLeaf(ASTNode::NodeType::Math, sourceRange(contentBegin, contentEnd), position);
+    } else {
+        emitLeaf(ASTNode::NodeType::Math, mathContent, position);
+    }
 }
 
-std::shared_ptr<ASTNode> Parser::parseText() {
-    auto node = std::make_shared<ASTNode>(ASTNode::NodeType::Text, currentToken.value, currentToken.position, currentState());
+void Parser::parseText() {
+    emitLeaf(ASTNode::NodeType::Text, currentToken.view(), currentToken.position);
     advance();
-    return node;
-}
-
-std::string Parser::parseBraceContent() {
-    expect(TokenType::OpenBrace);
-    std::string content;
-    int braceCount = 1;
-
-    while (braceCount > 0 && currentToken.type != TokenType::EOFToken) {
-        if (currentToken.type == TokenType::OpenBrace) {
-            braceCount++;
-        } else if (currentToken.type == TokenType::CloseBrace) {
-            braceCount--;
-            if (braceCount == 0) {
-                advance();
-                break;
+}
+
+void Parser::noteCrossReference(const CommandRecord& command, CrossReferences::Index node) {
+    if (command.required.empty()) {
+        return;
+    }
+    std::string_view labels = command.required[0];
+    switch (command.commandId()) {
+        case CommandId::Label:
+            handleLabel(labels, node);
+            break;
+        case CommandId::Ref:
+        case CommandId::Eqref:
+        case CommandId::Pageref:
+        case CommandId::Autoref:
+            handleReference(labels, node);
+            break;
+        case CommandId::Cref:
+            // \cref takes a comma-separated list.
+            while (!labels.empty()) {
+                size_t comma = labels.find(',');
+                handleReference(labels.substr(0, comma), node);
+                labels = comma == std::string_view::npos ? std::string_view() : labels.substr(comma + 1);
             }
-        }
-        content += currentToken.value;
-        advance();    
+            break;
+        default:
+            break;
     }
-    return content;
 }
 
-void Parser::handleLabel(const std::string& label, const std::shared_ptr<ASTNode>& node) {
-    symbolTable.addSymbol(label, node);
+void Parser::handleLabel(std::string_view label, CrossReferences::Index node) {
+    label = trimLabel(label);
+    if (!label.empty()) {
+        crossReferences.addLabel(label, node);
+    }
 }
 
-void Parser::handleReference(const std::string& label, const std::shared_ptr<ASTNode>& node) {
-    auto referencedNode = symbolTable.getSymbol(label);
-    if (referencedNode) {
-        node->addReference(referencedNode);
+void Parser::handleReference(std::string_view label, CrossReferences::Index node) {
+    label = trimLabel(label);
+    if (!label.empty()) {
+        crossReferences.addReference(label, node);
     }
 }
 
@@ -3,6 +3,8 @@
 #include <stack>
 #include "lexer.h"
 #include "ast.h"
+#include "flat_ast.h"
+#include "small_vector.h"
 #include "symbol_table.h"
 #include "parser_state.h"
 #include "fsm.h"
@@ -11,34 +13,95 @@
 
 class Parser {
 public:
-    Parser(Lexer& lexer);
+    struct Limits {
+        // Environments nested deeper than this are kept as childless nodes
+        // and their content is attached to the deepest open environment.
+        size_t maxNesting = 256;
+    };
 
+    Parser(TokenSource& tokens);
+    Parser(TokenSource& tokens, Limits limits);
+
+    // Parses and resolves \label/\ref cross-references.
     std::shared_ptr<AST> parseDocument();
+    // Leaves cross-references collected but unresolved, for callers that
+    // assemble a document from several parts before resolving it.
+    std::shared_ptr<AST> parseFragment();
+    // Parses input from inside a document body, as if \begin{document} were
+    // already open, without a node for it, and the parser's states were
+    // states: by default those just inside the environment, or where a parse
+    // of the preceding input ended. Like parseFragment otherwise.
+    std::shared_ptr<AST> parseBodyFragment();
+    std::shared_ptr<AST> parseBodyFragment(const std::stack<ParserState>& states);
+    // Emits the preorder flat layout directly, without building the pointer tree.
+    std::shared_ptr<FlatAST> parseFlatDocument();
 
     std::vector<std::string> chunkDocument();
+
+    size_t getNestingLimitHits() const { return nestingLimitHits; }
+    // Whether the last parse reached end of input outside any environment
+    // and math, i.e. input following it would parse the same on its own.
+    bool endedAtTopLevel() const { return topLevelAtEnd; }
+    // Whether the last parse reached end of input directly inside the
+    // document environment, opened there or assumed by parseBodyFragment,
+    // and not partway through a math span, so that parseBodyFragment with
+    // getStatesAtEnd() continues it exactly.
+    bool endedInDocumentBody() const { return documentBodyAtEnd; }
+    const std::stack<ParserState>& getStatesAtEnd() const { return statesAtEnd; }
 private:
-    Lexer& lexer;
+    // One per open environment. Environments are parsed by pushing and
+    // popping these rather than by recursion, so nesting depth costs no
+    // native stack.
+    struct EnvironmentFrame {
+        std::string_view name;
+        size_t stateDepth;
+        // Assumed open by parseBodyFragment; has no node to close.
+        bool implicit = false;
+    };
+
+    TokenSource& tokens;
+    Limits limits;
     Token currentToken;
     std::stack<ParserState> stateStack;
-    SymbolTable symbolTable;
+    SmallVector<EnvironmentFrame, 32> openEnvironments;
+    size_t suppressedDepth = 0;
+    size_t nestingLimitHits = 0;
+    bool topLevelAtEnd = true;
+    bool documentBodyAtEnd = false;
+    bool mathRanOut = false;
+    std::stack<ParserState> statesAtEnd;
+    CrossReferences crossReferences;
+    // Preorder ordinal of the last node emitted; the root is 0.
+    CrossReferences::Index emitted = 0;
+    ASTBuilder* builder = nullptr;
 
     void advance();
+    void trackMathShift();
 
     ParserState currentState() const;
     void pushState(ParserState state);
     void popState();
     void expect(TokenType type);
 
-    std::shared_ptr<ASTNode> parseElement();
-    std::shared_ptr<ASTNode> parseMathMode();
-    std::shared_ptr<ASTNode> parseEnvironment();
-    std::shared_ptr<ASTNode> parseEnvironmentContent();
-    std::shared_ptr<ASTNode> parseCommand();
-    std::shared_ptr<ASTNode> parseText();
+    void parseInto(ASTBuilder& target, const std::stack<ParserState>* bodyStates = nullptr);
+    void parseElement();
+    void parseMathMode();
+    void openEnvironment();
+    void closeEnvironment();
+    void handleEndEnvironment();
+    void parseCommand();
+    void parseText();
+
 
+    bool isSpanMode() const;
+    std::string_view sourceRange(size_t begin, size_t end) const;
+    void openNode(ASTNode::NodeType type, std::string_view content, size_t position,
+                  CommandRecord command = CommandRecord());
+    void emitLeaf(ASTNode::NodeType type, std::string_view content, size_t position,
+                  CommandRecord command = CommandRecord());
 
-    std::string parseBraceContent();
-    void handleLabel(const std::string& label, const std::shared_ptr<ASTNode>& node);
-    void handleReference(const std::string& label, const std::shared_ptr<ASTNode>& node);
+    void noteCrossReference(const CommandRecord& command, CrossReferences::Index node);
+    void handleLabel(std::string_view label, CrossReferences::Index node);
+    void handleReference(std::string_view label, CrossReferences::Index node);
 };
 #endif
@@ -0,0 +1,208 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Bounded multi-producer, multi-consumer queue over a ring of slots, each
+// with a sequence number that says whether it is ready to be written or
+// read (Vyukov's design); no locks are taken. push() waits while the queue
+// is full, which is what bounds the memory of a pipeline whose later stages
+// fall behind; pop() waits while it is empty and returns false once the
+// queue has been closed and drained.
+template <typename T>
+class BoundedQueue {
+public:
+	explicit BoundedQueue(std::size_t capacity) {
+		std::size_t size = 2;
+		while (size < capacity) {
+			size *= 2;
+		}
+		mask = size - 1;
+		slots = std::make_unique<Slot[]>(size);
+		for (std::size_t i = 0; i < size; ++i) {
+			slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	bool tryPush(T& value) {
+		std::size_t position = tail.load(std::memory_order_relaxed);
+		for (;;) {
+			Slot& slot = slots[position & mask];
+			std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+			std::ptrdiff_t difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position);
+			if (difference == 0) {
+				if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					slot.value = std::move(value);
+					slot.sequence.store(position + 1, std::memory_order_release);
+					noteDepth(position + 1);
+					return true;
+				}
+			} else if (difference < 0) {
+				return false;
+			} else {
+				position = tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool tryPop(T& value) {
+		std::size_t position = head.load(std::memory_order_relaxed);
+		for (;;) {
+			Slot& slot = slots[position & mask];
+			std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+			std::ptrdiff_t difference =
+			    static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position + 1);
+			if (difference == 0) {
+				if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					value = std::move(slot.value);
+					slot.sequence.store(position + mask + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (difference < 0) {
+				return false;
+			} else {
+				position = head.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	void push(T value) {
+		if (tryPush(value)) {
+			return;
+		}
+		fullWaits.fetch_add(1, std::memory_order_relaxed);
+		for (unsigned attempt = 0; !tryPush(value); ++attempt) {
+			backoff(attempt);
+		}
+	}
+
+	bool pop(T& value) {
+		for (unsigned attempt = 0;; ++attempt) {
+			if (tryPop(value)) {
+				return true;
+			}
+			if (closed.load(std::memory_order_acquire)) {
+				// Pushes made before close() are visible now.
+				return tryPop(value);
+			}
+			backoff(attempt);
+		}
+	}
+
+	// No more pushes; consumers finish what is queued.
+	void close() { closed.store(true, std::memory_order_release); }
+
+	std::size_t depth() const {
+		std::size_t in = tail.load(std::memory_order_relaxed);
+		std::size_t out = head.load(std::memory_order_relaxed);
+		return in > out ? in - out : 0;
+	}
+	std::size_t capacity() const { return mask + 1; }
+	std::size_t getMaxDepth() const { return maxDepth.load(std::memory_order_relaxed); }
+	// Pushes that found the queue full and had to wait.
+	std::size_t getFullWaits() const { return fullWaits.load(std::memory_order_relaxed); }
+
+private:
+	struct Slot {
+		std::atomic<std::size_t> sequence;
+		T value;
+	};
+
+	std::unique_ptr<Slot[]> slots;
+	std::size_t mask;
+	alignas(64) std::atomic<std::size_t> head{0};
+	alignas(64) std::atomic<std::size_t> tail{0};
+	std::atomic<bool> closed{false};
+	std::atomic<std::size_t> maxDepth{0};
+	std::atomic<std::size_t> fullWaits{0};
+
+	void noteDepth(std::size_t pushed) {
+		std::size_t popped = head.load(std::memory_order_relaxed);
+		std::size_t current = pushed > popped ? pushed - popped : 0;
+		std::size_t seen = maxDepth.load(std::memory_order_relaxed);
+		while (current > seen && !maxDepth.compare_exchange_weak(seen, current, std::memory_order_relaxed)) {
+		}
+	}
+
+	// Spins briefly, then yields, then sleeps: a stage waiting on a slow
+	// neighbour should not hold a core.
+	static void backoff(unsigned attempt) {
+		if (attempt < 16) {
+			return;
+		}
+		if (attempt < 64) {
+			std::this_thread::yield();
+			return;
+		}
+		std::this_thread::sleep_for(std::chrono::microseconds(attempt < 256 ? 50 : 1000));
+	}
+};
+
+struct StageCounters {
+	std::string name;
+	std::size_t threads = 0;
+	std::atomic<uint64_t> items{0};
+	std::atomic<uint64_t> busyNanos{0};
+
+	explicit StageCounters(std::string name) : name(std::move(name)) {}
+};
+
+// Starts count threads that pop items from in, pass each to step and push
+// it on to out (if any). The last thread to run out of input closes out, so
+// the close ripples down the pipeline. Returns the number of threads started.
+template <typename T, typename Step>
+std::size_t startStage(std::vector<std::thread>& threads, std::size_t count, BoundedQueue<T>& in,
+                       BoundedQueue<T>* out, StageCounters& counters, Step step) {
+	auto remaining = std::make_shared<std::atomic<std::size_t>>(count);
+	auto finish = [remaining, out](std::size_t workers) {
+		if (remaining->fetch_sub(workers) == workers && out) {
+			out->close();
+		}
+	};
+	auto work = [&in, out, &counters, step, finish]() mutable {
+		T item;
+		while (in.pop(item)) {
+			auto start = std::chrono::steady_clock::now();
+			step(item);
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			counters.busyNanos.fetch_add(
+			    static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()),
+			    std::memory_order_relaxed);
+			counters.items.fetch_add(1, std::memory_order_relaxed);
+			if (out) {
+				out->push(std::move(item));
+			}
+		}
+		finish(1);
+	};
+
+	std::size_t started = 0;
+	for (; started < count; ++started) {
+		try {
+			threads.emplace_back(work);
+		} catch (const std::system_error& e) {
+			if (started == 0) {
+				throw;
+			}
+			std::cerr << "Warning: could not start " << counters.name << " thread: " << e.what() << "\n";
+			break;
+		}
+	}
+	counters.threads = started;
+	if (started < count) {
+		finish(count - started);
+	}
+	return started;
+}
+
+#endif
@@ -27,17 +27,22 @@ def load_json(filename):
             return {}
 
 def split_text(text, max_size):
-    """Split text into chunks under the max_size limit."""
-    words = text.split()
+    """Split text into chunks under the max_size limit in bytes.
+
+    The parser already sizes chunks by token budget, so this only guards the
+    metadata limit; it keeps a running byte count instead of re-joining."""
     chunks = []
     current_chunk = []
+    current_size = 0
 
-    for word in words:
-        current_chunk.append(word)
-        if len(' '.join(current_chunk).encode('utf-8')) > max_size:
-            current_chunk.pop()
+    for word in text.split():
+        size = len(word.encode('utf-8'))
+        if current_chunk and current_size + 1 + size > max_size:
             chunks.append(' '.join(current_chunk))
-            current_chunk = [word]
+            current_chunk = []
+            current_size = 0
+        current_size += size + (1 if current_chunk else 0)
+        current_chunk.append(word)
 
     if current_chunk:
         chunks.append(' '.join(current_chunk))
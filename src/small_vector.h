@@ -0,0 +1,73 @@
+#ifndef SMALL_VECTOR_H
+#define SMALL_VECTOR_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <type_traits>
+
+// Vector of trivially copyable elements whose first N entries live inline.
+// Backs the explicit stacks that replace recursion in the parser and tree
+// walks: shallow documents never touch the heap, deep ones spill and keep
+// the grown buffer for reuse after clear().
+template <typename T, std::size_t N>
+class SmallVector {
+	static_assert(std::is_trivially_copyable<T>::value, "SmallVector holds trivially copyable elements");
+
+public:
+	SmallVector() = default;
+	~SmallVector() {
+		if (items != inlineItems()) {
+			std::free(items);
+		}
+	}
+	SmallVector(const SmallVector&) = delete;
+	SmallVector& operator=(const SmallVector&) = delete;
+
+	void push_back(const T& value) {
+		if (count == capacity) {
+			grow();
+		}
+		std::memcpy(static_cast<void*>(items + count), &value, sizeof(T));
+		count++;
+	}
+	void pop_back() { count--; }
+	void clear() { count = 0; }
+
+	T& back() { return items[count - 1]; }
+	const T& back() const { return items[count - 1]; }
+	T& operator[](std::size_t i) { return items[i]; }
+	const T& operator[](std::size_t i) const { return items[i]; }
+	T* begin() { return items; }
+	T* end() { return items + count; }
+	const T* begin() const { return items; }
+	const T* end() const { return items + count; }
+
+	std::size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+private:
+	alignas(T) unsigned char storage[N * sizeof(T)];
+	T* items = inlineItems();
+	std::size_t count = 0;
+	std::size_t capacity = N;
+
+	T* inlineItems() { return reinterpret_cast<T*>(storage); }
+
+	void grow() {
+		std::size_t next = capacity * 2;
+		T* grown = static_cast<T*>(std::malloc(next * sizeof(T)));
+		if (!grown) {
+			throw std::bad_alloc();
+		}
+		std::memcpy(static_cast<void*>(grown), items, count * sizeof(T));
+		if (items != inlineItems()) {
+			std::free(items);
+		}
+		items = grown;
+		capacity = next;
+	}
+};
+
+#endif
@@ -0,0 +1,69 @@
+#include "source_buffer.h"
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+std::shared_ptr<const SourceBuffer> SourceBuffer::fromString(std::string content) {
+    std::shared_ptr<SourceBuffer> buffer(new SourceBuffer());
+    buffer->owned = std::move(content);
+    buffer->data = buffer->owned.data();
+    buffer->length = buffer->owned.size();
+    return buffer;
+}
+
+std::shared_ptr<const SourceBuffer> SourceBuffer::mapFile(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open " + path + ": " + std::strerror(errno));
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Could not stat " + path + ": " + std::strerror(errno));
+    }
+
+    std::shared_ptr<SourceBuffer> buffer(new SourceBuffer());
+    if (st.st_size == 0) {
+        ::close(fd);
+        buffer->data = buffer->owned.data();
+        return buffer;
+    }
+
+    void* addr = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error("Could not map " + path + ": " + std::strerror(errno));
+    }
+
+    buffer->data = static_cast<const char*>(addr);
+    buffer->length = static_cast<size_t>(st.st_size);
+    buffer->mapped = true;
+    return buffer;
+}
+
+std::shared_ptr<const SourceBuffer> SourceBuffer::fromView(std::shared_ptr<const SourceBuffer> owner,
+                                                           std::string_view text) {
+    std::shared_ptr<SourceBuffer> buffer(new SourceBuffer());
+    buffer->owner = std::move(owner);
+    buffer->data = text.data();
+    buffer->length = text.size();
+    return buffer;
+}
+
+SourceBuffer::~SourceBuffer() {
+    if (mapped) {
+        ::munmap(const_cast<char*>(data), length);
+    }
+}
+
+std::string_view SourceBuffer::slice(std::size_t offset, std::size_t count) const {
+    if (offset > length) {
+        return std::string_view();
+    }
+    return view().substr(offset, count);
+}
@@ -0,0 +1,40 @@
+#ifndef SOURCE_BUFFER_H
+#define SOURCE_BUFFER_H
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <cstddef>
+
+// Immutable backing store for a document's text. Tokens and AST nodes produced
+// in span mode hold std::string_views into it, so it must outlive the AST.
+class SourceBuffer {
+public:
+	static std::shared_ptr<const SourceBuffer> fromString(std::string content);
+	static std::shared_ptr<const SourceBuffer> mapFile(const std::string& path);
+	// A buffer over text inside owner, which it keeps alive.
+	static std::shared_ptr<const SourceBuffer> fromView(std::shared_ptr<const SourceBuffer> owner,
+	                                                    std::string_view text);
+
+	~SourceBuffer();
+	SourceBuffer(const SourceBuffer&) = delete;
+	SourceBuffer& operator=(const SourceBuffer&) = delete;
+
+	std::string_view view() const { return std::string_view(data, length); }
+	std::string_view slice(std::size_t offset, std::size_t count) const;
+	const char* begin() const { return data; }
+	const char* end() const { return data + length; }
+	std::size_t size() const { return length; }
+	bool isMapped() const { return mapped || (owner && owner->isMapped()); }
+
+private:
+	SourceBuffer() = default;
+
+	std::string owned;
+	std::shared_ptr<const SourceBuffer> owner;
+	const char* data = nullptr;
+	std::size_t length = 0;
+	bool mapped = false;
+};
+
+#endif
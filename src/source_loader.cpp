@@ -0,0 +1,171 @@
+#include "source_loader.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <iostream>
+#include <iconv.h>
+#include <uchardet/uchardet.h>
+
+namespace {
+
+std::string withoutSpaces(std::string_view value) {
+	std::string result;
+	for (char c : value) {
+		if (!std::isspace(static_cast<unsigned char>(c))) {
+			result.push_back(c);
+		}
+	}
+	return result;
+}
+
+bool startsWith(std::string_view text, std::string_view prefix) {
+	return text.substr(0, prefix.size()) == prefix;
+}
+
+// The encoding declared by a command at the start of line, or empty.
+std::string declarationAt(std::string_view line) {
+	constexpr std::string_view usepackage = "\\usepackage[";
+	constexpr std::string_view inputencoding = "\\inputencoding{";
+	constexpr std::string_view cjk = "\\begin{CJK*}{";
+	if (startsWith(line, usepackage)) {
+		std::size_t end = line.find("]{inputenc}", usepackage.size());
+		if (end != std::string_view::npos) {
+			return withoutSpaces(line.substr(usepackage.size(), end - usepackage.size()));
+		}
+	} else if (startsWith(line, inputencoding)) {
+		std::size_t end = line.find('}', inputencoding.size());
+		if (end != std::string_view::npos) {
+			return withoutSpaces(line.substr(inputencoding.size(), end - inputencoding.size()));
+		}
+	} else if (startsWith(line, cjk)) {
+		// \begin{CJK*}{encoding}{font}
+		std::size_t end = line.find('}', cjk.size());
+		if (end != std::string_view::npos && end + 1 < line.size() && line[end + 1] == '{' &&
+		    line.find('}', end + 2) != std::string_view::npos) {
+			return withoutSpaces(line.substr(cjk.size(), end - cjk.size()));
+		}
+	}
+	return std::string();
+}
+
+}
+
+SourceScan scanSource(std::string_view text) {
+	SourceScan scan;
+	std::size_t lines = 0;
+	// Only backslashes and line ends matter in the declaration prefix; a
+	// backslash may start a declaration, which ends with its line.
+	std::size_t i = text.find_first_of("\\\n");
+	while (i != std::string_view::npos && lines < SourceScan::declarationLines && scan.declaredEncoding.empty()) {
+		if (text[i] == '\n') {
+			lines++;
+		} else {
+			std::size_t lineEnd = text.find('\n', i);
+			std::size_t lineLength = lineEnd == std::string_view::npos ? lineEnd : lineEnd - i;
+			scan.declaredEncoding = declarationAt(text.substr(i, lineLength));
+		}
+		i = text.find_first_of("\\\n", i + 1);
+	}
+	Utf8Check check = checkUtf8(text);
+	scan.validUtf8 = check.valid;
+	scan.ascii = check.ascii;
+	return scan;
+}
+
+LoadedSource loadSource(const std::filesystem::path& path) {
+	return loadSource(SourceBuffer::mapFile(path.string()));
+}
+
+LoadedSource loadSource(std::shared_ptr<const SourceBuffer> mapped) {
+	LoadedSource source;
+	SourceScan scan = scanSource(mapped->view());
+	source.declaredEncoding = scan.declaredEncoding;
+	if (scan.validUtf8) {
+		source.ascii = scan.ascii;
+		source.buffer = std::move(mapped);
+		return source;
+	}
+
+	std::string from = iconvEncodingName(scan.declaredEncoding);
+	if (from.empty() || from == "UTF-8") {
+		std::string detected = detectEncoding(mapped->view());
+		from = detected == "UNKNOWN" ? "UTF-8" : detected;
+	}
+	source.convertedFrom = from;
+	source.buffer = SourceBuffer::fromString(convertEncoding(mapped->view(), from, "UTF-8"));
+	return source;
+}
+
+std::string detectEncoding(std::string_view content) {
+	uchardet_t ud = uchardet_new();
+	if (uchardet_handle_data(ud, content.data(), content.size()) != 0) {
+		uchardet_delete(ud);
+		return "UNKNOWN";
+	}
+	uchardet_data_end(ud);
+	const char* charset = uchardet_get_charset(ud);
+	std::string result = charset && *charset ? charset : "UNKNOWN";
+	uchardet_delete(ud);
+	return result;
+}
+
+std::string convertEncoding(std::string_view input, const std::string& fromEncoding, const std::string& toEncoding) {
+	iconv_t cd = iconv_open(toEncoding.c_str(), fromEncoding.c_str());
+	if (cd == (iconv_t)-1) {
+		std::cerr << "Error: iconv_open failed for encoding conversion from " << fromEncoding << " to " << toEncoding
+		          << "." << std::endl;
+		return "";
+	}
+
+	std::size_t inBytesLeft = input.size();
+	std::size_t outBytesLeft = inBytesLeft * 4;
+	char* inBuf = const_cast<char*>(input.data());
+	std::string output;
+	output.resize(outBytesLeft);
+	char* outBuf = &output[0];
+
+	while (inBytesLeft > 0) {
+		std::size_t result = iconv(cd, &inBuf, &inBytesLeft, &outBuf, &outBytesLeft);
+		if (result == (std::size_t)-1) {
+			if (errno == EILSEQ || errno == EINVAL) {
+				std::cerr << "Warning: Invalid multibyte sequence encountered during conversion." << std::endl;
+				++inBuf;
+				--inBytesLeft;
+				continue;
+			} else if (errno == E2BIG) {
+				std::size_t used = output.size() - outBytesLeft;
+				output.resize(output.size() * 2);
+				outBuf = &output[0] + used;
+				outBytesLeft = output.size() - used;
+				continue;
+			} else {
+				std::cerr << "Error: iconv conversion failed from " << fromEncoding << " to " << toEncoding << "."
+				          << std::endl;
+				iconv_close(cd);
+				return "";
+			}
+		}
+	}
+	iconv_close(cd);
+
+	output.resize(output.size() - outBytesLeft);
+	return output;
+}
+
+std::string iconvEncodingName(std::string_view latexName) {
+	static const std::pair<const char*, const char*> names[] = {
+	    {"utf8", "UTF-8"},         {"utf8x", "UTF-8"},        {"latin1", "ISO-8859-1"}, {"latin2", "ISO-8859-2"},
+	    {"latin3", "ISO-8859-3"},  {"latin4", "ISO-8859-4"},  {"latin5", "ISO-8859-9"}, {"latin9", "ISO-8859-15"},
+	    {"latin10", "ISO-8859-16"}, {"ansinew", "CP1252"},     {"applemac", "MACINTOSH"}, {"bg5", "BIG5"},
+	    {"sjis", "SHIFT_JIS"},
+	};
+	std::string lower(latexName);
+	std::transform(lower.begin(), lower.end(), lower.begin(),
+	               [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+	for (const auto& [latex, iconvName] : names) {
+		if (lower == latex) {
+			return iconvName;
+		}
+	}
+	return lower == "utf-8" ? "UTF-8" : std::string(latexName);
+}
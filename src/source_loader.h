@@ -0,0 +1,57 @@
+#ifndef SOURCE_LOADER_H
+#define SOURCE_LOADER_H
+
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include "source_buffer.h"
+#include "utf8.h"
+
+// What a scan of a file finds: whether the whole text is well-formed UTF-8
+// and pure ASCII (see checkUtf8), and the first encoding declared with
+// inputenc, \inputencoding or a CJK environment within its first
+// declarationLines lines.
+struct SourceScan {
+	static constexpr std::size_t declarationLines = 50;
+
+	bool validUtf8 = true;
+	bool ascii = true;
+	std::string declaredEncoding;
+};
+
+SourceScan scanSource(std::string_view text);
+
+struct LoadedSource {
+	// The mapped file itself when it is valid UTF-8, otherwise the text
+	// converted to UTF-8 (empty if the conversion failed).
+	std::shared_ptr<const SourceBuffer> buffer;
+	std::string declaredEncoding;
+	// The encoding the text was converted from; empty when it was not.
+	std::string convertedFrom;
+	// Set when the text is plain ASCII, which later stages may take as leave
+	// to skip their UTF-8 handling.
+	bool ascii = false;
+
+	std::string_view text() const { return buffer->view(); }
+};
+
+// Maps the file and scans it once. Valid UTF-8 is used in place, whatever
+// the file declares; anything else is converted with iconv from the declared
+// encoding or, failing a declaration, the one uchardet detects. Throws
+// std::runtime_error if the file cannot be mapped.
+LoadedSource loadSource(const std::filesystem::path& path);
+// The same for a file already mapped, or any other buffer of raw bytes.
+LoadedSource loadSource(std::shared_ptr<const SourceBuffer> mapped);
+
+// uchardet's name for the encoding of content, or "UNKNOWN".
+std::string detectEncoding(std::string_view content);
+// Invalid sequences are skipped with a warning; returns an empty string if
+// iconv does not know either encoding.
+std::string convertEncoding(std::string_view input, const std::string& fromEncoding, const std::string& toEncoding);
+// iconv's name for a LaTeX inputenc option or CJK encoding, e.g. ISO-8859-1
+// for latin1; names iconv already knows are returned unchanged.
+std::string iconvEncodingName(std::string_view latexName);
+
+#endif
@@ -0,0 +1,285 @@
+#include "structural_index.h"
+#include <algorithm>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TEXQUERY_SIMD_X86 1
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define TEXQUERY_SIMD_NEON 1
+#endif
+
+namespace {
+
+struct BlockMasks {
+    uint64_t textStop;
+    uint64_t brace;
+    uint64_t bracket;
+};
+
+constexpr std::size_t kBlockSize = 64;
+
+BlockMasks classifyScalar(const char* block, std::size_t count) {
+    BlockMasks masks{0, 0, 0};
+    for (std::size_t i = 0; i < count; ++i) {
+        uint64_t bit = uint64_t(1) << i;
+        switch (block[i]) {
+            case '\0':
+                masks.textStop |= bit;
+                masks.brace |= bit;
+                masks.bracket |= bit;
+                break;
+            case '{':
+            case '}':
+                masks.textStop |= bit;
+                masks.brace |= bit;
+                break;
+            case '\\':
+            case '%':
+                masks.textStop |= bit;
+                break;
+            case '[':
+            case ']':
+                masks.bracket |= bit;
+                break;
+            default:
+                break;
+        }
+    }
+    return masks;
+}
+
+#if defined(TEXQUERY_SIMD_X86)
+
+__attribute__((target("avx2")))
+BlockMasks classifyAVX2(const char* block) {
+    BlockMasks masks{0, 0, 0};
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i openBrace = _mm256_set1_epi8('{');
+    const __m256i closeBrace = _mm256_set1_epi8('}');
+    const __m256i percent = _mm256_set1_epi8('%');
+    const __m256i nul = _mm256_setzero_si256();
+    const __m256i openBracket = _mm256_set1_epi8('[');
+    const __m256i closeBracket = _mm256_set1_epi8(']');
+
+    for (int half = 0; half < 2; ++half) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + half * 32));
+        __m256i isNul = _mm256_cmpeq_epi8(v, nul);
+        __m256i brace = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, openBrace),
+                                                        _mm256_cmpeq_epi8(v, closeBrace)), isNul);
+        __m256i text = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, backslash),
+                                                       _mm256_cmpeq_epi8(v, percent)), brace);
+        __m256i bracket = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, openBracket),
+                                                          _mm256_cmpeq_epi8(v, closeBracket)), isNul);
+        int shift = half * 32;
+        masks.textStop |= uint64_t(uint32_t(_mm256_movemask_epi8(text))) << shift;
+        masks.brace |= uint64_t(uint32_t(_mm256_movemask_epi8(brace))) << shift;
+        masks.bracket |= uint64_t(uint32_t(_mm256_movemask_epi8(bracket))) << shift;
+    }
+    return masks;
+}
+
+__attribute__((target("sse4.2")))
+BlockMasks classifySSE42(const char* block) {
+    BlockMasks masks{0, 0, 0};
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i openBrace = _mm_set1_epi8('{');
+    const __m128i closeBrace = _mm_set1_epi8('}');
+    const __m128i percent = _mm_set1_epi8('%');
+    const __m128i nul = _mm_setzero_si128();
+    const __m128i openBracket = _mm_set1_epi8('[');
+    const __m128i closeBracket = _mm_set1_epi8(']');
+
+    for (int quarter = 0; quarter < 4; ++quarter) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + quarter * 16));
+        __m128i isNul = _mm_cmpeq_epi8(v, nul);
+        __m128i brace = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, openBrace),
+                                                  _mm_cmpeq_epi8(v, closeBrace)), isNul);
+        __m128i text = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, backslash),
+                                                 _mm_cmpeq_epi8(v, percent)), brace);
+        __m128i bracket = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, openBracket),
+                                                    _mm_cmpeq_epi8(v, closeBracket)), isNul);
+        int shift = quarter * 16;
+        masks.textStop |= uint64_t(uint16_t(_mm_movemask_epi8(text))) << shift;
+        masks.brace |= uint64_t(uint16_t(_mm_movemask_epi8(brace))) << shift;
+        masks.bracket |= uint64_t(uint16_t(_mm_movemask_epi8(bracket))) << shift;
+    }
+    return masks;
+}
+
+#endif
+
+#if defined(TEXQUERY_SIMD_NEON)
+
+uint64_t neonMovemask(uint8x16_t m0, uint8x16_t m1, uint8x16_t m2, uint8x16_t m3) {
+    const uint8x16_t weights = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+                                0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
+    uint8x16_t sum0 = vpaddq_u8(vandq_u8(m0, weights), vandq_u8(m1, weights));
+    uint8x16_t sum1 = vpaddq_u8(vandq_u8(m2, weights), vandq_u8(m3, weights));
+    sum0 = vpaddq_u8(sum0, sum1);
+    sum0 = vpaddq_u8(sum0, sum0);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(sum0), 0);
+}
+
+BlockMasks classifyNEON(const char* block) {
+    uint8x16_t text[4];
+    uint8x16_t brace[4];
+    uint8x16_t bracket[4];
+    for (int quarter = 0; quarter < 4; ++quarter) {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(block + quarter * 16));
+        uint8x16_t isNul = vceqq_u8(v, vdupq_n_u8(0));
+        brace[quarter] = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('{')),
+                                           vceqq_u8(v, vdupq_n_u8('}'))), isNul);
+        text[quarter] = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('\\')),
+                                          vceqq_u8(v, vdupq_n_u8('%'))), brace[quarter]);
+        bracket[quarter] = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('[')),
+                                             vceqq_u8(v, vdupq_n_u8(']'))), isNul);
+    }
+    return {neonMovemask(text[0], text[1], text[2], text[3]),
+            neonMovemask(brace[0], brace[1], brace[2], brace[3]),
+            neonMovemask(bracket[0], bracket[1], bracket[2], bracket[3])};
+}
+
+#endif
+
+BlockMasks classifyBlock(StructuralIndex::Backend backend, const char* block) {
+    switch (backend) {
+#if defined(TEXQUERY_SIMD_X86)
+        case StructuralIndex::Backend::AVX2:
+            return classifyAVX2(block);
+        case StructuralIndex::Backend::SSE42:
+            return classifySSE42(block);
+#endif
+#if defined(TEXQUERY_SIMD_NEON)
+        case StructuralIndex::Backend::NEON:
+            return classifyNEON(block);
+#endif
+        default:
+            return classifyScalar(block, kBlockSize);
+    }
+}
+
+inline unsigned trailingZeros(uint64_t bits) {
+    return static_cast<unsigned>(__builtin_ctzll(bits));
+}
+
+}
+
+StructuralIndex::Backend StructuralIndex::detectBackend() {
+    static const Backend detected = [] {
+#if defined(TEXQUERY_SIMD_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return Backend::AVX2;
+        }
+        if (__builtin_cpu_supports("sse4.2")) {
+            return Backend::SSE42;
+        }
+        return Backend::Scalar;
+#elif defined(TEXQUERY_SIMD_NEON)
+        return Backend::NEON;
+#else
+        return Backend::Scalar;
+#endif
+    }();
+    return detected;
+}
+
+const char* StructuralIndex::backendName(Backend backend) {
+    switch (backend) {
+        case Backend::AVX2: return "AVX2";
+        case Backend::SSE42: return "SSE4.2";
+        case Backend::NEON: return "NEON";
+        default: return "scalar";
+    }
+}
+
+StructuralIndex::StructuralIndex(std::string_view input, Backend backend)
+    : backend(backend), length(input.size()) {
+    if (input.size() >= std::numeric_limits<uint32_t>::max()) {
+        return;
+    }
+
+    std::size_t blocks = (input.size() + kBlockSize - 1) / kBlockSize;
+    textStops.resize(blocks);
+    std::vector<uint64_t> braceMask(blocks);
+    std::vector<uint64_t> bracketMask(blocks);
+
+    std::size_t fullBlocks = input.size() / kBlockSize;
+    for (std::size_t b = 0; b < fullBlocks; ++b) {
+        BlockMasks masks = classifyBlock(backend, input.data() + b * kBlockSize);
+        textStops[b] = masks.textStop;
+        braceMask[b] = masks.brace;
+        bracketMask[b] = masks.bracket;
+    }
+    if (fullBlocks < blocks) {
+        BlockMasks masks = classifyScalar(input.data() + fullBlocks * kBlockSize,
+                                          input.size() - fullBlocks * kBlockSize);
+        textStops[fullBlocks] = masks.textStop;
+        braceMask[fullBlocks] = masks.brace;
+        bracketMask[fullBlocks] = masks.bracket;
+    }
+
+    pairGroups(input, braceMask, '{', braceOpens, braceCloses);
+    pairGroups(input, bracketMask, '[', bracketOpens, bracketCloses);
+    built = true;
+}
+
+void StructuralIndex::pairGroups(std::string_view input, const std::vector<uint64_t>& mask, char open,
+                                 std::vector<uint32_t>& opens, std::vector<uint32_t>& closes) const {
+    std::vector<uint32_t> pending;
+    for (std::size_t word = 0; word < mask.size(); ++word) {
+        uint64_t bits = mask[word];
+        while (bits) {
+            uint32_t position = static_cast<uint32_t>(word * 64 + trailingZeros(bits));
+            bits &= bits - 1;
+            char c = input[position];
+            if (c == open) {
+                pending.push_back(static_cast<uint32_t>(opens.size()));
+                opens.push_back(position);
+                closes.push_back(static_cast<uint32_t>(input.size()));
+            } else if (c == '\0') {
+                for (uint32_t index : pending) {
+                    closes[index] = position;
+                }
+                pending.clear();
+            } else if (!pending.empty()) {
+                closes[pending.back()] = position;
+                pending.pop_back();
+            }
+        }
+    }
+}
+
+std::size_t StructuralIndex::nextTextStop(std::size_t pos) const {
+    if (pos >= length) {
+        return length;
+    }
+    std::size_t word = pos / 64;
+    uint64_t bits = textStops[word] & (~uint64_t(0) << (pos % 64));
+    while (bits == 0) {
+        if (++word >= textStops.size()) {
+            return length;
+        }
+        bits = textStops[word];
+    }
+    return word * 64 + trailingZeros(bits);
+}
+
+std::size_t StructuralIndex::lookupClose(const std::vector<uint32_t>& opens,
+                                         const std::vector<uint32_t>& closes, std::size_t openPos) {
+    auto it = std::lower_bound(opens.begin(), opens.end(), openPos);
+    if (it == opens.end() || *it != openPos) {
+        return npos;
+    }
+    return closes[it - opens.begin()];
+}
+
+std::size_t StructuralIndex::braceClose(std::size_t openPos) const {
+    return lookupClose(braceOpens, braceCloses, openPos);
+}
+
+std::size_t StructuralIndex::bracketClose(std::size_t openPos) const {
+    return lookupClose(bracketOpens, bracketCloses, openPos);
+}
@@ -0,0 +1,57 @@
+#ifndef STRUCTURAL_INDEX_H
+#define STRUCTURAL_INDEX_H
+
+#include <string_view>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// First lexing stage: classifies the input in 64-byte blocks into a bitmap of
+// characters that end a text run (\ { } % and NUL), and precomputes where each
+// '{' and '[' closes. The lexer then jumps between set bits instead of testing
+// every byte. Built with AVX2/SSE4.2 or NEON when the CPU has them.
+class StructuralIndex {
+public:
+	enum class Backend {
+		Scalar,
+		SSE42,
+		AVX2,
+		NEON
+	};
+
+	static Backend detectBackend();
+	static const char* backendName(Backend backend);
+
+	StructuralIndex() = default;
+	StructuralIndex(std::string_view input, Backend backend);
+
+	bool isBuilt() const { return built; }
+	Backend getBackend() const { return backend; }
+
+	// First position >= pos holding a text-run terminator, or the input length.
+	std::size_t nextTextStop(std::size_t pos) const;
+	// For the '{' (or '[') at openPos: the position of its matching close, or
+	// of the NUL/end of input where an unbalanced group stops. Returns npos
+	// when openPos does not hold an opening character.
+	std::size_t braceClose(std::size_t openPos) const;
+	std::size_t bracketClose(std::size_t openPos) const;
+
+	static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+private:
+	void pairGroups(std::string_view input, const std::vector<uint64_t>& mask, char open,
+	                std::vector<uint32_t>& opens, std::vector<uint32_t>& closes) const;
+	static std::size_t lookupClose(const std::vector<uint32_t>& opens,
+	                               const std::vector<uint32_t>& closes, std::size_t openPos);
+
+	Backend backend = Backend::Scalar;
+	bool built = false;
+	std::size_t length = 0;
+	std::vector<uint64_t> textStops;
+	std::vector<uint32_t> braceOpens;
+	std::vector<uint32_t> braceCloses;
+	std::vector<uint32_t> bracketOpens;
+	std::vector<uint32_t> bracketCloses;
+};
+
+#endif
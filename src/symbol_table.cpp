@@ -1,21 +1,87 @@
 #include "symbol_table.h"
+#include <functional>
 
-void SymbolTable::addSymbol(const std::string& label, const std::shared_ptr<ASTNode>& node) {
-	if (table.find(label) != table.end()) {
-		std::cerr << "Warning: Symbol \"" << label << "\" is being overwritten in the symbol table.\n";
-	} 
-	table[label] = node;
+SymbolTable::Id SymbolTable::intern(std::string_view name) {
+	if ((names.size() + 1) * 4 > slots.size() * 3) {
+		grow();
+	}
+	std::size_t hash = std::hash<std::string_view>()(name);
+	std::size_t mask = slots.size() - 1;
+	for (std::size_t i = hash & mask;; i = (i + 1) & mask) {
+		Id id = slots[i];
+		if (id == npos) {
+			id = static_cast<Id>(names.size());
+			names.push_back(name);
+			hashes.push_back(hash);
+			slots[i] = id;
+			return id;
+		}
+		if (hashes[id] == hash && names[id] == name) {
+			return id;
+		}
+	}
 }
 
-std::shared_ptr<ASTNode> SymbolTable::getSymbol(const std::string& label) const {
-	auto it = table.find(label);
-	if (it != table.end()) {
-		return it->second;
+SymbolTable::Id SymbolTable::find(std::string_view name) const {
+	if (slots.empty()) {
+		return npos;
+	}
+	std::size_t hash = std::hash<std::string_view>()(name);
+	std::size_t mask = slots.size() - 1;
+	for (std::size_t i = hash & mask;; i = (i + 1) & mask) {
+		Id id = slots[i];
+		if (id == npos || (hashes[id] == hash && names[id] == name)) {
+			return id;
+		}
 	}
-	std::cerr << "Warning: Symbol \"" << label << "\" not found in the symbol table.\n";
-	return nullptr;
 }
 
-bool SymbolTable::hasSymbol(const std::string& label) const {
-	return table.find(label) != table.end();	
+void SymbolTable::grow() {
+	std::size_t capacity = slots.empty() ? 64 : slots.size() * 2;
+	slots.assign(capacity, npos);
+	std::size_t mask = capacity - 1;
+	for (Id id = 0; id < names.size(); ++id) {
+		std::size_t i = hashes[id] & mask;
+		while (slots[i] != npos) {
+			i = (i + 1) & mask;
+		}
+		slots[i] = id;
+	}
+}
+
+void CrossReferences::addLabel(std::string_view label, Index node) {
+	labels.push_back(Site{names.intern(label), node});
+}
+
+void CrossReferences::addReference(std::string_view label, Index node) {
+	references.push_back(Site{names.intern(label), node});
+}
+
+void CrossReferences::append(const CrossReferences& part, Index offset) {
+	for (const Site& site : part.labels) {
+		addLabel(part.names.name(site.label), site.node + offset);
+	}
+	for (const Site& site : part.references) {
+		addReference(part.names.name(site.label), site.node + offset);
+	}
+}
+
+void CrossReferences::resolve() {
+	std::vector<Index> definitions(names.size(), npos);
+	duplicateLabels = 0;
+	for (const Site& site : labels) {
+		if (definitions[site.label] != npos) {
+			duplicateLabels++;
+		}
+		definitions[site.label] = site.node;
+	}
+
+	targets.resize(references.size());
+	unresolved = 0;
+	for (std::size_t i = 0; i < references.size(); ++i) {
+		targets[i] = definitions[references[i].label];
+		if (targets[i] == npos) {
+			unresolved++;
+		}
+	}
 }
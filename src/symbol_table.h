@@ -1,21 +1,62 @@
 #ifndef SYMBOL_TABLE_H
 #define SYMBOL_TABLE_H
 
-#include <string>
-#include <unordered_map>
-#include <memory>
-#include <iostream>
-#include "ast.h"
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
 
+// Interns label names into dense ids with an open-addressing table. Names are
+// stored as views, so the text they point into must outlive the table.
 class SymbolTable {
 public:
-	void addSymbol(const std::string& label, const std::shared_ptr<ASTNode>& node);
-	std::shared_ptr<ASTNode> getSymbol(const std::string& label) const;
-	bool hasSymbol(const std::string& label) const;
+	using Id = uint32_t;
+	static constexpr Id npos = std::numeric_limits<Id>::max();
 
-private:	
-	std::unordered_map<std::string, std::shared_ptr<ASTNode>> table;
+	Id intern(std::string_view name);
+	Id find(std::string_view name) const;
+	std::string_view name(Id id) const { return names[id]; }
+	std::size_t size() const { return names.size(); }
+
+private:
+	std::vector<std::string_view> names;
+	std::vector<std::size_t> hashes;
+	// Power-of-two sized, linear probing; npos marks an empty slot.
+	std::vector<Id> slots;
+
+	void grow();
 };
 
+// \label and \ref-style sites of one document, keyed by the preorder ordinal
+// of the command node that carries them (the same numbering FlatAST uses).
+// Sites are collected while parsing and resolved in one batch afterwards, so
+// forward references need no special handling.
+struct CrossReferences {
+	using Index = uint32_t;
+	static constexpr Index npos = std::numeric_limits<Index>::max();
+
+	struct Site {
+		SymbolTable::Id label;
+		Index node;
+	};
+
+	SymbolTable names;
+	std::vector<Site> labels;
+	std::vector<Site> references;
+
+	// Filled by resolve(): for each reference, the ordinal of the node that
+	// defines its label, or npos.
+	std::vector<Index> targets;
+	std::size_t unresolved = 0;
+	std::size_t duplicateLabels = 0;
+
+	void addLabel(std::string_view label, Index node);
+	void addReference(std::string_view label, Index node);
+	// Appends part's sites with their ordinals shifted by offset.
+	void append(const CrossReferences& part, Index offset);
+	// A label defined more than once resolves to its last definition.
+	void resolve();
+};
 
 #endif
@@ -0,0 +1,324 @@
+#include "gtest/gtest.h"
+#include "../arena.h"
+#include "../ast.h"
+#include "../lexer.h"
+#include "../parser.h"
+#include "../flat_ast.h"
+#include "../ast_image.h"
+#include "../macro_expander.h"
+#include "../symbol_table.h"
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Tracked {
+    explicit Tracked(int& destroyed) : destroyed(destroyed) {}
+    ~Tracked() { destroyed++; }
+    int& destroyed;
+};
+
+}
+
+TEST(ArenaTest, AllocationsAreAlignedAndGrowAcrossBlocks) {
+    Arena arena(256);
+    for (int i = 0; i < 100; ++i) {
+        void* small = arena.allocate(3, 1);
+        void* wide = arena.allocate(24, 16);
+        EXPECT_NE(small, nullptr);
+        EXPECT_EQ(reinterpret_cast<std::uintptr_t>(wide) % 16, 0u);
+    }
+    EXPECT_GT(arena.blockCount(), 1u);
+
+    void* large = arena.allocate(1 << 20, 8);
+    EXPECT_NE(large, nullptr);
+    EXPECT_EQ(arena.copy("span"), "span");
+}
+
+TEST(ArenaTest, FinalizersRunWhenArenaIsReleased) {
+    int destroyed = 0;
+    {
+        Arena arena;
+        for (int i = 0; i < 10; ++i) {
+            arena.create<Tracked>(destroyed);
+        }
+        arena.create<int>(7);
+        EXPECT_EQ(destroyed, 0);
+    }
+    EXPECT_EQ(destroyed, 10);
+}
+
+TEST(ASTTest, NodesLiveInTheDocumentArena) {
+    Lexer lexer(R"(\section{Intro} Text $x$ \begin{itemize}\item one\end{itemize})");
+    Parser parser(lexer);
+    auto ast = parser.parseDocument();
+
+    ASSERT_NE(ast->root, nullptr);
+    EXPECT_EQ(ast->root->getType(), ASTNode::NodeType::Document);
+    EXPECT_GE(ast->nodeCount(), 5u);
+    EXPECT_GE(ast->getArena().bytesAllocated(), ast->nodeCount() * sizeof(ASTNode));
+
+    const auto& children = ast->root->getChildren();
+    ASSERT_FALSE(children.empty());
+    EXPECT_EQ(children[0]->getType(), ASTNode::NodeType::Command);
+    EXPECT_EQ(children[0]->getContent(), "\\section [] {Intro}");
+}
+
+TEST(ASTTest, ValidationProblemsAreRecordedNotThrown) {
+    AST ast;
+    ASTNode* math = ast.createNode(ASTNode::NodeType::Math, "x", 4, ParserState::MathModeState);
+    ast.createNode(ASTNode::NodeType::Text, "", 9, ParserState::DefaultState);
+    ASTNode* command = ast.createNode(ASTNode::NodeType::Command, "\\emph{y}", 12, ParserState::DefaultState);
+
+    EXPECT_FALSE(math->addChild(command));
+    EXPECT_FALSE(math->addChild(nullptr));
+    EXPECT_TRUE(ast.root->addChild(math));
+    EXPECT_TRUE(math->getChildren().empty());
+
+    const DiagnosticSink& diagnostics = ast.diagnostics;
+    ASSERT_EQ(diagnostics.size(), 2u);
+    EXPECT_EQ(diagnostics.getRecords()[0].code, DiagnosticCode::InvalidMathContent);
+    EXPECT_EQ(diagnostics.getRecords()[0].position, 4u);
+    EXPECT_EQ(diagnostics.getRecords()[1].code, DiagnosticCode::EmptyContent);
+    EXPECT_EQ(diagnostics.getRecords()[1].nodeType, static_cast<int>(ASTNode::NodeType::Text));
+}
+
+TEST(ASTTest, DeepTreesTearDownWithoutRecursion) {
+    auto ast = std::make_unique<AST>();
+    ASTNode* parent = ast->root;
+    for (int i = 0; i < 200000; ++i) {
+        ASTNode* child = ast->createNode(ASTNode::NodeType::Environment, "\\begin{a}", i,
+                                         ParserState::EnvironmentState, ASTNode::Storage::Borrowed);
+        parent->addChild(child);
+        parent = child;
+    }
+    EXPECT_EQ(ast->nodeCount(), 200001u);
+    ast.reset();
+}
+
+TEST(FlatASTTest, ParserEmitsPreorderRanges) {
+    auto source = SourceBuffer::fromString(
+        R"(\section{A} intro \begin{itemize}\item one \begin{center}\textbf{x}\end{center}\end{itemize} tail)");
+    Lexer lexer(source, LexerMode::Span);
+    Parser parser(lexer);
+    auto flat = parser.parseFlatDocument();
+
+    ASSERT_GE(flat->size(), 8u);
+    EXPECT_EQ(flat->type(0), ASTNode::NodeType::Document);
+    EXPECT_EQ(flat->parent(0), FlatAST::npos);
+    EXPECT_EQ(flat->subtreeEnd(0), flat->size());
+
+    FlatAST::Index itemize = FlatAST::npos;
+    for (FlatAST::Index i = 0; i < flat->size(); ++i) {
+        if (flat->type(i) == ASTNode::NodeType::Environment && flat->command(i).name == "itemize") {
+            itemize = i;
+        }
+        // Every node's range nests inside its parent's.
+        if (flat->parent(i) != FlatAST::npos) {
+            EXPECT_LT(flat->parent(i), i);
+            EXPECT_LE(flat->subtreeEnd(i), flat->subtreeEnd(flat->parent(i)));
+        }
+    }
+    ASSERT_NE(itemize, FlatAST::npos);
+    EXPECT_EQ(flat->depth(itemize), 1u);
+
+    std::vector<FlatAST::Index> items = flat->children(itemize);
+    ASSERT_EQ(items.size(), 3u);
+    EXPECT_EQ(flat->command(items[0]).name, "item");
+    EXPECT_EQ(flat->command(items[2]).name, "center");
+    EXPECT_EQ(flat->type(items[2] + 1), ASTNode::NodeType::Command);
+    EXPECT_EQ(flat->subtreeEnd(items[2]), items[2] + 2);
+    EXPECT_EQ(flat->nextSibling(itemize), flat->subtreeEnd(itemize));
+    EXPECT_EQ(flat->content(flat->nextSibling(itemize)), "tail");
+}
+
+TEST(FlatASTTest, FreezingTheTreeMatchesDirectEmission) {
+    const char* text = R"(\title{T} \begin{abstract} words $a$ \end{abstract} \cite[p.~3]{k} $$b$$)";
+    Lexer treeLexer(text);
+    Parser treeParser(treeLexer);
+    auto frozen = FlatAST::fromTree(*treeParser.parseDocument());
+
+    Lexer flatLexer(text);
+    Parser flatParser(flatLexer);
+    auto direct = flatParser.parseFlatDocument();
+
+    ASSERT_EQ(frozen->size(), direct->size());
+    for (FlatAST::Index i = 0; i < direct->size(); ++i) {
+        EXPECT_EQ(frozen->type(i), direct->type(i));
+        EXPECT_EQ(frozen->content(i), direct->content(i));
+        EXPECT_EQ(frozen->position(i), direct->position(i));
+        EXPECT_EQ(frozen->parent(i), direct->parent(i));
+        EXPECT_EQ(frozen->subtreeEnd(i), direct->subtreeEnd(i));
+        EXPECT_EQ(frozen->command(i).required, direct->command(i).required);
+    }
+}
+
+TEST(ParserTest, DeepNestingUsesNoNativeRecursion) {
+    const int levels = 100000;
+    std::string text;
+    for (int i = 0; i < levels; ++i) text += "\\begin{itemize}";
+    text += "core";
+    for (int i = 0; i < levels; ++i) text += "\\end{itemize}";
+    text += " after";
+
+    Parser::Limits limits;
+    limits.maxNesting = levels;
+    Lexer lexer(SourceBuffer::fromString(text), LexerMode::Span);
+    Parser parser(lexer, limits);
+    auto flat = parser.parseFlatDocument();
+
+    ASSERT_EQ(flat->size(), static_cast<FlatAST::Index>(levels + 3));
+    EXPECT_EQ(flat->depth(levels + 1), static_cast<FlatAST::Index>(levels + 1));
+    EXPECT_EQ(flat->content(levels + 1), "core");
+    EXPECT_EQ(flat->parent(levels + 2), 0u);
+    EXPECT_EQ(parser.getNestingLimitHits(), 0u);
+
+    Lexer treeLexer(SourceBuffer::fromString(text), LexerMode::Span);
+    Parser treeParser(treeLexer, limits);
+    auto ast = treeParser.parseDocument();
+    FSM fsm;
+    EXPECT_FALSE(fsm.chunkDocument(ast->root).empty());
+}
+
+TEST(ParserTest, NestingCapFlattensDeeperEnvironments) {
+    Lexer lexer(R"(\begin{a}\begin{b}\begin{c}\begin{d}inner\end{d}\end{c}tail\end{b}\end{a} after)");
+    Parser::Limits limits;
+    limits.maxNesting = 2;
+    Parser parser(lexer, limits);
+    auto flat = parser.parseFlatDocument();
+
+    EXPECT_EQ(parser.getNestingLimitHits(), 2u);
+    std::vector<FlatAST::Index> inB = flat->children(2);
+    ASSERT_EQ(inB.size(), 4u);
+    EXPECT_EQ(flat->command(inB[0]).name, "c");
+    EXPECT_EQ(flat->command(inB[1]).name, "d");
+    EXPECT_EQ(flat->content(inB[2]), "inner");
+    EXPECT_EQ(flat->content(inB[3]), "tail");
+    EXPECT_EQ(flat->content(flat->nextSibling(1)), "after");
+}
+
+TEST(SymbolTableTest, InterningIsStableAcrossGrowth) {
+    std::vector<std::string> names;
+    for (int i = 0; i < 1000; ++i) {
+        names.push_back("label:" + std::to_string(i));
+    }
+    SymbolTable table;
+    for (size_t i = 0; i < names.size(); ++i) {
+        EXPECT_EQ(table.intern(names[i]), i);
+    }
+    for (size_t i = 0; i < names.size(); ++i) {
+        EXPECT_EQ(table.intern(names[i]), i);
+        EXPECT_EQ(table.find(names[i]), i);
+        EXPECT_EQ(table.name(static_cast<SymbolTable::Id>(i)), names[i]);
+    }
+    EXPECT_EQ(table.find("missing"), SymbolTable::npos);
+    EXPECT_EQ(table.size(), names.size());
+}
+
+TEST(ParserTest, ReferencesResolveAfterParsing) {
+    Lexer lexer(R"(See \ref{late} and \cref{early, late}. \label{early}
+\begin{equation}x\label{late}\end{equation} \eqref{missing})");
+    Parser parser(lexer);
+    auto ast = parser.parseDocument();
+
+    const CrossReferences& refs = ast->crossReferences;
+    EXPECT_EQ(refs.labels.size(), 2u);
+    EXPECT_EQ(refs.references.size(), 4u);
+    EXPECT_EQ(refs.unresolved, 1u);
+
+    const auto& top = ast->root->getChildren();
+    auto findCommand = [&](std::string_view text) {
+        for (ASTNode* node : top) {
+            if (node->getContentView().substr(0, text.size()) == text) {
+                return node;
+            }
+        }
+        return static_cast<ASTNode*>(nullptr);
+    };
+    ASTNode* ref = findCommand("\\ref");
+    ASTNode* cref = findCommand("\\cref");
+    ASTNode* early = findCommand("\\label");
+    ASTNode* equation = findCommand("\\begin{equation}");
+    ASSERT_TRUE(ref && cref && early && equation);
+    ASTNode* late = equation->getChildren().back();
+
+    ASSERT_EQ(ref->getReferences().size(), 1u);
+    EXPECT_EQ(ref->getReferences()[0], late);
+    ASSERT_EQ(cref->getReferences().size(), 2u);
+    EXPECT_EQ(cref->getReferences()[0], early);
+    EXPECT_EQ(cref->getReferences()[1], late);
+    EXPECT_TRUE(findCommand("\\eqref")->getReferences().empty());
+
+    auto flat = FlatAST::fromTree(*ast);
+    for (size_t i = 0; i < refs.references.size(); ++i) {
+        CrossReferences::Index target = flat->crossReferences.targets[i];
+        if (target != CrossReferences::npos) {
+            EXPECT_EQ(flat->content(target).substr(0, 6), "\\label");
+        }
+    }
+}
+
+TEST(ASTImageTest, MappedImageMatchesTheParsedTree) {
+    Lexer lexer(SourceBuffer::fromString(R"(\newcommand{\sect}[1]{\section{#1}}
+\sect{Results} See \ref{eq}. \begin{equation}x\label{eq}\end{equation} \cite[p.~3]{k})"), LexerMode::Span);
+    MacroExpander expander(lexer);
+    Parser parser(expander);
+    auto flat = FlatAST::fromTree(*parser.parseDocument());
+
+    std::filesystem::path path = std::filesystem::temp_directory_path() / "texquery_ast_image_test.ast";
+    {
+        std::ofstream out(path, std::ios::binary);
+        ASTImage::write(*flat, "input-hash", out);
+    }
+    auto image = ASTImage::map(path.string());
+    std::filesystem::remove(path);
+    EXPECT_EQ(image->key(), "input-hash");
+    EXPECT_EQ(image->source(), flat->source->view());
+    ASSERT_EQ(image->size(), flat->size());
+    for (FlatAST::Index i = 0; i < flat->size(); ++i) {
+        EXPECT_EQ(image->type(i), flat->type(i));
+        EXPECT_EQ(image->content(i), flat->content(i));
+        EXPECT_EQ(image->position(i), flat->position(i));
+        EXPECT_EQ(image->state(i), flat->state(i));
+        EXPECT_EQ(image->parent(i), flat->parent(i));
+        EXPECT_EQ(image->subtreeEnd(i), flat->subtreeEnd(i));
+        CommandRecord command = image->command(i);
+        EXPECT_EQ(command.id, flat->command(i).id);
+        EXPECT_EQ(command.name, flat->command(i).name);
+        EXPECT_EQ(command.optional, flat->command(i).optional);
+        EXPECT_EQ(command.required, flat->command(i).required);
+    }
+    EXPECT_EQ(image->children(0), flat->children(0));
+
+    auto replayed = FlatAST::fromTree(*image->toTree());
+    ASSERT_EQ(replayed->size(), flat->size());
+    for (FlatAST::Index i = 0; i < flat->size(); ++i) {
+        EXPECT_EQ(replayed->type(i), flat->type(i));
+        EXPECT_EQ(replayed->content(i), flat->content(i));
+        EXPECT_EQ(replayed->subtreeEnd(i), flat->subtreeEnd(i));
+    }
+    EXPECT_EQ(replayed->crossReferences.targets, flat->crossReferences.targets);
+    EXPECT_EQ(replayed->crossReferences.unresolved, 0u);
+}
+
+TEST(ASTImageTest, RejectsOtherVersionsAndTruncatedImages) {
+    Lexer lexer(R"(\section{A} text)");
+    Parser parser(lexer);
+    auto flat = FlatAST::fromTree(*parser.parseDocument());
+    std::ostringstream out;
+    ASTImage::write(*flat, "", out);
+    std::string bytes = out.str();
+    EXPECT_NO_THROW(ASTImage::fromBuffer(SourceBuffer::fromString(bytes)));
+
+    std::string truncated = bytes.substr(0, bytes.size() - 8);
+    EXPECT_THROW(ASTImage::fromBuffer(SourceBuffer::fromString(truncated)), std::runtime_error);
+    std::string otherVersion = bytes;
+    otherVersion[8] ^= 0x7F;
+    EXPECT_THROW(ASTImage::fromBuffer(SourceBuffer::fromString(otherVersion)), std::runtime_error);
+    EXPECT_THROW(ASTImage::fromBuffer(SourceBuffer::fromString("not an image")), std::runtime_error);
+}
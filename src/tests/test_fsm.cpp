@@ -4,6 +4,7 @@
 #include "../parser.h"
 #include "../ast.h"
 #include <memory>
+#include <sstream>
 #include <string>
 
 class FSMTest : public ::testing::Test {
@@ -283,6 +284,230 @@ TEST_F(FSMTest, AffiliationReferenceExtraction) {
     EXPECT_EQ(jsonDocument["document"]["metadata"]["authors"][2]["affiliations"][1], "Institute 2, Another University");
 }
 
+TEST_F(FSMTest, InvalidTransitionsAreRecordedNotThrown) {
+    AST ast;
+    ASTNode* env = ast.createNode(ASTNode::NodeType::Environment, "\\begin{center}", 0, ParserState::EnvironmentState);
+    ASTNode* section = ast.createNode(ASTNode::NodeType::Section, "\\section{Inside}", 15, ParserState::EnvironmentState);
+    ASSERT_TRUE(ast.root->addChild(env));
+    ASSERT_TRUE(env->addChild(section));
+
+    FSM fsm;
+    fsm.chunkDocument(ast.root);
+
+    const DiagnosticSink& diagnostics = fsm.getDiagnostics();
+    ASSERT_EQ(diagnostics.count(DiagnosticCode::InvalidTransition), 1u);
+    EXPECT_EQ(diagnostics.getRecords()[0].position, 15u);
+    EXPECT_EQ(diagnostics.getRecords()[0].nodeType, static_cast<int>(ASTNode::NodeType::Section));
+}
+
+TEST(FSMTransitionTest, MatrixFollowsTheRuleTable) {
+    using State = FSM::FSMState;
+    static_assert(FSM::CheckedTransitions::allows(State::Start, State::InDocument), "");
+    static_assert(!FSM::CheckedTransitions::allows(State::Start, State::InText), "");
+    static_assert(FSM::UncheckedTransitions::allows(State::Start, State::InText), "");
+
+    for (const fsm_rules::Rule& rule : fsm_rules::rules) {
+        for (size_t to = 0; to < FSM::stateCount; ++to) {
+            bool listed = rule.to >> to & 1;
+            EXPECT_EQ(FSM::CheckedTransitions::allows(rule.from, static_cast<State>(to)), listed);
+        }
+    }
+    // States without a row accept nothing.
+    EXPECT_FALSE(FSM::CheckedTransitions::allows(State::InBibliography, State::InText));
+}
+
+TEST(FSMChunkTest, SinksReceiveEachChunkOnce) {
+    AST ast;
+    const char* parts[][2] = {{"\\section{One}", "Intro $x$ here."}, {"\\section{Two}", "More text."}};
+    size_t position = 0;
+    for (const auto& part : parts) {
+        ASTNode* section = ast.createNode(ASTNode::NodeType::Section, part[0], position++, ParserState::DefaultState);
+        ASTNode* text = ast.createNode(ASTNode::NodeType::Text, part[1], position++, ParserState::DefaultState);
+        ASSERT_TRUE(ast.root->addChild(section));
+        ASSERT_TRUE(ast.root->addChild(text));
+    }
+
+    FSM collected;
+    std::vector<std::string> chunks = collected.chunkDocument(ast.root);
+    ASSERT_EQ(chunks.size(), 3u);
+    EXPECT_NE(chunks[1].find("<inline_math>x</inline_math>"), std::string::npos);
+    EXPECT_NE(chunks[2].find("<text_content>More text.</text_content>"), std::string::npos);
+
+    std::ostringstream out;
+    StreamChunkSink stream(out, "\n--\n");
+    FSM streamed;
+    streamed.chunkDocument(ast.root, stream);
+    EXPECT_EQ(stream.getChunkCount(), chunks.size());
+    EXPECT_EQ(out.str(), chunks[0] + "\n--\n" + chunks[1] + "\n--\n" + chunks[2] + "\n--\n");
+}
+
+TEST(JsonWriterTest, MatchesDumpInBothStyles) {
+    std::string tricky = "plain ASCII run, long enough for words \"quoted\" \\ tab\t nl\n \x01 caf\xC3\xA9 \xF0\x9F\x98\x80 \x7F";
+    nlohmann::json expected = {
+        {"text", tricky},
+        {"empty", nlohmann::json::array()},
+        {"nested", {{"ids", {1, -2, 30}}, {"none", nullptr}, {"flag", true}, {"inner", nlohmann::json::object()}}}
+    };
+
+    for (JsonWriter::Style style : {JsonWriter::Style::Pretty, JsonWriter::Style::Compact}) {
+        std::ostringstream out;
+        {
+            JsonWriter writer(out, style);
+            writer.beginObject();
+            writer.key("empty");
+            writer.beginArray();
+            writer.endArray();
+            writer.key("nested");
+            writer.beginObject();
+            writer.key("flag");
+            writer.value(true);
+            writer.key("ids");
+            writer.beginArray();
+            for (int id : {1, -2, 30}) {
+                writer.value(id);
+            }
+            writer.endArray();
+            writer.key("inner");
+            writer.beginObject();
+            writer.endObject();
+            writer.key("none");
+            writer.null();
+            writer.endObject();
+            writer.key("text");
+            writer.value(tricky);
+            writer.endObject();
+        }
+        EXPECT_EQ(out.str(), style == JsonWriter::Style::Pretty ? expected.dump(4) : expected.dump());
+    }
+
+    std::string escaped;
+    JsonWriter::appendEscaped(escaped, "ok\xC3(\xED\xA0\x80");
+    EXPECT_EQ(escaped, "ok\xEF\xBF\xBD(\xEF\xBF\xBD\xEF\xBF\xBD\xEF\xBF\xBD");
+}
+
+TEST(FSMChunkTest, StreamedDocumentMatchesJsonDocument) {
+    AST ast;
+    ASTNode* section = ast.createNode(ASTNode::NodeType::Section, "\\section{Intro}", 0, ParserState::DefaultState);
+    ASTNode* text = ast.createNode(ASTNode::NodeType::Text, "A \"quoted\" $x$ word.", 1, ParserState::DefaultState);
+    ASSERT_TRUE(ast.root->addChild(section));
+    ASSERT_TRUE(ast.root->addChild(text));
+
+    FSM dom;
+    std::string expected = dom.chunkDocumentToJson(ast.root).dump(4);
+
+    std::ostringstream out;
+    FSM streamed;
+    {
+        JsonWriter writer(out);
+        streamed.writeDocumentJson(ast.root, writer);
+    }
+    EXPECT_EQ(out.str(), expected);
+}
+
+namespace {
+
+struct CollectedChunk {
+    std::string text;
+    std::string section;
+    size_t tokens;
+};
+
+class CollectingSink : public EmbeddingSink {
+public:
+    void write(const EmbeddingChunk& chunk) override {
+        chunks.push_back(CollectedChunk{std::string(chunk.text), std::string(chunk.sectionPath), chunk.tokens});
+    }
+    std::vector<CollectedChunk> chunks;
+};
+
+size_t count(const std::string& text, const std::string& needle) {
+    size_t n = 0;
+    for (size_t pos = text.find(needle); pos != std::string::npos; pos = text.find(needle, pos + 1)) {
+        n++;
+    }
+    return n;
+}
+
+}
+
+TEST(TokenChunkerTest, SplitsAtBoundariesWithinBudget) {
+    std::string citation = "<citation type=\"cite\">\n  <key>alpha</key>\n  <key>beta</key>\n</citation>\n";
+    std::string math = "<math_content>\n  <math_type>display</math_type>\n  <math_expression>a + b + c + d + e + f + g + h</math_expression>\n</math_content>\n";
+    std::string first = "<section_header>\n  <level>2</level>\n  <title>Intro</title>\n</section_header>\n"
+                        "<text_content>One two three. Four five six! Seven {eight. nine} ten.\n\nEleven twelve</text_content>\n" +
+                        citation + math + "<text_content>Tail words here.</text_content>\n"
+                        "<section_header>\n  <level>3</level>\n  <title>Details</title>\n</section_header>\n";
+    std::string second = "<text_content>Last part.</text_content>\n";
+
+    TokenChunker::Options options;
+    options.maxTokens = 40;
+    options.overlapTokens = 8;
+    CollectingSink sink;
+    TokenChunker chunker(sink, options);
+    chunker.write(first);
+    chunker.write(second);
+    chunker.finish();
+
+    ASSERT_GT(sink.chunks.size(), 3u);
+    size_t citations = 0;
+    for (const CollectedChunk& chunk : sink.chunks) {
+        EXPECT_EQ(count(chunk.text, "<text_content>"), count(chunk.text, "</text_content>"));
+        EXPECT_EQ(count(chunk.text, "<citation"), count(chunk.text, "</citation>"));
+        EXPECT_EQ(count(chunk.text, "<math_content>"), count(chunk.text, "</math_content>"));
+        EXPECT_EQ(chunk.text.find("{eight. </text_content>"), std::string::npos);
+        citations += count(chunk.text, "<citation");
+        // Only an indivisible block, or a section header with the first
+        // fragment after it, may exceed the budget.
+        if (chunk.tokens > options.maxTokens) {
+            EXPECT_TRUE(chunk.text.rfind("<math_content>", 0) == 0 || chunk.text.rfind("<section_header>", 0) == 0)
+                << chunk.text;
+        }
+        EXPECT_EQ(chunk.tokens, estimateTokens(chunk.text));
+    }
+    EXPECT_GE(citations, 1u);
+
+    EXPECT_EQ(sink.chunks.front().section, "Intro");
+    EXPECT_EQ(sink.chunks.front().text.rfind("<section_header>", 0), 0u);
+    EXPECT_EQ(sink.chunks.back().section, "Intro > Details");
+    EXPECT_NE(sink.chunks.back().text.find("Last part."), std::string::npos);
+    // The second chunk repeats the sentence that ended the first.
+    EXPECT_EQ(sink.chunks[1].text.rfind("<text_content>One two three. Four five six! ", 0), 0u) << sink.chunks[1].text;
+}
+
+TEST(TokenCounterTest, MatchesVocabularyTokensGreedily) {
+    std::istringstream vocab("aGVsbG8= 0\nIHdvcmxk 1\naA== 2\nw6k= 3\nbGxv 4\nIA== 5\nLg== 6\nMTIz 7\nCgo= 8\n!!! 9\n");
+    EXPECT_EQ(loadTokenVocabulary(vocab), 9u);
+
+    // hello| world|.| |123|4|5|6|h|é|llo|\n\n|\n
+    std::string text = "hello world. 123456h\xC3\xA9llo\n\n\n";
+    EXPECT_EQ(estimateTokens(text), 13u);
+    EXPECT_EQ(estimateTokens(""), 0u);
+
+    resetTokenVocabulary();
+    EXPECT_EQ(estimateTokens(text), roughTokenCount(text));
+}
+
+TEST(DAGTest, NumbersNodesPerGraph) {
+    DAG first;
+    auto intro = first.createNode(NodeType::Section, "Intro");
+    EXPECT_EQ(intro->getId(), "0_1_Intro");
+    EXPECT_EQ(first.getNode("0_1_Intro"), intro);
+    EXPECT_EQ(first.getNode("0_1_Other"), nullptr);
+    EXPECT_EQ(first.getNode("7_1_Intro"), nullptr);
+
+    // Numbering starts over in each graph and counts named nodes too.
+    DAG second;
+    auto author = second.getOrCreateNode("Jane Roe", NodeType::Author);
+    EXPECT_EQ(second.createNode(NodeType::Section, "Intro")->getId(), "1_1_Intro");
+    EXPECT_EQ(second.getOrCreateNode("Jane Roe", NodeType::Author), author);
+
+    auto replacement = DAGNode::create("Jane Roe", NodeType::Author);
+    second.addNode(replacement);
+    EXPECT_EQ(second.getNode("Jane Roe"), replacement);
+    EXPECT_EQ(replacement->getIndex(), author->getIndex());
+    EXPECT_EQ(second.getNodeCount(), 2u);
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -0,0 +1,56 @@
+#include "gtest/gtest.h"
+#include "../include_resolver.h"
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+TEST(IncludeResolverTest, ScansIncludeFormsOutsideComments) {
+    std::vector<IncludeDirective> directives = scanIncludes(
+        "\\input{ sec/a }\\input b.tex\n% \\input{commented}\n\\\\input{escaped}\\includegraphics{fig}"
+        "\\inputencoding{latin1}\\subfile{sub}\\import{parts/}{p}\\subimport*{d}{g}\\begin{document}");
+    ASSERT_EQ(directives.size(), 6u);
+    EXPECT_EQ(directives[0].kind, IncludeDirective::Kind::Input);
+    EXPECT_EQ(directives[0].name, "sec/a");
+    EXPECT_EQ(directives[1].name, "b.tex");
+    EXPECT_EQ(directives[2].kind, IncludeDirective::Kind::Subfile);
+    EXPECT_EQ(directives[3].kind, IncludeDirective::Kind::Import);
+    EXPECT_EQ(directives[3].directory, "parts/");
+    EXPECT_EQ(directives[3].name, "p");
+    EXPECT_EQ(directives[4].kind, IncludeDirective::Kind::Subimport);
+    EXPECT_EQ(directives[4].name, "g");
+    EXPECT_EQ(directives[5].kind, IncludeDirective::Kind::BeginDocument);
+}
+
+TEST(IncludeResolverTest, AssemblesIncludedFilesAndReusesCachedOnes) {
+    namespace fs = std::filesystem;
+    fs::path dir = fs::temp_directory_path() / "texquery_include_resolver";
+    fs::remove_all(dir);
+    fs::create_directories(dir / "sec");
+    fs::create_directories(dir / "parts");
+    std::ofstream(dir / "main.tex") << "\\begin{document}\n\\input{sec/a}\n\\subfile{sub}\n\\import{parts/}{p}\n"
+                                       "\\input{missing}\n\\input{sec/a}\n\\end{document}";
+    std::ofstream(dir / "sec" / "a.tex") << "A \\begin{document}text\\end{document}\\input{b}";
+    std::ofstream(dir / "sec" / "b.tex") << "B";
+    std::ofstream(dir / "sub.tex") << "\\documentclass[main]{subfiles}\n\\begin{document}SUB\\end{document}";
+    std::ofstream(dir / "parts" / "p.tex") << "\\input{q}";
+    std::ofstream(dir / "parts" / "q.tex") << "Q";
+
+    SourceCache cache(1024 * 1024);
+    IncludeResolver::Options options;
+    options.cache = &cache;
+    IncludeGraph graph = IncludeResolver::resolve(dir / "main.tex", options);
+    EXPECT_EQ(graph.assemble(), "\\begin{document}\nA textB\nSUB\nQ\n\\input{missing}\n\n\\end{document}");
+    ASSERT_EQ(graph.getFiles().size(), 6u);
+    EXPECT_EQ(graph.getFiles()[0].includes, (std::vector<size_t>{1, 3, 4, 1}));
+    EXPECT_EQ(graph.getFiles()[4].path, dir / "parts" / "p.tex");
+    EXPECT_EQ(cache.getStats().hits, 0u);
+
+    options.prefetchThreads = 1;
+    IncludeGraph again = IncludeResolver::resolve(dir / "main.tex", options);
+    EXPECT_EQ(again.assemble(), graph.assemble());
+    EXPECT_EQ(cache.getStats().hits, 5u);
+    EXPECT_TRUE(again.getFiles()[1].fromCache);
+    EXPECT_FALSE(again.getFiles()[0].fromCache);
+    fs::remove_all(dir);
+}
@@ -0,0 +1,256 @@
+#include "gtest/gtest.h"
+#include "../lexer.h"
+#include "../parser.h"
+#include "../ast.h"
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::vector<Token> lexAll(Lexer& lexer) {
+    std::vector<Token> tokens;
+    while (true) {
+        Token token = lexer.getNextToken();
+        if (token.type == TokenType::EOFToken) break;
+        tokens.push_back(token);
+    }
+    return tokens;
+}
+
+}
+
+TEST(LexerTest, OwningModeKeepsDisplayValues) {
+    Lexer lexer(R"(\section[short]{Intro} Some text $x$)");
+    auto tokens = lexAll(lexer);
+
+    ASSERT_EQ(tokens.size(), 2u);
+    EXPECT_EQ(tokens[0].type, TokenType::Command);
+    EXPECT_EQ(tokens[0].value, "\\section [short] {Intro}");
+    EXPECT_EQ(tokens[0].text, "\\section[short]{Intro}");
+    EXPECT_EQ(tokens[1].value, "Some text $x$");
+    EXPECT_EQ(tokens[1].position, 23u);
+}
+
+TEST(LexerTest, SpanModeTokensPointIntoSource) {
+    auto source = SourceBuffer::fromString(R"(\cite{knuth84} and {braces} % gone
+$$E=mc^2$$)");
+    Lexer lexer(source, LexerMode::Span);
+    auto tokens = lexAll(lexer);
+
+    const char* begin = source->begin();
+    const char* end = source->end();
+    for (const auto& token : tokens) {
+        EXPECT_TRUE(token.value.empty());
+        EXPECT_GE(token.text.data(), begin);
+        EXPECT_LE(token.text.data() + token.text.size(), end);
+        EXPECT_EQ(token.text, source->view().substr(token.position, token.text.size()));
+    }
+
+    ASSERT_EQ(tokens.size(), 7u);
+    EXPECT_EQ(tokens[0].view(), "\\cite{knuth84}");
+    EXPECT_EQ(tokens[1].view(), "and ");
+    EXPECT_EQ(tokens[2].type, TokenType::OpenBrace);
+    EXPECT_EQ(tokens[5].type, TokenType::MathShift);
+    EXPECT_EQ(tokens[5].view(), "$$");
+    EXPECT_EQ(tokens[6].view(), "E=mc^2$$");
+}
+
+TEST(LexerTest, SpanModeParserBorrowsContent) {
+    auto source = SourceBuffer::fromString("Plain words $a+b$ tail");
+    Lexer lexer(source, LexerMode::Span);
+    Parser parser(lexer);
+    auto ast = parser.parseDocument();
+
+    ASSERT_EQ(ast->source, source);
+    const auto& children = ast->root->getChildren();
+    ASSERT_FALSE(children.empty());
+    std::string_view text = children[0]->getContentView();
+    EXPECT_EQ(text, "Plain words $a+b$ tail");
+    EXPECT_EQ(text.data(), source->begin());
+}
+
+TEST(LexerTest, EnvironmentTokensCarryId) {
+    Lexer lexer(R"(\begin{figure*}[t] \caption{A} \end{figure*} \begin{mybox}\end{mybox})");
+    auto tokens = lexAll(lexer);
+
+    ASSERT_EQ(tokens.size(), 5u);
+    EXPECT_EQ(tokens[0].type, TokenType::BeginEnvironment);
+    EXPECT_EQ(tokens[0].command.id, static_cast<uint32_t>(EnvironmentId::Figure));
+    EXPECT_EQ(tokens[0].command.name, "figure*");
+    EXPECT_EQ(tokens[0].text, "\\begin{figure*}[t]");
+    EXPECT_EQ(tokens[1].type, TokenType::Command);
+    EXPECT_EQ(tokens[2].type, TokenType::EndEnvironment);
+    EXPECT_EQ(tokens[2].command.id, static_cast<uint32_t>(EnvironmentId::Figure));
+    EXPECT_EQ(tokens[3].command.id, static_cast<uint32_t>(EnvironmentId::Other));
+    EXPECT_EQ(tokens[3].command.name, "mybox");
+    EXPECT_EQ(tokens[4].type, TokenType::EndEnvironment);
+}
+
+TEST(LexerTest, CommandRecordsKeepNestedArguments) {
+    auto source = SourceBuffer::fromString(
+        R"(\newcommand{\kp}[1]{K_\mathrm{#1}} \section*{Intro \label{s:intro}} \cite[p.~3]{a, b}\\)");
+    Lexer lexer(source, LexerMode::Span);
+    auto tokens = lexAll(lexer);
+
+    ASSERT_EQ(tokens.size(), 5u);
+    const CommandRecord& newcommand = tokens[0].command;
+    EXPECT_EQ(newcommand.commandId(), CommandId::Newcommand);
+    EXPECT_EQ(newcommand.name, "newcommand");
+    ASSERT_EQ(newcommand.required.size(), 2u);
+    EXPECT_EQ(newcommand.required[0], "\\kp");
+    EXPECT_EQ(newcommand.required[1], "K_\\mathrm{#1}");
+    ASSERT_EQ(newcommand.optional.size(), 1u);
+    EXPECT_EQ(newcommand.optional[0], "1");
+
+    const CommandRecord& section = tokens[1].command;
+    EXPECT_EQ(section.commandId(), CommandId::Section);
+    EXPECT_EQ(commandKind(section.commandId()), CommandKind::Sectioning);
+    EXPECT_TRUE(section.starred);
+    ASSERT_EQ(section.required.size(), 1u);
+    EXPECT_EQ(section.required[0], "Intro \\label{s:intro}");
+
+    const CommandRecord& cite = tokens[2].command;
+    EXPECT_EQ(commandKind(cite.commandId()), CommandKind::Citation);
+    EXPECT_EQ(cite.optional[0], "p.~3");
+    EXPECT_EQ(cite.required[0], "a, b");
+    EXPECT_EQ(cite.required[0].data(), source->begin() + source->view().find("a, b"));
+
+    EXPECT_TRUE(tokens[3].command.name.empty());
+    EXPECT_TRUE(tokens[4].command.name.empty());
+}
+
+TEST(ParserTest, EnvironmentsBuildNestedSubtrees) {
+    for (LexerMode mode : {LexerMode::Owning, LexerMode::Span}) {
+        auto source = SourceBuffer::fromString(
+            "\\begin{document}intro \\begin{itemize}\\item one \\begin{x}\\end{itemize}"
+            " \\end{stray} tail \\item $\\alpha$ \\end{document} after");
+        Lexer lexer(source, mode);
+        Parser parser(lexer);
+        auto ast = parser.parseDocument();
+
+        const auto& top = ast->root->getChildren();
+        ASSERT_EQ(top.size(), 2u);
+        const auto& document = top[0];
+        EXPECT_EQ(document->getType(), ASTNode::NodeType::Environment);
+        EXPECT_EQ(document->getCommand().id, static_cast<uint32_t>(EnvironmentId::Document));
+        EXPECT_EQ(document->getContent(), "\\begin{document}");
+        EXPECT_EQ(top[1]->getContent(), "after");
+
+        const auto& body = document->getChildren();
+        ASSERT_EQ(body.size(), 5u);
+        EXPECT_EQ(body[0]->getContent(), "intro ");
+        EXPECT_EQ(body[2]->getContent(), "tail ");
+        EXPECT_EQ(body[4]->getType(), ASTNode::NodeType::Math);
+
+        // The unclosed {x} is closed by its parent's \end{itemize}.
+        const auto& itemize = body[1];
+        EXPECT_EQ(itemize->getCommand().name, "itemize");
+        ASSERT_EQ(itemize->getChildren().size(), 3u);
+        const auto& inner = itemize->getChildren()[2];
+        EXPECT_EQ(inner->getCommand().id, static_cast<uint32_t>(EnvironmentId::Other));
+        EXPECT_EQ(inner->getCommand().name, "x");
+        EXPECT_TRUE(inner->getChildren().empty());
+    }
+}
+
+namespace {
+
+std::vector<StructuralIndex::Backend> availableBackends() {
+    std::vector<StructuralIndex::Backend> backends = {StructuralIndex::Backend::Scalar};
+    if (StructuralIndex::detectBackend() != StructuralIndex::Backend::Scalar) {
+        backends.push_back(StructuralIndex::detectBackend());
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (StructuralIndex::detectBackend() == StructuralIndex::Backend::AVX2) {
+        backends.push_back(StructuralIndex::Backend::SSE42);
+    }
+#endif
+    return backends;
+}
+
+void expectSameTokens(const std::string& input) {
+    auto source = SourceBuffer::fromString(input);
+    Lexer reference(source, LexerMode::Span, StructuralIndex::Backend::Scalar);
+    auto expected = lexAll(reference);
+
+    for (auto backend : availableBackends()) {
+        Lexer lexer(source, LexerMode::Span, backend);
+        auto tokens = lexAll(lexer);
+        ASSERT_EQ(tokens.size(), expected.size()) << StructuralIndex::backendName(backend);
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            EXPECT_EQ(tokens[i].type, expected[i].type);
+            EXPECT_EQ(tokens[i].position, expected[i].position);
+            EXPECT_EQ(tokens[i].text, expected[i].text);
+        }
+    }
+}
+
+}
+
+TEST(StructuralIndexTest, FindsTextStopsAndMatchingGroups) {
+    std::string input = std::string(70, 'a') + "\\cmd[x[y]]{a{b}c}{open";
+    StructuralIndex index(input, StructuralIndex::detectBackend());
+
+    EXPECT_EQ(index.nextTextStop(0), 70u);
+    EXPECT_EQ(index.nextTextStop(71), 80u);
+    EXPECT_EQ(index.bracketClose(74), 79u);
+    EXPECT_EQ(index.braceClose(80), 86u);
+    EXPECT_EQ(index.braceClose(87), input.size());
+    EXPECT_EQ(index.braceClose(0), StructuralIndex::npos);
+}
+
+TEST(StructuralIndexTest, BackendsMatchScalarLexer) {
+    expectSameTokens(R"(\documentclass[twocolumn]{aastex631} % comment {
+\title{Nested {braces} and [brackets [inside]]} plain prose that runs well past
+one sixty-four byte block so the word-skipping path is exercised $x^2$ \\ \{ }
+\frac{a}{b} \unbalanced{never closed [ nor this)");
+    expectSameTokens(std::string("text\0with{nul}", 14) + "\\cmd{a\0b}");
+    expectSameTokens(std::string(200, ' ') + "\\x[" + std::string(100, '[') + "]");
+
+    const char alphabet[] = "ab \n\\{}[]%$";
+    unsigned seed = 12345;
+    for (int round = 0; round < 50; ++round) {
+        std::string input;
+        for (int i = 0; i < 300; ++i) {
+            seed = seed * 1103515245u + 12345u;
+            input += alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+        }
+        expectSameTokens(input);
+    }
+}
+
+TEST(CommandTableTest, PerfectHashClassifiesBuiltinsAndRejectsOthers) {
+    EXPECT_EQ(classifyCommand("documentclass").id, CommandId::Documentclass);
+    EXPECT_EQ(classifyCommand("citeauthor").kind, CommandKind::Citation);
+    EXPECT_EQ(classifyCommand("DeclareMathOperator").id, CommandId::DeclareMathOperator);
+    EXPECT_EQ(classifyCommand("eqref").kind, CommandKind::Reference);
+    for (std::string_view name : {"", "sectionx", "Section", "secti", "mathbb", "\\section"}) {
+        EXPECT_EQ(classifyCommand(name).id, CommandId::Other) << name;
+        EXPECT_EQ(classifyCommand(name).kind, CommandKind::Generic) << name;
+    }
+}
+
+TEST(CommandTableTest, AliasesExtendTheTable) {
+    std::istringstream aliases(R"(# journal macros
+\citeal \citep
+fref ref
+broken
+nothing \undefinedcommand
+\cite \ref
+)");
+    EXPECT_EQ(loadCommandAliases(aliases), 2u);
+
+    Lexer lexer(R"(\citeal{k}\fref{fig:a})");
+    auto tokens = lexAll(lexer);
+    ASSERT_GE(tokens.size(), 2u);
+    EXPECT_EQ(tokens[0].command.commandId(), CommandId::Citep);
+    EXPECT_EQ(commandKind(tokens[0].command.commandId()), CommandKind::Citation);
+    EXPECT_EQ(tokens[1].command.commandId(), CommandId::Ref);
+    EXPECT_EQ(classifyCommand("section").id, CommandId::Section);
+    EXPECT_EQ(classifyCommand("cite").id, CommandId::Cite);
+
+    resetCommandAliases();
+    EXPECT_EQ(classifyCommand("citeal").id, CommandId::Other);
+}
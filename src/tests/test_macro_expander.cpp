@@ -0,0 +1,132 @@
+#include "gtest/gtest.h"
+#include "../macro_expander.h"
+#include "../parser.h"
+#include "../ast.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::vector<Token> expandAll(MacroExpander& expander) {
+    std::vector<Token> tokens;
+    while (true) {
+        Token token = expander.getNextToken();
+        if (token.type == TokenType::EOFToken) break;
+        tokens.push_back(token);
+    }
+    return tokens;
+}
+
+std::vector<std::string> commandNames(const std::vector<Token>& tokens) {
+    std::vector<std::string> names;
+    for (const auto& token : tokens) {
+        if (token.type == TokenType::Command) {
+            names.emplace_back(token.command.name);
+        }
+    }
+    return names;
+}
+
+}
+
+TEST(MacroExpanderTest, NewcommandSubstitutesArgumentsAndDefault) {
+    Lexer lexer(SourceBuffer::fromString(R"(\newcommand{\vect}[1]{\mathbf{#1}}
+\newcommand{\pair}[2][a]{\cite{#1,#2}}
+\vect{x} \pair{b} \pair[c]{d})"), LexerMode::Span);
+    MacroExpander expander(lexer);
+    auto tokens = expandAll(expander);
+
+    EXPECT_TRUE(expander.isDefined("vect"));
+    EXPECT_TRUE(expander.isDefined("pair"));
+    EXPECT_EQ(expander.getStats().definitions, 2u);
+
+    std::vector<std::string> expected = {"newcommand", "newcommand", "mathbf", "cite", "cite"};
+    EXPECT_EQ(commandNames(tokens), expected);
+
+    std::vector<std::string_view> required;
+    for (const auto& token : tokens) {
+        if (token.type == TokenType::Command && !token.command.required.empty() &&
+            token.command.commandId() != CommandId::Newcommand) {
+            required.push_back(token.command.required[0]);
+        }
+    }
+    std::vector<std::string_view> expectedRequired = {"x", "a,b", "c,d"};
+    EXPECT_EQ(required, expectedRequired);
+}
+
+TEST(MacroExpanderTest, DefAndDeclareMathOperator) {
+    Lexer lexer(SourceBuffer::fromString(R"(\def\swap#1#2{\frac{#2}{#1}}\DeclareMathOperator*{\argmax}{arg\,max}
+\swap{a}{b} \argmax)"), LexerMode::Span);
+    MacroExpander expander(lexer);
+    auto tokens = expandAll(expander);
+
+    std::vector<std::string> expected = {"def", "DeclareMathOperator", "frac", "operatorname"};
+    EXPECT_EQ(commandNames(tokens), expected);
+    for (const auto& token : tokens) {
+        if (token.command.name == "frac") {
+            ASSERT_EQ(token.command.required.size(), 2u);
+            EXPECT_EQ(token.command.required[0], "b");
+            EXPECT_EQ(token.command.required[1], "a");
+        }
+        if (token.command.name == "operatorname") {
+            EXPECT_TRUE(token.command.starred);
+            ASSERT_EQ(token.command.required.size(), 1u);
+            EXPECT_EQ(token.command.required[0], "arg\\,max");
+        }
+    }
+}
+
+TEST(MacroExpanderTest, ExpandedSectioningReachesParser) {
+    Lexer lexer(SourceBuffer::fromString(R"(\newcommand{\sect}[1]{\section{#1}}
+\sect{Results} Body text)"), LexerMode::Span);
+    MacroExpander expander(lexer);
+    Parser parser(expander);
+    auto ast = parser.parseDocument();
+
+    bool foundSection = false;
+    for (const auto& child : ast->root->getChildren()) {
+        if (child->getCommand().commandId() == CommandId::Section) {
+            foundSection = true;
+            EXPECT_EQ(commandKind(child->getCommand().commandId()), CommandKind::Sectioning);
+            ASSERT_EQ(child->getCommand().required.size(), 1u);
+            EXPECT_EQ(child->getCommand().required[0], "Results");
+        }
+    }
+    EXPECT_TRUE(foundSection);
+    EXPECT_FALSE(ast->auxiliarySources.empty());
+}
+
+TEST(MacroExpanderTest, RepeatedInvocationsHitCache) {
+    Lexer lexer(SourceBuffer::fromString(R"(\newcommand{\R}{\mathbb{R}}\R \R \R)"), LexerMode::Span);
+    MacroExpander expander(lexer);
+    auto tokens = expandAll(expander);
+
+    EXPECT_EQ(expander.getStats().expansions, 3u);
+    EXPECT_EQ(expander.getStats().cacheMisses, 1u);
+    EXPECT_EQ(expander.getStats().cacheHits, 2u);
+    EXPECT_EQ(commandNames(tokens).size(), 4u);
+}
+
+TEST(MacroExpanderTest, LimitsStopRunawayExpansion) {
+    {
+        Lexer lexer(SourceBuffer::fromString(R"(\def\loop{\loop}\loop)"), LexerMode::Span);
+        MacroExpander::Limits limits;
+        limits.maxDepth = 8;
+        MacroExpander expander(lexer, limits);
+        auto tokens = expandAll(expander);
+
+        EXPECT_EQ(expander.getStats().depthLimitHits, 1u);
+        std::vector<std::string> expected = {"def", "loop"};
+        EXPECT_EQ(commandNames(tokens), expected);
+    }
+    {
+        Lexer lexer(SourceBuffer::fromString(R"(\def\twice{\x\x}\def\x{abcdefgh}\twice\twice)"), LexerMode::Span);
+        MacroExpander::Limits limits;
+        limits.maxExpandedBytes = 20;
+        MacroExpander expander(lexer, limits);
+        expandAll(expander);
+
+        EXPECT_GT(expander.getStats().sizeLimitHits, 0u);
+    }
+}
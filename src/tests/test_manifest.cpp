@@ -0,0 +1,93 @@
+#include "gtest/gtest.h"
+#include "../include_resolver.h"
+#include "../manifest.h"
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+TEST(ManifestTest, SkipsRecordedPapersAndResumesAfterATruncatedLine) {
+    namespace fs = std::filesystem;
+    fs::path dir = fs::temp_directory_path() / "texquery_manifest_test";
+    fs::remove_all(dir);
+    fs::create_directories(dir / "paper");
+    fs::path tex = dir / "paper" / "main.tex";
+    std::ofstream(tex) << "\\section{A}";
+    std::ofstream(dir / "paper.json") << "{}";
+
+    Manifest::Entry entry;
+    entry.hash = Manifest::hashContent("\\section{A}");
+    entry.listing = Manifest::listingOf({tex});
+    entry.inputs.push_back(Manifest::stamp(tex));
+    entry.outputs.push_back("paper.json");
+    {
+        Manifest manifest(dir / "manifest.jsonl", "options");
+        EXPECT_EQ(manifest.load(), 0u);
+        manifest.record("paper", entry);
+        manifest.record("other", entry);
+    }
+    // A run killed while appending leaves part of a line behind.
+    std::ofstream(dir / "manifest.jsonl", std::ios::app) << "{\"paper\":\"cut";
+
+    Manifest resumed(dir / "manifest.jsonl", "options");
+    EXPECT_EQ(resumed.load(), 2u);
+    EXPECT_TRUE(resumed.isUpToDate("paper", {tex}, dir));
+    EXPECT_TRUE(resumed.hasSameContent("paper", entry.hash, dir));
+    EXPECT_FALSE(resumed.hasSameContent("paper", Manifest::hashContent("\\section{B}"), dir));
+    EXPECT_FALSE(resumed.isUpToDate("missing", {tex}, dir));
+
+    std::ofstream(tex, std::ios::app) << " more";
+    EXPECT_FALSE(resumed.isUpToDate("paper", {tex}, dir));
+    fs::remove(dir / "paper.json");
+    EXPECT_FALSE(resumed.hasSameContent("paper", entry.hash, dir));
+
+    Manifest otherOptions(dir / "manifest.jsonl", "other options");
+    EXPECT_EQ(otherOptions.load(), 0u);
+    fs::remove_all(dir);
+}
+
+TEST(ManifestTest, IncludeCreatedWhereNoneWasFoundIsAChange) {
+    namespace fs = std::filesystem;
+    fs::path dir = fs::temp_directory_path() / "texquery_manifest_missing_test";
+    fs::remove_all(dir);
+    fs::create_directories(dir / "paper" / "sections");
+    fs::path tex = dir / "paper" / "main.tex";
+    std::ofstream(tex) << "\\input{sections/intro}\n\\input{sections/method}\n";
+    std::ofstream(dir / "paper" / "sections" / "method.tex") << "\\input{setup}\n";
+    std::ofstream(dir / "paper" / "setup.tex") << "Setup.\n";
+    std::ofstream(dir / "paper.json") << "{}";
+
+    IncludeGraph includes = IncludeResolver::resolve(tex, IncludeResolver::Options());
+    ASSERT_EQ(includes.getFiles().size(), 3u);
+    // setup.tex is looked for next to method.tex before the main directory.
+    std::vector<fs::path> missing = {(dir / "paper" / "sections" / "intro.tex").lexically_normal(),
+                                     (dir / "paper" / "sections" / "setup.tex").lexically_normal()};
+    EXPECT_EQ(includes.getMissing(), missing);
+
+    Manifest::Entry entry;
+    entry.hash = Manifest::hashContent(includes.assemble());
+    entry.listing = Manifest::listingOf({tex});
+    for (const auto& file : includes.getFiles()) {
+        entry.inputs.push_back(Manifest::stamp(file.path));
+    }
+    for (const auto& path : includes.getMissing()) {
+        entry.inputs.push_back(Manifest::FileStamp{path.string(), Manifest::missingSize, 0});
+    }
+    entry.outputs.push_back("paper.json");
+    {
+        Manifest manifest(dir / "manifest.jsonl", "options");
+        manifest.load();
+        manifest.record("paper", entry);
+    }
+
+    Manifest reloaded(dir / "manifest.jsonl", "options");
+    EXPECT_EQ(reloaded.load(), 1u);
+    EXPECT_TRUE(reloaded.isUpToDate("paper", {tex}, dir));
+    std::ofstream(dir / "paper" / "sections" / "setup.tex") << "Other setup.\n";
+    EXPECT_FALSE(reloaded.isUpToDate("paper", {tex}, dir));
+    fs::remove(dir / "paper" / "sections" / "setup.tex");
+    EXPECT_TRUE(reloaded.isUpToDate("paper", {tex}, dir));
+    std::ofstream(dir / "paper" / "sections" / "intro.tex") << "Intro.\n";
+    EXPECT_FALSE(reloaded.isUpToDate("paper", {tex}, dir));
+    fs::remove_all(dir);
+}
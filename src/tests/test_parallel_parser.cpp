@@ -0,0 +1,135 @@
+#include "gtest/gtest.h"
+#include "../parallel_parser.h"
+#include "../macro_expander.h"
+#include "../parser.h"
+#include "../flat_ast.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::shared_ptr<FlatAST> parseSerially(const std::shared_ptr<const SourceBuffer>& source) {
+    Lexer lexer(source, LexerMode::Span);
+    MacroExpander expander(lexer);
+    Parser parser(expander);
+    return FlatAST::fromTree(*parser.parseDocument());
+}
+
+void expectSameTree(const FlatAST& expected, const FlatAST& actual) {
+    ASSERT_EQ(expected.size(), actual.size());
+    for (FlatAST::Index i = 0; i < expected.size(); ++i) {
+        EXPECT_EQ(expected.type(i), actual.type(i));
+        EXPECT_EQ(expected.content(i), actual.content(i));
+        EXPECT_EQ(expected.position(i), actual.position(i));
+        EXPECT_EQ(expected.state(i), actual.state(i));
+        EXPECT_EQ(expected.subtreeEnd(i), actual.subtreeEnd(i));
+    }
+    EXPECT_EQ(expected.crossReferences.targets, actual.crossReferences.targets);
+    EXPECT_EQ(expected.crossReferences.unresolved, actual.crossReferences.unresolved);
+}
+
+std::string sections(int count) {
+    std::string text;
+    for (int i = 0; i < count; ++i) {
+        text += "\\section{Part " + std::to_string(i) + "}\\label{s" + std::to_string(i) + "}\n";
+        text += "Next is \\ref{s" + std::to_string(i + 1) + "}.\n";
+        text += "Some \\emph{text} with \\R and \\cite{k" + std::to_string(i) + "}.\n";
+        text += "\\begin{itemize}\\item one \\item two\\end{itemize}\n";
+    }
+    return text;
+}
+
+}
+
+TEST(ParallelParserTest, SplitPointsSkipCommentsAndEnvironments) {
+    std::string text = "pre\n% \\section{no}\n\\section{A}\\begin{figure}\\section{no}\\end{figure}\\chapter{B}";
+    auto points = ParallelParser::findSplitPoints(text);
+    ASSERT_EQ(points.size(), 2u);
+    EXPECT_EQ(text.compare(points[0], 10, "\\section{A"), 0);
+    EXPECT_EQ(text.compare(points[1], 10, "\\chapter{B"), 0);
+}
+
+TEST(ParallelParserTest, SlicedParseMatchesSerialParse) {
+    std::string text = "\\newcommand{\\R}{\\mathbb{R}}\n" + sections(40);
+    auto source = SourceBuffer::fromString(text);
+
+    ParallelParser::Options options;
+    options.threads = 4;
+    options.minSliceBytes = 256;
+    ParallelParser parallel(source, LexerMode::Span, options);
+    auto ast = parallel.parseDocument();
+
+    EXPECT_GT(parallel.getSliceCount(), 2u);
+    EXPECT_FALSE(parallel.usedFallback());
+    EXPECT_EQ(parallel.getMacroStats().definitions, 1u);
+    expectSameTree(*parseSerially(source), *FlatAST::fromTree(*ast));
+    // Each section refers forward into the next slice; only the last misses.
+    EXPECT_EQ(ast->crossReferences.references.size(), 40u);
+    EXPECT_EQ(ast->crossReferences.unresolved, 1u);
+}
+
+TEST(ParallelParserTest, SplitsSectionsInsideTheDocumentEnvironment) {
+    std::string text = "\\documentclass{article}\n\\usepackage{amsmath}\n\\newcommand{\\R}{\\mathbb{R}}\n"
+                       "\\begin{document}\n\\maketitle\n\\begin{abstract}Short.\\end{abstract}\n" +
+                       sections(40) + "\\bibliography{refs}\n\\end{document}\nTrailing notes.\n";
+    auto source = SourceBuffer::fromString(text);
+
+    auto layout = ParallelParser::scanLayout(text);
+    EXPECT_EQ(layout.splitPoints.size(), 40u);
+    EXPECT_EQ(text.compare(layout.documentBegin, 16, "\\begin{document}"), 0);
+    EXPECT_EQ(text.compare(layout.documentEnd, 14, "\\end{document}"), 0);
+
+    ParallelParser::Options options;
+    options.threads = 4;
+    options.minSliceBytes = 256;
+    ParallelParser parallel(source, LexerMode::Span, options);
+    auto ast = parallel.parseDocument();
+
+    EXPECT_GT(parallel.getSliceCount(), 2u);
+    EXPECT_FALSE(parallel.usedFallback());
+    expectSameTree(*parseSerially(source), *FlatAST::fromTree(*ast));
+    EXPECT_EQ(ast->crossReferences.unresolved, 1u);
+}
+
+TEST(ParallelParserTest, ReparsesSlicesAfterAStrayMathShift) {
+    // The lexer keeps "$" inside a text run, so "$\\R$" only shifts into math
+    // at its closing "$"; the math span then runs on to the next shift.
+    std::string text = "\\newcommand{\\R}{\\mathbb{R}}\n\\begin{document}\n";
+    for (int i = 0; i < 30; ++i) {
+        text += sections(1);
+        text += i % 7 == 3 ? "Let $x \\in \\R$ hold.\n" : "";
+    }
+    text += "\\end{document}\n";
+    auto source = SourceBuffer::fromString(text);
+
+    ParallelParser::Options options;
+    options.threads = 4;
+    options.minSliceBytes = 256;
+    ParallelParser parallel(source, LexerMode::Span, options);
+    auto ast = parallel.parseDocument();
+
+    EXPECT_GT(parallel.getSliceCount(), 2u);
+    EXPECT_GT(parallel.getReparsedSliceCount(), 0u);
+    EXPECT_FALSE(parallel.usedFallback());
+    expectSameTree(*parseSerially(source), *FlatAST::fromTree(*ast));
+}
+
+TEST(ParallelParserTest, UnsafeSplitsFallBackToSerialParse) {
+    ParallelParser::Options options;
+    options.threads = 4;
+    options.minSliceBytes = 256;
+
+    // A definition after the preamble would be invisible to earlier workers'
+    // neighbours; an unclosed group would swallow the next slice.
+    for (const std::string& insert : {std::string("\\newcommand{\\R}{x}\n"), std::string("\\textbf{open\n")}) {
+        std::string text = sections(10) + insert + sections(20);
+        auto source = SourceBuffer::fromString(text);
+        ParallelParser parallel(source, LexerMode::Span, options);
+        auto ast = parallel.parseDocument();
+
+        EXPECT_GT(parallel.getSliceCount(), 2u);
+        EXPECT_TRUE(parallel.usedFallback());
+        expectSameTree(*parseSerially(source), *FlatAST::fromTree(*ast));
+    }
+}
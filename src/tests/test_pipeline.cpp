@@ -0,0 +1,80 @@
+#include "gtest/gtest.h"
+#include "../log_capture.h"
+#include "../pipeline.h"
+#include <atomic>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST(LogCaptureTest, KeepsEachThreadsOutputTogether) {
+    std::ostringstream captured;
+    std::streambuf* original = std::cout.rdbuf(captured.rdbuf());
+    {
+        LogRouting routing;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([t]() {
+                LogCapture capture;
+                for (int line = 0; line < 50; ++line) {
+                    std::cout << "thread " << t << " line " << line << std::endl;
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    std::cout.rdbuf(original);
+
+    std::istringstream lines(captured.str());
+    std::string line;
+    int count = 0;
+    std::string expected;
+    while (std::getline(lines, line)) {
+        if (count % 50 == 0) {
+            expected = line.substr(0, line.find(" line "));
+        }
+        EXPECT_EQ(line, expected + " line " + std::to_string(count % 50));
+        count++;
+    }
+    EXPECT_EQ(count, 200);
+}
+
+TEST(BoundedQueueTest, DeliversEveryItemOnceUnderContention) {
+    BoundedQueue<int> queue(4);
+    std::atomic<long> sum{0};
+    std::atomic<int> count{0};
+    std::vector<std::thread> consumers;
+    for (int c = 0; c < 3; ++c) {
+        consumers.emplace_back([&]() {
+            int value;
+            while (queue.pop(value)) {
+                sum += value;
+                count++;
+            }
+        });
+    }
+    std::vector<std::thread> producers;
+    for (int p = 0; p < 4; ++p) {
+        producers.emplace_back([&queue, p]() {
+            for (int i = 1; i <= 1000; ++i) {
+                queue.push(p * 1000 + i);
+            }
+        });
+    }
+    for (auto& producer : producers) {
+        producer.join();
+    }
+    queue.close();
+    for (auto& consumer : consumers) {
+        consumer.join();
+    }
+
+    EXPECT_EQ(count.load(), 4000);
+    EXPECT_EQ(sum.load(), 4000L * 4001 / 2);
+    EXPECT_LE(queue.getMaxDepth(), queue.capacity());
+    int value;
+    EXPECT_FALSE(queue.pop(value));
+}
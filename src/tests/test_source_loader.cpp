@@ -0,0 +1,50 @@
+#include "gtest/gtest.h"
+#include "../source_loader.h"
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+TEST(SourceLoaderTest, RejectsMalformedUtf8) {
+    EXPECT_TRUE(isValidUtf8("plain ASCII text, long enough for the word loop"));
+    EXPECT_TRUE(isValidUtf8("caf\xC3\xA9 \xE2\x82\xAC \xF0\x9F\x98\x80"));
+    EXPECT_FALSE(isValidUtf8("overlong \xC0\x80"));
+    EXPECT_FALSE(isValidUtf8("overlong \xE0\x80\xAF"));
+    EXPECT_FALSE(isValidUtf8("surrogate \xED\xA0\x80"));
+    EXPECT_FALSE(isValidUtf8("past U+10FFFF \xF4\x90\x80\x80"));
+    EXPECT_FALSE(isValidUtf8("truncated \xE2\x82"));
+    EXPECT_FALSE(isValidUtf8("latin-1 caf\xE9"));
+}
+
+TEST(SourceLoaderTest, ScanFindsDeclarationsOnlyInThePrefix) {
+    SourceScan scan = scanSource("\\documentclass{article}\n\\usepackage[ latin1 ]{inputenc}\ncaf\xE9\n");
+    EXPECT_FALSE(scan.validUtf8);
+    EXPECT_EQ(scan.declaredEncoding, "latin1");
+    EXPECT_EQ(scanSource("\\begin{CJK*}{GBK}{song}").declaredEncoding, "GBK");
+    EXPECT_EQ(scanSource("\\usepackage[T1]{fontenc}").declaredEncoding, "");
+
+    std::string late(SourceScan::declarationLines, '\n');
+    late += "\\inputencoding{latin1}";
+    EXPECT_EQ(scanSource(late).declaredEncoding, "");
+    EXPECT_EQ(scanSource(late.substr(1)).declaredEncoding, "latin1");
+}
+
+TEST(SourceLoaderTest, MapsUtf8AndConvertsDeclaredEncodings) {
+    namespace fs = std::filesystem;
+    fs::path utf8 = fs::temp_directory_path() / "texquery_loader_utf8.tex";
+    fs::path latin1 = fs::temp_directory_path() / "texquery_loader_latin1.tex";
+    std::ofstream(utf8, std::ios::binary) << "\\usepackage[latin1]{inputenc}\ncaf\xC3\xA9";
+    std::ofstream(latin1, std::ios::binary) << "\\usepackage[latin1]{inputenc}\ncaf\xE9";
+
+    LoadedSource mapped = loadSource(utf8);
+    EXPECT_TRUE(mapped.buffer->isMapped());
+    EXPECT_TRUE(mapped.convertedFrom.empty());
+    EXPECT_EQ(mapped.text(), "\\usepackage[latin1]{inputenc}\ncaf\xC3\xA9");
+
+    LoadedSource converted = loadSource(latin1);
+    EXPECT_EQ(converted.convertedFrom, "ISO-8859-1");
+    EXPECT_EQ(converted.text(), "\\usepackage[latin1]{inputenc}\ncaf\xC3\xA9");
+    fs::remove(utf8);
+    fs::remove(latin1);
+    EXPECT_THROW(loadSource(utf8), std::runtime_error);
+}
@@ -0,0 +1,64 @@
+#include "gtest/gtest.h"
+#include "../utf8.h"
+#include "../source_loader.h"
+#include <string>
+#include <vector>
+
+namespace {
+
+std::vector<StructuralIndex::Backend> availableBackends() {
+    std::vector<StructuralIndex::Backend> backends = {StructuralIndex::Backend::Scalar};
+    if (StructuralIndex::detectBackend() != StructuralIndex::Backend::Scalar) {
+        backends.push_back(StructuralIndex::detectBackend());
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (StructuralIndex::detectBackend() == StructuralIndex::Backend::AVX2) {
+        backends.push_back(StructuralIndex::Backend::SSE42);
+    }
+#endif
+    return backends;
+}
+
+}
+
+TEST(Utf8Test, BackendsAgreeAcrossBlockBoundaries) {
+    const std::string valid[] = {"\xC3\xA9", "\xE2\x82\xAC", "\xF0\x9F\x98\x80", "\xEF\xBF\xBF", "\xF4\x8F\xBF\xBF",
+                                 "\xED\x9F\xBF"};
+    const std::string invalid[] = {"\xC0\x80",         "\xC1\xBF",     "\xE0\x80\xAF", "\xED\xA0\x80",
+                                   "\xF0\x80\x80\x80", "\xF4\x90\x80\x80", "\xF5\x80\x80\x80", "\x80",
+                                   "\xE2\x82\xAC\x80", "\xFF"};
+    auto expectAgreement = [](const std::string& text, bool expectValid, bool expectAscii) {
+        for (auto backend : availableBackends()) {
+            Utf8Check check = checkUtf8(text, backend);
+            EXPECT_EQ(check.valid, expectValid) << StructuralIndex::backendName(backend) << " at size " << text.size();
+            if (expectValid) {
+                EXPECT_EQ(check.ascii, expectAscii) << StructuralIndex::backendName(backend);
+            }
+        }
+    };
+
+    expectAgreement("", true, true);
+    // Sequences placed across the 16-, 32- and 64-byte block edges, and cut
+    // short at the end of the text.
+    for (size_t offset : {0, 13, 14, 15, 16, 29, 30, 31, 32, 62, 63, 64, 65}) {
+        std::string padding(offset, 'a');
+        expectAgreement(padding, true, true);
+        for (const auto& sequence : valid) {
+            expectAgreement(padding + sequence + std::string(40, 'b'), true, false);
+            expectAgreement(padding + sequence, true, false);
+            expectAgreement(padding + sequence.substr(0, sequence.size() - 1), false, false);
+            expectAgreement(padding + sequence.substr(0, sequence.size() - 1) + std::string(40, 'b'), false, false);
+        }
+        for (const auto& sequence : invalid) {
+            expectAgreement(padding + sequence + std::string(40, 'b'), false, false);
+            expectAgreement(padding + sequence, false, false);
+        }
+    }
+}
+
+TEST(Utf8Test, ScanReportsPlainAscii) {
+    EXPECT_TRUE(scanSource("\\section{Intro} plain text").ascii);
+    SourceScan accented = scanSource("\\section{Caf\xC3\xA9}");
+    EXPECT_TRUE(accented.validUtf8);
+    EXPECT_FALSE(accented.ascii);
+}
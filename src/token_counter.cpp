@@ -0,0 +1,325 @@
+#include "token_counter.h"
+#include "arena.h"
+#include "symbol_table.h"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+enum class CharClass : uint8_t { Space, Newline, Letter, Digit, Symbol };
+
+constexpr std::array<CharClass, 128> asciiClasses = [] {
+	std::array<CharClass, 128> classes{};
+	for (int c = 0; c < 128; ++c) {
+		if (c == '\n' || c == '\r') {
+			classes[c] = CharClass::Newline;
+		} else if (c == ' ' || c == '\t' || c == '\v' || c == '\f') {
+			classes[c] = CharClass::Space;
+		} else if (c >= '0' && c <= '9') {
+			classes[c] = CharClass::Digit;
+		} else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+			classes[c] = CharClass::Letter;
+		} else {
+			classes[c] = CharClass::Symbol;
+		}
+	}
+	return classes;
+}();
+
+// Without Unicode tables: the common space, break and punctuation blocks are
+// told apart, everything else counts as a letter.
+CharClass classifyCodepoint(uint32_t cp) {
+	if (cp == 0xA0 || (cp >= 0x2000 && cp <= 0x200A) || cp == 0x202F || cp == 0x205F || cp == 0x3000) {
+		return CharClass::Space;
+	}
+	if (cp == 0x85 || cp == 0x2028 || cp == 0x2029) {
+		return CharClass::Newline;
+	}
+	if ((cp >= 0xA1 && cp <= 0xBF) || cp == 0xD7 || cp == 0xF7 || (cp >= 0x2010 && cp <= 0x2BFF) ||
+	    (cp >= 0x3001 && cp <= 0x303F) || (cp >= 0xFF01 && cp <= 0xFF0F) || (cp >= 0x1F000 && cp <= 0x1FAFF)) {
+		return CharClass::Symbol;
+	}
+	return CharClass::Letter;
+}
+
+// Index of the first byte at or after i that is not ASCII.
+std::size_t asciiEnd(std::string_view text, std::size_t i) {
+	const char* p = text.data() + i;
+	const char* end = text.data() + text.size();
+#if defined(__SSE2__)
+	for (; end - p >= 16; p += 16) {
+		int mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+		if (mask != 0) {
+			return static_cast<std::size_t>(p - text.data()) + static_cast<std::size_t>(__builtin_ctz(mask));
+		}
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	for (; end - p >= 16; p += 16) {
+		if (vmaxvq_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(p))) >= 0x80) {
+			break;
+		}
+	}
+#endif
+	while (p < end && static_cast<unsigned char>(*p) < 0x80) {
+		++p;
+	}
+	return static_cast<std::size_t>(p - text.data());
+}
+
+class Scanner {
+public:
+	explicit Scanner(std::string_view text) : text(text) {}
+
+	// Class of the character at i; length receives its size in bytes.
+	CharClass classify(std::size_t i, std::size_t& length) {
+		if (i < asciiFrom || i >= asciiTo) {
+			if (static_cast<unsigned char>(text[i]) < 0x80) {
+				asciiFrom = i;
+				asciiTo = asciiEnd(text, i);
+			} else {
+				return decode(i, length);
+			}
+		}
+		length = 1;
+		return asciiClasses[static_cast<unsigned char>(text[i])];
+	}
+
+	CharClass classify(std::size_t i) {
+		std::size_t length;
+		return classify(i, length);
+	}
+
+	std::size_t runOf(std::size_t i, CharClass cls) {
+		std::size_t length;
+		while (i < text.size() && classify(i, length) == cls) {
+			i += length;
+		}
+		return i;
+	}
+
+private:
+	std::string_view text;
+	std::size_t asciiFrom = 0;
+	std::size_t asciiTo = 0;
+
+	CharClass decode(std::size_t i, std::size_t& length) {
+		unsigned char lead = static_cast<unsigned char>(text[i]);
+		uint32_t cp;
+		if ((lead & 0xE0) == 0xC0) {
+			length = 2;
+			cp = lead & 0x1F;
+		} else if ((lead & 0xF0) == 0xE0) {
+			length = 3;
+			cp = lead & 0x0F;
+		} else if ((lead & 0xF8) == 0xF0) {
+			length = 4;
+			cp = lead & 0x07;
+		} else {
+			length = 1;
+			return CharClass::Symbol;
+		}
+		if (i + length > text.size()) {
+			length = 1;
+			return CharClass::Symbol;
+		}
+		for (std::size_t k = 1; k < length; ++k) {
+			unsigned char next = static_cast<unsigned char>(text[i + k]);
+			if ((next & 0xC0) != 0x80) {
+				length = 1;
+				return CharClass::Symbol;
+			}
+			cp = (cp << 6) | (next & 0x3F);
+		}
+		return classifyCodepoint(cp);
+	}
+};
+
+struct Vocabulary {
+	Arena storage{1 << 20};
+	SymbolTable tokens;
+	std::size_t longest = 0;
+};
+
+std::unique_ptr<Vocabulary> vocabulary;
+
+std::size_t countPiece(const Vocabulary& vocab, std::string_view piece) {
+	std::size_t tokens = 0;
+	while (!piece.empty()) {
+		std::size_t length = std::min(piece.size(), vocab.longest);
+		while (length > 1 && vocab.tokens.find(piece.substr(0, length)) == SymbolTable::npos) {
+			length--;
+		}
+		tokens++;
+		piece.remove_prefix(length);
+	}
+	return tokens;
+}
+
+int base64Value(char c) {
+	if (c >= 'A' && c <= 'Z') return c - 'A';
+	if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+	if (c >= '0' && c <= '9') return c - '0' + 52;
+	if (c == '+') return 62;
+	if (c == '/') return 63;
+	return -1;
+}
+
+bool decodeBase64(std::string_view text, std::string& out) {
+	out.clear();
+	uint32_t bits = 0;
+	int count = 0;
+	for (char c : text) {
+		if (c == '=') {
+			break;
+		}
+		int value = base64Value(c);
+		if (value < 0) {
+			return false;
+		}
+		bits = (bits << 6) | static_cast<uint32_t>(value);
+		count += 6;
+		if (count >= 8) {
+			count -= 8;
+			out.push_back(static_cast<char>((bits >> count) & 0xFF));
+		}
+	}
+	return !out.empty();
+}
+
+}
+
+std::size_t roughTokenCount(std::string_view text) {
+	std::size_t tokens = 0;
+	std::size_t i = 0;
+	auto isWordByte = [](unsigned char c) {
+		return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || c >= 0x80;
+	};
+	while (i < text.size()) {
+		if (isWordByte(static_cast<unsigned char>(text[i]))) {
+			std::size_t start = i;
+			while (i < text.size() && isWordByte(static_cast<unsigned char>(text[i]))) {
+				++i;
+			}
+			tokens += 1 + (i - start - 1) / 4;
+		} else {
+			char c = text[i];
+			if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+				tokens++;
+			}
+			++i;
+		}
+	}
+	return tokens;
+}
+
+std::size_t estimateTokens(std::string_view text) {
+	if (!vocabulary) {
+		return roughTokenCount(text);
+	}
+
+	Scanner scan(text);
+	std::size_t total = 0;
+	std::size_t i = 0;
+	std::size_t n = text.size();
+	while (i < n) {
+		std::size_t length;
+		CharClass cls = scan.classify(i, length);
+		std::size_t end;
+		if (cls == CharClass::Letter) {
+			end = scan.runOf(i, CharClass::Letter);
+		} else if (cls == CharClass::Digit) {
+			end = i;
+			for (int k = 0; k < 3 && end < n && scan.classify(end) == CharClass::Digit; ++k) {
+				end++;
+			}
+		} else if (cls != CharClass::Newline && i + length < n && scan.classify(i + length) == CharClass::Letter) {
+			end = scan.runOf(i + length, CharClass::Letter);
+		} else if (cls == CharClass::Symbol ||
+		           (text[i] == ' ' && i + 1 < n && scan.classify(i + 1) == CharClass::Symbol)) {
+			end = scan.runOf(cls == CharClass::Symbol ? i : i + 1, CharClass::Symbol);
+			end = scan.runOf(end, CharClass::Newline);
+		} else {
+			// Whitespace through its last line break; otherwise all but the
+			// last character, which goes with the word that follows.
+			std::size_t j = i;
+			std::size_t lastBreak = 0;
+			std::size_t lastLength = 0;
+			while (j < n) {
+				std::size_t charLength;
+				CharClass next = scan.classify(j, charLength);
+				if (next != CharClass::Space && next != CharClass::Newline) {
+					break;
+				}
+				j += charLength;
+				lastLength = charLength;
+				if (next == CharClass::Newline) {
+					lastBreak = j;
+				}
+			}
+			if (lastBreak > 0) {
+				end = lastBreak;
+			} else if (j < n && j - i > length) {
+				end = j - lastLength;
+			} else {
+				end = j;
+			}
+		}
+		total += countPiece(*vocabulary, text.substr(i, end - i));
+		i = end;
+	}
+	return total;
+}
+
+std::size_t loadTokenVocabulary(std::istream& in) {
+	auto vocab = std::make_unique<Vocabulary>();
+	std::string line;
+	std::string token;
+	std::size_t lineNumber = 0;
+	while (std::getline(in, line)) {
+		lineNumber++;
+		if (!line.empty() && line.back() == '\r') {
+			line.pop_back();
+		}
+		if (line.empty()) {
+			continue;
+		}
+		std::size_t space = line.find(' ');
+		if (!decodeBase64(std::string_view(line).substr(0, space), token)) {
+			std::cerr << "Warning: token vocabulary line " << lineNumber << " is not a base64 token.\n";
+			continue;
+		}
+		if (vocab->tokens.find(token) == SymbolTable::npos) {
+			vocab->tokens.intern(vocab->storage.copy(token));
+			vocab->longest = std::max(vocab->longest, token.size());
+		}
+	}
+	if (vocab->tokens.size() == 0) {
+		throw std::runtime_error("Token vocabulary is empty");
+	}
+	std::size_t size = vocab->tokens.size();
+	vocabulary = std::move(vocab);
+	return size;
+}
+
+std::size_t loadTokenVocabulary(const std::string& path) {
+	std::ifstream in(path);
+	if (!in) {
+		throw std::runtime_error("Could not open token vocabulary: " + path);
+	}
+	return loadTokenVocabulary(in);
+}
+
+void resetTokenVocabulary() {
+	vocabulary.reset();
+}
@@ -0,0 +1,32 @@
+#ifndef TOKEN_COUNTER_H
+#define TOKEN_COUNTER_H
+
+#include <cstddef>
+#include <istream>
+#include <string>
+#include <string_view>
+
+// Estimated subword token count of text, for sizing chunks against an
+// embedding model's limit. Text is pre-split the way GPT-style tokenizers
+// do (letter runs with one leading space or symbol, digit groups of up to
+// three, symbol runs, whitespace) and each piece is matched greedily,
+// longest token first, against the loaded vocabulary. That tracks real BPE
+// counts closely without applying merges. ASCII stretches, found sixteen
+// bytes at a time, are classified by table; only other bytes are decoded.
+// Without a vocabulary this is roughTokenCount.
+std::size_t estimateTokens(std::string_view text);
+
+// Words count one token plus one per further four letters, other non-space
+// characters one each.
+std::size_t roughTokenCount(std::string_view text);
+
+// Loads a vocabulary in the tiktoken text format: one base64-encoded token
+// and its rank per line, e.g. cl100k_base.tiktoken. Malformed lines are
+// reported and skipped. Replaces any earlier vocabulary and returns its size.
+// Not thread-safe: call at startup, before any counting.
+std::size_t loadTokenVocabulary(std::istream& in);
+std::size_t loadTokenVocabulary(const std::string& path);
+// Drops the vocabulary, back to roughTokenCount.
+void resetTokenVocabulary();
+
+#endif
@@ -0,0 +1,326 @@
+#include "utf8.h"
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TEXQUERY_SIMD_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define TEXQUERY_SIMD_NEON 1
+#endif
+
+namespace {
+
+// Length of the well-formed UTF-8 sequence starting at p (Unicode table
+// 3-7), or 0 if there is none; left is the number of bytes available.
+std::size_t sequenceLength(const unsigned char* p, std::size_t left) {
+	unsigned char c = p[0];
+	if (c < 0x80) {
+		return 1;
+	}
+	if (c < 0xC2) {
+		return 0;
+	}
+	if (c < 0xE0) {
+		return left >= 2 && (p[1] & 0xC0) == 0x80 ? 2 : 0;
+	}
+	if (c < 0xF0) {
+		unsigned char low = c == 0xE0 ? 0xA0 : 0x80;
+		unsigned char high = c == 0xED ? 0x9F : 0xBF;
+		return left >= 3 && p[1] >= low && p[1] <= high && (p[2] & 0xC0) == 0x80 ? 3 : 0;
+	}
+	if (c < 0xF5) {
+		unsigned char low = c == 0xF0 ? 0x90 : 0x80;
+		unsigned char high = c == 0xF4 ? 0x8F : 0xBF;
+		return left >= 4 && p[1] >= low && p[1] <= high && (p[2] & 0xC0) == 0x80 && (p[3] & 0xC0) == 0x80 ? 4
+		                                                                                                    : 0;
+	}
+	return 0;
+}
+
+Utf8Check checkScalar(const unsigned char* p, std::size_t n) {
+	Utf8Check check;
+	std::size_t i = 0;
+	while (i < n) {
+		// Eight ASCII bytes at a time.
+		if (i + 8 <= n) {
+			uint64_t word;
+			std::memcpy(&word, p + i, 8);
+			if ((word & 0x8080808080808080ull) == 0) {
+				i += 8;
+				continue;
+			}
+		}
+		if (p[i] >= 0x80) {
+			check.ascii = false;
+		}
+		std::size_t length = sequenceLength(p + i, n - i);
+		if (length == 0) {
+			check.valid = false;
+			return check;
+		}
+		i += length;
+	}
+	return check;
+}
+
+#if defined(TEXQUERY_SIMD_X86) || defined(TEXQUERY_SIMD_NEON)
+
+// Error bits of the lookup tables; a pair of bytes is invalid when the
+// entries for its first byte's high and low nibble and its second byte's
+// high nibble share a bit.
+constexpr uint8_t tooShort = 1 << 0;     // 11______ 0_______, 11______ 11______
+constexpr uint8_t tooLong = 1 << 1;      // 0_______ 10______
+constexpr uint8_t overlong3 = 1 << 2;    // 11100000 100_____
+constexpr uint8_t tooLarge = 1 << 3;     // 11110100 1001____ and above
+constexpr uint8_t surrogate = 1 << 4;    // 11101101 101_____
+constexpr uint8_t overlong2 = 1 << 5;    // 1100000_ 10______
+constexpr uint8_t tooLarge1000 = 1 << 6; // 11110101 1000____ and above
+constexpr uint8_t overlong4 = 1 << 6;    // 11110000 1000____
+constexpr uint8_t twoConts = 1 << 7;     // 10______ 10______, checked against the bytes before
+constexpr uint8_t carry = tooShort | tooLong | twoConts;
+
+alignas(16) constexpr uint8_t firstHigh[16] = {
+    tooLong, tooLong, tooLong, tooLong, tooLong, tooLong, tooLong, tooLong,
+    twoConts, twoConts, twoConts, twoConts,
+    tooShort | overlong2,
+    tooShort,
+    tooShort | overlong3 | surrogate,
+    tooShort | tooLarge | tooLarge1000 | overlong4,
+};
+
+alignas(16) constexpr uint8_t firstLow[16] = {
+    carry | overlong3 | overlong2 | overlong4,
+    carry | overlong2,
+    carry,
+    carry,
+    carry | tooLarge,
+    carry | tooLarge | tooLarge1000,
+    carry | tooLarge | tooLarge1000,
+    carry | tooLarge | tooLarge1000,
+    carry | tooLarge | tooLarge1000,
+    carry | tooLarge | tooLarge1000,
+    carry | tooLarge | tooLarge1000,
+    carry | tooLarge | tooLarge1000,
+    carry | tooLarge | tooLarge1000,
+    carry | tooLarge | tooLarge1000 | surrogate,
+    carry | tooLarge | tooLarge1000,
+    carry | tooLarge | tooLarge1000,
+};
+
+alignas(16) constexpr uint8_t secondHigh[16] = {
+    tooShort, tooShort, tooShort, tooShort, tooShort, tooShort, tooShort, tooShort,
+    tooLong | overlong2 | twoConts | overlong3 | tooLarge1000 | overlong4,
+    tooLong | overlong2 | twoConts | overlong3 | tooLarge,
+    tooLong | overlong2 | twoConts | surrogate | tooLarge,
+    tooLong | overlong2 | twoConts | surrogate | tooLarge,
+    tooShort, tooShort, tooShort, tooShort,
+};
+
+// A block whose last three bytes are greater than these ends inside a
+// sequence: a lead byte last, a three- or four-byte lead second to last, or
+// a four-byte lead third to last.
+alignas(32) constexpr uint8_t incompleteBelow[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF,
+};
+
+#endif
+
+#if defined(TEXQUERY_SIMD_X86)
+
+struct StateAVX2 {
+	__m256i previous;
+	__m256i incomplete;
+	__m256i error;
+	__m256i bytes;
+};
+
+__attribute__((target("avx2"), always_inline)) inline
+__m256i nibbleLookupAVX2(const uint8_t* table, __m256i nibbles) {
+	__m256i lanes = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(table)));
+	return _mm256_shuffle_epi8(lanes, nibbles);
+}
+
+__attribute__((target("avx2"), always_inline)) inline
+void blockAVX2(StateAVX2& state, __m256i input) {
+	state.bytes = _mm256_or_si256(state.bytes, input);
+	if (_mm256_movemask_epi8(input) == 0) {
+		state.error = _mm256_or_si256(state.error, state.incomplete);
+		state.incomplete = _mm256_setzero_si256();
+		state.previous = input;
+		return;
+	}
+	const __m256i lowNibble = _mm256_set1_epi8(0x0F);
+	// The previous block's high lane followed by this one's low lane, so the
+	// per-lane alignr shifts bytes across the lane boundary.
+	__m256i shifted = _mm256_permute2x128_si256(state.previous, input, 0x21);
+	__m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+	__m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+	__m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+
+	__m256i special = _mm256_and_si256(
+	    _mm256_and_si256(nibbleLookupAVX2(firstHigh, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), lowNibble)),
+	                     nibbleLookupAVX2(firstLow, _mm256_and_si256(prev1, lowNibble))),
+	    nibbleLookupAVX2(secondHigh, _mm256_and_si256(_mm256_srli_epi16(input, 4), lowNibble)));
+	// 0x80 where the byte two back is at least 0xE0 or three back at least
+	// 0xF0, i.e. where a continuation may follow a continuation.
+	__m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+	__m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+	__m256i due = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(static_cast<char>(0x80)));
+	state.error = _mm256_or_si256(state.error, _mm256_xor_si256(due, special));
+
+	state.incomplete =
+	    _mm256_subs_epu8(input, _mm256_load_si256(reinterpret_cast<const __m256i*>(incompleteBelow)));
+	state.previous = input;
+}
+
+__attribute__((target("avx2")))
+Utf8Check checkAVX2(const unsigned char* p, std::size_t n) {
+	StateAVX2 state{_mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(),
+	                _mm256_setzero_si256()};
+	std::size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		blockAVX2(state, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i)));
+	}
+	// The tail is padded with NULs, which also ends any sequence still open.
+	alignas(32) unsigned char tail[32] = {};
+	if (i < n) {
+		std::memcpy(tail, p + i, n - i);
+	}
+	blockAVX2(state, _mm256_load_si256(reinterpret_cast<const __m256i*>(tail)));
+	state.error = _mm256_or_si256(state.error, state.incomplete);
+
+	Utf8Check check;
+	check.valid = _mm256_testz_si256(state.error, state.error) != 0;
+	check.ascii = _mm256_movemask_epi8(state.bytes) == 0;
+	return check;
+}
+
+struct StateSSE {
+	__m128i previous;
+	__m128i incomplete;
+	__m128i error;
+	__m128i bytes;
+};
+
+__attribute__((target("sse4.2"), always_inline)) inline
+void blockSSE(StateSSE& state, __m128i input) {
+	state.bytes = _mm_or_si128(state.bytes, input);
+	if (_mm_movemask_epi8(input) == 0) {
+		state.error = _mm_or_si128(state.error, state.incomplete);
+		state.incomplete = _mm_setzero_si128();
+		state.previous = input;
+		return;
+	}
+	const __m128i lowNibble = _mm_set1_epi8(0x0F);
+	__m128i prev1 = _mm_alignr_epi8(input, state.previous, 15);
+	__m128i prev2 = _mm_alignr_epi8(input, state.previous, 14);
+	__m128i prev3 = _mm_alignr_epi8(input, state.previous, 13);
+
+	__m128i special = _mm_and_si128(
+	    _mm_and_si128(_mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(firstHigh)),
+	                                   _mm_and_si128(_mm_srli_epi16(prev1, 4), lowNibble)),
+	                  _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(firstLow)),
+	                                   _mm_and_si128(prev1, lowNibble))),
+	    _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(secondHigh)),
+	                     _mm_and_si128(_mm_srli_epi16(input, 4), lowNibble)));
+	__m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+	__m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+	__m128i due = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(static_cast<char>(0x80)));
+	state.error = _mm_or_si128(state.error, _mm_xor_si128(due, special));
+
+	state.incomplete = _mm_subs_epu8(input, _mm_load_si128(reinterpret_cast<const __m128i*>(incompleteBelow + 16)));
+	state.previous = input;
+}
+
+__attribute__((target("sse4.2")))
+Utf8Check checkSSE(const unsigned char* p, std::size_t n) {
+	StateSSE state{_mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128()};
+	std::size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		blockSSE(state, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)));
+	}
+	alignas(16) unsigned char tail[16] = {};
+	if (i < n) {
+		std::memcpy(tail, p + i, n - i);
+	}
+	blockSSE(state, _mm_load_si128(reinterpret_cast<const __m128i*>(tail)));
+	state.error = _mm_or_si128(state.error, state.incomplete);
+
+	Utf8Check check;
+	check.valid = _mm_testz_si128(state.error, state.error) != 0;
+	check.ascii = _mm_movemask_epi8(state.bytes) == 0;
+	return check;
+}
+
+#elif defined(TEXQUERY_SIMD_NEON)
+
+struct StateNEON {
+	uint8x16_t previous;
+	uint8x16_t incomplete;
+	uint8x16_t error;
+	uint8x16_t bytes;
+};
+
+inline void blockNEON(StateNEON& state, uint8x16_t input) {
+	state.bytes = vorrq_u8(state.bytes, input);
+	if (vmaxvq_u8(input) < 0x80) {
+		state.error = vorrq_u8(state.error, state.incomplete);
+		state.incomplete = vdupq_n_u8(0);
+		state.previous = input;
+		return;
+	}
+	const uint8x16_t lowNibble = vdupq_n_u8(0x0F);
+	uint8x16_t prev1 = vextq_u8(state.previous, input, 15);
+	uint8x16_t prev2 = vextq_u8(state.previous, input, 14);
+	uint8x16_t prev3 = vextq_u8(state.previous, input, 13);
+
+	uint8x16_t special = vandq_u8(vandq_u8(vqtbl1q_u8(vld1q_u8(firstHigh), vshrq_n_u8(prev1, 4)),
+	                                       vqtbl1q_u8(vld1q_u8(firstLow), vandq_u8(prev1, lowNibble))),
+	                              vqtbl1q_u8(vld1q_u8(secondHigh), vshrq_n_u8(input, 4)));
+	uint8x16_t third = vqsubq_u8(prev2, vdupq_n_u8(0xE0 - 0x80));
+	uint8x16_t fourth = vqsubq_u8(prev3, vdupq_n_u8(0xF0 - 0x80));
+	uint8x16_t due = vandq_u8(vorrq_u8(third, fourth), vdupq_n_u8(0x80));
+	state.error = vorrq_u8(state.error, veorq_u8(due, special));
+
+	state.incomplete = vqsubq_u8(input, vld1q_u8(incompleteBelow + 16));
+	state.previous = input;
+}
+
+Utf8Check checkNEON(const unsigned char* p, std::size_t n) {
+	StateNEON state{vdupq_n_u8(0), vdupq_n_u8(0), vdupq_n_u8(0), vdupq_n_u8(0)};
+	std::size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		blockNEON(state, vld1q_u8(p + i));
+	}
+	unsigned char tail[16] = {};
+	if (i < n) {
+		std::memcpy(tail, p + i, n - i);
+	}
+	blockNEON(state, vld1q_u8(tail));
+	state.error = vorrq_u8(state.error, state.incomplete);
+
+	Utf8Check check;
+	check.valid = vmaxvq_u8(state.error) == 0;
+	check.ascii = vmaxvq_u8(state.bytes) < 0x80;
+	return check;
+}
+
+#endif
+
+}
+
+Utf8Check checkUtf8(std::string_view text, StructuralIndex::Backend backend) {
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(text.data());
+	switch (backend) {
+#if defined(TEXQUERY_SIMD_X86)
+		case StructuralIndex::Backend::AVX2: return checkAVX2(p, text.size());
+		case StructuralIndex::Backend::SSE42: return checkSSE(p, text.size());
+#elif defined(TEXQUERY_SIMD_NEON)
+		case StructuralIndex::Backend::NEON: return checkNEON(p, text.size());
+#endif
+		default: return checkScalar(p, text.size());
+	}
+}
@@ -0,0 +1,28 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <string_view>
+#include "structural_index.h"
+
+struct Utf8Check {
+	// Well-formed UTF-8 (Unicode table 3-7): no overlong forms, surrogates,
+	// code points past U+10FFFF or sequences cut short.
+	bool valid = true;
+	// Every byte below 0x80, so the text needs no Unicode handling at all.
+	bool ascii = true;
+};
+
+// Validates text in one pass with the lookup-table method of Keiser and
+// Lemire: three 16-entry tables indexed by the nibbles of each byte and the
+// one before it flag every invalid two-byte pattern, and the bytes two and
+// three back tell where a third or fourth continuation byte is due. Blocks
+// of pure ASCII only check that no sequence was left open. Runs 32 bytes at
+// a time with AVX2, 16 with SSE4.2 or NEON; the scalar backend decodes
+// sequence by sequence.
+Utf8Check checkUtf8(std::string_view text, StructuralIndex::Backend backend = StructuralIndex::detectBackend());
+
+inline bool isValidUtf8(std::string_view text) {
+	return checkUtf8(text).valid;
+}
+
+#endif